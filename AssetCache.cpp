@@ -0,0 +1,331 @@
+// Generated asset cache.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "AssetCache.h"
+
+#include <Resources/DirectoryManager.h>
+#include <Resources/Exceptions.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::DirectoryManager;
+
+        static const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+        static const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+        static const string MANIFEST = "manifest.txt";
+        static const string PARTIAL = ".partial/";
+
+#ifdef _WIN32
+        static bool PathExists(const string& path) {
+            return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+        }
+
+        static bool IsDirectory(const string& path) {
+            DWORD attr = GetFileAttributesA(path.c_str());
+            return attr != INVALID_FILE_ATTRIBUTES &&
+                (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        }
+
+        static void MakeDirectory(const string& path) {
+            _mkdir(path.c_str());
+        }
+
+        // The entries of a directory, without . and ..
+        static std::vector<string> ListDirectory(const string& path) {
+            std::vector<string> entries;
+            WIN32_FIND_DATAA data;
+            HANDLE h = FindFirstFileA((path + "/*").c_str(), &data);
+            if (h == INVALID_HANDLE_VALUE) return entries;
+            do {
+                if (strcmp(data.cFileName, ".") != 0 &&
+                    strcmp(data.cFileName, "..") != 0)
+                    entries.push_back(data.cFileName);
+            } while (FindNextFileA(h, &data));
+            FindClose(h);
+            return entries;
+        }
+
+        static void RemoveFile(const string& path) {
+            DeleteFileA(path.c_str());
+        }
+
+        static void RemoveEmptyDirectory(const string& path) {
+            RemoveDirectoryA(path.c_str());
+        }
+
+        // Flush a file to disk. Directories need no flush on NTFS.
+        static bool SyncFile(const string& path, bool directory) {
+            if (directory) return true;
+            HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (h == INVALID_HANDLE_VALUE) return false;
+            bool ok = FlushFileBuffers(h) != 0;
+            CloseHandle(h);
+            return ok;
+        }
+
+        // Rename, replacing a file at to.
+        static bool ReplacePath(const string& from, const string& to) {
+            return MoveFileExA(from.c_str(), to.c_str(),
+                               MOVEFILE_REPLACE_EXISTING |
+                               MOVEFILE_WRITE_THROUGH) != 0;
+        }
+#else
+        static bool PathExists(const string& path) {
+            struct stat st;
+            return stat(path.c_str(), &st) == 0;
+        }
+
+        static bool IsDirectory(const string& path) {
+            struct stat st;
+            return lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        static void MakeDirectory(const string& path) {
+            mkdir(path.c_str(), 0755);
+        }
+
+        // The entries of a directory, without . and ..
+        static std::vector<string> ListDirectory(const string& path) {
+            std::vector<string> entries;
+            DIR* d = opendir(path.c_str());
+            if (d == NULL) return entries;
+            struct dirent* e;
+            while ((e = readdir(d)) != NULL)
+                if (strcmp(e->d_name, ".") != 0 &&
+                    strcmp(e->d_name, "..") != 0)
+                    entries.push_back(e->d_name);
+            closedir(d);
+            return entries;
+        }
+
+        static void RemoveFile(const string& path) {
+            unlink(path.c_str());
+        }
+
+        static void RemoveEmptyDirectory(const string& path) {
+            rmdir(path.c_str());
+        }
+
+        // Flush a file, or the entries of a directory, to disk.
+        static bool SyncFile(const string& path, bool directory) {
+            int fd = open(path.c_str(), directory ? O_RDONLY : O_WRONLY);
+            if (fd < 0) return false;
+            bool ok = fsync(fd) == 0;
+            close(fd);
+            return ok;
+        }
+
+        // Rename, replacing a file at to.
+        static bool ReplacePath(const string& from, const string& to) {
+            return rename(from.c_str(), to.c_str()) == 0;
+        }
+#endif
+
+        static void MakeParents(const string& path) {
+            for (string::size_type i = path.find('/', 1);
+                 i != string::npos; i = path.find('/', i + 1))
+                MakeDirectory(path.substr(0, i));
+        }
+
+        // Remove a file or a directory tree.
+        static void RemovePath(const string& path) {
+            if (!IsDirectory(path)) {
+                RemoveFile(path);
+                return;
+            }
+            std::vector<string> entries = ListDirectory(path);
+            for (unsigned int i = 0; i < entries.size(); ++i)
+                RemovePath(path + "/" + entries[i]);
+            RemoveEmptyDirectory(path);
+        }
+
+        // Flush a file or a directory tree to disk, so a rename after
+        // it never exposes data still only in the page cache.
+        static bool SyncPath(const string& path) {
+            if (!IsDirectory(path))
+                return SyncFile(path, false);
+            std::vector<string> entries = ListDirectory(path);
+            bool ok = true;
+            for (unsigned int i = 0; i < entries.size(); ++i)
+                ok = SyncPath(path + "/" + entries[i]) && ok;
+            return SyncFile(path, true) && ok;
+        }
+
+        // The directory holding path.
+        static string Parent(const string& path) {
+            string::size_type i = path.find_last_of('/');
+            return i == string::npos ? "." : path.substr(0, i);
+        }
+
+        AssetKey::AssetKey(const string& generator)
+            : hash(FNV_OFFSET) {
+            Add(generator);
+        }
+
+        void AssetKey::Add(const void* data, unsigned int size) {
+            const unsigned char* bytes = (const unsigned char*)data;
+            for (unsigned int i = 0; i < size; ++i) {
+                hash ^= bytes[i];
+                hash *= FNV_PRIME;
+            }
+        }
+
+        AssetKey& AssetKey::Add(int value) {
+            Add(&value, sizeof(value));
+            return *this;
+        }
+
+        AssetKey& AssetKey::Add(unsigned int value) {
+            Add(&value, sizeof(value));
+            return *this;
+        }
+
+        AssetKey& AssetKey::Add(float value) {
+            Add(&value, sizeof(value));
+            return *this;
+        }
+
+        AssetKey& AssetKey::Add(const string& value) {
+            // Length first so ("ab","c") and ("a","bc") differ.
+            Add((unsigned int)value.size());
+            Add(value.data(), value.size());
+            return *this;
+        }
+
+        AssetKey& AssetKey::AddFile(const string& file) {
+            string path = PathExists(file) ? file
+                : DirectoryManager::FindFileInPath(file);
+            Add(file);
+            std::ifstream in(path.c_str(), std::ios::binary);
+            if (!in.is_open()) {
+                Add(string("<missing>"));
+                return *this;
+            }
+            char buffer[64 * 1024];
+            while (in) {
+                in.read(buffer, sizeof(buffer));
+                Add(buffer, in.gcount());
+            }
+            return *this;
+        }
+
+        string AssetKey::ToString() const {
+            char str[17];
+            snprintf(str, sizeof(str), "%016llx", hash);
+            return str;
+        }
+
+        GeneratedAssetCache::GeneratedAssetCache(const string& dir)
+            : dir(dir) {
+            std::ifstream in((dir + MANIFEST).c_str());
+            string line;
+            while (std::getline(in, line)) {
+                std::istringstream entry(line);
+                string asset, key;
+                if (entry >> asset >> key)
+                    manifest[asset] = key;
+            }
+            // Leftovers from an interrupted run.
+            RemovePath(dir + PARTIAL);
+        }
+
+        bool GeneratedAssetCache::IsValid(const string& asset,
+                                          const AssetKey& key) {
+            lock.Lock();
+            std::map<string, string>::iterator itr = manifest.find(asset);
+            bool valid = itr != manifest.end() && itr->second == key.ToString();
+            lock.Unlock();
+            return valid && PathExists(GetPath(asset));
+        }
+
+        string GeneratedAssetCache::GetPath(const string& asset) {
+            return dir + asset;
+        }
+
+        string GeneratedAssetCache::GetTempPath(const string& asset) {
+            string path = dir + PARTIAL + asset;
+            MakeParents(path);
+            RemovePath(path);
+            return path;
+        }
+
+        void GeneratedAssetCache::Commit(const string& asset,
+                                         const AssetKey& key) {
+            string path = GetPath(asset);
+            string temp = dir + PARTIAL + asset;
+            // The data has to be on disk before the rename makes it
+            // the asset, or a crash could leave a renamed but empty
+            // file behind.
+            if (!SyncPath(temp))
+                throw Resources::ResourceException
+                    ("could not flush generated asset: " + temp);
+
+            lock.Lock();
+            try {
+                // Drop the old entry before touching its data, so a
+                // crash in between leaves the asset marked as stale.
+                if (manifest.erase(asset) > 0)
+                    WriteManifest();
+                RemovePath(path);
+                MakeParents(path);
+                if (!ReplacePath(temp, path))
+                    throw Resources::ResourceException
+                        ("could not move generated asset into place: " + path);
+                SyncFile(Parent(path), true);
+                manifest[asset] = key.ToString();
+                WriteManifest();
+            } catch (...) {
+                lock.Unlock();
+                throw;
+            }
+            lock.Unlock();
+        }
+
+        void GeneratedAssetCache::WriteManifest() {
+            // The caller holds the lock.
+            string path = dir + MANIFEST;
+            string temp = path + ".tmp";
+            MakeParents(path);
+            bool ok;
+            {
+                std::ofstream out(temp.c_str());
+                std::map<string, string>::iterator itr = manifest.begin();
+                for (; itr != manifest.end(); ++itr)
+                    out << itr->first << " " << itr->second << "\n";
+                out.close();
+                ok = !out.fail();
+            }
+            if (!ok || !SyncFile(temp, false) || !ReplacePath(temp, path))
+                throw Resources::ResourceException
+                    ("could not write generated asset manifest: " + path);
+            SyncFile(dir, true);
+        }
+
+    }
+}
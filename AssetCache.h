@@ -0,0 +1,98 @@
+// Generated asset cache.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _ASSET_CACHE_H_
+#define _ASSET_CACHE_H_
+
+#include <Core/Mutex.h>
+
+#include <map>
+#include <string>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::string;
+
+        /**
+         * Hash of everything a generated asset depends on: the name
+         * and version of the generator, its parameters and the
+         * contents of any source files. Uses 64 bit FNV-1a.
+         */
+        class AssetKey {
+            unsigned long long hash;
+            void Add(const void* data, unsigned int size);
+        public:
+            AssetKey(const string& generator);
+
+            AssetKey& Add(int value);
+            AssetKey& Add(unsigned int value);
+            AssetKey& Add(float value);
+            AssetKey& Add(const string& value);
+
+            /**
+             * Hash the contents of a file. Relative paths are looked
+             * up through the DirectoryManager. A missing file is
+             * hashed as such, so the key changes once it appears.
+             */
+            AssetKey& AddFile(const string& file);
+
+            string ToString() const;
+        };
+
+        /**
+         * A cache of generated assets in a single directory, with a
+         * manifest mapping each asset to the key it was generated
+         * from.
+         *
+         * An asset is written to GetTempPath and only moved into
+         * place by Commit, which updates the manifest afterwards. An
+         * interrupted write therefore never shows up as a valid
+         * asset, and an asset is only trusted while its key matches.
+         *
+         * Safe to use from several threads at once, as long as they
+         * write different assets.
+         */
+        class GeneratedAssetCache {
+            string dir;
+            std::map<string, string> manifest;
+            // Guards the manifest and its file.
+            Core::Mutex lock;
+
+            void WriteManifest();
+        public:
+            GeneratedAssetCache(const string& dir);
+
+            /**
+             * True if the asset exists and was generated from key.
+             */
+            bool IsValid(const string& asset, const AssetKey& key);
+
+            string GetPath(const string& asset);
+
+            /**
+             * Path to write a new version of the asset to. Parent
+             * directories are created.
+             */
+            string GetTempPath(const string& asset);
+
+            /**
+             * Replace the asset with the one written to GetTempPath
+             * and record key for it in the manifest. The new asset is
+             * flushed to disk before it is moved into place. Throws a
+             * ResourceException if it cannot be, or if the manifest
+             * cannot be written.
+             */
+            void Commit(const string& asset, const AssetKey& key);
+        };
+
+    }
+}
+
+#endif
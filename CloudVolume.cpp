@@ -0,0 +1,516 @@
+// Cloud volume generation.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "CloudVolume.h"
+#include "ParallelRange.h"
+
+#include <Core/Mutex.h>
+#include <Logging/Logger.h>
+#include <Math/RandomGenerator.h>
+#include <Utils/TerrainTexUtils.h>
+#include <Utils/Timer.h>
+#include <Utils/ValueNoise.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define CLOUD_VOLUME_SSE
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using namespace Resources;
+        using std::vector;
+
+        // Row kernels. The SSE and scalar versions perform the exact
+        // same float operations in the same order, so both produce
+        // identical results.
+
+        // dst = a + (b - a) * w
+        static void LerpRow(float* dst, const float* a, const float* b,
+                            float w, unsigned int n) {
+            unsigned int i = 0;
+#ifdef CLOUD_VOLUME_SSE
+            __m128 vw = _mm_set1_ps(w);
+            for (; i + 4 <= n; i += 4) {
+                __m128 va = _mm_loadu_ps(a + i);
+                __m128 vb = _mm_loadu_ps(b + i);
+                _mm_storeu_ps(dst + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vw)));
+            }
+#endif
+            for (; i < n; ++i)
+                dst[i] = a[i] + (b[i] - a[i]) * w;
+        }
+
+        // dst += a + (b - a) * w
+        static void AccumulateLerpRow(float* dst, const float* a, const float* b,
+                                      const float* w, unsigned int n) {
+            unsigned int i = 0;
+#ifdef CLOUD_VOLUME_SSE
+            for (; i + 4 <= n; i += 4) {
+                __m128 va = _mm_loadu_ps(a + i);
+                __m128 vb = _mm_loadu_ps(b + i);
+                __m128 l = _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), _mm_loadu_ps(w + i)));
+                _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), l));
+            }
+#endif
+            for (; i < n; ++i)
+                dst[i] += a[i] + (b[i] - a[i]) * w[i];
+        }
+
+        // sum += a
+        static void AddRow(float* sum, const float* a, unsigned int n) {
+            unsigned int i = 0;
+#ifdef CLOUD_VOLUME_SSE
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), _mm_loadu_ps(a + i)));
+#endif
+            for (; i < n; ++i)
+                sum[i] += a[i];
+        }
+
+        // sum += a - b
+        static void AddDiffRow(float* sum, const float* a, const float* b,
+                               unsigned int n) {
+            unsigned int i = 0;
+#ifdef CLOUD_VOLUME_SSE
+            for (; i + 4 <= n; i += 4) {
+                __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                _mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), d));
+            }
+#endif
+            for (; i < n; ++i)
+                sum[i] += a[i] - b[i];
+        }
+
+        // dst = src * s
+        static void ScaleRow(float* dst, const float* src, float s,
+                             unsigned int n) {
+            unsigned int i = 0;
+#ifdef CLOUD_VOLUME_SSE
+            __m128 vs = _mm_set1_ps(s);
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), vs));
+#endif
+            for (; i < n; ++i)
+                dst[i] = src[i] * s;
+        }
+
+        // v = lo + (v - min) * s
+        static void RescaleRow(float* v, float min, float lo, float s,
+                               unsigned int n) {
+            unsigned int i = 0;
+#ifdef CLOUD_VOLUME_SSE
+            __m128 vmin = _mm_set1_ps(min);
+            __m128 vlo = _mm_set1_ps(lo);
+            __m128 vs = _mm_set1_ps(s);
+            for (; i + 4 <= n; i += 4) {
+                __m128 x = _mm_sub_ps(_mm_loadu_ps(v + i), vmin);
+                _mm_storeu_ps(v + i, _mm_add_ps(vlo, _mm_mul_ps(x, vs)));
+            }
+#endif
+            for (; i < n; ++i)
+                v[i] = lo + (v[i] - min) * s;
+        }
+
+        static inline unsigned int Wrap(int i, unsigned int n) {
+            int m = i % (int)n;
+            return m < 0 ? m + n : m;
+        }
+
+        /**
+         * White noise in [0, bandwidth), drawn in memory order from a
+         * generator seeded with seed. This is the lattice of the
+         * ValueNoise extension and has to stay sequential to draw the
+         * same values.
+         */
+        static void CreateNoise(float* data, unsigned int size,
+                                float bandwidth, unsigned int seed) {
+            Math::RandomGenerator r;
+            r.Seed(seed);
+            for (unsigned int i = 0; i < size; ++i)
+                data[i] = r.UniformFloat(0.0f, bandwidth);
+        }
+
+        /**
+         * Adds the trilinearly resampled (and wrapped) lower layer to
+         * the current one, one z slab at a time. The lower layer is
+         * first interpolated in y and z into a single line, which is
+         * then expanded along x with precomputed indices and weights.
+         */
+        class CombineJob : public IRangeJob {
+            float* dst;
+            const float* src;
+            unsigned int w, h, d, sw, sh, sd;
+            vector<unsigned int> x0, x1;
+            vector<float> wx;
+        public:
+            CombineJob(float* dst, unsigned int w, unsigned int h, unsigned int d,
+                       const float* src, unsigned int sw, unsigned int sh, unsigned int sd)
+                : dst(dst), src(src), w(w), h(h), d(d), sw(sw), sh(sh), sd(sd),
+                  x0(w), x1(w), wx(w) {
+                for (unsigned int x = 0; x < w; ++x) {
+                    float fx = (x + 0.5f) * sw / w - 0.5f;
+                    int ix = (int)floor(fx);
+                    x0[x] = Wrap(ix, sw);
+                    x1[x] = Wrap(ix + 1, sw);
+                    wx[x] = fx - ix;
+                }
+            }
+
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> near(sw), far(sw), line(sw), a(w), b(w);
+                for (unsigned int z = begin; z < end; ++z) {
+                    float fz = (z + 0.5f) * sd / d - 0.5f;
+                    int iz = (int)floor(fz);
+                    float wz = fz - iz;
+                    const float* z0 = src + Wrap(iz, sd) * sw * sh;
+                    const float* z1 = src + Wrap(iz + 1, sd) * sw * sh;
+                    for (unsigned int y = 0; y < h; ++y) {
+                        float fy = (y + 0.5f) * sh / h - 0.5f;
+                        int iy = (int)floor(fy);
+                        float wy = fy - iy;
+                        unsigned int y0 = Wrap(iy, sh) * sw;
+                        unsigned int y1 = Wrap(iy + 1, sh) * sw;
+
+                        LerpRow(&near[0], z0 + y0, z0 + y1, wy, sw);
+                        LerpRow(&far[0], z1 + y0, z1 + y1, wy, sw);
+                        LerpRow(&line[0], &near[0], &far[0], wz, sw);
+
+                        for (unsigned int x = 0; x < w; ++x) {
+                            a[x] = line[x0[x]];
+                            b[x] = line[x1[x]];
+                        }
+                        AccumulateLerpRow(dst + (z * h + y) * w,
+                                          &a[0], &b[0], &wx[0], w);
+                    }
+                }
+            }
+        };
+
+        /**
+         * Wrapping box blur of radius r over 'lanes' interleaved
+         * lines, where element k of lane l is base[k * stride + l].
+         * The lanes are contiguous in memory, so the running sums of
+         * neighbouring lanes are updated four at a time.
+         */
+        static void BlurLines(float* base, unsigned int lanes, unsigned int n,
+                              unsigned int stride, unsigned int r,
+                              vector<float>& in, vector<float>& sum) {
+            in.resize(n * lanes);
+            sum.assign(lanes, 0.0f);
+            for (unsigned int k = 0; k < n; ++k)
+                memcpy(&in[k * lanes], base + k * stride, lanes * sizeof(float));
+
+            const float inv = 1.0f / (2 * r + 1);
+            for (int k = -(int)r; k <= (int)r; ++k)
+                AddRow(&sum[0], &in[Wrap(k, n) * lanes], lanes);
+            ScaleRow(base, &sum[0], inv, lanes);
+            for (unsigned int i = 1; i < n; ++i) {
+                AddDiffRow(&sum[0],
+                           &in[Wrap(i + r, n) * lanes],
+                           &in[Wrap((int)i - (int)r - 1, n) * lanes],
+                           lanes);
+                ScaleRow(base + i * stride, &sum[0], inv, lanes);
+            }
+        }
+
+        class BlurXJob : public IRangeJob {
+            float* data;
+            unsigned int w, h, r;
+        public:
+            BlurXJob(float* data, unsigned int w, unsigned int h, unsigned int r)
+                : data(data), w(w), h(h), r(r) {}
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> in, sum;
+                for (unsigned int row = begin * h; row < end * h; ++row)
+                    BlurLines(data + row * w, 1, w, 1, r, in, sum);
+            }
+        };
+
+        class BlurYJob : public IRangeJob {
+            float* data;
+            unsigned int w, h, r;
+        public:
+            BlurYJob(float* data, unsigned int w, unsigned int h, unsigned int r)
+                : data(data), w(w), h(h), r(r) {}
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> in, sum;
+                for (unsigned int z = begin; z < end; ++z)
+                    BlurLines(data + z * w * h, w, h, w, r, in, sum);
+            }
+        };
+
+        class BlurZJob : public IRangeJob {
+            float* data;
+            unsigned int w, h, d, r;
+        public:
+            BlurZJob(float* data, unsigned int w, unsigned int h,
+                     unsigned int d, unsigned int r)
+                : data(data), w(w), h(h), d(d), r(r) {}
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> in, sum;
+                for (unsigned int y = begin; y < end; ++y)
+                    BlurLines(data + y * w, w, d, w * h, r, in, sum);
+            }
+        };
+
+        class MinMaxJob : public IRangeJob {
+            const float* data;
+            unsigned int sliceSize;
+            Core::Mutex lock;
+        public:
+            float min, max;
+            MinMaxJob(const float* data, unsigned int sliceSize)
+                : data(data), sliceSize(sliceSize),
+                  min(data[0]), max(data[0]) {}
+            void Run(unsigned int begin, unsigned int end) {
+                float lmin = data[begin * sliceSize];
+                float lmax = lmin;
+                for (unsigned int i = begin * sliceSize; i < end * sliceSize; ++i) {
+                    if (data[i] < lmin) lmin = data[i];
+                    if (data[i] > lmax) lmax = data[i];
+                }
+                lock.Lock();
+                if (lmin < min) min = lmin;
+                if (lmax > max) max = lmax;
+                lock.Unlock();
+            }
+        };
+
+        class RescaleJob : public IRangeJob {
+            float* data;
+            unsigned int sliceSize;
+            float min, lo, scale;
+        public:
+            RescaleJob(float* data, unsigned int sliceSize,
+                       float min, float lo, float scale)
+                : data(data), sliceSize(sliceSize),
+                  min(min), lo(lo), scale(scale) {}
+            void Run(unsigned int begin, unsigned int end) {
+                for (unsigned int z = begin; z < end; ++z)
+                    RescaleRow(data + z * sliceSize, min, lo, scale, sliceSize);
+            }
+        };
+
+        class ExpCurveJob : public IRangeJob {
+            float* data;
+            unsigned int sliceSize;
+            float cover, logSharpness;
+        public:
+            ExpCurveJob(float* data, unsigned int sliceSize,
+                        float cover, float sharpness)
+                : data(data), sliceSize(sliceSize), cover(cover),
+                  logSharpness(log(sharpness)) {}
+            void Run(unsigned int begin, unsigned int end) {
+                for (unsigned int i = begin * sliceSize; i < end * sliceSize; ++i) {
+                    float c = data[i] * 255.0f - cover;
+                    if (c < 0.0f) c = 0.0f;
+                    data[i] = 1.0f - expf(c * logSharpness);
+                }
+            }
+        };
+
+        static void Blur(float* data, unsigned int w, unsigned int h,
+                         unsigned int d, unsigned int r) {
+            BlurXJob bx(data, w, h, r);
+            ParallelRange::Run(bx, d);
+            BlurYJob by(data, w, h, r);
+            ParallelRange::Run(by, d);
+            BlurZJob bz(data, w, h, d, r);
+            ParallelRange::Run(bz, h);
+        }
+
+        FloatTexture3DPtr CloudVolume::Generate(unsigned int xResolution,
+                                                unsigned int yResolution,
+                                                unsigned int zResolution,
+                                                float bandwidth,
+                                                float mResolution,
+                                                float mBandwidth,
+                                                unsigned int blur,
+                                                unsigned int layers,
+                                                unsigned int seed) {
+            // Layer sizes from the top layer and down.
+            vector<unsigned int> xs, ys, zs;
+            vector<float> bands;
+            float x = xResolution, y = yResolution, z = zResolution;
+            float b = bandwidth;
+            for (unsigned int l = 0; l <= layers; ++l) {
+                xs.push_back(x < 1.0f ? 1 : (unsigned int)x);
+                ys.push_back(y < 1.0f ? 1 : (unsigned int)y);
+                zs.push_back(z < 1.0f ? 1 : (unsigned int)z);
+                bands.push_back(b);
+                x *= mResolution; y *= mResolution; z *= mResolution;
+                b *= mBandwidth;
+            }
+
+            // ValueNoise draws the seed of each layer from one
+            // generator before recursing into the layer below, so
+            // the seeds are drawn from the top layer and down.
+            Math::RandomGenerator r;
+            r.Seed(seed);
+            vector<unsigned int> seeds;
+            for (unsigned int l = 0; l <= layers; ++l)
+                seeds.push_back(r.UniformInt(0, 256));
+
+            // Build from the smallest layer and up, combining each
+            // layer with the one below it and blurring the result.
+            FloatTexture3DPtr below;
+            for (int l = layers; l >= 0; --l) {
+                FloatTexture3DPtr noise = FloatTexture3DPtr
+                    (new Texture3D<float>(xs[l], ys[l], zs[l], 1));
+                float* data = noise->GetData();
+                CreateNoise(data, xs[l] * ys[l] * zs[l], bands[l], seeds[l]);
+
+                if (below) {
+                    CombineJob cj(data, xs[l], ys[l], zs[l],
+                                  below->GetData(), xs[l+1], ys[l+1], zs[l+1]);
+                    ParallelRange::Run(cj, zs[l]);
+                    Blur(data, xs[l], ys[l], zs[l], blur);
+                }
+                below = noise;
+            }
+            return below;
+        }
+
+        void CloudVolume::Normalize(FloatTexture3DPtr tex, float min, float max) {
+            float* data = tex->GetData();
+            unsigned int sliceSize = tex->GetWidth() * tex->GetHeight();
+            MinMaxJob mm(data, sliceSize);
+            ParallelRange::Run(mm, tex->GetDepth());
+
+            float range = mm.max - mm.min;
+            float scale = range > 0.0f ? (max - min) / range : 0.0f;
+            RescaleJob rj(data, sliceSize, mm.min, min, scale);
+            ParallelRange::Run(rj, tex->GetDepth());
+        }
+
+        void CloudVolume::ExpCurve(FloatTexture3DPtr tex, float cover, float sharpness) {
+            ExpCurveJob ej(tex->GetData(), tex->GetWidth() * tex->GetHeight(),
+                           cover, sharpness);
+            ParallelRange::Run(ej, tex->GetDepth());
+        }
+
+        /**
+         * Fills z slabs of the occupancy grid.
+         */
+        class OccupancyJob : public IRangeJob {
+            const float* src;
+            float* dst;
+            unsigned int w, h, d, c, brick, gw, gh;
+        public:
+            OccupancyJob(const float* src, float* dst, unsigned int w,
+                         unsigned int h, unsigned int d, unsigned int c,
+                         unsigned int brick, unsigned int gw, unsigned int gh)
+                : src(src), dst(dst), w(w), h(h), d(d), c(c), brick(brick),
+                  gw(gw), gh(gh) {}
+            void Run(unsigned int begin, unsigned int end) {
+                int b = brick;
+                for (unsigned int gz = begin; gz < end; ++gz)
+                    for (unsigned int gy = 0; gy < gh; ++gy)
+                        for (unsigned int gx = 0; gx < gw; ++gx) {
+                            float m = 0.0f;
+                            for (int z = (int)gz * b - 1; z <= ((int)gz + 1) * b; ++z)
+                                for (int y = (int)gy * b - 1; y <= ((int)gy + 1) * b; ++y) {
+                                    const float* row = src + (Wrap(z, d) * h + Wrap(y, h)) * w * c;
+                                    for (int x = (int)gx * b - 1; x <= ((int)gx + 1) * b; ++x)
+                                        m = std::max(m, row[Wrap(x, w) * c + c - 1]);
+                                }
+                            dst[(gz * gh + gy) * gw + gx] = m;
+                        }
+            }
+        };
+
+        FloatTexture3DPtr CloudVolume::Occupancy(FloatTexture3DPtr tex, unsigned int brick) {
+            unsigned int w = tex->GetWidth(), h = tex->GetHeight(), d = tex->GetDepth();
+            unsigned int gw = (w + brick - 1) / brick;
+            unsigned int gh = (h + brick - 1) / brick;
+            unsigned int gd = (d + brick - 1) / brick;
+            FloatTexture3DPtr grid(new Texture3D<float>(gw, gh, gd, 1));
+            OccupancyJob job(tex->GetData(), grid->GetData(), w, h, d,
+                             tex->GetChannels(), brick, gw, gh);
+            ParallelRange::Run(job, gd);
+            return grid;
+        }
+
+        void CloudVolume::Benchmark(unsigned int size) {
+            double voxels = (double)size * size * size;
+            Utils::Timer timer;
+
+            timer.Start();
+            FloatTexture3DPtr tex = Generate(size, size, size, 128, 0.5, 1, 3, 3, 0);
+            double gen = timer.GetElapsedTime().AsInt() / 1000000.0;
+
+            timer.Reset();
+            timer.Start();
+            Normalize(tex, 0, 1);
+            double norm = timer.GetElapsedTime().AsInt() / 1000000.0;
+
+            timer.Reset();
+            timer.Start();
+            ExpCurve(tex);
+            double exp = timer.GetElapsedTime().AsInt() / 1000000.0;
+
+            double total = gen + norm + exp;
+            logger.info << "cloud volume " << size << "^3 on "
+                        << ParallelRange::GetThreadCount() << " threads: "
+                        << "generate " << voxels / gen << " voxels/s, "
+                        << "normalize " << voxels / norm << " voxels/s, "
+                        << "exp curve " << voxels / exp << " voxels/s, "
+                        << "total " << voxels / total << " voxels/s"
+                        << logger.end;
+
+            // ValueNoise is serial, so it is only compared at the
+            // size of the cloud asset and below.
+            if (size > 128) return;
+            unsigned int depth = size / 2;
+            FloatTexture3DPtr ours = Generate(size, size, depth, 128, 0.5, 1, 3, 3, 0);
+            Normalize(ours, 0, 1);
+            ExpCurve(ours);
+
+            timer.Reset();
+            timer.Start();
+            FloatTexture3DPtr ref = ValueNoise::Generate3D(size, size, depth,
+                                                           128, 0.5, 1, 3, 3, 0);
+            TexUtils::Normalize3D(ref, 0, 1);
+            TexUtils::CloudExpCurve3D(ref);
+            double serial = timer.GetElapsedTime().AsInt() / 1000000.0;
+
+            if (ref->GetWidth() != ours->GetWidth() ||
+                ref->GetHeight() != ours->GetHeight() ||
+                ref->GetDepth() != ours->GetDepth() ||
+                ref->GetChannels() != ours->GetChannels()) {
+                logger.warning << "cloud volume " << size << "^2*" << depth
+                               << ": ValueNoise made a volume of another size"
+                               << logger.end;
+                return;
+            }
+            unsigned int count = size * size * depth;
+            unsigned int differing = 0;
+            float maxDiff = 0.0f;
+            const float* r = ref->GetData();
+            const float* o = ours->GetData();
+            for (unsigned int i = 0; i < count; ++i)
+                if (memcmp(r + i, o + i, sizeof(float)) != 0) {
+                    ++differing;
+                    maxDiff = std::max(maxDiff, (float)fabs(r[i] - o[i]));
+                }
+            logger.info << "cloud volume " << size << "^2*" << depth
+                        << " ValueNoise: " << serial * 1000.0 << " ms, max difference "
+                        << maxDiff << ", " << differing << " of " << count
+                        << " voxels differ" << logger.end;
+        }
+
+    }
+}
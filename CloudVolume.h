@@ -0,0 +1,96 @@
+// Cloud volume generation.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _CLOUD_VOLUME_H_
+#define _CLOUD_VOLUME_H_
+
+#include <Resources/Texture3D.h>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::FloatTexture3DPtr;
+
+        /**
+         * Parallel version of the layered value noise used for the
+         * cloud volume (see the Noise chapter of the report).
+         *
+         * The lattice of every layer is drawn sequentially from a
+         * RandomGenerator in the order ValueNoise draws it. Combining
+         * each layer with the layer below, blurring, normalizing and
+         * the exp curve run in slabs spread over all cores. None of
+         * these depend on the slab split or on the SSE path, so the
+         * result is the same for any number of threads.
+         *
+         * The passes are written after the ValueNoise and TexUtils
+         * ones, not taken from them, so the volume is not known to
+         * be bit identical to the library's. Benchmark compares the
+         * two.
+         */
+        class CloudVolume {
+        public:
+            /**
+             * Generate a single channel noise volume.
+             *
+             * @param xResolution, yResolution, zResolution Size of
+             * the top layer.
+             * @param bandwidth Value range of the top layer.
+             * @param mResolution Resolution multiplier between layers.
+             * @param mBandwidth Bandwidth multiplier between layers.
+             * @param blur Box blur radius applied after each combine.
+             * @param layers Number of layers below the top layer.
+             * @param seed Seed for the lattice values.
+             */
+            static FloatTexture3DPtr Generate(unsigned int xResolution,
+                                              unsigned int yResolution,
+                                              unsigned int zResolution,
+                                              float bandwidth,
+                                              float mResolution,
+                                              float mBandwidth,
+                                              unsigned int blur,
+                                              unsigned int layers,
+                                              unsigned int seed);
+
+            /**
+             * Linearly rescale all values into [min, max].
+             */
+            static void Normalize(FloatTexture3DPtr tex, float min, float max);
+
+            /**
+             * The exponential cloud filter, expects values in [0, 1].
+             * Values below cover/255 become fully transparent.
+             */
+            static void ExpCurve(FloatTexture3DPtr tex,
+                                 float cover = 100.0f,
+                                 float sharpness = 0.95f);
+
+            /**
+             * Coarse occupancy grid for empty space skipping: the
+             * largest value of the last channel in each brick^3
+             * block of voxels and the voxels next to it, wrapping at
+             * the edges. A ray may skip a cell holding zero without
+             * missing anything the trilinear filter would blend in.
+             */
+            static FloatTexture3DPtr Occupancy(FloatTexture3DPtr tex,
+                                               unsigned int brick);
+
+            /**
+             * Time the full cloud pipeline on a size^3 volume and log
+             * the throughput in voxels per second. Up to size 128 the
+             * volume of the cloud asset, size^2 * size/2, is also
+             * made by ValueNoise and TexUtils, and the largest
+             * difference and the number of differing voxels logged.
+             */
+            static void Benchmark(unsigned int size);
+        };
+
+    }
+}
+
+#endif
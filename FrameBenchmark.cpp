@@ -0,0 +1,305 @@
+// Frame time benchmark.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "FrameBenchmark.h"
+
+#include <Logging/Logger.h>
+#include <Meta/OpenGL.h>
+
+#include <algorithm>
+#include <cstdio>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::vector;
+
+        FrameBenchmark::FrameBenchmark(Core::IEngine& engine, Display::Camera& camera,
+                                       unsigned int frames, string output,
+                                       unsigned int warmup)
+            : engine(engine), camera(camera), warmup(warmup), frames(frames),
+              step(0), output(output), renderTime(0.0f), started(false),
+              renderBegin(*this), renderEnd(*this), useQueries(false) {
+            for (unsigned int i = 0; i < QUERIES; ++i) {
+                queries[i] = 0;
+                queryFrame[i] = 0;
+                pending[i] = false;
+            }
+        }
+
+        void FrameBenchmark::Attach(Renderers::IRenderer& renderer) {
+            renderer.PreProcessEvent().Attach(renderBegin);
+            renderer.PostProcessEvent().Attach(renderEnd);
+        }
+
+        void FrameBenchmark::AddKey(Vector<3, float> position, Vector<3, float> lookAt) {
+            Key k;
+            k.position = position;
+            k.lookAt = lookAt;
+            path.push_back(k);
+        }
+
+        unsigned int FrameBenchmark::AddListener(string name) {
+            listenerNames.push_back(name);
+            listenerTimes.push_back(0.0f);
+            return listenerNames.size() - 1;
+        }
+
+        void FrameBenchmark::AddListenerTime(unsigned int index, float ms) {
+            listenerTimes[index] += ms;
+        }
+
+        unsigned int FrameBenchmark::AddCounter(string name) {
+            counterNames.push_back(name);
+            counters.push_back(0.0f);
+            return counterNames.size() - 1;
+        }
+
+        void FrameBenchmark::SetCounter(unsigned int index, float value) {
+            counters[index] = value;
+        }
+
+        static Vector<3, float> CatmullRom(const Vector<3, float>& p0, const Vector<3, float>& p1,
+                                           const Vector<3, float>& p2, const Vector<3, float>& p3,
+                                           float t) {
+            float t2 = t * t, t3 = t2 * t;
+            return (p1 * 2.0f + (p2 - p0) * t +
+                    (p0 * 2.0f - p1 * 5.0f + p2 * 4.0f - p3) * t2 +
+                    (p1 * 3.0f - p0 - p2 * 3.0f + p3) * t3) * 0.5f;
+        }
+
+        void FrameBenchmark::MoveCamera() {
+            if (path.empty()) return;
+            float t = 0.0f;
+            if (step >= warmup && frames > 1)
+                t = (step - warmup) / float(frames - 1) * (path.size() - 1);
+            unsigned int n = path.size() - 1;
+            unsigned int i = std::min((unsigned int)t, n);
+            float f = t - i;
+            const Key& k0 = path[i > 0 ? i - 1 : 0];
+            const Key& k1 = path[i];
+            const Key& k2 = path[std::min(i + 1, n)];
+            const Key& k3 = path[std::min(i + 2, n)];
+            Vector<3, float> pos = CatmullRom(k0.position, k1.position,
+                                              k2.position, k3.position, f);
+            Vector<3, float> at = CatmullRom(k0.lookAt, k1.lookAt,
+                                             k2.lookAt, k3.lookAt, f);
+            camera.SetPosition(pos);
+            camera.LookAt(at[0], at[1], at[2]);
+        }
+
+        void FrameBenchmark::BeginRender() {
+            renderTimer.Reset();
+            renderTimer.Start();
+            if (!started) {
+                started = true;
+                useQueries = GLEW_ARB_timer_query;
+                if (useQueries)
+                    glGenQueries(QUERIES, queries);
+                else
+                    logger.info << "no timer queries, GPU times are not recorded"
+                                << logger.end;
+            }
+            if (!useQueries) return;
+            // Results are read QUERIES frames late, so the CPU only
+            // waits for the GPU when it is that far behind.
+            unsigned int slot = step % QUERIES;
+            CollectQuery(slot);
+            glBeginQuery(GL_TIME_ELAPSED, queries[slot]);
+            // Warm up frames point past the last result.
+            queryFrame[slot] = step >= warmup ? results.size() : frames;
+            pending[slot] = true;
+        }
+
+        void FrameBenchmark::EndRender() {
+            renderTime = renderTimer.GetElapsedTime().AsInt() / 1000.0f;
+            if (useQueries)
+                glEndQuery(GL_TIME_ELAPSED);
+        }
+
+        void FrameBenchmark::CollectQuery(unsigned int slot) {
+            if (!pending[slot]) return;
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &ns);
+            if (queryFrame[slot] < results.size())
+                results[queryFrame[slot]].gpu = ns / 1000000.0f;
+            pending[slot] = false;
+        }
+
+        void FrameBenchmark::Handle(Core::ProcessEventArg arg) {
+            if (step >= warmup && results.size() < frames) {
+                Frame f;
+                f.frame = frameTimer.GetElapsedTime().AsInt() / 1000.0f;
+                f.render = renderTime;
+                f.gpu = -1.0f;
+                f.listeners = listenerTimes;
+                f.counters = counters;
+                results.push_back(f);
+                if (results.size() == frames) {
+                    for (unsigned int i = 0; i < QUERIES; ++i)
+                        CollectQuery(i);
+                    if (output.size() > 4 && output.substr(output.size() - 4) == ".csv")
+                        WriteCSV();
+                    else
+                        Write();
+                    engine.Stop();
+                    return;
+                }
+            }
+            listenerTimes.assign(listenerNames.size(), 0.0f);
+            ++step;
+            MoveCamera();
+            frameTimer.Reset();
+            frameTimer.Start();
+        }
+
+        // A JSON string literal of s.
+        static string Quote(const string& s) {
+            string q = "\"";
+            for (unsigned int i = 0; i < s.size(); ++i) {
+                unsigned char c = s[i];
+                if (c == '"' || c == '\\') {
+                    q += '\\';
+                    q += c;
+                } else if (c < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    q += esc;
+                } else
+                    q += c;
+            }
+            return q + "\"";
+        }
+
+        struct Summary {
+            float mean, p50, p90, p95, p99, max;
+        };
+
+        static Summary Summarize(vector<float> v) {
+            Summary s = { 0, 0, 0, 0, 0, 0 };
+            if (v.empty()) return s;
+            std::sort(v.begin(), v.end());
+            double sum = 0.0;
+            for (unsigned int i = 0; i < v.size(); ++i)
+                sum += v[i];
+            s.mean = sum / v.size();
+            // Nearest rank percentiles.
+            unsigned int n = v.size();
+            s.p50 = v[std::min(n - 1, (n * 50 + 99) / 100 - 1)];
+            s.p90 = v[std::min(n - 1, (n * 90 + 99) / 100 - 1)];
+            s.p95 = v[std::min(n - 1, (n * 95 + 99) / 100 - 1)];
+            s.p99 = v[std::min(n - 1, (n * 99 + 99) / 100 - 1)];
+            s.max = v[n - 1];
+            return s;
+        }
+
+        static void WriteSummary(FILE* out, const char* name, const vector<float>& v,
+                                 bool last) {
+            Summary s = Summarize(v);
+            fprintf(out, "    %s: {\"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, "
+                    "\"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}%s\n",
+                    Quote(name).c_str(), s.mean, s.p50, s.p90, s.p95, s.p99, s.max, last ? "" : ",");
+        }
+
+        static void WriteArray(FILE* out, const char* name, const vector<float>& v,
+                               bool last) {
+            fprintf(out, "    %s: [", Quote(name).c_str());
+            for (unsigned int i = 0; i < v.size(); ++i) {
+                if (i) fprintf(out, ", ");
+                // Missing values are negative.
+                if (v[i] < 0.0f) fprintf(out, "null");
+                else fprintf(out, "%.4f", v[i]);
+            }
+            fprintf(out, "]%s\n", last ? "" : ",");
+        }
+
+        void FrameBenchmark::Write() {
+            FILE* out = fopen(output.c_str(), "w");
+            if (out == NULL) {
+                logger.error << "could not write benchmark results: " << output << logger.end;
+                return;
+            }
+            vector<float> frame, render, gpu, gpuFrames;
+            vector<vector<float> > listeners(listenerNames.size());
+            vector<vector<float> > counts(counterNames.size());
+            for (unsigned int i = 0; i < results.size(); ++i) {
+                frame.push_back(results[i].frame);
+                render.push_back(results[i].render);
+                gpuFrames.push_back(results[i].gpu);
+                if (results[i].gpu >= 0.0f)
+                    gpu.push_back(results[i].gpu);
+                for (unsigned int n = 0; n < listenerNames.size(); ++n)
+                    listeners[n].push_back(results[i].listeners[n]);
+                for (unsigned int n = 0; n < counterNames.size(); ++n)
+                    counts[n].push_back(results[i].counters[n]);
+            }
+
+            fprintf(out, "{\n  \"frames\": %u,\n  \"warmup\": %u,\n  \"keys\": %u,\n",
+                    (unsigned int)results.size(), warmup, (unsigned int)path.size());
+            const char* gl = (const char*)glGetString(GL_RENDERER);
+            fprintf(out, "  \"renderer\": %s,\n", Quote(gl ? gl : "unknown").c_str());
+            fprintf(out, "  \"summary\": {\n");
+            WriteSummary(out, "frame", frame, false);
+            WriteSummary(out, "render_cpu", render, false);
+            WriteSummary(out, "gpu", gpu, true);
+            fprintf(out, "  },\n  \"listeners\": {\n");
+            for (unsigned int n = 0; n < listenerNames.size(); ++n)
+                WriteSummary(out, listenerNames[n].c_str(), listeners[n], n + 1 == listenerNames.size());
+            fprintf(out, "  },\n  \"counters\": {\n");
+            for (unsigned int n = 0; n < counterNames.size(); ++n)
+                WriteSummary(out, counterNames[n].c_str(), counts[n],
+                             n + 1 == counterNames.size());
+            fprintf(out, "  },\n  \"per_frame\": {\n");
+            WriteArray(out, "frame", frame, false);
+            WriteArray(out, "render_cpu", render, false);
+            WriteArray(out, "gpu", gpuFrames, listenerNames.empty() && counterNames.empty());
+            for (unsigned int n = 0; n < listenerNames.size(); ++n)
+                WriteArray(out, listenerNames[n].c_str(), listeners[n],
+                           n + 1 == listenerNames.size() && counterNames.empty());
+            for (unsigned int n = 0; n < counterNames.size(); ++n)
+                WriteArray(out, counterNames[n].c_str(), counts[n],
+                           n + 1 == counterNames.size());
+            fprintf(out, "  }\n}\n");
+            fclose(out);
+
+            Summary s = Summarize(frame);
+            logger.info << "benchmark of " << results.size() << " frames written to "
+                        << output << ": mean " << s.mean << " ms, p95 " << s.p95
+                        << " ms, p99 " << s.p99 << " ms" << logger.end;
+        }
+
+        void FrameBenchmark::WriteCSV() {
+            FILE* out = fopen(output.c_str(), "w");
+            if (out == NULL) {
+                logger.error << "could not write benchmark results: " << output << logger.end;
+                return;
+            }
+            fprintf(out, "frame,frame_ms,render_cpu_ms,gpu_ms");
+            for (unsigned int n = 0; n < listenerNames.size(); ++n)
+                fprintf(out, ",%s_ms", listenerNames[n].c_str());
+            for (unsigned int n = 0; n < counterNames.size(); ++n)
+                fprintf(out, ",%s", counterNames[n].c_str());
+            fprintf(out, "\n");
+            for (unsigned int i = 0; i < results.size(); ++i) {
+                const Frame& f = results[i];
+                fprintf(out, "%u,%.4f,%.4f,", i, f.frame, f.render);
+                if (f.gpu >= 0.0f) fprintf(out, "%.4f", f.gpu);
+                for (unsigned int n = 0; n < listenerNames.size(); ++n)
+                    fprintf(out, ",%.4f", f.listeners[n]);
+                for (unsigned int n = 0; n < counterNames.size(); ++n)
+                    fprintf(out, ",%g", f.counters[n]);
+                fprintf(out, "\n");
+            }
+            fclose(out);
+            logger.info << "benchmark of " << results.size() << " frames written to "
+                        << output << logger.end;
+        }
+
+    }
+}
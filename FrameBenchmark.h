@@ -0,0 +1,178 @@
+// Frame time benchmark.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _FRAME_BENCHMARK_H_
+#define _FRAME_BENCHMARK_H_
+
+#include <Core/IEngine.h>
+#include <Core/IListener.h>
+#include <Core/EngineEvents.h>
+#include <Display/Camera.h>
+#include <Math/Vector.h>
+#include <Renderers/IRenderer.h>
+#include <Utils/Timer.h>
+
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Math::Vector;
+        using std::string;
+
+        class FrameBenchmark;
+
+        /**
+         * Times another listener and reports the time to a frame
+         * benchmark under a name.
+         */
+        template <class T>
+        class TimedListener : public Core::IListener<T> {
+            Core::IListener<T>& listener;
+            FrameBenchmark& benchmark;
+            unsigned int index;
+            Utils::Timer timer;
+        public:
+            TimedListener(Core::IListener<T>& listener,
+                          FrameBenchmark& benchmark, string name);
+            void Handle(T arg);
+        };
+
+        /**
+         * Flies the camera along a scripted path, one fixed step per
+         * frame, and records the time of every frame after a number
+         * of warm up frames. When done the timings are written to a
+         * file and the engine is stopped.
+         *
+         * Per frame it records the time between frames, the CPU time
+         * spent in the renderer, the GPU time of the frame from a
+         * timer query when the driver supports it, and the time of
+         * every listener wrapped in a TimedListener, and any counts
+         * reported for it. The output is
+         * JSON with per frame values and percentiles, or CSV with the
+         * per frame values only when the file name ends in .csv.
+         *
+         * The camera moves per frame and not per second, so the same
+         * frames are rendered on any machine and the results can be
+         * compared between runs.
+         */
+        class FrameBenchmark
+            : public Core::IListener<Core::ProcessEventArg> {
+        public:
+            struct Key {
+                Vector<3, float> position, lookAt;
+            };
+
+        private:
+            class RenderBegin
+                : public Core::IListener<Renderers::RenderingEventArg> {
+                FrameBenchmark& b;
+            public:
+                RenderBegin(FrameBenchmark& b) : b(b) {}
+                void Handle(Renderers::RenderingEventArg arg) { b.BeginRender(); }
+            };
+            class RenderEnd
+                : public Core::IListener<Renderers::RenderingEventArg> {
+                FrameBenchmark& b;
+            public:
+                RenderEnd(FrameBenchmark& b) : b(b) {}
+                void Handle(Renderers::RenderingEventArg arg) { b.EndRender(); }
+            };
+
+            struct Frame {
+                float frame, render, gpu;
+                std::vector<float> listeners;
+                std::vector<float> counters;
+            };
+
+            Core::IEngine& engine;
+            Display::Camera& camera;
+            unsigned int warmup, frames, step;
+            string output;
+            std::vector<Key> path;
+            std::vector<string> listenerNames;
+            std::vector<Frame> results;
+            std::vector<float> listenerTimes;
+            std::vector<string> counterNames;
+            std::vector<float> counters;
+            float renderTime;
+            Utils::Timer frameTimer, renderTimer;
+            bool started;
+            RenderBegin renderBegin;
+            RenderEnd renderEnd;
+
+            static const unsigned int QUERIES = 4;
+            unsigned int queries[QUERIES];
+            // The result index each query is measuring, if any.
+            unsigned int queryFrame[QUERIES];
+            bool pending[QUERIES];
+            bool useQueries;
+
+            void BeginRender();
+            void EndRender();
+            void MoveCamera();
+            void CollectQuery(unsigned int slot);
+            void Write();
+            void WriteCSV();
+
+        public:
+            /**
+             * @param frames Number of frames to measure, the camera
+             * path is spread evenly over them.
+             * @param output File to write the results to.
+             */
+            FrameBenchmark(Core::IEngine& engine, Display::Camera& camera,
+                           unsigned int frames, string output,
+                           unsigned int warmup = 60);
+
+            /**
+             * Time the renderer from its pre process to its post
+             * process event.
+             */
+            void Attach(Renderers::IRenderer& renderer);
+
+            void AddKey(Vector<3, float> position, Vector<3, float> lookAt);
+
+            /**
+             * Register a named listener timing, returns the index to
+             * report it under.
+             */
+            unsigned int AddListener(string name);
+            void AddListenerTime(unsigned int index, float ms);
+
+            /**
+             * Register a named count, such as the number of objects
+             * drawn, returns the index to report it under. The last
+             * value set before a frame is recorded is kept.
+             */
+            unsigned int AddCounter(string name);
+            void SetCounter(unsigned int index, float value);
+
+            void Handle(Core::ProcessEventArg arg);
+        };
+
+        template <class T>
+        TimedListener<T>::TimedListener(Core::IListener<T>& listener,
+                                        FrameBenchmark& benchmark, string name)
+            : listener(listener), benchmark(benchmark),
+              index(benchmark.AddListener(name)) {}
+
+        template <class T>
+        void TimedListener<T>::Handle(T arg) {
+            timer.Reset();
+            timer.Start();
+            listener.Handle(arg);
+            benchmark.AddListenerTime(index, timer.GetElapsedTime().AsInt() / 1000.0f);
+        }
+
+    }
+}
+
+#endif
@@ -0,0 +1,217 @@
+// Grass mask.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "GrassMask.h"
+
+#include <Logging/Logger.h>
+#include <Meta/OpenGL.h>
+#include <Resources/Exceptions.h>
+
+#include "ParallelRange.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::ResourceException;
+        using Resources::UCharTexture2D;
+
+        const float GrassMask::MIN_NORMAL_Y = 0.7f;
+        const float GrassMask::MIN_HEIGHT = 8.0f;
+        const float GrassMask::MAX_HEIGHT = 60.0f;
+
+        static const char MAGIC[8] = "OEGRAS1";
+
+        /**
+         * Bakes rows of cells into the mask texture.
+         */
+        class GrassBakeJob : public IRangeJob {
+            IHeightField* terrain;
+            int width, depth, cellSize;
+            float widthScale;
+            unsigned char* data;
+            unsigned int columns;
+            const TerrainRegion& cells;
+
+            float Height(int x, int z) {
+                x = std::min(std::max(x, 0), width - 1);
+                z = std::min(std::max(z, 0), depth - 1);
+                return terrain->GetHeight(x, z);
+            }
+
+        public:
+            GrassBakeJob(IHeightField* terrain, int width, int depth,
+                         int cellSize, float widthScale,
+                         unsigned char* data, unsigned int columns,
+                         const TerrainRegion& cells)
+                : terrain(terrain), width(width), depth(depth), cellSize(cellSize),
+                  widthScale(widthScale), data(data), columns(columns), cells(cells) {}
+
+            void Run(unsigned int begin, unsigned int end) {
+                for (unsigned int row = begin; row < end; ++row) {
+                    int cz = cells.z + row;
+                    for (int cx = cells.x; cx < cells.x + (int)cells.width; ++cx) {
+                        int x0 = cx * cellSize, z0 = cz * cellSize;
+                        int x1 = std::min(x0 + cellSize, width);
+                        int z1 = std::min(z0 + cellSize, depth);
+                        float n[3] = { 0.0f, 0.0f, 0.0f };
+                        unsigned int grass = 0, total = 0;
+                        for (int z = z0; z < z1; ++z)
+                            for (int x = x0; x < x1; ++x) {
+                                float h = Height(x, z);
+                                float dx = (Height(x + 1, z) - Height(x - 1, z)) / (2.0f * widthScale);
+                                float dz = (Height(x, z + 1) - Height(x, z - 1)) / (2.0f * widthScale);
+                                float inv = 1.0f / sqrt(dx * dx + 1.0f + dz * dz);
+                                n[0] -= dx * inv;
+                                n[1] += inv;
+                                n[2] -= dz * inv;
+                                if (GrassMask::MIN_NORMAL_Y <= inv &&
+                                    GrassMask::MIN_HEIGHT <= h && h <= GrassMask::MAX_HEIGHT)
+                                    ++grass;
+                                ++total;
+                            }
+                        float len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                        unsigned char* texel = data + (cz * columns + cx) * 4;
+                        for (unsigned int i = 0; i < 3; ++i)
+                            texel[i] = (unsigned char)((n[i] / len * 0.5f + 0.5f) * 255.0f + 0.5f);
+                        texel[3] = (unsigned char)(grass * 255 / total);
+                    }
+                }
+            }
+        };
+
+        GrassMask::GrassMask(IHeightField* terrain,
+                             unsigned int width, unsigned int depth,
+                             float widthScale, unsigned int cellSize)
+            : terrain(terrain), width(width), depth(depth),
+              cellSize(std::max(1u, cellSize)), widthScale(widthScale) {
+            columns = (width + this->cellSize - 1) / this->cellSize;
+            rows = (depth + this->cellSize - 1) / this->cellSize;
+            texture = Resources::UCharTexture2DPtr(new UCharTexture2D(columns, rows, 4));
+            texture->SetColorFormat(Resources::RGBA);
+            texture->SetWrapping(Resources::CLAMP_TO_EDGE);
+            texture->SetMipmapping(false);
+            bits.resize((columns * rows + 31) / 32, 0);
+        }
+
+        TerrainRegion GrassMask::ToCells(const TerrainRegion& vertices) const {
+            // Normals reach one vertex into the neighbours.
+            int x0 = vertices.x - 1, z0 = vertices.z - 1;
+            int x1 = vertices.x + (int)vertices.width + 1;
+            int z1 = vertices.z + (int)vertices.depth + 1;
+            int c = cellSize;
+            x0 = x0 < 0 ? 0 : x0 / c;
+            z0 = z0 < 0 ? 0 : z0 / c;
+            x1 = (x1 + c - 1) / c;
+            z1 = (z1 + c - 1) / c;
+            return TerrainRegion(x0, z0, std::max(x1 - x0, 0), std::max(z1 - z0, 0))
+                .Clip(columns, rows);
+        }
+
+        void GrassMask::UpdateBits(const TerrainRegion& cells) {
+            const unsigned char* data = texture->GetData();
+            for (int z = cells.z; z < cells.z + (int)cells.depth; ++z)
+                for (int x = cells.x; x < cells.x + (int)cells.width; ++x) {
+                    unsigned int i = z * columns + x;
+                    if (data[i * 4 + 3])
+                        bits[i / 32] |= 1u << (i % 32);
+                    else
+                        bits[i / 32] &= ~(1u << (i % 32));
+                }
+        }
+
+        void GrassMask::Bake() {
+            TerrainRegion cells(0, 0, columns, rows);
+            GrassBakeJob job(terrain, width, depth, cellSize, widthScale,
+                             texture->GetData(), columns, cells);
+            ParallelRange::Run(job, rows);
+            UpdateBits(cells);
+        }
+
+        void GrassMask::Bake(const TerrainRegion& vertices) {
+            TerrainRegion cells = ToCells(vertices);
+            if (cells.IsEmpty()) return;
+            GrassBakeJob job(terrain, width, depth, cellSize, widthScale,
+                             texture->GetData(), columns, cells);
+            // Edits are small, one thread is enough.
+            job.Run(0, cells.depth);
+            UpdateBits(cells);
+            dirty = dirty.IsEmpty() ? cells : dirty.Union(cells);
+        }
+
+        void GrassMask::Save(string file) {
+            FILE* out = fopen(file.c_str(), "wb");
+            if (out == NULL)
+                throw ResourceException("could not write grass mask: " + file);
+            fwrite(MAGIC, sizeof(MAGIC), 1, out);
+            fwrite(&columns, sizeof(columns), 1, out);
+            fwrite(&rows, sizeof(rows), 1, out);
+            fwrite(&cellSize, sizeof(cellSize), 1, out);
+            fwrite(texture->GetData(), 4, columns * rows, out);
+            fclose(out);
+        }
+
+        bool GrassMask::Load(string file) {
+            FILE* in = fopen(file.c_str(), "rb");
+            if (in == NULL) return false;
+            char magic[8];
+            unsigned int c, r, s;
+            bool ok = fread(magic, sizeof(magic), 1, in) == 1 &&
+                memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                fread(&c, sizeof(c), 1, in) == 1 &&
+                fread(&r, sizeof(r), 1, in) == 1 &&
+                fread(&s, sizeof(s), 1, in) == 1 &&
+                c == columns && r == rows && s == cellSize &&
+                fread(texture->GetData(), 4, columns * rows, in) == columns * rows;
+            fclose(in);
+            if (ok) UpdateBits(TerrainRegion(0, 0, columns, rows));
+            return ok;
+        }
+
+        void GrassMask::Handle(TerrainEditEventArg arg) {
+            Bake(arg.region);
+        }
+
+        void GrassMask::Handle(Renderers::RenderingEventArg arg) {
+            if (dirty.IsEmpty() || texture->GetID() == 0) return;
+            glBindTexture(GL_TEXTURE_2D, texture->GetID());
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, columns);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, dirty.x, dirty.z, dirty.width, dirty.depth,
+                            GL_RGBA, GL_UNSIGNED_BYTE,
+                            texture->GetData() + (dirty.z * columns + dirty.x) * 4);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            CHECK_FOR_GL_ERROR();
+            dirty = TerrainRegion();
+        }
+
+        bool GrassMask::Any(const TerrainRegion& vertices) const {
+            int c = cellSize;
+            int x0 = std::max(vertices.x, 0) / c, z0 = std::max(vertices.z, 0) / c;
+            int x1 = (vertices.x + (int)vertices.width + c - 1) / c;
+            int z1 = (vertices.z + (int)vertices.depth + c - 1) / c;
+            TerrainRegion cells = TerrainRegion
+                (x0, z0, std::max(x1 - x0, 0), std::max(z1 - z0, 0)).Clip(columns, rows);
+            for (int z = cells.z; z < cells.z + (int)cells.depth; ++z)
+                for (int x = cells.x; x < cells.x + (int)cells.width; ++x) {
+                    unsigned int i = z * columns + x;
+                    if (bits[i / 32] & (1u << (i % 32)))
+                        return true;
+                }
+            return false;
+        }
+
+    }
+}
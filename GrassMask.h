@@ -0,0 +1,117 @@
+// Grass mask.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _GRASS_MASK_H_
+#define _GRASS_MASK_H_
+
+#include <Core/IListener.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/Texture2D.h>
+
+#include "TerrainEditor.h"
+
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::string;
+
+        /**
+         * Where grass may grow on a height map, baked per cell of
+         * cellSize * cellSize vertices.
+         *
+         * A vertex may carry grass if its normal is no steeper than
+         * MIN_NORMAL_Y and its height is within [MIN_HEIGHT,
+         * MAX_HEIGHT]. Each cell keeps the fraction of its vertices
+         * that may, as grass density, and their mean normal. Both are
+         * kept in an RGBA texture, the normal in rgb and the density
+         * in alpha, so the grass shader gets its placement and
+         * lighting from one fetch. A bit per cell tells whether it
+         * has any grass at all.
+         *
+         * The mask listens to the terrain editor and rebakes only the
+         * cells under an edit; the changed rectangle of the texture
+         * is uploaded in the next renderer pre process event.
+         */
+        class GrassMask
+            : public Core::IListener<TerrainEditEventArg>
+            , public Core::IListener<Renderers::RenderingEventArg> {
+        public:
+            static const float MIN_NORMAL_Y;
+            static const float MIN_HEIGHT, MAX_HEIGHT;
+
+        private:
+            IHeightField* terrain;
+            unsigned int width, depth, cellSize;
+            float widthScale;
+            unsigned int columns, rows;
+            Resources::UCharTexture2DPtr texture;
+            std::vector<unsigned int> bits;
+            // Changed cells waiting to be uploaded.
+            TerrainRegion dirty;
+
+            TerrainRegion ToCells(const TerrainRegion& vertices) const;
+            void UpdateBits(const TerrainRegion& cells);
+
+        public:
+            /**
+             * @param width, depth Size of the height map in vertices.
+             */
+            GrassMask(IHeightField* terrain,
+                      unsigned int width, unsigned int depth,
+                      float widthScale, unsigned int cellSize = 2);
+
+            /**
+             * Bake every cell.
+             */
+            void Bake();
+
+            /**
+             * Bake the cells touched by a rectangle of vertices,
+             * including those whose normals depend on it.
+             */
+            void Bake(const TerrainRegion& vertices);
+
+            /**
+             * Save the baked cells, or load them again. Load returns
+             * false if the file is missing or made for another size.
+             */
+            void Save(string file);
+            bool Load(string file);
+
+            /**
+             * Rebakes the edited cells, attach to the terrain editor
+             * edit event.
+             */
+            void Handle(TerrainEditEventArg arg);
+
+            /**
+             * Uploads the edited cells, attach to the renderer pre
+             * process event.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+
+            /**
+             * True if any cell touching the rectangle of vertices
+             * has grass.
+             */
+            bool Any(const TerrainRegion& vertices) const;
+
+            Resources::UCharTexture2DPtr GetTexture() { return texture; }
+            unsigned int GetCellSize() const { return cellSize; }
+            unsigned int GetColumns() const { return columns; }
+            unsigned int GetRows() const { return rows; }
+        };
+
+    }
+}
+
+#endif
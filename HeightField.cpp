@@ -0,0 +1,157 @@
+// Height field.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "HeightField.h"
+
+#include <Meta/OpenGL.h>
+#include <Scene/HeightMapNode.h>
+
+#include "ParallelRange.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::FloatTexture2D;
+
+        float NodeHeightField::GetHeight(int x, int z) {
+            return node->GetVertex(x, z)[1];
+        }
+
+        void NodeHeightField::SetHeights(int x, int z, unsigned int width,
+                                         unsigned int depth, float* heights) {
+            node->SetVertices(x, z, width, depth, heights);
+        }
+
+        float NodeHeightField::GetWidthScale() {
+            return node->GetWidthScale();
+        }
+
+        Vector<3, float> NodeHeightField::GetOffset() {
+            return node->GetOffset();
+        }
+
+        ITexture2DPtr NodeHeightField::GetHeightMap() {
+            return node->GetHeightMap();
+        }
+
+        /**
+         * Computes the normals of rows of a rectangle from the
+         * central differences of the heights, clamped at the edges.
+         */
+        class NormalJob : public IRangeJob {
+            const float* heights;
+            float* normals;
+            int width, depth, x0, x1, z0;
+            float heightScale, widthScale;
+
+            float Height(int x, int z) {
+                x = std::min(std::max(x, 0), width - 1);
+                z = std::min(std::max(z, 0), depth - 1);
+                return heights[z * width + x] * heightScale;
+            }
+
+        public:
+            NormalJob(const float* heights, float* normals, int width, int depth,
+                      int x0, int x1, int z0, float heightScale, float widthScale)
+                : heights(heights), normals(normals), width(width), depth(depth),
+                  x0(x0), x1(x1), z0(z0), heightScale(heightScale),
+                  widthScale(widthScale) {}
+
+            void Run(unsigned int begin, unsigned int end) {
+                for (int z = z0 + begin; z < z0 + (int)end; ++z)
+                    for (int x = x0; x < x1; ++x) {
+                        float nx = Height(x - 1, z) - Height(x + 1, z);
+                        float ny = 2.0f * widthScale;
+                        float nz = Height(x, z - 1) - Height(x, z + 1);
+                        float inv = 1.0f / sqrt(nx * nx + ny * ny + nz * nz);
+                        float* n = normals + (z * width + x) * 4;
+                        n[0] = nx * inv;
+                        n[1] = ny * inv;
+                        n[2] = nz * inv;
+                        n[3] = 0.0f;
+                    }
+            }
+        };
+
+        HeightField::HeightField(FloatTexture2DPtr map, float heightScale,
+                                 float widthScale, Vector<3, float> offset)
+            : map(map), width(map->GetWidth()), depth(map->GetHeight()),
+              heightScale(heightScale), widthScale(widthScale), offset(offset),
+              dirtyX0(0), dirtyZ0(0), dirtyX1(0), dirtyZ1(0), loaded(false) {
+            normals = FloatTexture2DPtr(new FloatTexture2D(width, depth, 4));
+            normals->SetColorFormat(Resources::RGBA32F);
+            normals->SetWrapping(Resources::CLAMP_TO_EDGE);
+            normals->SetMipmapping(false);
+            NormalJob job(map->GetData(), normals->GetData(), width, depth,
+                          0, width, 0, heightScale, widthScale);
+            ParallelRange::Run(job, depth);
+        }
+
+        float HeightField::GetHeight(int x, int z) {
+            x = std::min(std::max(x, 0), width - 1);
+            z = std::min(std::max(z, 0), depth - 1);
+            return map->GetData()[z * width + x] * heightScale;
+        }
+
+        void HeightField::SetHeights(int x, int z, unsigned int w,
+                                     unsigned int d, float* heights) {
+            float* data = map->GetData();
+            for (unsigned int j = 0; j < d; ++j)
+                for (unsigned int i = 0; i < w; ++i)
+                    data[(z + j) * width + x + i] = heights[j * w + i] / heightScale;
+
+            // The normals reach one vertex into the neighbours.
+            int x0 = std::max(x - 1, 0), z0 = std::max(z - 1, 0);
+            int x1 = std::min(x + (int)w + 1, width);
+            int z1 = std::min(z + (int)d + 1, depth);
+            if (x1 <= x0 || z1 <= z0) return;
+            // Edits are small, one thread is enough.
+            NormalJob job(data, normals->GetData(), width, depth,
+                          x0, x1, z0, heightScale, widthScale);
+            job.Run(0, z1 - z0);
+
+            if (dirtyX0 == dirtyX1) {
+                dirtyX0 = x0; dirtyZ0 = z0;
+                dirtyX1 = x1; dirtyZ1 = z1;
+            } else {
+                dirtyX0 = std::min(dirtyX0, x0); dirtyZ0 = std::min(dirtyZ0, z0);
+                dirtyX1 = std::max(dirtyX1, x1); dirtyZ1 = std::max(dirtyZ1, z1);
+            }
+        }
+
+        void HeightField::Handle(Renderers::RenderingEventArg arg) {
+            if (!loaded) {
+                arg.renderer.LoadTexture(map);
+                arg.renderer.LoadTexture(normals);
+                loaded = true;
+                dirtyX0 = dirtyX1 = 0;
+                return;
+            }
+            if (dirtyX0 == dirtyX1) return;
+            int w = dirtyX1 - dirtyX0, d = dirtyZ1 - dirtyZ0;
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+            glBindTexture(GL_TEXTURE_2D, map->GetID());
+            glTexSubImage2D(GL_TEXTURE_2D, 0, dirtyX0, dirtyZ0, w, d,
+                            GL_LUMINANCE, GL_FLOAT,
+                            map->GetData() + dirtyZ0 * width + dirtyX0);
+            glBindTexture(GL_TEXTURE_2D, normals->GetID());
+            glTexSubImage2D(GL_TEXTURE_2D, 0, dirtyX0, dirtyZ0, w, d,
+                            GL_RGBA, GL_FLOAT,
+                            normals->GetData() + (dirtyZ0 * width + dirtyX0) * 4);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            CHECK_FOR_GL_ERROR();
+            dirtyX0 = dirtyX1 = 0;
+        }
+
+    }
+}
@@ -0,0 +1,118 @@
+// Height field.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHT_FIELD_H_
+#define _HEIGHT_FIELD_H_
+
+#include <Core/IListener.h>
+#include <Math/Vector.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/Texture2D.h>
+
+namespace OpenEngine {
+    namespace Scene {
+        class HeightMapNode;
+    }
+}
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Math::Vector;
+        using Resources::FloatTexture2DPtr;
+        using Resources::ITexture2DPtr;
+
+        /**
+         * The heights of the terrain, as read by the editor, the
+         * grass and the patch culling and drawing.
+         */
+        class IHeightField {
+        public:
+            virtual ~IHeightField() {}
+
+            /**
+             * Height of a vertex above the offset, the height map
+             * value times the height scale.
+             */
+            virtual float GetHeight(int x, int z) = 0;
+
+            /**
+             * Write a rectangle of vertex heights, width * depth of
+             * them with x varying fastest.
+             */
+            virtual void SetHeights(int x, int z, unsigned int width,
+                                    unsigned int depth, float* heights) = 0;
+
+            virtual float GetWidthScale() = 0;
+            virtual Vector<3, float> GetOffset() = 0;
+            virtual ITexture2DPtr GetHeightMap() = 0;
+        };
+
+        /**
+         * The heights of a height map node, for when the node itself
+         * draws the terrain and holds its vertices anyway.
+         */
+        class NodeHeightField : public IHeightField {
+            Scene::HeightMapNode* node;
+        public:
+            NodeHeightField(Scene::HeightMapNode* node) : node(node) {}
+            float GetHeight(int x, int z);
+            void SetHeights(int x, int z, unsigned int width,
+                            unsigned int depth, float* heights);
+            float GetWidthScale();
+            Vector<3, float> GetOffset();
+            ITexture2DPtr GetHeightMap();
+        };
+
+        /**
+         * The heights kept in the height map texture itself, with a
+         * normal map of raw float normals computed from them, so the
+         * terrain can be drawn by other nodes without a height map
+         * node building its vertex buffers.
+         *
+         * Written heights update both maps on the CPU; the changed
+         * rectangle is uploaded in the next renderer pre process
+         * event. The first event uploads both textures whole.
+         */
+        class HeightField
+            : public IHeightField
+            , public Core::IListener<Renderers::RenderingEventArg> {
+            FloatTexture2DPtr map, normals;
+            int width, depth;
+            float heightScale, widthScale;
+            Vector<3, float> offset;
+            // Changed texels waiting to be uploaded, x0 == x1 if none.
+            int dirtyX0, dirtyZ0, dirtyX1, dirtyZ1;
+            bool loaded;
+
+            void ComputeNormals(int x0, int z0, int x1, int z1);
+
+        public:
+            HeightField(FloatTexture2DPtr map, float heightScale,
+                        float widthScale, Vector<3, float> offset);
+
+            float GetHeight(int x, int z);
+            void SetHeights(int x, int z, unsigned int width,
+                            unsigned int depth, float* heights);
+            float GetWidthScale() { return widthScale; }
+            Vector<3, float> GetOffset() { return offset; }
+            ITexture2DPtr GetHeightMap() { return map; }
+            ITexture2DPtr GetNormalMap() { return normals; }
+
+            /**
+             * Uploads the maps, attach as a startup upload and to
+             * the renderer pre process event.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+        };
+
+    }
+}
+
+#endif
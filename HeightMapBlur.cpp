@@ -0,0 +1,179 @@
+// Height map blur.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "HeightMapBlur.h"
+#include "ParallelRange.h"
+
+#include <Logging/Logger.h>
+#include <Utils/Timer.h>
+#include <Utils/TerrainUtils.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using namespace Resources;
+        using std::vector;
+
+        // Columns per vertical tile. 64 floats per row of a tile keeps
+        // the running sums of a tile in a few cache lines.
+        static const unsigned int TILE = 64;
+
+        static inline unsigned int Clamp(int i, unsigned int n) {
+            return i < 0 ? 0 : (i >= (int)n ? n - 1 : i);
+        }
+
+        /**
+         * Blur 'lanes' interleaved lines 'passes' times, where
+         * element k of lane l is base[k * stride + l]. The lines are
+         * copied to a contiguous buffer once, blurred there and
+         * copied back. Running sums are kept in doubles so long lines
+         * do not drift.
+         */
+        static void BlurLines(float* base, unsigned int lanes, unsigned int n,
+                              unsigned int stride, unsigned int r, unsigned int passes,
+                              vector<float>& line, vector<float>& tmp, vector<double>& sum) {
+            line.resize(n * lanes);
+            tmp.resize(n * lanes);
+            sum.resize(lanes);
+            for (unsigned int k = 0; k < n; ++k)
+                memcpy(&line[k * lanes], base + k * stride, lanes * sizeof(float));
+
+            const double inv = 1.0 / (2 * r + 1);
+            for (unsigned int p = 0; p < passes; ++p) {
+                for (unsigned int l = 0; l < lanes; ++l)
+                    sum[l] = 0.0;
+                for (int k = -(int)r; k <= (int)r; ++k) {
+                    const float* in = &line[Clamp(k, n) * lanes];
+                    for (unsigned int l = 0; l < lanes; ++l)
+                        sum[l] += in[l];
+                }
+                for (unsigned int l = 0; l < lanes; ++l)
+                    tmp[l] = sum[l] * inv;
+
+                for (unsigned int i = 1; i < n; ++i) {
+                    const float* add = &line[Clamp(i + r, n) * lanes];
+                    const float* sub = &line[Clamp((int)i - (int)r - 1, n) * lanes];
+                    float* out = &tmp[i * lanes];
+                    for (unsigned int l = 0; l < lanes; ++l) {
+                        sum[l] += add[l] - sub[l];
+                        out[l] = sum[l] * inv;
+                    }
+                }
+                line.swap(tmp);
+            }
+
+            for (unsigned int k = 0; k < n; ++k)
+                memcpy(base + k * stride, &line[k * lanes], lanes * sizeof(float));
+        }
+
+        class RowBlurJob : public IRangeJob {
+            float* data;
+            unsigned int w, c, r, passes;
+        public:
+            RowBlurJob(float* data, unsigned int w, unsigned int c,
+                       unsigned int r, unsigned int passes)
+                : data(data), w(w), c(c), r(r), passes(passes) {}
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> line, tmp;
+                vector<double> sum;
+                for (unsigned int y = begin; y < end; ++y)
+                    BlurLines(data + y * w * c, c, w, c, r, passes, line, tmp, sum);
+            }
+        };
+
+        class ColumnBlurJob : public IRangeJob {
+            float* data;
+            unsigned int w, h, c, r, passes;
+        public:
+            ColumnBlurJob(float* data, unsigned int w, unsigned int h, unsigned int c,
+                          unsigned int r, unsigned int passes)
+                : data(data), w(w), h(h), c(c), r(r), passes(passes) {}
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> line, tmp;
+                vector<double> sum;
+                for (unsigned int t = begin; t < end; ++t) {
+                    unsigned int x0 = t * TILE;
+                    unsigned int x1 = x0 + TILE < w ? x0 + TILE : w;
+                    BlurLines(data + x0 * c, (x1 - x0) * c, h, w * c,
+                              r, passes, line, tmp, sum);
+                }
+            }
+        };
+
+        void HeightMapBlur::BoxBlur(FloatTexture2DPtr tex,
+                                    unsigned int passes,
+                                    unsigned int radius) {
+            if (passes == 0 || radius == 0) return;
+            float* data = tex->GetData();
+            unsigned int w = tex->GetWidth();
+            unsigned int h = tex->GetHeight();
+            unsigned int c = tex->GetChannels();
+
+            RowBlurJob rows(data, w, c, radius, passes);
+            ParallelRange::Run(rows, h);
+            ColumnBlurJob columns(data, w, h, c, radius, passes);
+            ParallelRange::Run(columns, (w + TILE - 1) / TILE);
+        }
+
+        void HeightMapBlur::Benchmark(unsigned int size) {
+            FloatTexture2DPtr map(new Texture2D<float>(size, size, 1));
+            float* data = map->GetData();
+            for (unsigned int i = 0; i < size * size; ++i)
+                data[i] = (i * 2654435761U >> 16) & 0xff;
+
+            FloatTexture2DPtr ref;
+            if (size <= 4096) {
+                ref = FloatTexture2DPtr(new Texture2D<float>(size, size, 1));
+                memcpy(ref->GetData(), data, size * size * sizeof(float));
+            }
+
+            Utils::Timer timer;
+            timer.Start();
+            BoxBlur(map, 3);
+            double fused = timer.GetElapsedTime().AsInt() / 1000.0;
+            logger.info << "height map blur " << size << "^2 on "
+                        << ParallelRange::GetThreadCount() << " threads: "
+                        << fused << " ms" << logger.end;
+
+            // The serial blur is far too slow to compare at 16k.
+            if (!ref) return;
+            timer.Reset();
+            timer.Start();
+            Utils::BoxBlur(ref);
+            Utils::BoxBlur(ref);
+            Utils::BoxBlur(ref);
+            double serial = timer.GetElapsedTime().AsInt() / 1000.0;
+
+            // Three passes of radius 1 reach 3 texels into the map.
+            const unsigned int border = 3;
+            float borderDiff = 0.0f, innerDiff = 0.0f;
+            const float* r = ref->GetData();
+            for (unsigned int y = 0; y < size; ++y)
+                for (unsigned int x = 0; x < size; ++x) {
+                    unsigned int i = y * size + x;
+                    float diff = fabs(r[i] - data[i]);
+                    if (x < border || y < border ||
+                        x >= size - border || y >= size - border)
+                        borderDiff = std::max(borderDiff, diff);
+                    else
+                        innerDiff = std::max(innerDiff, diff);
+                }
+            logger.info << "height map blur " << size << "^2 serial: "
+                        << serial << " ms, max difference " << innerDiff
+                        << " inside, " << borderDiff << " at the border"
+                        << logger.end;
+        }
+
+    }
+}
@@ -0,0 +1,52 @@
+// Height map blur.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHT_MAP_BLUR_H_
+#define _HEIGHT_MAP_BLUR_H_
+
+#include <Resources/Texture2D.h>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::FloatTexture2DPtr;
+
+        /**
+         * Repeated box blur of a height map in a single call.
+         *
+         * The blur is separable, so all horizontal passes are run on
+         * a row while it is in cache, one thread per slab of rows,
+         * and then all vertical passes on tiles of neighbouring
+         * columns. Each pass is a running sum with clamp to edge
+         * borders and costs the same for any radius.
+         *
+         * It stands in for calling Utils::BoxBlur passes times. That
+         * the library blur also clamps at the edges is assumed, not
+         * checked here; Benchmark logs how far the two are apart.
+         */
+        class HeightMapBlur {
+        public:
+            static void BoxBlur(FloatTexture2DPtr tex,
+                                unsigned int passes,
+                                unsigned int radius = 1);
+
+            /**
+             * Log the time to blur size^2 maps with three passes,
+             * compared to three Utils::BoxBlur calls for the smaller
+             * sizes. The largest difference is logged separately for
+             * the border, where the two blurs differ if the library
+             * does not clamp to the edge, and for the interior.
+             */
+            static void Benchmark(unsigned int size);
+        };
+
+    }
+}
+
+#endif
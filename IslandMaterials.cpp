@@ -0,0 +1,162 @@
+// Island material preprocessing.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "IslandMaterials.h"
+#include "ParallelRange.h"
+
+#include <Logging/Logger.h>
+#include <Utils/Timer.h>
+
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define ISLAND_MATERIALS_SSE
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using namespace Resources;
+        using std::vector;
+
+        static inline unsigned int Hash(unsigned int x) {
+            x ^= x >> 16;
+            x *= 0x7feb352dU;
+            x ^= x >> 15;
+            x *= 0x846ca68bU;
+            x ^= x >> 16;
+            return x;
+        }
+
+        // Uniform in (0, 1] from the counter i of stream seed.
+        static inline float Uniform(unsigned int seed, unsigned int i) {
+            return ((Hash(Hash(i) ^ seed) >> 8) + 1) / 16777216.0f;
+        }
+
+        static inline unsigned char ToByte(float v) {
+            float b = (v * 0.5f + 0.5f) * 256.0f;
+            return b >= 255.0f ? 255 : (b <= 0.0f ? 0 : (unsigned char)b);
+        }
+
+        /**
+         * Normalize the vectors (1, y[i], z[i]) and store them as
+         * bytes at out[i * stride]. The SSE and scalar paths do the
+         * same float operations, so both give the same bytes.
+         */
+        static void PackNormalRow(float* y, float* z, unsigned int n,
+                                  unsigned char* out, unsigned int stride,
+                                  vector<float>& x) {
+            x.resize(n);
+            unsigned int i = 0;
+#ifdef ISLAND_MATERIALS_SSE
+            const __m128 one = _mm_set1_ps(1.0f);
+            for (; i + 4 <= n; i += 4) {
+                __m128 vy = _mm_loadu_ps(y + i);
+                __m128 vz = _mm_loadu_ps(z + i);
+                __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(one, _mm_mul_ps(vy, vy)),
+                                                    _mm_mul_ps(vz, vz)));
+                _mm_storeu_ps(&x[i], _mm_div_ps(one, len));
+                _mm_storeu_ps(y + i, _mm_div_ps(vy, len));
+                _mm_storeu_ps(z + i, _mm_div_ps(vz, len));
+            }
+#endif
+            for (; i < n; ++i) {
+                float len = sqrtf((1.0f + y[i] * y[i]) + z[i] * z[i]);
+                x[i] = 1.0f / len;
+                y[i] = y[i] / len;
+                z[i] = z[i] / len;
+            }
+            for (i = 0; i < n; ++i) {
+                out[i * stride + 0] = ToByte(x[i]);
+                out[i * stride + 1] = ToByte(y[i]);
+                out[i * stride + 2] = ToByte(z[i]);
+            }
+        }
+
+        class SnowNormalJob : public IRangeJob {
+            unsigned char* data;
+            unsigned int width;
+            float sigma;
+            unsigned int seed;
+        public:
+            SnowNormalJob(unsigned char* data, unsigned int width,
+                          float sigma, unsigned int seed)
+                : data(data), width(width), sigma(sigma), seed(seed) {}
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> y(width), z(width), x;
+                const float twoPi = 6.28318530718f;
+                for (unsigned int row = begin; row < end; ++row) {
+                    // One Box-Muller pair gives both random components.
+                    for (unsigned int i = 0; i < width; ++i) {
+                        unsigned int t = (row * width + i) * 2;
+                        float r = sigma * sqrtf(-2.0f * logf(Uniform(seed, t)));
+                        float a = twoPi * Uniform(seed, t + 1);
+                        y[i] = r * cosf(a);
+                        z[i] = r * sinf(a);
+                    }
+                    PackNormalRow(&y[0], &z[0], width,
+                                  data + row * width * 3, 3, x);
+                }
+            }
+        };
+
+        class FlattenNormalJob : public IRangeJob {
+            unsigned char* data;
+            unsigned int width, channels;
+        public:
+            FlattenNormalJob(unsigned char* data, unsigned int width,
+                             unsigned int channels)
+                : data(data), width(width), channels(channels) {}
+            void Run(unsigned int begin, unsigned int end) {
+                vector<float> y(width), z(width), x;
+                for (unsigned int row = begin; row < end; ++row) {
+                    unsigned char* p = data + row * width * channels;
+                    for (unsigned int i = 0; i < width; ++i) {
+                        y[i] = (p[i * channels + 1] / 256.0f) * 2.0f - 1.0f;
+                        z[i] = (p[i * channels + 2] / 256.0f) * 2.0f - 1.0f;
+                    }
+                    PackNormalRow(&y[0], &z[0], width, p, channels, x);
+                }
+            }
+        };
+
+        UCharTexture2DPtr IslandMaterials::SnowNormals(unsigned int width,
+                                                       unsigned int height,
+                                                       float sigma,
+                                                       unsigned int seed) {
+            UCharTexture2DPtr tex(new Texture2D<unsigned char>(width, height, 3));
+            tex->SetColorFormat(BGR);
+            SnowNormalJob job(tex->GetData(), width, sigma, Hash(seed));
+            ParallelRange::Run(job, height);
+            return tex;
+        }
+
+        void IslandMaterials::FlattenNormals(UCharTexture2DPtr tex) {
+            FlattenNormalJob job(tex->GetData(), tex->GetWidth(), tex->GetChannels());
+            ParallelRange::Run(job, tex->GetHeight());
+        }
+
+        void IslandMaterials::Benchmark(unsigned int size) {
+            Utils::Timer timer;
+            timer.Start();
+            UCharTexture2DPtr snow = SnowNormals(size, size, 0.1f, 0);
+            double gen = timer.GetElapsedTime().AsInt() / 1000.0;
+            timer.Reset();
+            timer.Start();
+            FlattenNormals(snow);
+            double flat = timer.GetElapsedTime().AsInt() / 1000.0;
+            logger.info << "snow normals " << size << "^2 on "
+                        << ParallelRange::GetThreadCount() << " threads: "
+                        << gen << " ms, flatten: " << flat << " ms" << logger.end;
+        }
+
+    }
+}
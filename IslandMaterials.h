@@ -0,0 +1,54 @@
+// Island material preprocessing.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _ISLAND_MATERIALS_H_
+#define _ISLAND_MATERIALS_H_
+
+#include <Resources/Texture2D.h>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::UCharTexture2DPtr;
+
+        /**
+         * The normal map passes run while constructing the island
+         * materials, as row parallel kernels.
+         *
+         * Random numbers are a hash of the seed and the texel index
+         * instead of a sequential generator, so the output is the
+         * same for any number of threads.
+         */
+        class IslandMaterials {
+        public:
+            /**
+             * A BGR normal map of (1, n, n) normals, where n is
+             * normal distributed with the given standard deviation.
+             */
+            static UCharTexture2DPtr SnowNormals(unsigned int width,
+                                                 unsigned int height,
+                                                 float sigma,
+                                                 unsigned int seed);
+
+            /**
+             * Replace the first component of every normal by one and
+             * renormalize, in place.
+             */
+            static void FlattenNormals(UCharTexture2DPtr tex);
+
+            /**
+             * Log the time to build the snow normal map.
+             */
+            static void Benchmark(unsigned int size);
+        };
+
+    }
+}
+
+#endif
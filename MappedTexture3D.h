@@ -0,0 +1,439 @@
+// Memory mapped 3d texture.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _MAPPED_TEXTURE_3D_H_
+#define _MAPPED_TEXTURE_3D_H_
+
+#include <Resources/Texture3D.h>
+#include <Resources/Exceptions.h>
+#include <Logging/Logger.h>
+#include <Meta/OpenGL.h>
+#include <Renderers/IRenderer.h>
+
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace OpenEngine {
+    namespace Resources {
+
+        /**
+         * Header of the raw 3d texture container. The header is
+         * followed by the mip chain, with every level starting on a
+         * page boundary so it can be used straight from the mapping.
+         */
+        struct Texture3DContainerHeader {
+            static const unsigned int MAX_LEVELS = 16;
+            static const unsigned int ALIGNMENT = 4096;
+
+            char magic[8];
+            unsigned int version;
+            unsigned int type;      // sizeof the element type
+            unsigned int format;    // ColorFormat
+            unsigned int width, height, depth, channels;
+            unsigned int levels;
+            unsigned int arrayMips; // depth is kept for texture arrays
+            unsigned long long offset[MAX_LEVELS];
+            unsigned long long size[MAX_LEVELS];
+
+            bool IsValid() const {
+                return memcmp(magic, "OETEX3D", 8) == 0 && version == 1 &&
+                    0 < levels && levels <= MAX_LEVELS;
+            }
+        };
+
+        /**
+         * The GL pixel format and internal format of a color format,
+         * false if there is none.
+         *
+         * @param half Keep float formats as 16 bit floats.
+         */
+        inline bool GLTextureFormat(ColorFormat color, bool half,
+                                    GLenum& format, GLenum& internal) {
+            switch (color) {
+            case BGR:          format = GL_BGR;       internal = GL_RGB8; break;
+            case BGRA:         format = GL_BGRA;      internal = GL_RGBA8; break;
+            case RGB:          format = GL_RGB;       internal = GL_RGB8; break;
+            case RGBA:         format = GL_RGBA;      internal = GL_RGBA8; break;
+            case LUMINANCE:    format = GL_LUMINANCE; internal = GL_LUMINANCE8; break;
+            case RGBA32F:
+                format = GL_RGBA;
+                internal = half ? GL_RGBA16F_ARB : GL_RGBA32F_ARB;
+                break;
+            case LUMINANCE32F:
+                format = GL_LUMINANCE;
+                internal = half ? GL_LUMINANCE16F_ARB : GL_LUMINANCE32F_ARB;
+                break;
+            default:
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * A 3d texture backed by a memory mapped container file.
+         *
+         * Level 0 is the texture data, so the renderer uploads it
+         * straight from the page cache without decoding or copying.
+         * The remaining levels can be uploaded with UploadMipChain.
+         *
+         * The mapping is private, so the data may be written to, but
+         * a written page is copied and the changes never reach the
+         * container file.
+         */
+        template <class T>
+        class MappedTexture3D : public Texture3D<T> {
+        private:
+            std::string file;
+            Texture3DContainerHeader header;
+            void* map;
+            size_t mapSize;
+            bool halfFloat;
+
+            static unsigned long long Offset(unsigned long long& pos,
+                                             unsigned long long size) {
+                unsigned int a = Texture3DContainerHeader::ALIGNMENT;
+                pos = (pos + a - 1) / a * a;
+                unsigned long long offset = pos;
+                pos += size;
+                return offset;
+            }
+
+            /**
+             * Box filter one level down. Texture arrays are only
+             * filtered in width and height.
+             */
+            static void Downsample(const T* src, unsigned int w, unsigned int h,
+                                   unsigned int d, unsigned int c, bool array,
+                                   std::vector<T>& dst, unsigned int& dw,
+                                   unsigned int& dh, unsigned int& dd) {
+                dw = w > 1 ? w / 2 : 1;
+                dh = h > 1 ? h / 2 : 1;
+                dd = (array || d == 1) ? d : d / 2;
+                unsigned int fx = w / dw, fy = h / dh, fz = d / dd;
+                dst.resize(dw * dh * dd * c);
+                float inv = 1.0f / (fx * fy * fz);
+                for (unsigned int z = 0; z < dd; ++z)
+                    for (unsigned int y = 0; y < dh; ++y)
+                        for (unsigned int x = 0; x < dw; ++x)
+                            for (unsigned int ch = 0; ch < c; ++ch) {
+                                float sum = 0.0f;
+                                for (unsigned int k = 0; k < fz; ++k)
+                                    for (unsigned int j = 0; j < fy; ++j)
+                                        for (unsigned int i = 0; i < fx; ++i)
+                                            sum += src[(((z*fz+k) * h + y*fy+j) * w + x*fx+i) * c + ch];
+                                dst[((z * dh + y) * dw + x) * c + ch] = Round(sum * inv);
+                            }
+            }
+
+            static T Round(float v);
+
+            static void WriteAt(FILE* out, unsigned long long offset,
+                                const void* data, size_t size, std::string file) {
+                if (fseek(out, offset, SEEK_SET) != 0 ||
+                    fwrite(data, 1, size, out) != size) {
+                    fclose(out);
+                    remove(file.c_str());
+                    throw ResourceException("could not write texture container: " + file);
+                }
+            }
+
+            MappedTexture3D(std::string file)
+                : Texture3D<T>(), file(file), map(NULL), mapSize(0), halfFloat(false) {
+                memset(&header, 0, sizeof(header));
+            }
+
+        public:
+            static boost::shared_ptr<MappedTexture3D<T> > Create(std::string file) {
+                boost::shared_ptr<MappedTexture3D<T> > tex(new MappedTexture3D<T>(file));
+                tex->Load();
+                return tex;
+            }
+
+            /**
+             * Write tex and its mip chain to a container file.
+             *
+             * @param array Build the mip chain for a texture array,
+             * where layers are not filtered together.
+             */
+            static void Write(boost::shared_ptr<Texture3D<T> > tex,
+                              std::string file, bool array) {
+                Texture3DContainerHeader header;
+                memset(&header, 0, sizeof(header));
+                memcpy(header.magic, "OETEX3D", 8);
+                header.version = 1;
+                header.type = sizeof(T);
+                header.format = tex->GetColorFormat();
+                header.width = tex->GetWidth();
+                header.height = tex->GetHeight();
+                header.depth = tex->GetDepth();
+                header.channels = tex->GetChannels();
+                header.arrayMips = array;
+
+                FILE* out = fopen(file.c_str(), "wb");
+                if (out == NULL)
+                    throw ResourceException("could not write texture container: " + file);
+
+                unsigned long long pos = sizeof(header);
+                unsigned int w = header.width, h = header.height, d = header.depth;
+                unsigned int c = header.channels;
+                const T* level = tex->GetData();
+                std::vector<T> current, next;
+                for (unsigned int l = 0; l < Texture3DContainerHeader::MAX_LEVELS; ++l) {
+                    header.size[l] = (unsigned long long)w * h * d * c * sizeof(T);
+                    header.offset[l] = Offset(pos, header.size[l]);
+                    WriteAt(out, header.offset[l], level, header.size[l], file);
+                    header.levels = l + 1;
+
+                    if (w == 1 && h == 1 && (array || d == 1)) break;
+                    unsigned int nw, nh, nd;
+                    Downsample(level, w, h, d, c, array, next, nw, nh, nd);
+                    current.swap(next);
+                    level = &current[0];
+                    w = nw; h = nh; d = nd;
+                }
+                // Pad the file so the last level can be mapped as a
+                // whole page.
+                unsigned int a = Texture3DContainerHeader::ALIGNMENT;
+                pos = (pos + a - 1) / a * a;
+                char pad = 0;
+                WriteAt(out, pos - 1, &pad, 1, file);
+                WriteAt(out, 0, &header, sizeof(header), file);
+                // Buffered data is written out by fclose, so a full
+                // disk may only show up here.
+                if (fclose(out) != 0) {
+                    remove(file.c_str());
+                    throw ResourceException("could not write texture container: " + file);
+                }
+            }
+
+            ~MappedTexture3D() {
+                Unload();
+            }
+
+        private:
+#ifdef _WIN32
+            // Map the whole file copy on write.
+            void Map() {
+                HANDLE f = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (f == INVALID_HANDLE_VALUE)
+                    throw ResourceException("could not open texture container: " + file);
+                LARGE_INTEGER size;
+                if (!GetFileSizeEx(f, &size) ||
+                    size.QuadPart < (LONGLONG)sizeof(header)) {
+                    CloseHandle(f);
+                    throw ResourceException("invalid texture container: " + file);
+                }
+                mapSize = (size_t)size.QuadPart;
+                // The view keeps the mapping and the file open.
+                HANDLE m = CreateFileMappingA(f, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+                CloseHandle(f);
+                if (m != NULL) {
+                    map = MapViewOfFile(m, FILE_MAP_COPY, 0, 0, mapSize);
+                    CloseHandle(m);
+                }
+                if (map == NULL)
+                    throw ResourceException("could not map texture container: " + file);
+            }
+
+            void Unmap() {
+                UnmapViewOfFile(map);
+            }
+#else
+            // Map the whole file copy on write.
+            void Map() {
+                int fd = open(file.c_str(), O_RDONLY);
+                if (fd < 0)
+                    throw ResourceException("could not open texture container: " + file);
+                struct stat st;
+                if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header)) {
+                    close(fd);
+                    throw ResourceException("invalid texture container: " + file);
+                }
+                mapSize = st.st_size;
+                map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (map == MAP_FAILED) {
+                    map = NULL;
+                    throw ResourceException("could not map texture container: " + file);
+                }
+                // Start reading ahead, the upload follows right away.
+                madvise(map, mapSize, MADV_WILLNEED);
+            }
+
+            void Unmap() {
+                munmap(map, mapSize);
+            }
+#endif
+
+        public:
+            void Load() {
+                if (map != NULL) return;
+                Map();
+                memcpy(&header, map, sizeof(header));
+                if (!IsComplete()) {
+                    Unload();
+                    throw ResourceException("invalid texture container: " + file);
+                }
+
+                this->width = header.width;
+                this->height = header.height;
+                this->depth = header.depth;
+                this->channels = header.channels;
+                this->data = (T*)((char*)map + header.offset[0]);
+                this->SetColorFormat((ColorFormat)header.format);
+            }
+
+            /**
+             * Whether the header describes levels that are all the
+             * size their dimensions give and all inside the mapping.
+             */
+            bool IsComplete() const {
+                if (!header.IsValid() || header.type != sizeof(T) ||
+                    header.width == 0 || header.height == 0 ||
+                    header.depth == 0 || header.channels == 0)
+                    return false;
+                unsigned long long w = header.width, h = header.height, d = header.depth;
+                for (unsigned int l = 0; l < header.levels; ++l) {
+                    unsigned long long size = w * h * d * header.channels * sizeof(T);
+                    if (header.size[l] != size ||
+                        header.offset[l] < sizeof(header) ||
+                        header.offset[l] > mapSize ||
+                        header.size[l] > mapSize - header.offset[l])
+                        return false;
+                    w = w > 1 ? w / 2 : 1;
+                    h = h > 1 ? h / 2 : 1;
+                    if (!header.arrayMips && d > 1) d /= 2;
+                }
+                return true;
+            }
+
+            void Unload() {
+                if (map == NULL) return;
+                Unmap();
+                map = NULL;
+                // Keep the base class from freeing the mapping.
+                this->data = NULL;
+            }
+
+            unsigned int GetMipLevels() const {
+                return header.levels;
+            }
+
+            T* GetMipData(unsigned int level) {
+                return (T*)((char*)map + header.offset[level]);
+            }
+
+            /**
+             * Keep float textures as 16 bit floats on the GPU. Takes
+             * effect in UploadMipChain, which then uploads level 0
+             * again as well.
+             */
+            void SetHalfFloat(bool half) {
+                halfFloat = half;
+            }
+
+            bool GetHalfFloat() const {
+                return halfFloat;
+            }
+
+            /**
+             * Texture array containers are uploaded as texture arrays.
+             */
+            GLenum GetTarget() const {
+                return header.arrayMips ? GL_TEXTURE_2D_ARRAY_EXT : GL_TEXTURE_3D;
+            }
+
+            /**
+             * Load the texture with the renderer and upload the mip
+             * chain of the container. The driver is kept from
+             * generating mip levels that would only be replaced.
+             */
+            void LoadTexture(Renderers::IRenderer& renderer) {
+                bool mipmapping = this->UseMipmapping();
+                bool chain = mipmapping && header.levels > 1;
+                if (chain) this->SetMipmapping(false);
+                renderer.LoadTexture(this);
+                if (!chain) return;
+                this->SetMipmapping(true);
+                UploadMipChain();
+                GLenum target = GetTarget();
+                glBindTexture(target, this->GetID());
+                glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+                glBindTexture(target, 0);
+                CHECK_FOR_GL_ERROR();
+            }
+
+            /**
+             * Upload levels 1 and up from the container to the
+             * currently loaded texture object, instead of letting the
+             * driver generate them.
+             */
+            void UploadMipChain() {
+                GLenum target = GetTarget();
+                GLenum type = sizeof(T) == 1 ? GL_UNSIGNED_BYTE : GL_FLOAT;
+                GLenum format, internal;
+                if (!GLTextureFormat(this->GetColorFormat(), halfFloat, format, internal)) {
+                    logger.warning << "no mip chain upload for the color format of "
+                                   << file << logger.end;
+                    return;
+                }
+
+                glBindTexture(target, this->GetID());
+                glTexParameteri(target, GL_GENERATE_MIPMAP, GL_FALSE);
+                unsigned int w = header.width, h = header.height, d = header.depth;
+                // The renderer loaded level 0 at full precision.
+                if (halfFloat && type == GL_FLOAT)
+                    glTexImage3D(target, 0, internal, w, h, d, 0,
+                                 format, type, GetMipData(0));
+                for (unsigned int l = 1; l < header.levels; ++l) {
+                    w = w > 1 ? w / 2 : 1;
+                    h = h > 1 ? h / 2 : 1;
+                    if (!header.arrayMips && d > 1) d /= 2;
+                    glTexImage3D(target, l, internal, w, h, d, 0,
+                                 format, type, GetMipData(l));
+                }
+                glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, header.levels - 1);
+                glBindTexture(target, 0);
+                CHECK_FOR_GL_ERROR();
+            }
+        };
+
+        template <> inline float MappedTexture3D<float>::Round(float v) {
+            return v;
+        }
+
+        template <> inline unsigned char MappedTexture3D<unsigned char>::Round(float v) {
+            return (unsigned char)(v + 0.5f);
+        }
+
+        typedef MappedTexture3D<float> FloatMappedTexture3D;
+        typedef MappedTexture3D<unsigned char> UCharMappedTexture3D;
+        typedef boost::shared_ptr<FloatMappedTexture3D> FloatMappedTexture3DPtr;
+        typedef boost::shared_ptr<UCharMappedTexture3D> UCharMappedTexture3DPtr;
+
+    }
+}
+
+#endif
@@ -0,0 +1,114 @@
+// Parallel range.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "ParallelRange.h"
+
+#include <Core/Mutex.h>
+#include <Core/Thread.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::vector;
+
+        // Threads besides the calling ones not claimed by any run, set
+        // on first use.
+        static Core::Mutex budgetLock;
+        static int spare = -1;
+
+        class RangeWorker : public Core::Thread {
+            IRangeJob& job;
+            unsigned int begin, end;
+        public:
+            RangeWorker(IRangeJob& job, unsigned int begin, unsigned int end)
+                : job(job), begin(begin), end(end) {}
+            void Run() {
+                job.Run(begin, end);
+            }
+        };
+
+        unsigned int ParallelRange::GetThreadCount() {
+            const char* env = getenv("OE_THREADS");
+            if (env != NULL && atoi(env) > 0)
+                return atoi(env);
+#ifdef _WIN32
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            long cores = info.dwNumberOfProcessors;
+#else
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+            return cores > 0 ? cores : 1;
+        }
+
+        unsigned int ParallelRange::Claim(unsigned int wanted) {
+            budgetLock.Lock();
+            if (spare < 0) spare = GetThreadCount() - 1;
+            unsigned int claimed = std::min(wanted, (unsigned int)spare);
+            spare -= claimed;
+            budgetLock.Unlock();
+            return claimed;
+        }
+
+        void ParallelRange::Release(unsigned int threads) {
+            budgetLock.Lock();
+            spare += threads;
+            budgetLock.Unlock();
+        }
+
+        void ParallelRange::Run(IRangeJob& job, unsigned int count,
+                                unsigned int threads) {
+            if (count == 0) return;
+            unsigned int claimed = 0;
+            if (threads == 0) {
+                claimed = Claim(std::min(count, GetThreadCount()) - 1);
+                threads = claimed + 1;
+            }
+            if (threads > count) threads = count;
+
+            if (threads <= 1) {
+                job.Run(0, count);
+                Release(claimed);
+                return;
+            }
+
+            // Spread the remainder over the first slabs so no slab is
+            // more than one element larger than another.
+            unsigned int slab = count / threads;
+            unsigned int rest = count % threads;
+            vector<RangeWorker*> workers;
+            unsigned int begin = 0;
+            for (unsigned int t = 0; t < threads - 1; ++t) {
+                unsigned int end = begin + slab + (t < rest ? 1 : 0);
+                RangeWorker* w = new RangeWorker(job, begin, end);
+                w->Start();
+                workers.push_back(w);
+                begin = end;
+            }
+            job.Run(begin, count);
+
+            for (unsigned int t = 0; t < workers.size(); ++t) {
+                workers[t]->Wait();
+                delete workers[t];
+            }
+            Release(claimed);
+        }
+
+    }
+}
@@ -0,0 +1,63 @@
+// Parallel range.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _PARALLEL_RANGE_H_
+#define _PARALLEL_RANGE_H_
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * A job that can be split into independent slabs. Run is
+         * called once for each slab [begin, end) and may be called
+         * concurrently from several threads, so a job must only write
+         * to data owned by the slab.
+         */
+        class IRangeJob {
+        public:
+            virtual ~IRangeJob() {}
+            virtual void Run(unsigned int begin, unsigned int end) = 0;
+        };
+
+        /**
+         * Splits a range into contiguous slabs and runs them on one
+         * thread per core. The calling thread processes the last slab
+         * itself and returns when all slabs are done.
+         *
+         * Without a thread count the extra threads are claimed from a
+         * budget of one per core, shared by the whole process. Runs
+         * started from several threads at once, or from inside
+         * another run, get what is left, down to the calling thread
+         * alone, so the cores are never oversubscribed.
+         */
+        class ParallelRange {
+        public:
+            /**
+             * The number of threads used when none is given. Can be
+             * overridden with the OE_THREADS environment variable.
+             */
+            static unsigned int GetThreadCount();
+
+            /**
+             * Claim up to wanted threads besides the calling one from
+             * the budget. Returns the number claimed, to be given back
+             * with Release. For long running threads of their own,
+             * like the workers of the startup graph.
+             */
+            static unsigned int Claim(unsigned int wanted);
+            static void Release(unsigned int threads);
+
+            static void Run(IRangeJob& job, unsigned int count,
+                            unsigned int threads = 0);
+        };
+
+    }
+}
+
+#endif
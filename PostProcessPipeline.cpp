@@ -0,0 +1,354 @@
+// Post process pipeline.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "PostProcessPipeline.h"
+#include "PostProcessTimer.h"
+#include "AssetCache.h"
+
+#include <Logging/Logger.h>
+#include <Resources/DirectoryManager.h>
+#include <Resources/Exceptions.h>
+#include <Resources/ResourceManager.h>
+#include <Scene/PostProcessNode.h>
+#include <Scene/ChainPostProcessNode.h>
+
+#include <fstream>
+#include <sstream>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::DirectoryManager;
+        using Resources::IShaderResource;
+        using Resources::ResourceException;
+        using Resources::ResourceManager;
+        using Scene::PostProcessNode;
+        using Scene::ChainPostProcessNode;
+
+        PostProcessPipeline::Stage::Stage(PostProcessPipeline& pipeline, string name,
+                                          std::list<IShaderResourcePtr> effects,
+                                          string snippet, bool chain, bool enabled,
+                                          IStageSetup* setup)
+            : pipeline(pipeline), name(name), effects(effects), snippet(snippet),
+              chain(chain), enabled(enabled), setup(setup) {}
+
+        void PostProcessPipeline::Stage::SetEnabled(bool enabled) {
+            if (this->enabled == enabled) return;
+            this->enabled = enabled;
+            pipeline.dirty = true;
+        }
+
+        void PostProcessPipeline::Stage::Build(Vector<2, int> dimension,
+                                               Renderers::RenderingEventArg arg) {
+            if (chain)
+                nodes.push_back(new ChainPostProcessNode(effects, dimension, 1, true));
+            else if (!passes.empty()) {
+                std::list<Pass>::iterator itr = passes.begin();
+                for (; itr != passes.end(); ++itr) {
+                    PostProcessNode* n = new PostProcessNode(itr->effect, itr->dimension);
+                    if (!nodes.empty()) nodes.back()->AddNode(n);
+                    nodes.push_back(n);
+                }
+            } else
+                nodes.push_back(new PostProcessNode(effects.front(), dimension));
+
+            if (setup) setup->Setup(*this, nodes.front());
+            for (unsigned int i = 0; i < nodes.size(); ++i) {
+                // Nested passes share the name, so the timer charges
+                // each its own time and sums them into the stage.
+                if (pipeline.timer) pipeline.timer->SetName(nodes[i], name);
+                if (chain)
+                    ((ChainPostProcessNode*)nodes[i])->Handle(arg);
+                else
+                    ((PostProcessNode*)nodes[i])->Handle(arg);
+            }
+        }
+
+        void PostProcessPipeline::Stage::Destroy() {
+            // Unlinked first, so no node is deleted through its parent.
+            for (unsigned int i = 0; i + 1 < nodes.size(); ++i)
+                nodes[i]->RemoveNode(nodes[i + 1]);
+            for (unsigned int i = 0; i < nodes.size(); ++i)
+                delete nodes[i];
+            nodes.clear();
+        }
+
+        void PostProcessPipeline::Stage::SetUniform(string name, Vector<4, float> value,
+                                                    unsigned int size) {
+            Uniform u;
+            u.size = size;
+            u.value = value;
+            uniforms[name] = u;
+            if (program) Apply();
+        }
+
+        void PostProcessPipeline::Stage::SetUniform(string name, float value) {
+            SetUniform(name, Vector<4, float>(value, 0.0f, 0.0f, 0.0f), 1);
+        }
+
+        void PostProcessPipeline::Stage::SetUniform(string name, Vector<2, float> value) {
+            SetUniform(name, Vector<4, float>(value[0], value[1], 0.0f, 0.0f), 2);
+        }
+
+        void PostProcessPipeline::Stage::SetUniform(string name, Vector<3, float> value) {
+            SetUniform(name, Vector<4, float>(value[0], value[1], value[2], 0.0f), 3);
+        }
+
+        void PostProcessPipeline::Stage::SetUniform(string name, Vector<4, float> value) {
+            SetUniform(name, value, 4);
+        }
+
+        void PostProcessPipeline::Stage::SetTexture(string name, ITexture2DPtr texture) {
+            textures[name] = texture;
+            if (program) Apply();
+        }
+
+        void PostProcessPipeline::Stage::Apply() {
+            std::map<string, Uniform>::iterator u = uniforms.begin();
+            for (; u != uniforms.end(); ++u) {
+                const Vector<4, float>& v = u->second.value;
+                switch (u->second.size) {
+                case 1: program->SetUniform(u->first, v[0]); break;
+                case 2: program->SetUniform(u->first, Vector<2, float>(v[0], v[1])); break;
+                case 3: program->SetUniform(u->first, Vector<3, float>(v[0], v[1], v[2])); break;
+                default: program->SetUniform(u->first, v); break;
+                }
+            }
+            std::map<string, ITexture2DPtr>::iterator t = textures.begin();
+            for (; t != textures.end(); ++t)
+                program->SetTexture(t->first, t->second);
+        }
+
+        PostProcessPipeline::PostProcessPipeline(ISceneNode* parent, ISceneNode* child,
+                                                 Vector<2, int> dimension,
+                                                 GeneratedAssetCache& cache)
+            : parent(parent), child(child), dimension(dimension), cache(cache),
+              timer(NULL), dirty(true) {
+            parent->AddNode(child);
+            clock.Start();
+        }
+
+        PostProcessPipeline::~PostProcessPipeline() {
+            for (unsigned int i = 0; i < stages.size(); ++i)
+                delete stages[i];
+        }
+
+        PostProcessPipeline::Stage* PostProcessPipeline::AddStage(string name,
+                                                                  IShaderResourcePtr effect,
+                                                                  bool enabled,
+                                                                  IStageSetup* setup,
+                                                                  string snippet) {
+            std::list<IShaderResourcePtr> effects;
+            effects.push_back(effect);
+            stages.push_back(new Stage(*this, name, effects, snippet, false, enabled, setup));
+            if (timer) timer->AddStage(name);
+            dirty = true;
+            return stages.back();
+        }
+
+        PostProcessPipeline::Stage* PostProcessPipeline::AddChain(string name,
+                                                                  std::list<IShaderResourcePtr> effects,
+                                                                  bool enabled,
+                                                                  IStageSetup* setup) {
+            stages.push_back(new Stage(*this, name, effects, "", true, enabled, setup));
+            if (timer) timer->AddStage(name);
+            dirty = true;
+            return stages.back();
+        }
+
+        PostProcessPipeline::Stage* PostProcessPipeline::AddPasses(string name,
+                                                                   std::list<Pass> passes,
+                                                                   bool enabled,
+                                                                   IStageSetup* setup,
+                                                                   string snippet) {
+            Stage* s = new Stage(*this, name, std::list<IShaderResourcePtr>(),
+                                 snippet, false, enabled, setup);
+            s->passes = passes;
+            stages.push_back(s);
+            if (timer) timer->AddStage(name);
+            dirty = true;
+            return s;
+        }
+
+        PostProcessPipeline::Stage* PostProcessPipeline::AddPointwise(string name,
+                                                                      string snippet,
+                                                                      bool enabled) {
+            stages.push_back(new Stage(*this, name, std::list<IShaderResourcePtr>(),
+                                       snippet, false, enabled, NULL));
+            dirty = true;
+            return stages.back();
+        }
+
+        PostProcessPipeline::Stage* PostProcessPipeline::GetStage(string name) {
+            for (unsigned int i = 0; i < stages.size(); ++i)
+                if (stages[i]->name == name)
+                    return stages[i];
+            return NULL;
+        }
+
+        // The program around the snippets: color0 at the pixel is run
+        // through each snippet in turn, the depth is passed on.
+        static const char* FUSED_HEADER =
+            "uniform sampler2D color0;\n"
+            "uniform sampler2DShadow depth;\n"
+            "uniform float time;\n"
+            "varying vec2 texCoord;\n";
+
+        PostProcessPipeline::Fused PostProcessPipeline::Compile(const std::vector<Stage*>& group) {
+            AssetKey key("fused post process 1");
+            std::ostringstream code, unifs, calls;
+            Fused f;
+            f.node = NULL;
+            f.animated = false;
+            code << FUSED_HEADER;
+            for (unsigned int i = 0; i < group.size(); ++i) {
+                const string& snippet = group[i]->snippet;
+                key.Add(snippet).AddFile(snippet);
+                std::ifstream in(DirectoryManager::FindFileInPath(snippet).c_str());
+                if (!in.is_open())
+                    throw ResourceException("could not read post process snippet: " + snippet);
+                code << "\n";
+                string line;
+                while (std::getline(in, line)) {
+                    // Default values of the snippet uniforms.
+                    if (line.compare(0, 7, "//unif:") == 0)
+                        unifs << line.substr(2) << "\n";
+                    // Snippets reading the time uniform say so.
+                    if (line.compare(0, 13, "//uses: time") == 0 &&
+                        line.find_first_not_of(" \t\r", 13) == string::npos)
+                        f.animated = true;
+                    code << line << "\n";
+                }
+                // The function is named after the file.
+                string function = snippet.substr(snippet.find_last_of('/') + 1);
+                function = function.substr(0, function.find('.'));
+                calls << "    color = " << function << "(color);\n";
+            }
+            code << "\nvoid main() {\n"
+                 << "    vec4 color = texture2D(color0, texCoord);\n"
+                 << calls.str()
+                 << "    gl_FragColor = color;\n"
+                 << "    gl_FragDepth = shadow2D(depth, vec3(texCoord, 0.0)).x;\n"
+                 << "}\n";
+
+            string asset = "postprocess/" + key.ToString();
+            if (!cache.IsValid(asset + ".glsl", key)) {
+                std::ofstream frag(cache.GetTempPath(asset + ".frag").c_str());
+                frag << code.str();
+                frag.close();
+                cache.Commit(asset + ".frag", key);
+                std::ofstream glsl(cache.GetTempPath(asset + ".glsl").c_str());
+                glsl << "# Generated from the post process snippets, do not edit.\n"
+                     << "vert: shaders/default.vert\n"
+                     << "frag: " << cache.GetPath(asset + ".frag") << "\n"
+                     << unifs.str();
+                glsl.close();
+                cache.Commit(asset + ".glsl", key);
+            }
+            f.program = ResourceManager<IShaderResource>::Create(cache.GetPath(asset + ".glsl"));
+            return f;
+        }
+
+        void PostProcessPipeline::Fuse(std::vector<Stage*>& group,
+                                       std::map<string, Fused>& used,
+                                       Renderers::RenderingEventArg arg) {
+            if (group.empty()) return;
+            // The group is collected from the outside in, the
+            // innermost snippet runs first.
+            std::vector<Stage*> order(group.rbegin(), group.rend());
+            group.clear();
+            string name;
+            for (unsigned int i = 0; i < order.size(); ++i)
+                name += (i ? " + " : "") + order[i]->name;
+
+            Fused f;
+            std::map<string, Fused>::iterator itr = fused.find(name);
+            if (itr != fused.end()) {
+                f = itr->second;
+                fused.erase(itr);
+            } else {
+                f = Compile(order);
+                PostProcessNode* n = new PostProcessNode(f.program, dimension);
+                n->Handle(arg);
+                f.node = n;
+                if (timer) timer->SetName(n, name);
+            }
+            for (unsigned int i = 0; i < order.size(); ++i) {
+                order[i]->program = f.program;
+                order[i]->Apply();
+            }
+            used[name] = f;
+            linked.push_back(std::make_pair(f.node, f.node));
+        }
+
+        void PostProcessPipeline::Rebuild(Renderers::RenderingEventArg arg) {
+            // Unlink the current chain.
+            ISceneNode* prev = parent;
+            for (unsigned int i = 0; i < linked.size(); ++i) {
+                prev->RemoveNode(linked[i].first);
+                prev = linked[i].second;
+            }
+            prev->RemoveNode(child);
+            linked.clear();
+
+            for (unsigned int i = 0; i < stages.size(); ++i) {
+                Stage& s = *stages[i];
+                if (!s.enabled) {
+                    s.Destroy();
+                    s.program = IShaderResourcePtr();
+                    continue;
+                }
+                if (s.nodes.empty() && (!s.effects.empty() || !s.passes.empty()))
+                    s.Build(dimension, arg);
+            }
+
+            // Runs of snippets become fused nodes. A stage with passes
+            // ends the run outside it, and its own snippet starts it.
+            std::vector<Stage*> group;
+            std::map<string, Fused> used;
+            for (unsigned int i = 0; i < stages.size(); ++i) {
+                Stage& s = *stages[i];
+                if (!s.enabled) continue;
+                if (!s.snippet.empty()) group.push_back(&s);
+                if (!s.nodes.empty()) {
+                    Fuse(group, used, arg);
+                    linked.push_back(std::make_pair(s.nodes.front(), s.nodes.back()));
+                }
+            }
+            Fuse(group, used, arg);
+            std::map<string, Fused>::iterator itr = fused.begin();
+            for (; itr != fused.end(); ++itr)
+                delete itr->second.node;
+            fused = used;
+
+            prev = parent;
+            for (unsigned int i = 0; i < linked.size(); ++i) {
+                prev->AddNode(linked[i].first);
+                prev = linked[i].second;
+            }
+            prev->AddNode(child);
+
+            logger.info << "post process pipeline: " << linked.size()
+                        << " nodes for " << stages.size() << " stages" << logger.end;
+        }
+
+        void PostProcessPipeline::Handle(Renderers::RenderingEventArg arg) {
+            if (dirty) {
+                dirty = false;
+                Rebuild(arg);
+            }
+            float time = clock.GetElapsedTime().AsInt() / 1000000.0f;
+            std::map<string, Fused>::iterator itr = fused.begin();
+            for (; itr != fused.end(); ++itr)
+                if (itr->second.animated)
+                    itr->second.program->SetUniform("time", time);
+        }
+
+    }
+}
@@ -0,0 +1,230 @@
+// Post process pipeline.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _POST_PROCESS_PIPELINE_H_
+#define _POST_PROCESS_PIPELINE_H_
+
+#include <Core/IListener.h>
+#include <Math/Vector.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/IShaderResource.h>
+#include <Resources/ITexture2D.h>
+#include <Scene/ISceneNode.h>
+#include <Utils/Timer.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Math::Vector;
+        using Resources::IShaderResourcePtr;
+        using Resources::ITexture2DPtr;
+        using Scene::ISceneNode;
+        using std::string;
+
+        class GeneratedAssetCache;
+        class PostProcessTimer;
+
+        /**
+         * A chain of post process stages between two scene nodes,
+         * where only the enabled stages exist.
+         *
+         * A disabled stage has no node: it is neither in the scene
+         * nor holding a frame buffer. Toggling a stage only marks the
+         * pipeline dirty; the chain is rebuilt in the next renderer
+         * pre process event, creating the nodes of newly enabled
+         * stages and deleting those of disabled ones. Shaders are
+         * kept by the stages, so a rebuild only allocates frame
+         * buffers.
+         *
+         * Pointwise stages are GLSL snippets rather than shaders.
+         * Each snippet defines a function named after its file,
+         * taking and returning a color, and prefixes its uniforms so
+         * they do not clash with those of other snippets. Adjacent
+         * enabled snippets are fused into one generated program and
+         * run in a single pass, so a chain of color transforms costs
+         * one full screen read and write instead of one per effect.
+         * A stage with passes may end in a snippet, which is then
+         * the first in its program and the only one that may read
+         * color0 away from the current pixel.
+         *
+         * The fused programs see color0, depth, texCoord and time,
+         * the seconds since the pipeline was made. A snippet reading
+         * time has a line "//uses: time", so its program is updated
+         * every frame.
+         */
+        class PostProcessPipeline
+            : public Core::IListener<Renderers::RenderingEventArg> {
+        public:
+            class Stage;
+
+            /**
+             * A pass of a multi resolution stage. The effect reads a
+             * frame buffer of the given size holding the output of
+             * the pass inside it, or the scene for the innermost
+             * pass, and writes at the size of the pass outside it.
+             */
+            struct Pass {
+                IShaderResourcePtr effect;
+                Vector<2, int> dimension;
+                Pass(IShaderResourcePtr effect, Vector<2, int> dimension)
+                    : effect(effect), dimension(dimension) {}
+            };
+
+            /**
+             * Called when the node of a stage has been created, before
+             * it is initialized, to connect it to other resources.
+             */
+            class IStageSetup {
+            public:
+                virtual ~IStageSetup() {}
+                virtual void Setup(Stage& stage, ISceneNode* node) = 0;
+            };
+
+            class Stage {
+                friend class PostProcessPipeline;
+                struct Uniform {
+                    unsigned int size;
+                    Vector<4, float> value;
+                };
+                PostProcessPipeline& pipeline;
+                string name;
+                std::list<IShaderResourcePtr> effects;
+                std::list<Pass> passes;
+                string snippet;
+                bool chain, enabled;
+                std::vector<ISceneNode*> nodes;
+                IStageSetup* setup;
+                IShaderResourcePtr program;
+                std::map<string, Uniform> uniforms;
+                std::map<string, ITexture2DPtr> textures;
+
+                Stage(PostProcessPipeline& pipeline, string name,
+                      std::list<IShaderResourcePtr> effects, string snippet,
+                      bool chain, bool enabled, IStageSetup* setup);
+                void SetUniform(string name, Vector<4, float> value,
+                                unsigned int size);
+                void Apply();
+                void Build(Vector<2, int> dimension, Renderers::RenderingEventArg arg);
+                void Destroy();
+            public:
+                // Not const, so they can be used by an inspection bar.
+                bool Enabled() { return enabled; }
+                void SetEnabled(bool enabled);
+                string GetName() const { return name; }
+
+                /**
+                 * The outermost node of the stage, or NULL while it is
+                 * disabled or not yet built.
+                 */
+                ISceneNode* GetNode() const { return nodes.empty() ? NULL : nodes.front(); }
+
+                /**
+                 * The node of a pass, from the outside in, for stages
+                 * added with AddPasses.
+                 */
+                ISceneNode* GetPass(unsigned int i) const { return nodes[i]; }
+
+                /**
+                 * Uniforms and textures of the snippet. They are kept
+                 * by the stage and set again whenever the snippet is
+                 * fused into a new program.
+                 */
+                void SetUniform(string name, float value);
+                void SetUniform(string name, Vector<2, float> value);
+                void SetUniform(string name, Vector<3, float> value);
+                void SetUniform(string name, Vector<4, float> value);
+                void SetTexture(string name, ITexture2DPtr texture);
+            };
+
+        private:
+            friend class Stage;
+            struct Fused {
+                ISceneNode* node;
+                IShaderResourcePtr program;
+                bool animated;
+            };
+            ISceneNode* parent;
+            ISceneNode* child;
+            Vector<2, int> dimension;
+            GeneratedAssetCache& cache;
+            std::vector<Stage*> stages;
+            // The outermost and innermost node of each linked stage.
+            std::vector<std::pair<ISceneNode*, ISceneNode*> > linked;
+            std::map<string, Fused> fused;
+            PostProcessTimer* timer;
+            Utils::Timer clock;
+            bool dirty;
+
+            Fused Compile(const std::vector<Stage*>& group);
+            void Fuse(std::vector<Stage*>& group,
+                      std::map<string, Fused>& used,
+                      Renderers::RenderingEventArg arg);
+            void Rebuild(Renderers::RenderingEventArg arg);
+
+        public:
+            /**
+             * The stages are inserted between parent and child, which
+             * are linked directly while no stage is enabled. Fused
+             * programs are generated into the cache.
+             */
+            PostProcessPipeline(ISceneNode* parent, ISceneNode* child,
+                                Vector<2, int> dimension,
+                                GeneratedAssetCache& cache);
+            ~PostProcessPipeline();
+
+            /**
+             * Stages are applied to the scene in reverse order of
+             * adding them, the first stage added is the outermost.
+             */
+            Stage* AddStage(string name, IShaderResourcePtr effect,
+                            bool enabled, IStageSetup* setup = NULL,
+                            string snippet = "");
+            Stage* AddChain(string name, std::list<IShaderResourcePtr> effects,
+                            bool enabled, IStageSetup* setup = NULL);
+
+            /**
+             * Add a stage of nested passes at their own resolutions,
+             * listed from the outside in.
+             */
+            Stage* AddPasses(string name, std::list<Pass> passes,
+                             bool enabled, IStageSetup* setup = NULL,
+                             string snippet = "");
+
+            /**
+             * Add a stage made only of a pointwise snippet, a path
+             * looked up through the DirectoryManager.
+             */
+            Stage* AddPointwise(string name, string snippet, bool enabled);
+
+            Stage* GetStage(string name);
+            unsigned int GetActiveStages() const { return linked.size(); }
+
+            /**
+             * Time stage nodes under the name of their stage. Set it
+             * before adding stages.
+             */
+            void SetTimer(PostProcessTimer* timer) { this->timer = timer; }
+
+            /**
+             * Rebuilds the chain if needed and advances the time of
+             * the fused programs, attach to the renderer pre process
+             * event.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,224 @@
+// Post process stage timing.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "PostProcessTimer.h"
+
+#include <Logging/Logger.h>
+#include <Meta/OpenGL.h>
+
+#include <algorithm>
+#include <sstream>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::vector;
+
+        // Frames to wait for GPU results before blocking on them.
+        static const unsigned int LATENCY = 3;
+
+        PostProcessStage::PostProcessStage(string name)
+            : name(name), cpu(SAMPLES), gpu(SAMPLES), cpuCount(0), gpuCount(0) {}
+
+        void PostProcessStage::AddCPU(float ms) {
+            cpu[cpuCount++ % SAMPLES] = ms;
+        }
+
+        void PostProcessStage::AddGPU(float ms) {
+            gpu[gpuCount++ % SAMPLES] = ms;
+        }
+
+        float PostProcessStage::Mean(const vector<float>& v, unsigned int count) {
+            unsigned int n = std::min(count, SAMPLES);
+            if (n == 0) return 0.0f;
+            float sum = 0.0f;
+            for (unsigned int i = 0; i < n; ++i)
+                sum += v[i];
+            return sum / n;
+        }
+
+        float PostProcessStage::Percentile(const vector<float>& v, unsigned int count,
+                                           float p) {
+            unsigned int n = std::min(count, SAMPLES);
+            if (n == 0) return 0.0f;
+            vector<float> sorted(v.begin(), v.begin() + n);
+            std::sort(sorted.begin(), sorted.end());
+            unsigned int rank = (unsigned int)(p / 100.0f * n + 0.5f);
+            return sorted[std::min(n - 1, rank > 0 ? rank - 1 : 0)];
+        }
+
+        vector<unsigned int> PostProcessStage::GetGPUHistogram(float width,
+                                                               unsigned int buckets) const {
+            vector<unsigned int> h(buckets, 0);
+            unsigned int n = std::min(gpuCount, SAMPLES);
+            for (unsigned int i = 0; i < n; ++i) {
+                unsigned int b = (unsigned int)(std::max(gpu[i], 0.0f) / width);
+                ++h[std::min(b, buckets - 1)];
+            }
+            return h;
+        }
+
+        PostProcessTimer::PostProcessTimer()
+            : initialized(false), useQueries(false) {}
+
+        PostProcessTimer::~PostProcessTimer() {
+            for (unsigned int i = 0; i < stages.size(); ++i)
+                delete stages[i];
+        }
+
+        unsigned int PostProcessTimer::AddStage(string name) {
+            for (unsigned int i = 0; i < stages.size(); ++i)
+                if (stages[i]->GetName() == name)
+                    return i;
+            stages.push_back(new PostProcessStage(name));
+            return stages.size() - 1;
+        }
+
+        void PostProcessTimer::SetName(const void* node, string name) {
+            stageIndex[node] = AddStage(name);
+        }
+
+        unsigned int PostProcessTimer::Query() {
+            if (freeQueries.empty()) {
+                GLuint q[16];
+                glGenQueries(16, q);
+                freeQueries.insert(freeQueries.end(), q, q + 16);
+            }
+            unsigned int q = freeQueries.back();
+            freeQueries.pop_back();
+            return q;
+        }
+
+        void PostProcessTimer::Begin(const void* node) {
+            if (!initialized) {
+                initialized = true;
+                useQueries = GLEW_ARB_timer_query;
+                if (!useQueries)
+                    logger.info << "no timestamp queries, post process GPU "
+                                << "times are not recorded" << logger.end;
+            }
+            std::map<const void*, unsigned int>::iterator itr = stageIndex.find(node);
+            if (itr == stageIndex.end()) {
+                std::ostringstream name;
+                name << "post process " << stages.size();
+                SetName(node, name.str());
+                itr = stageIndex.find(node);
+            }
+
+            Record r;
+            r.stage = itr->second;
+            r.parent = stack.empty() ? -1 : stack.back();
+            r.begin = r.end = 0;
+            r.cpu = r.childCPU = 0.0f;
+            if (useQueries) {
+                r.begin = Query();
+                r.end = Query();
+                glQueryCounter(r.begin, GL_TIMESTAMP);
+                current.last = r.begin;
+            }
+            stack.push_back(current.records.size());
+            current.records.push_back(r);
+            if (timers.size() < stack.size())
+                timers.resize(stack.size());
+            timers[stack.size() - 1].Reset();
+            timers[stack.size() - 1].Start();
+        }
+
+        void PostProcessTimer::End(const void* node) {
+            if (stack.empty()) return;
+            Record& r = current.records[stack.back()];
+            r.cpu = timers[stack.size() - 1].GetElapsedTime().AsInt() / 1000.0f;
+            if (useQueries) {
+                glQueryCounter(r.end, GL_TIMESTAMP);
+                current.last = r.end;
+            }
+            if (r.parent >= 0)
+                current.records[r.parent].childCPU += r.cpu;
+            stack.pop_back();
+        }
+
+        void PostProcessTimer::Resolve(Frame& f) {
+            vector<Record>& frame = f.records;
+            vector<float> gpu(frame.size(), 0.0f), childGPU(frame.size(), 0.0f);
+            if (useQueries)
+                for (unsigned int i = 0; i < frame.size(); ++i) {
+                    GLuint64 t0 = 0, t1 = 0;
+                    glGetQueryObjectui64v(frame[i].begin, GL_QUERY_RESULT, &t0);
+                    glGetQueryObjectui64v(frame[i].end, GL_QUERY_RESULT, &t1);
+                    gpu[i] = (t1 - t0) / 1000000.0f;
+                    if (frame[i].parent >= 0)
+                        childGPU[frame[i].parent] += gpu[i];
+                    freeQueries.push_back(frame[i].begin);
+                    freeQueries.push_back(frame[i].end);
+                }
+
+            // A stage may be drawn more than once a frame, for instance
+            // in a reflection pass, so its times are summed first.
+            vector<float> cpuSum(stages.size(), 0.0f), gpuSum(stages.size(), 0.0f);
+            vector<bool> seen(stages.size(), false);
+            for (unsigned int i = 0; i < frame.size(); ++i) {
+                unsigned int s = frame[i].stage;
+                cpuSum[s] += frame[i].cpu - frame[i].childCPU;
+                gpuSum[s] += gpu[i] - childGPU[i];
+                seen[s] = true;
+            }
+            for (unsigned int s = 0; s < stages.size(); ++s) {
+                if (!seen[s]) continue;
+                stages[s]->AddCPU(cpuSum[s]);
+                if (useQueries)
+                    stages[s]->AddGPU(gpuSum[s]);
+            }
+        }
+
+        void PostProcessTimer::Handle(Renderers::RenderingEventArg arg) {
+            // Stages left open by an aborted pass are dropped.
+            stack.clear();
+            if (!current.records.empty()) {
+                pending.push_back(current);
+                current = Frame();
+            }
+
+            while (!pending.empty()) {
+                Frame& f = pending.front();
+                if (useQueries && pending.size() <= LATENCY) {
+                    GLint available = 0;
+                    glGetQueryObjectiv(f.last, GL_QUERY_RESULT_AVAILABLE, &available);
+                    if (!available) break;
+                }
+                Resolve(f);
+                pending.pop_front();
+            }
+        }
+
+        void PostProcessTimer::Dump() {
+            const float width = 0.25f;
+            const unsigned int buckets = 12;
+            logger.info << "post process stage times in ms, self time only, over the last "
+                        << PostProcessStage::SAMPLES << " frames" << logger.end;
+            float cpuTotal = 0.0f, gpuTotal = 0.0f;
+            for (unsigned int i = 0; i < stages.size(); ++i) {
+                PostProcessStage& s = *stages[i];
+                vector<unsigned int> h = s.GetGPUHistogram(width, buckets);
+                std::ostringstream hist;
+                for (unsigned int b = 0; b < h.size(); ++b)
+                    hist << (b ? " " : "") << h[b];
+                logger.info << s.GetName()
+                            << ": cpu " << s.GetCPU() << " (p95 " << s.GetCPUPercentile(95) << ")"
+                            << ", gpu " << s.GetGPU() << " (p95 " << s.GetGPUPercentile(95) << ")"
+                            << ", gpu histogram per " << width << " ms [" << hist.str() << "]"
+                            << logger.end;
+                cpuTotal += s.GetCPU();
+                gpuTotal += s.GetGPU();
+            }
+            logger.info << "post process total: cpu " << cpuTotal
+                        << ", gpu " << gpuTotal << logger.end;
+        }
+
+    }
+}
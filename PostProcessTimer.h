@@ -0,0 +1,142 @@
+// Post process stage timing.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _POST_PROCESS_TIMER_H_
+#define _POST_PROCESS_TIMER_H_
+
+#include <Core/IListener.h>
+#include <Renderers/IRenderer.h>
+#include <Utils/Timer.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::string;
+
+        /**
+         * Rolling timings of one post process stage, the last SAMPLES
+         * frames of CPU and GPU time spent in the stage itself, not
+         * counting the stages nested inside it.
+         */
+        class PostProcessStage {
+        public:
+            static const unsigned int SAMPLES = 256;
+
+        private:
+            string name;
+            std::vector<float> cpu, gpu;
+            unsigned int cpuCount, gpuCount;
+
+            static float Mean(const std::vector<float>& v, unsigned int n);
+            static float Percentile(const std::vector<float>& v, unsigned int n, float p);
+
+        public:
+            PostProcessStage(string name);
+
+            void AddCPU(float ms);
+            void AddGPU(float ms);
+
+            string GetName() const { return name; }
+            // Not const, so they can be read by an inspection bar.
+            float GetCPU() { return Mean(cpu, cpuCount); }
+            float GetGPU() { return Mean(gpu, gpuCount); }
+            float GetCPUPercentile(float p) const { return Percentile(cpu, cpuCount, p); }
+            float GetGPUPercentile(float p) const { return Percentile(gpu, gpuCount, p); }
+
+            /**
+             * Count the GPU samples in buckets of the given width,
+             * with the last bucket holding everything above.
+             */
+            std::vector<unsigned int> GetGPUHistogram(float width,
+                                                      unsigned int buckets) const;
+        };
+
+        /**
+         * Times the post process stages of the scene with CPU timers
+         * and GPU timestamp queries. A rendering view calls Begin and
+         * End around each stage; stages may nest, and each is charged
+         * only its own time.
+         *
+         * GPU results are read back a few frames late so the renderer
+         * does not wait on the GPU. Without ARB_timer_query only CPU
+         * times are recorded.
+         */
+        class PostProcessTimer
+            : public Core::IListener<Renderers::RenderingEventArg> {
+            struct Record {
+                unsigned int stage;
+                int parent;
+                unsigned int begin, end;
+                float cpu, childCPU;
+            };
+            struct Frame {
+                std::vector<Record> records;
+                // The query issued last, its result is the last
+                // to become available.
+                unsigned int last;
+                Frame() : last(0) {}
+            };
+
+            std::vector<PostProcessStage*> stages;
+            std::map<const void*, unsigned int> stageIndex;
+            Frame current;
+            std::vector<int> stack;
+            std::vector<Utils::Timer> timers;
+            std::deque<Frame> pending;
+            std::vector<unsigned int> freeQueries;
+            bool initialized, useQueries;
+
+            unsigned int Query();
+            void Resolve(Frame& frame);
+
+        public:
+            PostProcessTimer();
+            ~PostProcessTimer();
+
+            /**
+             * Add a stage before any node is timed under its name, so
+             * it can be inspected from the start. Returns its index.
+             */
+            unsigned int AddStage(string name);
+
+            /**
+             * Time a node under a stage name. Nodes given the same
+             * name share a stage, so a node replacing another keeps
+             * adding to its timings. Unnamed nodes are named by the
+             * order they are first seen in.
+             */
+            void SetName(const void* node, string name);
+
+            void Begin(const void* node);
+            void End(const void* node);
+
+            /**
+             * Ends the frame, attach to the renderer post process
+             * event.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+
+            const std::vector<PostProcessStage*>& GetStages() const { return stages; }
+
+            /**
+             * Log mean, percentiles and a GPU time histogram of every
+             * stage.
+             */
+            void Dump();
+        };
+
+    }
+}
+
+#endif
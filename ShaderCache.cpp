@@ -0,0 +1,199 @@
+// Shader program cache.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "ShaderCache.h"
+
+#include <Logging/Logger.h>
+#include <Meta/OpenGL.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        static const string PROGRAMS = "shaders";
+
+#ifdef _WIN32
+        // The entries of a directory, without hidden ones, and
+        // whether each is a directory.
+        static void ListDirectory(const string& path, std::vector<string>& entries,
+                                  std::vector<bool>& dirs) {
+            WIN32_FIND_DATAA data;
+            HANDLE h = FindFirstFileA((path + "/*").c_str(), &data);
+            if (h == INVALID_HANDLE_VALUE) return;
+            do {
+                if (data.cFileName[0] == '.') continue;
+                entries.push_back(data.cFileName);
+                dirs.push_back((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+            } while (FindNextFileA(h, &data));
+            FindClose(h);
+        }
+
+        static bool PathExists(const string& path) {
+            return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+        }
+
+        static void MakeDirectory(const string& path) {
+            _mkdir(path.c_str());
+        }
+
+        static string AbsolutePath(const string& path) {
+            char full[MAX_PATH];
+            DWORD n = GetFullPathNameA(path.c_str(), MAX_PATH, full, NULL);
+            return 0 < n && n < MAX_PATH ? string(full) : path;
+        }
+
+        // Set a variable unless the user has, true if it holds value.
+        static bool SetDefault(const char* name, const string& value) {
+            const char* old = getenv(name);
+            if (old == NULL) {
+                _putenv_s(name, value.c_str());
+                old = getenv(name);
+            }
+            return old != NULL && value == old;
+        }
+#else
+        // The entries of a directory, without hidden ones, and
+        // whether each is a directory.
+        static void ListDirectory(const string& path, std::vector<string>& entries,
+                                  std::vector<bool>& dirs) {
+            DIR* d = opendir(path.c_str());
+            if (d == NULL) return;
+            struct dirent* e;
+            while ((e = readdir(d)) != NULL) {
+                if (e->d_name[0] == '.') continue;
+                struct stat st;
+                if (stat((path + "/" + e->d_name).c_str(), &st) != 0) continue;
+                entries.push_back(e->d_name);
+                dirs.push_back(S_ISDIR(st.st_mode));
+            }
+            closedir(d);
+        }
+
+        static bool PathExists(const string& path) {
+            struct stat st;
+            return stat(path.c_str(), &st) == 0;
+        }
+
+        static void MakeDirectory(const string& path) {
+            mkdir(path.c_str(), 0755);
+        }
+
+        static string AbsolutePath(const string& path) {
+            if (path[0] == '/') return path;
+            char cwd[4096];
+            if (getcwd(cwd, sizeof(cwd)) == NULL) return path;
+            return string(cwd) + "/" + path;
+        }
+
+        // Set a variable unless the user has, true if it holds value.
+        static bool SetDefault(const char* name, const string& value) {
+            setenv(name, value.c_str(), 0);
+            const char* old = getenv(name);
+            return old != NULL && value == old;
+        }
+#endif
+
+        void ShaderCache::AddDirectory(AssetKey& key, const string& dir) {
+            if (!PathExists(dir)) {
+                key.Add(dir + " <missing>");
+                return;
+            }
+            std::vector<string> entries;
+            std::vector<bool> dirs;
+            ListDirectory(dir, entries, dirs);
+            // Directory order is not stable between runs.
+            std::vector<std::pair<string, bool> > sorted;
+            for (unsigned int i = 0; i < entries.size(); ++i)
+                sorted.push_back(std::make_pair(entries[i], (bool)dirs[i]));
+            std::sort(sorted.begin(), sorted.end());
+
+            for (unsigned int i = 0; i < sorted.size(); ++i) {
+                string path = dir + "/" + sorted[i].first;
+                if (sorted[i].second)
+                    AddDirectory(key, path);
+                else
+                    key.AddFile(path);
+            }
+        }
+
+        ShaderCache::ShaderCache(GeneratedAssetCache& cache,
+                                 const std::vector<string>& dirs)
+            : cache(cache), sources("shader programs 2"),
+              requested(false), warm(false) {
+            for (unsigned int i = 0; i < dirs.size(); ++i)
+                AddDirectory(sources, dirs[i]);
+            // The directory has to exist for the driver to use it,
+            // it is keyed on the driver once there is a context.
+            string dir = cache.GetPath(PROGRAMS);
+            if (!PathExists(dir)) MakeDirectory(dir);
+
+            // Settings made by the user are left alone, and the
+            // directory only counts as requested if ours stuck.
+            dir = AbsolutePath(dir);
+            bool mesa = SetDefault("MESA_SHADER_CACHE_DIR", dir);
+            mesa = SetDefault("MESA_GLSL_CACHE_DIR", dir) || mesa;
+            bool nvidia = SetDefault("__GL_SHADER_DISK_CACHE", "1") &&
+                SetDefault("__GL_SHADER_DISK_CACHE_PATH", dir);
+            SetDefault("__GL_SHADER_DISK_CACHE_SKIP_CLEANUP", "1");
+            requested = mesa || nvidia;
+        }
+
+        void ShaderCache::Handle(Renderers::RenderingEventArg arg) {
+            const char* vendor = (const char*)glGetString(GL_VENDOR);
+            const char* renderer = (const char*)glGetString(GL_RENDERER);
+            const char* version = (const char*)glGetString(GL_VERSION);
+            AssetKey key = sources;
+            key.Add(string(vendor ? vendor : ""))
+                .Add(string(renderer ? renderer : ""))
+                .Add(string(version ? version : ""));
+
+            string dir = cache.GetPath(PROGRAMS);
+            if (cache.IsValid(PROGRAMS, key)) {
+                // Only a driver that honours the directory writes to
+                // it, so programs in it are known to be its own.
+                std::vector<string> entries;
+                std::vector<bool> dirs;
+                ListDirectory(dir, entries, dirs);
+                warm = !entries.empty();
+            } else {
+                // An empty directory replaces the programs of the old
+                // sources or driver.
+                MakeDirectory(cache.GetTempPath(PROGRAMS));
+                cache.Commit(PROGRAMS, key);
+            }
+
+            string driver = string(renderer ? renderer : "") + ", " +
+                (version ? version : "");
+            if (warm)
+                logger.info << "shader programs cached in " << dir
+                            << " for " << driver << logger.end;
+            else if (requested)
+                logger.info << "driver shader cache requested in " << dir
+                            << " for " << driver
+                            << ", the driver may not use it" << logger.end;
+            else
+                logger.info << "driver shader cache settings of the user kept, "
+                            << "not caching shader programs in " << dir
+                            << logger.end;
+        }
+
+    }
+}
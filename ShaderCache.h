@@ -0,0 +1,77 @@
+// Shader program cache.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _SHADER_CACHE_H_
+#define _SHADER_CACHE_H_
+
+#include <Core/IListener.h>
+#include <Renderers/IRenderer.h>
+
+#include "AssetCache.h"
+
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::string;
+
+        /**
+         * Keeps the linked shader programs between runs, in a
+         * directory of the generated asset cache keyed by a hash of
+         * every shader source file and of the GL vendor, renderer and
+         * version.
+         *
+         * The shader plugin compiles and links the programs itself,
+         * so they cannot be stored with glGetProgramBinary here.
+         * Instead the program cache of the driver is asked to use the
+         * directory, by environment variables set before the GL
+         * context is created. Whether a driver honours them is not
+         * known up front, nor whether the user pointed it elsewhere.
+         * Once a source file or the driver changes, the directory is
+         * replaced by an empty one.
+         */
+        class ShaderCache
+            : public Core::IListener<Renderers::RenderingEventArg> {
+            GeneratedAssetCache& cache;
+            AssetKey sources;
+            bool requested, warm;
+
+            static void AddDirectory(AssetKey& key, const string& dir);
+
+        public:
+            /**
+             * Create before the GL context is.
+             *
+             * @param dirs Directories of shader sources, all files
+             * below them are hashed.
+             */
+            ShaderCache(GeneratedAssetCache& cache,
+                        const std::vector<string>& dirs);
+
+            /**
+             * True if the driver wrote programs to the directory on an
+             * earlier run with the current sources and driver. Known
+             * once the renderer is initialized.
+             */
+            bool IsWarm() const { return warm; }
+
+            /**
+             * Keys the directory on the driver and logs what is
+             * known of the cache, attach to the renderer initialize
+             * event before any shader is loaded.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,211 @@
+// Startup graph.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "StartupGraph.h"
+
+#include <Core/Thread.h>
+#include <Logging/Logger.h>
+#include <Resources/Exceptions.h>
+
+#include "ParallelRange.h"
+
+#include <exception>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::ResourceException;
+
+        class StartupGraph::Worker : public Core::Thread {
+            StartupGraph& graph;
+            unsigned int index;
+        public:
+            Worker(StartupGraph& graph, unsigned int index)
+                : graph(graph), index(index) {}
+            void Run() {
+                graph.Work(index);
+            }
+        };
+
+        StartupGraph::StartupGraph(unsigned int threads)
+            : threads(threads ? threads : ParallelRange::GetThreadCount()),
+              active(0), uploaded(false), drawn(false) {
+            timer.Start();
+        }
+
+        StartupGraph::~StartupGraph() {
+            for (unsigned int i = 0; i < stages.size(); ++i)
+                delete stages[i].run;
+        }
+
+        float StartupGraph::Now() {
+            return timer.GetElapsedTime().AsInt() / 1000.0f;
+        }
+
+        unsigned int StartupGraph::Add(string name, IStartupStage* stage) {
+            Stage s;
+            s.name = name;
+            s.run = stage;
+            s.upload = NULL;
+            s.waiting = 0;
+            s.done = false;
+            s.start = s.end = 0.0f;
+            s.worker = 0;
+            stages.push_back(s);
+            return stages.size() - 1;
+        }
+
+        unsigned int StartupGraph::AddUpload(string name,
+                                             Core::IListener<Renderers::RenderingEventArg>& upload) {
+            unsigned int i = Add(name, NULL);
+            stages[i].upload = &upload;
+            return i;
+        }
+
+        void StartupGraph::After(unsigned int stage, unsigned int dependency) {
+            if (stages[stage].upload || stages[dependency].upload)
+                throw ResourceException("upload stages run in the order they are added: "
+                                        + stages[stage].name);
+            stages[dependency].dependents.push_back(stage);
+            ++stages[stage].waiting;
+        }
+
+        void StartupGraph::StartWorkers(unsigned int takers) {
+            // The caller holds the lock. Workers started before may
+            // not have taken their stage yet, the extra ones find
+            // nothing ready and stop.
+            unsigned int wanted = ready.size() > takers ? ready.size() - takers : 0;
+            for (; 0 < wanted && active < threads; --wanted) {
+                // The first worker runs in place of the thread waiting
+                // in Run, the others take their core from the budget
+                // the parallel ranges inside the stages share.
+                if (0 < active && ParallelRange::Claim(1) == 0) break;
+                Worker* w = new Worker(*this, workers.size() + 1);
+                workers.push_back(w);
+                ++active;
+                w->Start();
+            }
+        }
+
+        void StartupGraph::Work(unsigned int worker) {
+            lock.Lock();
+            while (!ready.empty()) {
+                unsigned int i = ready.front();
+                ready.pop_front();
+                lock.Unlock();
+
+                Stage& s = stages[i];
+                s.worker = worker;
+                s.start = Now();
+                string error;
+                try {
+                    s.run->Run();
+                } catch (std::exception& e) {
+                    error = e.what();
+                } catch (...) {
+                    error = "unknown error";
+                }
+                s.end = Now();
+
+                lock.Lock();
+                if (!error.empty()) {
+                    // The stages after it are never ready.
+                    if (failure.empty())
+                        failure = s.name + ": " + error;
+                    continue;
+                }
+                s.done = true;
+                for (unsigned int d = 0; d < s.dependents.size(); ++d)
+                    if (--stages[s.dependents[d]].waiting == 0)
+                        ready.push_back(s.dependents[d]);
+                // This worker takes the next stage itself.
+                StartWorkers(1);
+            }
+            --active;
+            if (0 < active) ParallelRange::Release(1);
+            lock.Unlock();
+        }
+
+        void StartupGraph::Log(unsigned int stage) {
+            const Stage& s = stages[stage];
+            if (s.worker)
+                logger.info << "  " << s.name << ": " << s.start << " - " << s.end
+                            << " ms on worker " << s.worker << logger.end;
+            else
+                logger.info << "  " << s.name << ": " << s.start << " - " << s.end
+                            << " ms on the render thread" << logger.end;
+        }
+
+        void StartupGraph::Run() {
+            float begin = Now();
+            lock.Lock();
+            for (unsigned int i = 0; i < stages.size(); ++i)
+                if (stages[i].run && stages[i].waiting == 0)
+                    ready.push_back(i);
+            StartWorkers(0);
+            lock.Unlock();
+
+            // Workers are only started by the graph or a running
+            // worker, so once every worker in the list is done no
+            // more are started.
+            for (unsigned int i = 0; ; ++i) {
+                lock.Lock();
+                bool more = i < workers.size();
+                Worker* w = more ? workers[i] : NULL;
+                lock.Unlock();
+                if (!more) break;
+                w->Wait();
+            }
+            for (unsigned int i = 0; i < workers.size(); ++i)
+                delete workers[i];
+            workers.clear();
+
+            float cpu = 0.0f;
+            logger.info << "startup stages on up to " << threads << " workers:" << logger.end;
+            for (unsigned int i = 0; i < stages.size(); ++i) {
+                if (stages[i].run == NULL) continue;
+                if (stages[i].done || stages[i].end > 0.0f) {
+                    Log(i);
+                    cpu += stages[i].end - stages[i].start;
+                } else
+                    logger.info << "  " << stages[i].name << ": not run" << logger.end;
+            }
+            logger.info << "startup stages done after " << Now() - begin << " ms, "
+                        << cpu << " ms of work" << logger.end;
+
+            if (!failure.empty())
+                throw ResourceException("startup stage failed, " + failure);
+            for (unsigned int i = 0; i < stages.size(); ++i)
+                if (stages[i].run && !stages[i].done)
+                    throw ResourceException("startup stage waits on itself: " + stages[i].name);
+        }
+
+        void StartupGraph::Handle(Renderers::RenderingEventArg arg) {
+            if (uploaded) {
+                if (!drawn)
+                    logger.info << "first frame after " << Now() << " ms" << logger.end;
+                drawn = true;
+                return;
+            }
+            uploaded = true;
+            logger.info << "startup uploads:" << logger.end;
+            for (unsigned int i = 0; i < stages.size(); ++i) {
+                Stage& s = stages[i];
+                if (s.upload == NULL) continue;
+                s.start = Now();
+                s.upload->Handle(arg);
+                s.end = Now();
+                s.done = true;
+                Log(i);
+            }
+            logger.info << "startup uploads done after " << Now() << " ms" << logger.end;
+        }
+
+    }
+}
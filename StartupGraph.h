@@ -0,0 +1,143 @@
+// Startup graph.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _STARTUP_GRAPH_H_
+#define _STARTUP_GRAPH_H_
+
+#include <Core/IListener.h>
+#include <Core/Mutex.h>
+#include <Renderers/IRenderer.h>
+#include <Utils/Timer.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::string;
+
+        /**
+         * The CPU work of a startup stage.
+         */
+        class IStartupStage {
+        public:
+            virtual ~IStartupStage() {}
+            virtual void Run() = 0;
+        };
+
+        /**
+         * A startup stage that calls a function on shared data.
+         */
+        template <class T>
+        class StartupCall : public IStartupStage {
+            void (*stage)(T&);
+            T& data;
+        public:
+            StartupCall(void (*stage)(T&), T& data) : stage(stage), data(data) {}
+            void Run() { stage(data); }
+        };
+
+        /**
+         * Runs the stages of startup as a graph of dependencies.
+         *
+         * CPU stages run on a pool of worker threads as soon as the
+         * stages they come after are done, so independent stages
+         * overlap. Run returns when all of them are done. Stages may
+         * run concurrently and must not touch GL, anything else they
+         * share, the logger included, has to be locked by the stages
+         * themselves. The graph itself only logs from Run and Handle.
+         * The workers count against the thread budget of
+         * ParallelRange, so ranges run inside stages only get the
+         * cores no stage is using.
+         *
+         * Upload stages are renderer initialize listeners. They run on
+         * the render thread, in the order they were added, when the
+         * graph gets the renderer initialize event, so attach it last.
+         *
+         * The start and end of every stage is logged as a timeline
+         * from the start of Run, ending with the time until the first
+         * frame is drawn.
+         */
+        class StartupGraph
+            : public Core::IListener<Renderers::RenderingEventArg> {
+            struct Stage {
+                string name;
+                IStartupStage* run;
+                Core::IListener<Renderers::RenderingEventArg>* upload;
+                std::vector<unsigned int> dependents;
+                unsigned int waiting;
+                bool done;
+                float start, end;
+                // Zero for the render thread.
+                unsigned int worker;
+            };
+            class Worker;
+
+            std::vector<Stage> stages;
+            std::deque<unsigned int> ready;
+            std::vector<Worker*> workers;
+            unsigned int threads, active;
+            bool uploaded, drawn;
+            string failure;
+            Core::Mutex lock;
+            Utils::Timer timer;
+
+            float Now();
+            void StartWorkers(unsigned int takers);
+            void Work(unsigned int worker);
+            void Log(unsigned int stage);
+
+        public:
+            /**
+             * @param threads Worker threads, zero for one per core.
+             */
+            StartupGraph(unsigned int threads = 0);
+            ~StartupGraph();
+
+            /**
+             * Add a CPU stage, the graph deletes it.
+             */
+            unsigned int Add(string name, IStartupStage* stage);
+
+            template <class T>
+            unsigned int Add(string name, void (*stage)(T&), T& data) {
+                return Add(name, new StartupCall<T>(stage, data));
+            }
+
+            /**
+             * Add a stage run on the render thread.
+             */
+            unsigned int AddUpload(string name,
+                                   Core::IListener<Renderers::RenderingEventArg>& upload);
+
+            /**
+             * Run a CPU stage after another one is done.
+             */
+            void After(unsigned int stage, unsigned int dependency);
+
+            /**
+             * Run the CPU stages. Throws if a stage failed, the stages
+             * after it are not run.
+             */
+            void Run();
+
+            /**
+             * Runs the upload stages on the first event and logs the
+             * time of the first frame on the second. Attach to the
+             * renderer initialize and post process events.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+        };
+
+    }
+}
+
+#endif
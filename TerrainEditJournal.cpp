@@ -0,0 +1,411 @@
+// Terrain edit journal.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "TerrainEditJournal.h"
+
+#include <Logging/Logger.h>
+#include <Resources/Exceptions.h>
+#include <Utils/Timer.h>
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::ResourceException;
+        using std::vector;
+
+        static const char MAGIC[8] = "OEEDIT3";
+
+        static inline unsigned int Bits(float f) {
+            unsigned int u;
+            memcpy(&u, &f, sizeof(u));
+            return u;
+        }
+
+        static inline float Float(unsigned int u) {
+            float f;
+            memcpy(&f, &u, sizeof(f));
+            return f;
+        }
+
+        // Write to the temporary journal, removing it and throwing if
+        // the write falls short.
+        static void Write(FILE* out, const void* data, size_t size,
+                          string tmp) {
+            if (fwrite(data, 1, size, out) != size) {
+                fclose(out);
+                remove(tmp.c_str());
+                throw ResourceException("could not write terrain edit journal: " + tmp);
+            }
+        }
+
+        // Rename, replacing a file at to.
+        static bool ReplaceJournal(const string& from, const string& to) {
+#ifdef _WIN32
+            return MoveFileExA(from.c_str(), to.c_str(),
+                               MOVEFILE_REPLACE_EXISTING |
+                               MOVEFILE_WRITE_THROUGH) != 0;
+#else
+            return rename(from.c_str(), to.c_str()) == 0;
+#endif
+        }
+
+        static unsigned int Checksum(const float* h, unsigned int n) {
+            unsigned int hash = 2166136261U;
+            for (unsigned int i = 0; i < n; ++i) {
+                unsigned int u = Bits(h[i]);
+                for (unsigned int b = 0; b < 4; ++b) {
+                    hash ^= (u >> (b * 8)) & 0xff;
+                    hash *= 16777619U;
+                }
+            }
+            return hash;
+        }
+
+        static void PutVarint(vector<unsigned char>& out, unsigned int v) {
+            while (v >= 0x80) {
+                out.push_back((v & 0x7f) | 0x80);
+                v >>= 7;
+            }
+            out.push_back(v);
+        }
+
+        static unsigned int GetVarint(const unsigned char*& in,
+                                      const unsigned char* end) {
+            unsigned int v = 0, shift = 0;
+            for (;;) {
+                // Five bytes hold 32 bits.
+                if (in == end || shift > 28)
+                    throw ResourceException("corrupt terrain edit delta");
+                unsigned char b = *in++;
+                v |= (b & 0x7f) << shift;
+                if (!(b & 0x80)) return v;
+                shift += 7;
+            }
+        }
+
+        /**
+         * Encode the change from one height array to another as pairs
+         * of a run of unchanged words and a run of literal words. A
+         * literal is the difference of the bit patterns, zigzag
+         * encoded as a varint. Heights close to each other have close
+         * bit patterns, so small edits take one to three bytes.
+         */
+        static void Encode(const float* a, const float* b, unsigned int n,
+                           vector<unsigned char>& out) {
+            out.clear();
+            unsigned int i = 0;
+            while (i < n) {
+                unsigned int zeros = 0;
+                while (i + zeros < n && Bits(a[i + zeros]) == Bits(b[i + zeros]))
+                    ++zeros;
+                i += zeros;
+                unsigned int literals = 0;
+                while (i + literals < n && Bits(a[i + literals]) != Bits(b[i + literals]))
+                    ++literals;
+                PutVarint(out, zeros);
+                PutVarint(out, literals);
+                for (unsigned int k = 0; k < literals; ++k) {
+                    unsigned int d = Bits(b[i + k]) - Bits(a[i + k]);
+                    PutVarint(out, (d << 1) ^ (0 - (d >> 31)));
+                }
+                i += literals;
+            }
+        }
+
+        /**
+         * Apply an encoded delta to an array of n heights, turning the
+         * heights before the edit into those after it, or back. The
+         * bit patterns wrap around, so both ways are exact. Throws if
+         * the delta does not fit the array.
+         */
+        static void Decode(const vector<unsigned char>& data, float* h,
+                           unsigned int n, bool forward) {
+            if (data.empty()) return;
+            const unsigned char* in = &data[0];
+            const unsigned char* end = in + data.size();
+            unsigned int i = 0;
+            while (in < end) {
+                unsigned int zeros = GetVarint(in, end);
+                unsigned int literals = GetVarint(in, end);
+                if (zeros > n - i || literals > n - i - zeros)
+                    throw ResourceException("corrupt terrain edit delta");
+                i += zeros;
+                for (unsigned int k = 0; k < literals; ++k, ++i) {
+                    unsigned int z = GetVarint(in, end);
+                    unsigned int d = (z >> 1) ^ (0 - (z & 1));
+                    h[i] = Float(forward ? Bits(h[i]) + d : Bits(h[i]) - d);
+                }
+            }
+        }
+
+        unsigned long long TerrainEditJournal::Step::Size() const {
+            unsigned long long s = sizeof(Step);
+            for (unsigned int i = 0; i < deltas.size(); ++i)
+                s += sizeof(Delta) + deltas[i].data.size();
+            return s;
+        }
+
+        TerrainEditJournal::TerrainEditJournal(TerrainEditor& editor,
+                                               unsigned long long budget)
+            : editor(editor), budget(budget), size(0),
+              dropped(0), applying(false) {}
+
+        void TerrainEditJournal::Handle(TerrainEditEventArg arg) {
+            if (applying) return;
+
+            for (unsigned int i = 0; i < redo.size(); ++i)
+                size -= redo[i].Size();
+            redo.clear();
+
+            if (undo.empty() || undo.back().batch != arg.batch) {
+                undo.push_back(Step());
+                undo.back().batch = arg.batch;
+                size += sizeof(Step);
+            }
+
+            unsigned int n = arg.region.width * arg.region.depth;
+            Step& step = undo.back();
+            step.deltas.push_back(Delta());
+            Delta& d = step.deltas.back();
+            d.region = arg.region;
+            d.checksum = Checksum(arg.after, n);
+            Encode(arg.before, arg.after, n, d.data);
+            size += sizeof(Delta) + d.data.size();
+            Trim();
+        }
+
+        void TerrainEditJournal::Trim() {
+            // The step being recorded is never dropped.
+            while (size > budget && undo.size() > 1) {
+                size -= undo.front().Size();
+                undo.pop_front();
+                ++dropped;
+            }
+        }
+
+        void TerrainEditJournal::Apply(Step& step, bool forward) {
+            IHeightField* terrain = editor.GetTerrain();
+            applying = true;
+            for (unsigned int k = 0; k < step.deltas.size(); ++k) {
+                // Regions are written back in reverse order on undo,
+                // in case a later region of the step overlaps them.
+                Delta& d = step.deltas[forward ? k : step.deltas.size() - 1 - k];
+                const TerrainRegion& r = d.region;
+                heights.resize(r.width * r.depth);
+                for (unsigned int j = 0; j < r.depth; ++j)
+                    for (unsigned int i = 0; i < r.width; ++i)
+                        heights[j * r.width + i] = terrain->GetHeight(r.x + i, r.z + j);
+                Decode(d.data, &heights[0], heights.size(), forward);
+                editor.Write(r, &heights[0]);
+            }
+            applying = false;
+        }
+
+        unsigned int TerrainEditJournal::BaseChecksum() {
+            // The heights with every step undone, without touching
+            // the terrain.
+            editor.Flush();
+            IHeightField* terrain = editor.GetTerrain();
+            unsigned int w = editor.GetWidth(), d = editor.GetDepth();
+            vector<float> base(w * d);
+            for (unsigned int z = 0; z < d; ++z)
+                for (unsigned int x = 0; x < w; ++x)
+                    base[z * w + x] = terrain->GetHeight(x, z);
+            for (unsigned int s = undo.size(); s-- > 0; )
+                for (unsigned int k = undo[s].deltas.size(); k-- > 0; ) {
+                    const Delta& delta = undo[s].deltas[k];
+                    const TerrainRegion& r = delta.region;
+                    heights.resize(r.width * r.depth);
+                    for (unsigned int j = 0; j < r.depth; ++j)
+                        memcpy(&heights[j * r.width], &base[(r.z + j) * w + r.x],
+                               r.width * sizeof(float));
+                    Decode(delta.data, &heights[0], heights.size(), false);
+                    for (unsigned int j = 0; j < r.depth; ++j)
+                        memcpy(&base[(r.z + j) * w + r.x], &heights[j * r.width],
+                               r.width * sizeof(float));
+                }
+            return Checksum(&base[0], base.size());
+        }
+
+        bool TerrainEditJournal::Undo() {
+            if (undo.empty()) return false;
+            // Queued strokes were made on top of the current heights.
+            editor.Flush();
+            if (undo.empty()) return false;
+            Apply(undo.back(), false);
+            redo.push_back(undo.back());
+            undo.pop_back();
+            return true;
+        }
+
+        bool TerrainEditJournal::Redo() {
+            if (redo.empty()) return false;
+            editor.Flush();
+            if (redo.empty()) return false;
+            Apply(redo.back(), true);
+            undo.push_back(redo.back());
+            redo.pop_back();
+            return true;
+        }
+
+        void TerrainEditJournal::Save(string file) {
+            // Written next to the journal and renamed over it, so a
+            // failed save leaves the last good journal in place.
+            string tmp = file + ".partial";
+            FILE* out = fopen(tmp.c_str(), "wb");
+            if (out == NULL)
+                throw ResourceException("could not write terrain edit journal: " + tmp);
+            unsigned int w = editor.GetWidth(), d = editor.GetDepth();
+            unsigned int base = BaseChecksum();
+            unsigned int steps = undo.size();
+            Write(out, MAGIC, sizeof(MAGIC), tmp);
+            Write(out, &w, sizeof(w), tmp);
+            Write(out, &d, sizeof(d), tmp);
+            Write(out, &base, sizeof(base), tmp);
+            Write(out, &steps, sizeof(steps), tmp);
+            for (unsigned int s = 0; s < steps; ++s) {
+                const Step& step = undo[s];
+                unsigned int deltas = step.deltas.size();
+                Write(out, &deltas, sizeof(deltas), tmp);
+                for (unsigned int i = 0; i < deltas; ++i) {
+                    const Delta& delta = step.deltas[i];
+                    unsigned int bytes = delta.data.size();
+                    Write(out, &delta.region.x, 2 * sizeof(int), tmp);
+                    Write(out, &delta.region.width, sizeof(unsigned int), tmp);
+                    Write(out, &delta.region.depth, sizeof(unsigned int), tmp);
+                    Write(out, &delta.checksum, sizeof(unsigned int), tmp);
+                    Write(out, &bytes, sizeof(bytes), tmp);
+                    if (bytes)
+                        Write(out, &delta.data[0], bytes, tmp);
+                }
+            }
+            // Buffered data is written out by fclose, so a full disk
+            // may only show up here.
+            if (fclose(out) != 0) {
+                remove(tmp.c_str());
+                throw ResourceException("could not write terrain edit journal: " + tmp);
+            }
+            if (!ReplaceJournal(tmp, file)) {
+                remove(tmp.c_str());
+                throw ResourceException("could not replace terrain edit journal: " + file);
+            }
+            logger.info << "saved " << steps << " terrain edits to " << file
+                        << " (" << dropped << " older edits dropped)" << logger.end;
+        }
+
+        unsigned int TerrainEditJournal::Replay(string file) {
+            FILE* in = fopen(file.c_str(), "rb");
+            if (in == NULL)
+                throw ResourceException("could not open terrain edit journal: " + file);
+            char magic[8];
+            unsigned int w, d, base, steps;
+            if (fread(magic, sizeof(magic), 1, in) != 1 ||
+                memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+                fread(&w, sizeof(w), 1, in) != 1 ||
+                fread(&d, sizeof(d), 1, in) != 1 ||
+                fread(&base, sizeof(base), 1, in) != 1 ||
+                fread(&steps, sizeof(steps), 1, in) != 1 ||
+                w != editor.GetWidth() || d != editor.GetDepth()) {
+                fclose(in);
+                throw ResourceException("invalid terrain edit journal: " + file);
+            }
+
+            std::deque<Step> loaded;
+            bool ok = true;
+            for (unsigned int s = 0; s < steps && ok; ++s) {
+                unsigned int deltas;
+                ok = fread(&deltas, sizeof(deltas), 1, in) == 1;
+                loaded.push_back(Step());
+                loaded.back().batch = 0;
+                for (unsigned int i = 0; i < deltas && ok; ++i) {
+                    Delta delta;
+                    unsigned int bytes;
+                    ok = fread(&delta.region.x, sizeof(int), 2, in) == 2 &&
+                        fread(&delta.region.width, sizeof(unsigned int), 1, in) == 1 &&
+                        fread(&delta.region.depth, sizeof(unsigned int), 1, in) == 1 &&
+                        fread(&delta.checksum, sizeof(unsigned int), 1, in) == 1 &&
+                        fread(&bytes, sizeof(bytes), 1, in) == 1;
+                    if (!ok) break;
+                    TerrainRegion c = delta.region.Clip(w, d);
+                    ok = c.x == delta.region.x && c.z == delta.region.z &&
+                        c.width == delta.region.width && c.depth == delta.region.depth;
+                    // At most two varints per run and one per height.
+                    unsigned long long n = (unsigned long long)c.width * c.depth;
+                    ok = ok && bytes <= 15 * (n + 1);
+                    if (!ok) break;
+                    delta.data.resize(bytes);
+                    if (ok && bytes)
+                        ok = fread(&delta.data[0], 1, bytes, in) == bytes;
+                    loaded.back().deltas.push_back(delta);
+                }
+            }
+            fclose(in);
+            if (!ok)
+                throw ResourceException("truncated terrain edit journal: " + file);
+            // Every delta must fit its region before the terrain is
+            // touched.
+            for (unsigned int s = 0; s < loaded.size(); ++s)
+                for (unsigned int i = 0; i < loaded[s].deltas.size(); ++i) {
+                    const Delta& delta = loaded[s].deltas[i];
+                    heights.assign(delta.region.width * delta.region.depth, 0.0f);
+                    try {
+                        Decode(delta.data, heights.empty() ? NULL : &heights[0],
+                               heights.size(), true);
+                    } catch (ResourceException&) {
+                        throw ResourceException("corrupt terrain edit journal: " + file);
+                    }
+                }
+
+            if (BaseChecksum() != base)
+                throw ResourceException("terrain edit journal was recorded on other heights: "
+                                        + file);
+
+            while (Undo());
+            undo.clear();
+            redo.clear();
+            size = 0;
+            dropped = 0;
+
+            Utils::Timer timer;
+            timer.Start();
+            unsigned int mismatches = 0, regions = 0;
+            for (unsigned int s = 0; s < loaded.size(); ++s) {
+                Step& step = loaded[s];
+                Apply(step, true);
+                for (unsigned int i = 0; i < step.deltas.size(); ++i) {
+                    const TerrainRegion& r = step.deltas[i].region;
+                    heights.resize(r.width * r.depth);
+                    for (unsigned int j = 0; j < r.depth; ++j)
+                        for (unsigned int k = 0; k < r.width; ++k)
+                            heights[j * r.width + k] =
+                                editor.GetTerrain()->GetHeight(r.x + k, r.z + j);
+                    if (Checksum(&heights[0], heights.size()) != step.deltas[i].checksum)
+                        ++mismatches;
+                    ++regions;
+                }
+                undo.push_back(step);
+                size += step.Size();
+            }
+            Trim();
+            logger.info << "replayed " << loaded.size() << " terrain edits ("
+                        << regions << " regions) in "
+                        << timer.GetElapsedTime().AsInt() / 1000.0 << " ms, "
+                        << mismatches << " mismatches" << logger.end;
+            return mismatches;
+        }
+
+    }
+}
@@ -0,0 +1,103 @@
+// Terrain edit journal.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TERRAIN_EDIT_JOURNAL_H_
+#define _TERRAIN_EDIT_JOURNAL_H_
+
+#include "TerrainEditor.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::string;
+
+        /**
+         * Undo and redo for a terrain editor.
+         *
+         * Every region the editor writes is stored as the difference
+         * of the bit patterns of the heights before and after, packed
+         * as varints, with runs of unchanged heights run length
+         * encoded. The difference works both ways, so undo and redo
+         * are exact and only touch the region itself. The regions of
+         * one flush are undone as one step.
+         *
+         * The oldest steps are dropped when the journal grows past
+         * its memory budget.
+         */
+        class TerrainEditJournal
+            : public Core::IListener<TerrainEditEventArg> {
+            struct Delta {
+                TerrainRegion region;
+                std::vector<unsigned char> data;
+                // Checksum of the heights after the edit.
+                unsigned int checksum;
+            };
+            struct Step {
+                unsigned int batch;
+                std::vector<Delta> deltas;
+                unsigned long long Size() const;
+            };
+
+            TerrainEditor& editor;
+            unsigned long long budget, size;
+            std::deque<Step> undo, redo;
+            std::vector<float> heights;
+            unsigned int dropped;
+            bool applying;
+
+            void Apply(Step& step, bool forward);
+            void Trim();
+            unsigned int BaseChecksum();
+
+        public:
+            /**
+             * @param budget Bytes of compressed deltas to keep.
+             */
+            TerrainEditJournal(TerrainEditor& editor,
+                               unsigned long long budget = 64 << 20);
+
+            void Handle(TerrainEditEventArg arg);
+
+            bool Undo();
+            bool Redo();
+
+            /**
+             * Write the steps that can be undone to a file, oldest
+             * first, with a checksum of the heights before the oldest
+             * one.
+             */
+            void Save(string file);
+
+            /**
+             * Undo everything, then redo the steps of a saved
+             * journal one at a time, checking each region against
+             * the checksum recorded when it was edited. Returns the
+             * number of mismatching regions, which is zero when the
+             * session replays exactly.
+             *
+             * The deltas only make sense on the heights they were
+             * recorded on, so a journal is refused unless undoing
+             * everything gives the heights it starts from.
+             */
+            unsigned int Replay(string file);
+
+            unsigned int GetUndoSteps() const { return undo.size(); }
+            unsigned int GetRedoSteps() const { return redo.size(); }
+            unsigned int GetDroppedSteps() const { return dropped; }
+            unsigned long long GetSize() const { return size; }
+        };
+
+    }
+}
+
+#endif
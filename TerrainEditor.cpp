@@ -0,0 +1,205 @@
+// Terrain editor.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "TerrainEditor.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::vector;
+
+        bool TerrainRegion::Overlaps(const TerrainRegion& o) const {
+            return x < o.x + (int)o.width && o.x < x + (int)width &&
+                z < o.z + (int)o.depth && o.z < z + (int)depth;
+        }
+
+        TerrainRegion TerrainRegion::Union(const TerrainRegion& o) const {
+            int x0 = std::min(x, o.x), z0 = std::min(z, o.z);
+            int x1 = std::max(x + (int)width, o.x + (int)o.width);
+            int z1 = std::max(z + (int)depth, o.z + (int)o.depth);
+            return TerrainRegion(x0, z0, x1 - x0, z1 - z0);
+        }
+
+        TerrainRegion TerrainRegion::Clip(unsigned int w, unsigned int d) const {
+            int x0 = std::max(x, 0), z0 = std::max(z, 0);
+            int x1 = std::min(x + (int)width, (int)w);
+            int z1 = std::min(z + (int)depth, (int)d);
+            if (x1 <= x0 || z1 <= z0) return TerrainRegion(x0, z0, 0, 0);
+            return TerrainRegion(x0, z0, x1 - x0, z1 - z0);
+        }
+
+        static TerrainRegion Grow(const TerrainRegion& r, int n) {
+            return TerrainRegion(r.x - n, r.z - n, r.width + 2 * n, r.depth + 2 * n);
+        }
+
+        TerrainEditor::TerrainEditor(IHeightField* terrain,
+                                     unsigned int width, unsigned int depth)
+            : terrain(terrain), width(width), depth(depth), regionsWritten(0),
+              batches(0), flushing(false) {}
+
+        void TerrainEditor::Apply(const Brush& brush, float x, float z) {
+            Stroke s;
+            s.brush = brush;
+            s.x = x;
+            s.z = z;
+            int x0 = (int)floor(x - brush.radius);
+            int z0 = (int)floor(z - brush.radius);
+            int x1 = (int)ceil(x + brush.radius);
+            int z1 = (int)ceil(z + brush.radius);
+            s.bounds = TerrainRegion(x0, z0, x1 - x0 + 1, z1 - z0 + 1).Clip(width, depth);
+            if (!s.bounds.IsEmpty())
+                strokes.push_back(s);
+        }
+
+        void TerrainEditor::Fill(int x, int z, unsigned int w, unsigned int d,
+                                 float height) {
+            Stroke s;
+            s.brush = Brush(FILL, 0.0f, 1.0f, 0.0f, height);
+            s.x = x;
+            s.z = z;
+            s.bounds = TerrainRegion(x, z, w, d).Clip(width, depth);
+            if (!s.bounds.IsEmpty())
+                strokes.push_back(s);
+        }
+
+        float TerrainEditor::Weight(const Stroke& s, int x, int z) const {
+            if (s.brush.mode == FILL) return 1.0f;
+            float dx = x - s.x, dz = z - s.z;
+            float d = sqrt(dx * dx + dz * dz);
+            float r = s.brush.radius;
+            if (d >= r) return 0.0f;
+            float inner = r * (1.0f - s.brush.falloff);
+            if (d <= inner) return 1.0f;
+            float t = (r - d) / (r - inner);
+            return t * t * (3.0f - 2.0f * t);
+        }
+
+        void TerrainEditor::Read(const TerrainRegion& r, vector<float>& out) {
+            out.resize(r.width * r.depth);
+            for (unsigned int j = 0; j < r.depth; ++j)
+                for (unsigned int i = 0; i < r.width; ++i)
+                    out[j * r.width + i] = terrain->GetHeight(r.x + i, r.z + j);
+        }
+
+        void TerrainEditor::ApplyStroke(const Stroke& s, const TerrainRegion& halo,
+                                        const vector<float>& src,
+                                        vector<float>& dst) {
+            const Brush& b = s.brush;
+            const int hw = halo.width;
+            for (int z = s.bounds.z; z < s.bounds.z + (int)s.bounds.depth; ++z)
+                for (int x = s.bounds.x; x < s.bounds.x + (int)s.bounds.width; ++x) {
+                    float w = Weight(s, x, z);
+                    if (w <= 0.0f) continue;
+                    int i = (z - halo.z) * hw + (x - halo.x);
+                    float h = src[i];
+                    switch (b.mode) {
+                    case RAISE:   h += b.strength * w; break;
+                    case LOWER:   h -= b.strength * w; break;
+                    case FLATTEN: h += (b.target - h) * b.strength * w; break;
+                    case FILL:    h = b.target; break;
+                    case SMOOTH: {
+                        float sum = 0.0f;
+                        unsigned int n = 0;
+                        for (int dz = -1; dz <= 1; ++dz)
+                            for (int dx = -1; dx <= 1; ++dx) {
+                                int sx = x + dx - halo.x, sz = z + dz - halo.z;
+                                if (sx < 0 || sz < 0 || sx >= hw || sz >= (int)halo.depth)
+                                    continue;
+                                sum += src[sz * hw + sx];
+                                ++n;
+                            }
+                        h += (sum / n - h) * b.strength * w;
+                        break;
+                    }
+                    }
+                    dst[i] = h;
+                }
+        }
+
+        void TerrainEditor::Flush() {
+            if (strokes.empty()) return;
+
+            // Coalesce the stroke bounds into disjoint regions. Regions
+            // closer than the smoothing halo are merged too, so no
+            // stroke reads heights another region is about to change.
+            vector<TerrainRegion> regions;
+            for (unsigned int s = 0; s < strokes.size(); ++s) {
+                TerrainRegion r = strokes[s].bounds;
+                bool merged = true;
+                while (merged) {
+                    merged = false;
+                    for (unsigned int i = 0; i < regions.size(); ++i)
+                        if (Grow(regions[i], 1).Overlaps(r)) {
+                            r = r.Union(regions[i]);
+                            regions.erase(regions.begin() + i);
+                            merged = true;
+                            break;
+                        }
+                }
+                regions.push_back(r);
+            }
+
+            ++batches;
+            flushing = true;
+            vector<float> src, dst;
+            for (unsigned int i = 0; i < regions.size(); ++i) {
+                const TerrainRegion& r = regions[i];
+                TerrainRegion halo = Grow(r, 1).Clip(width, depth);
+                Read(halo, src);
+                dst = src;
+
+                // Strokes are applied in the order they were made. A
+                // stroke only writes inside its bounds, so copying
+                // those back keeps src equal to dst for the next one.
+                for (unsigned int s = 0; s < strokes.size(); ++s) {
+                    const TerrainRegion& b = strokes[s].bounds;
+                    if (!b.Overlaps(r)) continue;
+                    ApplyStroke(strokes[s], halo, src, dst);
+                    for (unsigned int j = 0; j < b.depth; ++j) {
+                        unsigned int row = (b.z - halo.z + j) * halo.width + (b.x - halo.x);
+                        std::copy(dst.begin() + row, dst.begin() + row + b.width,
+                                  src.begin() + row);
+                    }
+                }
+
+                after.resize(r.width * r.depth);
+                for (unsigned int j = 0; j < r.depth; ++j)
+                    for (unsigned int k = 0; k < r.width; ++k)
+                        after[j * r.width + k] =
+                            dst[(r.z - halo.z + j) * halo.width + (r.x - halo.x + k)];
+                Write(r, &after[0]);
+            }
+            flushing = false;
+            strokes.clear();
+        }
+
+        void TerrainEditor::Write(const TerrainRegion& region, const float* heights) {
+            if (!flushing) ++batches;
+            Read(region, before);
+            vector<float> h(heights, heights + region.width * region.depth);
+            terrain->SetHeights(region.x, region.z, region.width, region.depth, &h[0]);
+            ++regionsWritten;
+
+            TerrainEditEventArg arg;
+            arg.region = region;
+            arg.before = &before[0];
+            arg.after = &h[0];
+            arg.batch = batches;
+            editEvent.Notify(arg);
+        }
+
+        void TerrainEditor::Handle(Core::ProcessEventArg arg) {
+            Flush();
+        }
+
+    }
+}
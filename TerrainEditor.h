@@ -0,0 +1,152 @@
+// Terrain editor.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TERRAIN_EDITOR_H_
+#define _TERRAIN_EDITOR_H_
+
+#include <Core/IListener.h>
+#include <Core/EngineEvents.h>
+#include <Core/Event.h>
+
+#include "HeightField.h"
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * A rectangle of height map vertices.
+         */
+        struct TerrainRegion {
+            int x, z;
+            unsigned int width, depth;
+
+            TerrainRegion() : x(0), z(0), width(0), depth(0) {}
+            TerrainRegion(int x, int z, unsigned int width, unsigned int depth)
+                : x(x), z(z), width(width), depth(depth) {}
+
+            bool Overlaps(const TerrainRegion& o) const;
+            TerrainRegion Union(const TerrainRegion& o) const;
+            TerrainRegion Clip(unsigned int w, unsigned int d) const;
+            bool IsEmpty() const { return width == 0 || depth == 0; }
+        };
+
+        /**
+         * Sent once for every region written to the terrain. Both
+         * height arrays are width * depth, x varying fastest. All
+         * regions written by one flush share the batch number.
+         */
+        struct TerrainEditEventArg {
+            TerrainRegion region;
+            const float* before;
+            const float* after;
+            unsigned int batch;
+        };
+
+        /**
+         * Brush based editing of a height field.
+         *
+         * Strokes are queued and flushed once per frame. On flush the
+         * bounding rectangles of the strokes are coalesced, each
+         * rectangle is read once, all strokes inside it are applied,
+         * and it is written back with a single SetHeights call, so
+         * normals and morph deltas are only recomputed for the
+         * patches under the brushes.
+         */
+        class TerrainEditor
+            : public Core::IListener<Core::ProcessEventArg> {
+        public:
+            enum BrushMode { RAISE, LOWER, FLATTEN, SMOOTH, FILL };
+
+            struct Brush {
+                BrushMode mode;
+                float radius;
+                // Height per stroke for RAISE and LOWER, blend factor
+                // in [0, 1] for FLATTEN and SMOOTH.
+                float strength;
+                // Fraction of the radius over which the brush fades
+                // out. 0 is a hard edge.
+                float falloff;
+                // Target height for FLATTEN and FILL.
+                float target;
+
+                Brush(BrushMode mode = RAISE, float radius = 8.0f,
+                      float strength = 1.0f, float falloff = 0.5f,
+                      float target = 0.0f)
+                    : mode(mode), radius(radius), strength(strength),
+                      falloff(falloff), target(target) {}
+            };
+
+        private:
+            struct Stroke {
+                Brush brush;
+                float x, z;
+                TerrainRegion bounds;
+            };
+
+            IHeightField* terrain;
+            unsigned int width, depth;
+            std::vector<Stroke> strokes;
+            std::vector<float> before, after;
+            Core::Event<TerrainEditEventArg> editEvent;
+            unsigned int regionsWritten;
+            unsigned int batches;
+            bool flushing;
+
+            float Weight(const Stroke& s, int x, int z) const;
+            void Read(const TerrainRegion& r, std::vector<float>& out);
+            void ApplyStroke(const Stroke& s, const TerrainRegion& halo,
+                             const std::vector<float>& src,
+                             std::vector<float>& dst);
+
+        public:
+            /**
+             * @param width, depth Size of the height map in vertices.
+             */
+            TerrainEditor(IHeightField* terrain,
+                          unsigned int width, unsigned int depth);
+
+            /**
+             * Queue a brush stroke centered at (x, z) in height map
+             * vertex coordinates.
+             */
+            void Apply(const Brush& brush, float x, float z);
+
+            /**
+             * Queue setting a rectangle to a constant height.
+             */
+            void Fill(int x, int z, unsigned int w, unsigned int d, float height);
+
+            /**
+             * Write all queued strokes to the terrain.
+             */
+            void Flush();
+
+            void Handle(Core::ProcessEventArg arg);
+
+            /**
+             * Write heights to a region directly, bypassing the
+             * brushes. Sends an edit event like a flush does, in a
+             * batch of its own.
+             */
+            void Write(const TerrainRegion& region, const float* heights);
+
+            Core::IEvent<TerrainEditEventArg>& EditEvent() { return editEvent; }
+
+            IHeightField* GetTerrain() { return terrain; }
+            unsigned int GetWidth() const { return width; }
+            unsigned int GetDepth() const { return depth; }
+            unsigned int GetRegionsWritten() const { return regionsWritten; }
+        };
+
+    }
+}
+
+#endif
@@ -7,32 +7,48 @@
 // See the GNU General Public License for more details (see LICENSE). 
 //--------------------------------------------------------------------
 
-#include <Scene/HeightMapNode.h>
 #include "TerrainHandler.h"
 
-TerrainHandler::TerrainHandler(HeightMapNode* node)
-    : terrain(node){
+#include <Logging/Logger.h>
+#include <Resources/Exceptions.h>
+
+TerrainHandler::TerrainHandler(TerrainEditor& editor, TerrainEditJournal& journal,
+                               std::string journalFile)
+    : editor(editor), journal(journal), brush(TerrainEditor::RAISE, 1.0f, 10.0f, 0.0f),
+      journalFile(journalFile) {
     
 }
 
 void TerrainHandler::Handle(KeyboardEventArg arg){
-    if (arg.type == EVENT_PRESS && arg.sym == KEY_u){
-        terrain->SetVertex(128,128, terrain->GetVertex(128, 128)[1] + 10);
-        terrain->SetVertex(128,129, terrain->GetVertex(128, 129)[1] + 10);
-        terrain->SetVertex(129,128, terrain->GetVertex(129, 128)[1] + 10);
-        terrain->SetVertex(129,129, terrain->GetVertex(129, 129)[1] + 10);
+    if (arg.type != EVENT_PRESS) return;
+
+    // A hard brush of radius 1 at (128.5, 128.5) covers the 2x2
+    // vertices from (128, 128), and moves them by 10 like the keys
+    // always have.
+    if (arg.sym == KEY_u){
+        brush.mode = TerrainEditor::RAISE;
+        editor.Apply(brush, 128.5, 128.5);
+    }
+    if (arg.sym == KEY_i){
+        brush.mode = TerrainEditor::LOWER;
+        editor.Apply(brush, 128.5, 128.5);
     }
-    if (arg.type == EVENT_PRESS && arg.sym == KEY_i){
-        terrain->SetVertex(128,128, terrain->GetVertex(128, 128)[1] - 10);
-        terrain->SetVertex(128,129, terrain->GetVertex(128, 129)[1] - 10);
-        terrain->SetVertex(129,128, terrain->GetVertex(129, 128)[1] - 10);
-        terrain->SetVertex(129,129, terrain->GetVertex(129, 129)[1] - 10);
+    if (arg.sym == KEY_o)
+        editor.Apply(TerrainEditor::Brush(TerrainEditor::SMOOTH, 8.0f, 1.0f, 0.5f),
+                     128.5, 128.5);
+    if (arg.sym == KEY_r){
+        editor.Fill(57, 57, 8, 8, 70);
     }
-    if (arg.type == EVENT_PRESS && arg.sym == KEY_r){
-        float* hat = new float[64];
-        for (int i = 0; i < 64; ++i)
-            hat[i] = 70;
-        terrain->SetVertices(57, 57, 8, 8, hat);
-        //terrain->SetVertices(-1, -1, 3, 3, hat);
+    if (arg.sym == KEY_z)
+        journal.Undo();
+    if (arg.sym == KEY_y)
+        journal.Redo();
+    try {
+        if (arg.sym == KEY_j)
+            journal.Save(journalFile);
+        if (arg.sym == KEY_p)
+            journal.Replay(journalFile);
+    } catch (OpenEngine::Resources::ResourceException& e) {
+        logger.error << e.what() << logger.end;
     }
 }
@@ -9,20 +9,21 @@
 
 #include <Devices/IKeyboard.h>
 
-namespace OpenEngine {
-    namespace Scene {
-        class HeightMapNode;
-    }
-}
+#include "TerrainEditor.h"
+#include "TerrainEditJournal.h"
 
 using namespace OpenEngine::Devices;
-using namespace OpenEngine::Scene;
+using namespace OpenEngine::Utils;
 
 class TerrainHandler : public IListener<KeyboardEventArg> {
 private:
-    HeightMapNode* terrain;
+    TerrainEditor& editor;
+    TerrainEditJournal& journal;
+    TerrainEditor::Brush brush;
+    std::string journalFile;
 public:
-    TerrainHandler(HeightMapNode* node);
+    TerrainHandler(TerrainEditor& editor, TerrainEditJournal& journal,
+                   std::string journalFile);
     ~TerrainHandler() {}
 
     void Handle(KeyboardEventArg arg);
@@ -0,0 +1,249 @@
+// Terrain patch culler.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "TerrainPatchCuller.h"
+
+#include <Math/Matrix.h>
+
+#include "ParallelRange.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Math::Matrix;
+        using Math::Vector;
+
+        static const float PI = 3.14159265f;
+
+        /**
+         * Measures the height bounds of rows of patches.
+         */
+        class PatchBoundsJob : public IRangeJob {
+            IHeightField* terrain;
+            int width, depth, squares;
+            const TerrainRegion& patches;
+        public:
+            std::vector<float> minY, maxY;
+
+            PatchBoundsJob(IHeightField* terrain, int width, int depth,
+                           int squares, const TerrainRegion& patches)
+                : terrain(terrain), width(width), depth(depth), squares(squares),
+                  patches(patches), minY(patches.width * patches.depth),
+                  maxY(patches.width * patches.depth) {}
+
+            void Run(unsigned int begin, unsigned int end) {
+                for (unsigned int row = begin; row < end; ++row)
+                    for (unsigned int col = 0; col < patches.width; ++col) {
+                        unsigned int p = row * patches.width + col;
+                        int x0 = (patches.x + col) * squares;
+                        int z0 = (patches.z + row) * squares;
+                        int x1 = std::min(x0 + squares, width - 1);
+                        int z1 = std::min(z0 + squares, depth - 1);
+                        minY[p] = 1e30f;
+                        maxY[p] = -1e30f;
+                        for (int z = z0; z <= z1; ++z)
+                            for (int x = x0; x <= x1; ++x) {
+                                float h = terrain->GetHeight(x, z);
+                                minY[p] = std::min(minY[p], h);
+                                maxY[p] = std::max(maxY[p], h);
+                            }
+                    }
+            }
+        };
+
+        // A patch inside the frustum, with its horizontal distances
+        // and the directions it covers as seen from the camera.
+        struct Candidate {
+            float dmin, dmax;
+            float a0, a1;
+            unsigned int index;
+            bool operator<(const Candidate& c) const { return dmin < c.dmin; }
+        };
+
+        TerrainPatchCuller::TerrainPatchCuller(IHeightField* terrain,
+                                               unsigned int width, unsigned int depth,
+                                               unsigned int squares)
+            : terrain(terrain), width(width), depth(depth),
+              squares(std::max(1u, squares)), horizon(BINS),
+              frustumCulled(0), horizonCulled(0), drawn(0), horizonTest(true) {
+            columns = (width - 1 + this->squares - 1) / this->squares;
+            rows = (depth - 1 + this->squares - 1) / this->squares;
+            bounds.resize(columns * rows);
+            visible.resize(columns * rows, true);
+            Measure(TerrainRegion(0, 0, columns, rows));
+        }
+
+        void TerrainPatchCuller::Measure(const TerrainRegion& patches) {
+            PatchBoundsJob job(terrain, width, depth, squares, patches);
+            ParallelRange::Run(job, patches.depth);
+            for (unsigned int row = 0; row < patches.depth; ++row)
+                for (unsigned int col = 0; col < patches.width; ++col) {
+                    Bounds& b = bounds[(patches.z + row) * columns + patches.x + col];
+                    b.minY = job.minY[row * patches.width + col];
+                    b.maxY = job.maxY[row * patches.width + col];
+                }
+        }
+
+        float TerrainPatchCuller::GroundHeight(float x, float z) {
+            // Outside the map the terrain can be seen from below, so
+            // there is no ground to stand on.
+            float ws = terrain->GetWidthScale();
+            if (x < 0.0f || z < 0.0f || (width - 1) * ws < x || (depth - 1) * ws < z)
+                return 1e30f;
+            int x0 = std::min(int(x / ws), int(width) - 2);
+            int z0 = std::min(int(z / ws), int(depth) - 2);
+            float h = terrain->GetHeight(x0, z0);
+            h = std::max(h, terrain->GetHeight(x0 + 1, z0));
+            h = std::max(h, terrain->GetHeight(x0, z0 + 1));
+            return std::max(h, terrain->GetHeight(x0 + 1, z0 + 1));
+        }
+
+        void TerrainPatchCuller::Cull(Display::IViewingVolume& view) {
+            // The frustum planes, from the columns of the view
+            // projection matrix.
+            Matrix<4, 4, float> m = view.GetViewMatrix() * view.GetProjectionMatrix();
+            float planes[6][4];
+            for (unsigned int i = 0; i < 4; ++i) {
+                planes[0][i] = m(i, 3) + m(i, 0);
+                planes[1][i] = m(i, 3) - m(i, 0);
+                planes[2][i] = m(i, 3) + m(i, 1);
+                planes[3][i] = m(i, 3) - m(i, 1);
+                planes[4][i] = m(i, 3) + m(i, 2);
+                planes[5][i] = m(i, 3) - m(i, 2);
+            }
+
+            Vector<3, float> offset = terrain->GetOffset();
+            Vector<3, float> eye = view.GetPosition();
+            float side = squares * terrain->GetWidthScale();
+            // The camera relative to the corner of the map.
+            float ex = eye[0] - offset[0], ez = eye[2] - offset[2];
+
+            frustumCulled = horizonCulled = drawn = 0;
+            std::vector<Candidate> candidates;
+            candidates.reserve(bounds.size());
+            for (unsigned int row = 0; row < rows; ++row)
+                for (unsigned int col = 0; col < columns; ++col) {
+                    unsigned int index = row * columns + col;
+                    const Bounds& b = bounds[index];
+                    float min[3] = { col * side + offset[0], b.minY, row * side + offset[2] };
+                    float max[3] = { min[0] + side, b.maxY, min[2] + side };
+                    bool inside = true;
+                    for (unsigned int i = 0; i < 6 && inside; ++i) {
+                        // The corner furthest along the plane normal.
+                        float d = planes[i][3];
+                        for (unsigned int j = 0; j < 3; ++j)
+                            d += planes[i][j] * (planes[i][j] < 0.0f ? min[j] : max[j]);
+                        inside = 0.0f <= d;
+                    }
+                    visible[index] = inside;
+                    if (!inside) {
+                        ++frustumCulled;
+                        continue;
+                    }
+
+                    Candidate c;
+                    c.index = index;
+                    float x0 = col * side - ex, z0 = row * side - ez;
+                    float x1 = x0 + side, z1 = z0 + side;
+                    float dx = std::max(std::max(x0, -x1), 0.0f);
+                    float dz = std::max(std::max(z0, -z1), 0.0f);
+                    c.dmin = sqrt(dx * dx + dz * dz);
+                    dx = std::max(fabsf(x0), fabsf(x1));
+                    dz = std::max(fabsf(z0), fabsf(z1));
+                    c.dmax = sqrt(dx * dx + dz * dz);
+                    c.a0 = c.a1 = 0.0f;
+                    if (0.0f < c.dmin) {
+                        // Corner directions relative to the center,
+                        // the patch spans less than half a turn.
+                        float center = atan2(z0 + z1, x0 + x1);
+                        float xs[4] = { x0, x1, x0, x1 }, zs[4] = { z0, z0, z1, z1 };
+                        c.a0 = c.a1 = center;
+                        for (unsigned int i = 0; i < 4; ++i) {
+                            float a = atan2(zs[i], xs[i]) - center;
+                            if (PI < a) a -= 2.0f * PI;
+                            if (a < -PI) a += 2.0f * PI;
+                            c.a0 = std::min(c.a0, center + a);
+                            c.a1 = std::max(c.a1, center + a);
+                        }
+                    }
+                    candidates.push_back(c);
+                }
+
+            // The horizon only holds when the camera is above the
+            // terrain, every ray below it then passes the surface.
+            if (!horizonTest || eye[1] <= GroundHeight(ex, ez)) {
+                drawn = candidates.size();
+                return;
+            }
+
+            std::sort(candidates.begin(), candidates.end());
+            horizon.assign(BINS, -1e30f);
+            const float binsPerRadian = BINS / (2.0f * PI);
+            // Patches not yet wholly nearer than the next candidate,
+            // by their furthest distance.
+            typedef std::pair<float, unsigned int> Pending;
+            std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending> > pending;
+            for (unsigned int i = 0; i < candidates.size(); ++i) {
+                const Candidate& c = candidates[i];
+                while (!pending.empty() && pending.top().first <= c.dmin) {
+                    // Raise the horizon over the directions the
+                    // patch covers entirely, with the lowest slope to
+                    // the top of its solid part.
+                    const Candidate& o = candidates[pending.top().second];
+                    pending.pop();
+                    float dy = bounds[o.index].minY - eye[1];
+                    float slope = dy / (0.0f < dy ? o.dmax : o.dmin);
+                    int b0 = int(ceil((o.a0 + PI) * binsPerRadian));
+                    int b1 = int(floor((o.a1 + PI) * binsPerRadian));
+                    for (int b = b0; b < b1; ++b) {
+                        float& h = horizon[(b + BINS) % BINS];
+                        h = std::max(h, slope);
+                    }
+                }
+                if (c.dmin <= 0.0f) {
+                    // The camera is over the patch.
+                    ++drawn;
+                    continue;
+                }
+
+                // The highest slope to the top of the patch.
+                float dy = bounds[c.index].maxY - eye[1];
+                float slope = dy / (0.0f < dy ? c.dmin : c.dmax);
+                int b0 = int(floor((c.a0 + PI) * binsPerRadian));
+                int b1 = int(floor((c.a1 + PI) * binsPerRadian));
+                bool hidden = true;
+                for (int b = b0; b <= b1 && hidden; ++b)
+                    hidden = slope < horizon[(b + BINS) % BINS];
+                if (hidden) {
+                    visible[c.index] = false;
+                    ++horizonCulled;
+                } else
+                    ++drawn;
+                pending.push(Pending(c.dmax, i));
+            }
+        }
+
+        void TerrainPatchCuller::Handle(TerrainEditEventArg arg) {
+            const TerrainRegion& r = arg.region;
+            // Patches share their border vertices.
+            int c0 = std::max(r.x - 1, 0) / int(squares);
+            int r0 = std::max(r.z - 1, 0) / int(squares);
+            int c1 = std::min((r.x + (int)r.width) / int(squares) + 1, int(columns));
+            int r1 = std::min((r.z + (int)r.depth) / int(squares) + 1, int(rows));
+            if (c0 < c1 && r0 < r1)
+                Measure(TerrainRegion(c0, r0, c1 - c0, r1 - r0));
+        }
+
+    }
+}
@@ -0,0 +1,105 @@
+// Terrain patch culler.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TERRAIN_PATCH_CULLER_H_
+#define _TERRAIN_PATCH_CULLER_H_
+
+#include <Core/IListener.h>
+#include <Display/IViewingVolume.h>
+
+#include "TerrainEditor.h"
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * Decides which patches of a height map need drawing.
+         *
+         * The height bounds of every patch are kept, and measured
+         * again for the patches under a terrain edit. Each frame the
+         * patch boxes are tested against the view frustum, and the
+         * patches left are tested front to back against a horizon:
+         * the lowest elevation, per direction around the camera, that
+         * is certainly below the terrain already passed. The terrain
+         * under a patch is solid up to its minimum height, so a patch
+         * raises the horizon over the directions it covers entirely,
+         * and a patch whose top is below the horizon over every
+         * direction it covers is hidden.
+         *
+         * A patch only raises the horizon for patches that are wholly
+         * further away than it, so the test never hides a patch that
+         * can be seen.
+         */
+        class TerrainPatchCuller
+            : public Core::IListener<TerrainEditEventArg> {
+        public:
+            // Directions the horizon is kept for.
+            static const unsigned int BINS = 1024;
+
+        private:
+            struct Bounds {
+                float minY, maxY;
+            };
+
+            IHeightField* terrain;
+            unsigned int width, depth, squares;
+            unsigned int columns, rows;
+            std::vector<Bounds> bounds;
+            std::vector<bool> visible;
+            std::vector<float> horizon;
+            unsigned int frustumCulled, horizonCulled, drawn;
+            bool horizonTest;
+
+            void Measure(const TerrainRegion& patches);
+            float GroundHeight(float x, float z);
+
+        public:
+            /**
+             * @param width, depth Size of the height map in vertices.
+             * @param squares Side of a patch in height map squares.
+             */
+            TerrainPatchCuller(IHeightField* terrain,
+                               unsigned int width, unsigned int depth,
+                               unsigned int squares = 32);
+
+            /**
+             * Cull the patches for a view.
+             */
+            void Cull(Display::IViewingVolume& view);
+
+            /**
+             * Measures the edited patches again, attach to the
+             * terrain editor edit event.
+             */
+            void Handle(TerrainEditEventArg arg);
+
+            bool IsVisible(unsigned int column, unsigned int row) const {
+                return visible[row * columns + column];
+            }
+
+            void SetHorizonTest(bool enabled) { horizonTest = enabled; }
+            bool GetHorizonTest() const { return horizonTest; }
+
+            unsigned int GetColumns() const { return columns; }
+            unsigned int GetRows() const { return rows; }
+
+            /**
+             * Patch counts of the last cull.
+             */
+            unsigned int GetFrustumCulled() const { return frustumCulled; }
+            unsigned int GetHorizonCulled() const { return horizonCulled; }
+            unsigned int GetDrawn() const { return drawn; }
+        };
+
+    }
+}
+
+#endif
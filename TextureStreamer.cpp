@@ -0,0 +1,335 @@
+// Texture streamer.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "TextureStreamer.h"
+
+#include <Core/Thread.h>
+#include <Logging/Logger.h>
+
+#include "ParallelRange.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <set>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        class TextureStreamer::Worker : public Core::Thread {
+            TextureStreamer& streamer;
+        public:
+            bool claimed, done;
+            Worker(TextureStreamer& streamer, bool claimed)
+                : streamer(streamer), claimed(claimed), done(false) {}
+            void Run() {
+                streamer.Work(*this);
+            }
+        };
+
+        TextureStreamer::TextureStreamer(unsigned int budget,
+                                         unsigned int buffers,
+                                         unsigned int threads)
+            : budget(budget), threads(threads ? threads : ParallelRange::GetThreadCount()),
+              buffers(std::max(1u, buffers), 0), nextBuffer(0),
+              initialized(false), usePBO(false), active(0),
+              pending(0), streamed(0), frames(0), bytes(0) {
+            timer.Start();
+        }
+
+        TextureStreamer::~TextureStreamer() {
+            std::deque<Job*> waiting;
+            lock.Lock();
+            // Workers stop after the texture they are decoding.
+            waiting.swap(decode);
+            lock.Unlock();
+            ReapWorkers(true);
+            if (usePBO) glDeleteBuffers(buffers.size(), &buffers[0]);
+            // A job waiting for its placeholder is in another queue
+            // as well.
+            std::set<Job*> jobs(waiting.begin(), waiting.end());
+            jobs.insert(added.begin(), added.end());
+            jobs.insert(decoded.begin(), decoded.end());
+            jobs.insert(uploads.begin(), uploads.end());
+            for (std::set<Job*>::iterator i = jobs.begin(); i != jobs.end(); ++i) {
+                delete (*i)->texture;
+                delete *i;
+            }
+        }
+
+        void TextureStreamer::Add(IStreamedTexture* texture,
+                                  Math::Vector<4, unsigned char> placeholder) {
+            Job* job = new Job();
+            job->texture = texture;
+            job->placeholder = placeholder;
+            job->placeholderID = job->id = 0;
+            job->slice = job->row = 0;
+            lock.Lock();
+            added.push_back(job);
+            decode.push_back(job);
+            ++pending;
+            StartWorkers();
+            lock.Unlock();
+        }
+
+        void TextureStreamer::StartWorkers() {
+            // The caller holds the lock.
+            for (unsigned int wanted = decode.size();
+                 active < wanted && active < threads; ) {
+                // The workers take their core from the budget the
+                // parallel ranges and the startup graph share. One
+                // runs without, so textures are decoded while the
+                // budget is used up, the others are started on a
+                // later frame once cores are given back.
+                bool claimed = ParallelRange::Claim(1) == 1;
+                if (!claimed && 0 < active) break;
+                Worker* w = new Worker(*this, claimed);
+                workers.push_back(w);
+                ++active;
+                w->Start();
+            }
+        }
+
+        void TextureStreamer::ReapWorkers(bool wait) {
+            lock.Lock();
+            std::vector<Worker*> finished;
+            for (unsigned int i = 0; i < workers.size(); ) {
+                if (wait || workers[i]->done) {
+                    finished.push_back(workers[i]);
+                    workers[i] = workers.back();
+                    workers.pop_back();
+                } else ++i;
+            }
+            lock.Unlock();
+            for (unsigned int i = 0; i < finished.size(); ++i) {
+                finished[i]->Wait();
+                delete finished[i];
+            }
+        }
+
+        void TextureStreamer::Work(Worker& worker) {
+            lock.Lock();
+            while (!decode.empty()) {
+                Job* job = decode.front();
+                decode.pop_front();
+                lock.Unlock();
+
+                string error;
+                try {
+                    job->texture->Decode();
+                } catch (std::exception& e) {
+                    error = e.what();
+                } catch (...) {
+                    error = "unknown error";
+                }
+
+                lock.Lock();
+                job->error = error;
+                decoded.push_back(job);
+            }
+            --active;
+            if (worker.claimed) ParallelRange::Release(1);
+            // The render thread reaps it.
+            worker.done = true;
+            lock.Unlock();
+        }
+
+        void TextureStreamer::CreatePlaceholder(Job* job) {
+            GLenum target = job->texture->GetTarget();
+            const Math::Vector<4, unsigned char>& c = job->placeholder;
+            unsigned char texel[4] = { c[0], c[1], c[2], c[3] };
+            glGenTextures(1, &job->placeholderID);
+            glBindTexture(target, job->placeholderID);
+            glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            if (target == GL_TEXTURE_2D)
+                glTexImage2D(target, 0, GL_RGBA8, 1, 1, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, texel);
+            else
+                glTexImage3D(target, 0, GL_RGBA8, 1, 1, 1, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, texel);
+            glBindTexture(target, 0);
+            CHECK_FOR_GL_ERROR();
+            job->texture->SetID(job->placeholderID);
+        }
+
+        void TextureStreamer::Handle(Renderers::RenderingEventArg arg) {
+            if (!initialized) {
+                initialized = true;
+                usePBO = GLEW_ARB_pixel_buffer_object;
+                if (usePBO) glGenBuffers(buffers.size(), &buffers[0]);
+                else
+                    logger.info << "no pixel buffer objects, textures are streamed "
+                                << "from client memory" << logger.end;
+            }
+
+            lock.Lock();
+            std::deque<Job*> newJobs, newUploads;
+            newJobs.swap(added);
+            newUploads.swap(decoded);
+            bool reap = active < workers.size();
+            StartWorkers();
+            lock.Unlock();
+            if (reap) ReapWorkers(false);
+
+            for (unsigned int i = 0; i < newJobs.size(); ++i)
+                CreatePlaceholder(newJobs[i]);
+            for (unsigned int i = 0; i < newUploads.size(); ++i) {
+                Job* job = newUploads[i];
+                if (job->error.empty()) {
+                    uploads.push_back(job);
+                    continue;
+                }
+                logger.warning << "could not stream " << job->texture->GetName()
+                               << ", keeping its placeholder: " << job->error
+                               << logger.end;
+                lock.Lock();
+                --pending;
+                lock.Unlock();
+                delete job->texture;
+                delete job;
+            }
+            if (uploads.empty()) return;
+
+            Upload();
+            ++frames;
+            if (pending == 0)
+                logger.info << "streamed " << streamed << " textures, "
+                            << bytes / (1 << 20) << " MB over " << frames
+                            << " frames, done after "
+                            << timer.GetElapsedTime().AsInt() / 1000 << " ms"
+                            << logger.end;
+        }
+
+        void TextureStreamer::Upload() {
+            std::vector<Band> bands;
+            std::vector<Job*> completed;
+            char* mapped = NULL;
+            if (usePBO) {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, buffers[nextBuffer]);
+                nextBuffer = (nextBuffer + 1) % buffers.size();
+                // Orphan the last contents of the buffer rather than
+                // wait for their upload to finish.
+                glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, budget, NULL, GL_STREAM_DRAW);
+                mapped = (char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY);
+                if (mapped == NULL) {
+                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+                    logger.warning << "could not map a pixel buffer, textures are "
+                                   << "streamed from client memory" << logger.end;
+                    usePBO = false;
+                }
+            }
+
+            unsigned int used = 0;
+            while (!uploads.empty()) {
+                Job* job = uploads.front();
+                IStreamedTexture* texture = job->texture;
+                if (job->id == 0) {
+                    glGenTextures(1, &job->id);
+                    glBindTexture(texture->GetTarget(), job->id);
+                    texture->Allocate();
+                    glBindTexture(texture->GetTarget(), 0);
+                }
+                if (job->slice == texture->GetSlices()) {
+                    completed.push_back(job);
+                    uploads.pop_front();
+                    continue;
+                }
+
+                Band band;
+                band.job = job;
+                band.slice = texture->GetSlice(job->slice);
+                band.row = job->row;
+                unsigned int rowSize = band.slice.width * band.slice.texelSize;
+                unsigned int left = band.slice.height - job->row;
+                band.rows = std::min(left, (budget - used) / rowSize);
+                // Rows wider than the whole budget go one at a time.
+                if (band.rows == 0 && used == 0) band.rows = 1;
+                if (band.rows == 0) break;
+
+                unsigned int size = band.rows * rowSize;
+                if (mapped && size <= budget) {
+                    band.offset = used;
+                    memcpy(mapped + used, (const char*)band.slice.data + job->row * rowSize,
+                           size);
+                } else
+                    // Straight from client memory.
+                    band.offset = ~0u;
+                bands.push_back(band);
+                // Keep the bands word aligned in the buffer.
+                used = std::min(budget, (used + size + 15) & ~15u);
+                bytes += size;
+
+                job->row += band.rows;
+                if (job->row == band.slice.height) {
+                    job->row = 0;
+                    ++job->slice;
+                }
+            }
+
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            if (mapped) {
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+                for (unsigned int i = 0; i < bands.size(); ++i)
+                    if (bands[i].offset != ~0u)
+                        UploadBand(bands[i], (const GLvoid*)(size_t)bands[i].offset);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+            }
+            for (unsigned int i = 0; i < bands.size(); ++i) {
+                const Band& b = bands[i];
+                if (b.offset != ~0u) continue;
+                unsigned int rowSize = b.slice.width * b.slice.texelSize;
+                UploadBand(b, (const char*)b.slice.data + b.row * rowSize);
+            }
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            CHECK_FOR_GL_ERROR();
+
+            // The last texture reached may have had its last band
+            // uploaded, it need not wait for the next frame.
+            if (!uploads.empty() &&
+                uploads.front()->slice == uploads.front()->texture->GetSlices()) {
+                completed.push_back(uploads.front());
+                uploads.pop_front();
+            }
+            for (unsigned int i = 0; i < completed.size(); ++i)
+                Complete(completed[i]);
+        }
+
+        void TextureStreamer::UploadBand(const Band& b, const void* pixels) {
+            GLenum target = b.job->texture->GetTarget();
+            glBindTexture(target, b.job->id);
+            if (target == GL_TEXTURE_2D)
+                glTexSubImage2D(target, b.slice.level, 0, b.row, b.slice.width, b.rows,
+                                b.slice.format, b.slice.type, pixels);
+            else
+                glTexSubImage3D(target, b.slice.level, 0, b.row, b.slice.layer,
+                                b.slice.width, b.rows, 1,
+                                b.slice.format, b.slice.type, pixels);
+            glBindTexture(target, 0);
+        }
+
+        void TextureStreamer::Complete(Job* job) {
+            IStreamedTexture* texture = job->texture;
+            GLenum target = texture->GetTarget();
+            glBindTexture(target, job->id);
+            texture->Finish();
+            glBindTexture(target, 0);
+            texture->SetID(job->id);
+            glDeleteTextures(1, &job->placeholderID);
+            CHECK_FOR_GL_ERROR();
+            ++streamed;
+            lock.Lock();
+            --pending;
+            lock.Unlock();
+            delete texture;
+            delete job;
+        }
+
+    }
+}
@@ -0,0 +1,341 @@
+// Texture streamer.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEXTURE_STREAMER_H_
+#define _TEXTURE_STREAMER_H_
+
+#include <Core/IListener.h>
+#include <Core/Mutex.h>
+#include <Math/Vector.h>
+#include <Meta/OpenGL.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/Exceptions.h>
+#include <Resources/Texture2D.h>
+#include <Utils/Timer.h>
+
+#include "MappedTexture3D.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using std::string;
+
+        /**
+         * A texture the streamer decodes and uploads.
+         *
+         * Decode runs on a worker thread and must not touch GL. The
+         * rest is called on the render thread after it, with the new
+         * texture object bound to the target.
+         */
+        class IStreamedTexture {
+        public:
+            /**
+             * One 2d image of the texture, a mip level of a 2d
+             * texture or a layer of a level of a 3d texture, with
+             * tightly packed rows.
+             */
+            struct Slice {
+                GLint level, layer;
+                unsigned int width, height;
+                GLenum format, type;
+                unsigned int texelSize;
+                const void* data;
+            };
+
+            virtual ~IStreamedTexture() {}
+
+            virtual string GetName() = 0;
+            virtual GLenum GetTarget() = 0;
+            virtual void Decode() = 0;
+
+            /**
+             * Define the levels of the bound texture object and set
+             * its parameters.
+             */
+            virtual void Allocate() = 0;
+            virtual unsigned int GetSlices() = 0;
+            virtual Slice GetSlice(unsigned int i) = 0;
+
+            /**
+             * Called when every slice is uploaded.
+             */
+            virtual void Finish() = 0;
+
+            /**
+             * Hand the texture object to the texture resource.
+             */
+            virtual void SetID(GLuint id) = 0;
+        };
+
+        /**
+         * The GL wrap mode of a texture wrapping.
+         */
+        inline GLint GLWrapping(Resources::Wrapping wrapping) {
+            switch (wrapping) {
+            case Resources::CLAMP:         return GL_CLAMP;
+            case Resources::CLAMP_TO_EDGE: return GL_CLAMP_TO_EDGE;
+            default:                       return GL_REPEAT;
+            }
+        }
+
+        /**
+         * A 2d texture decoded by loading it, its mip levels are
+         * generated after the upload.
+         */
+        template <class T>
+        class StreamedTexture2D : public IStreamedTexture {
+            boost::shared_ptr<Resources::Texture2D<T> > tex;
+            string name;
+            GLenum format, internal;
+        public:
+            StreamedTexture2D(boost::shared_ptr<Resources::Texture2D<T> > tex,
+                              string name)
+                : tex(tex), name(name) {}
+
+            string GetName() { return name; }
+            GLenum GetTarget() { return GL_TEXTURE_2D; }
+
+            void Decode() {
+                tex->Load();
+                if (!Resources::GLTextureFormat(tex->GetColorFormat(), false,
+                                                format, internal))
+                    throw Resources::ResourceException("no upload for the color format of "
+                                                       + name);
+            }
+
+            void Allocate() {
+                GLint wrap = GLWrapping(tex->GetWrapping());
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                                tex->UseMipmapping() ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+                glTexImage2D(GL_TEXTURE_2D, 0, internal, tex->GetWidth(), tex->GetHeight(),
+                             0, format, sizeof(T) == 1 ? GL_UNSIGNED_BYTE : GL_FLOAT, NULL);
+            }
+
+            unsigned int GetSlices() { return 1; }
+
+            Slice GetSlice(unsigned int i) {
+                Slice s;
+                s.level = s.layer = 0;
+                s.width = tex->GetWidth();
+                s.height = tex->GetHeight();
+                s.format = format;
+                s.type = sizeof(T) == 1 ? GL_UNSIGNED_BYTE : GL_FLOAT;
+                s.texelSize = tex->GetChannels() * sizeof(T);
+                s.data = tex->GetData();
+                return s;
+            }
+
+            void Finish() {
+                if (tex->UseMipmapping())
+                    glGenerateMipmapEXT(GL_TEXTURE_2D);
+            }
+
+            void SetID(GLuint id) { tex->SetID(id); }
+        };
+
+        /**
+         * A mapped 3d texture, uploaded with the mip chain of its
+         * container if it uses mipmapping. Decoding reads the
+         * mapping in from disk.
+         */
+        template <class T>
+        class StreamedMappedTexture3D : public IStreamedTexture {
+        protected:
+            boost::shared_ptr<Resources::MappedTexture3D<T> > tex;
+            string name;
+            GLenum format, internal;
+            std::vector<Slice> slices;
+        public:
+            StreamedMappedTexture3D(boost::shared_ptr<Resources::MappedTexture3D<T> > tex,
+                                    string name)
+                : tex(tex), name(name) {}
+
+            string GetName() { return name; }
+            GLenum GetTarget() { return tex->GetTarget(); }
+
+            void Decode() {
+                if (!Resources::GLTextureFormat(tex->GetColorFormat(), tex->GetHalfFloat(),
+                                                format, internal))
+                    throw Resources::ResourceException("no upload for the color format of "
+                                                       + name);
+                bool array = GetTarget() == GL_TEXTURE_2D_ARRAY_EXT;
+                unsigned int levels = tex->UseMipmapping() ? tex->GetMipLevels() : 1;
+                unsigned int w = tex->GetWidth(), h = tex->GetHeight(), d = tex->GetDepth();
+                slices.clear();
+                for (unsigned int l = 0; l < levels; ++l) {
+                    const char* level = (const char*)tex->GetMipData(l);
+                    Slice s;
+                    s.level = l;
+                    s.width = w;
+                    s.height = h;
+                    s.format = format;
+                    s.type = sizeof(T) == 1 ? GL_UNSIGNED_BYTE : GL_FLOAT;
+                    s.texelSize = tex->GetChannels() * sizeof(T);
+                    unsigned int size = w * h * s.texelSize;
+                    for (unsigned int z = 0; z < d; ++z) {
+                        s.layer = z;
+                        s.data = level + z * size;
+                        slices.push_back(s);
+                    }
+                    // Fault the pages in here rather than while the
+                    // render thread copies them.
+                    volatile char sum = 0;
+                    for (unsigned int i = 0; i < d * size;
+                         i += Resources::Texture3DContainerHeader::ALIGNMENT)
+                        sum += level[i];
+                    w = w > 1 ? w / 2 : 1;
+                    h = h > 1 ? h / 2 : 1;
+                    if (!array && d > 1) d /= 2;
+                }
+            }
+
+            void Allocate() {
+                GLenum target = GetTarget();
+                GLint wrap = GLWrapping(tex->GetWrapping());
+                glTexParameteri(target, GL_TEXTURE_WRAP_S, wrap);
+                glTexParameteri(target, GL_TEXTURE_WRAP_T, wrap);
+                glTexParameteri(target, GL_TEXTURE_WRAP_R, wrap);
+                glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(target, GL_TEXTURE_MIN_FILTER,
+                                tex->UseMipmapping() ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+                GLint last = 0;
+                for (unsigned int i = 0; i < slices.size(); ++i) {
+                    const Slice& s = slices[i];
+                    if (s.layer != 0) continue;
+                    // The depth of the level is the layers after it.
+                    unsigned int d = 1;
+                    while (i + d < slices.size() && slices[i + d].level == s.level) ++d;
+                    glTexImage3D(target, s.level, internal, s.width, s.height, d, 0,
+                                 s.format, s.type, NULL);
+                    last = s.level;
+                }
+                glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, last);
+            }
+
+            unsigned int GetSlices() { return slices.size(); }
+            Slice GetSlice(unsigned int i) { return slices[i]; }
+            void Finish() {}
+            void SetID(GLuint id) { tex->SetID(id); }
+        };
+
+        /**
+         * Decodes textures on worker threads and uploads them over
+         * the following frames, through a ring of pixel buffer
+         * objects filled with at most a fixed number of bytes a
+         * frame.
+         *
+         * A texture added to the streamer gets a one texel texture
+         * object of a placeholder color when the renderer is
+         * initialized, or on the next frame after that, so it can be
+         * drawn right away. The full texture is uploaded to a texture
+         * object of its own, which replaces the placeholder once
+         * every slice of it is uploaded, so a texture is never drawn
+         * half uploaded. A texture that fails to decode keeps its
+         * placeholder.
+         *
+         * Attach the streamer to the renderer initialize and
+         * preprocess events, and add the textures before anything
+         * else loads them.
+         */
+        class TextureStreamer
+            : public Core::IListener<Renderers::RenderingEventArg> {
+            struct Job {
+                IStreamedTexture* texture;
+                Math::Vector<4, unsigned char> placeholder;
+                GLuint placeholderID, id;
+                unsigned int slice, row;
+                string error;
+            };
+            // A band of rows of a slice, copied to the pixel buffer.
+            struct Band {
+                Job* job;
+                IStreamedTexture::Slice slice;
+                unsigned int row, rows;
+                unsigned int offset;
+            };
+            class Worker;
+
+            unsigned int budget, threads;
+            std::vector<GLuint> buffers;
+            unsigned int nextBuffer;
+            bool initialized, usePBO;
+
+            // Shared with the workers.
+            std::deque<Job*> added, decode, decoded;
+            std::vector<Worker*> workers;
+            unsigned int active;
+            Core::Mutex lock;
+
+            // Render thread only.
+            std::deque<Job*> uploads;
+            unsigned int pending, streamed, frames;
+            unsigned long long bytes;
+            Utils::Timer timer;
+
+            void StartWorkers();
+            void ReapWorkers(bool wait);
+            void Work(Worker& worker);
+            void CreatePlaceholder(Job* job);
+            void Upload();
+            void UploadBand(const Band& band, const void* pixels);
+            void Complete(Job* job);
+
+        public:
+            /**
+             * @param budget Bytes uploaded a frame.
+             * @param buffers Pixel buffers in the ring, a buffer is
+             * filled again this many frames after it was used.
+             * @param threads Most decode threads, zero for one per
+             * core. All but one are claimed from the ParallelRange
+             * budget.
+             */
+            TextureStreamer(unsigned int budget = 4 << 20,
+                            unsigned int buffers = 3,
+                            unsigned int threads = 0);
+            ~TextureStreamer();
+
+            /**
+             * Stream a texture, the streamer deletes it.
+             *
+             * @param placeholder RGBA color drawn until it is uploaded.
+             */
+            void Add(IStreamedTexture* texture,
+                     Math::Vector<4, unsigned char> placeholder);
+
+            template <class T>
+            void Add(boost::shared_ptr<Resources::Texture2D<T> > tex, string name,
+                     Math::Vector<4, unsigned char> placeholder) {
+                Add(new StreamedTexture2D<T>(tex, name), placeholder);
+            }
+
+            template <class T>
+            void Add(boost::shared_ptr<Resources::MappedTexture3D<T> > tex, string name,
+                     Math::Vector<4, unsigned char> placeholder) {
+                Add(new StreamedMappedTexture3D<T>(tex, name), placeholder);
+            }
+
+            /**
+             * Textures not uploaded yet.
+             */
+            unsigned int GetPending() const { return pending; }
+
+            void Handle(Renderers::RenderingEventArg arg);
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,268 @@
+// Tiled height map.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "TiledHeightMap.h"
+
+#include <Logging/Logger.h>
+#include <Resources/Exceptions.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using namespace Resources;
+        using std::vector;
+
+        static const char MAGIC[8] = "OEHMAP1";
+        static const unsigned long long DATA_OFFSET = 4096;
+
+        static inline int Clamp(int i, unsigned int n) {
+            return i < 0 ? 0 : (i >= (int)n ? n - 1 : i);
+        }
+
+        // Read size bytes at a 64 bit offset, false on a short read.
+        static bool ReadAt(FILE* in, unsigned long long offset,
+                           void* data, size_t size) {
+#ifdef _WIN32
+            if (_fseeki64(in, offset, SEEK_SET) != 0) return false;
+#else
+            if (fseeko(in, offset, SEEK_SET) != 0) return false;
+#endif
+            return fread(data, 1, size, in) == size;
+        }
+
+        void TextureHeightRows::ReadRows(unsigned int z, unsigned int rows,
+                                         float* out) {
+            unsigned int w = map->GetWidth();
+            unsigned int c = map->GetChannels();
+            const float* src = map->GetData() + (unsigned long long)z * w * c;
+            for (unsigned long long i = 0; i < (unsigned long long)rows * w; ++i)
+                out[i] = src[i * c];
+        }
+
+        RawHeightRows::RawHeightRows(string file, unsigned int width,
+                                     unsigned int height)
+            : file(file), width(width), height(height) {
+            in = fopen(file.c_str(), "rb");
+            if (in == NULL)
+                throw ResourceException("could not open raw height map: " + file);
+        }
+
+        RawHeightRows::~RawHeightRows() {
+            fclose(in);
+        }
+
+        void RawHeightRows::ReadRows(unsigned int z, unsigned int rows, float* out) {
+            unsigned long long bytes = (unsigned long long)rows * width * sizeof(float);
+            unsigned long long offset = (unsigned long long)z * width * sizeof(float);
+            if (!ReadAt(in, offset, out, bytes))
+                throw ResourceException("short read of raw height map: " + file);
+        }
+
+        static void WriteTile(FILE* out, const vector<float>& tile, string file) {
+            if (fwrite(&tile[0], sizeof(float), tile.size(), out) != tile.size()) {
+                fclose(out);
+                remove(file.c_str());
+                throw ResourceException("could not write tiled height map: " + file);
+            }
+        }
+
+        void TiledHeightMap::Build(IHeightRows& rows, string file,
+                                   unsigned int tileSize) {
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.width = rows.GetWidth();
+            header.height = rows.GetHeight();
+            header.tileSize = tileSize;
+            header.tilesX = (header.width + tileSize - 1) / tileSize;
+            header.tilesZ = (header.height + tileSize - 1) / tileSize;
+
+            FILE* out = fopen(file.c_str(), "wb");
+            if (out == NULL)
+                throw ResourceException("could not write tiled height map: " + file);
+            vector<char> pad(DATA_OFFSET, 0);
+            memcpy(&pad[0], &header, sizeof(header));
+            if (fwrite(&pad[0], 1, pad.size(), out) != pad.size()) {
+                fclose(out);
+                remove(file.c_str());
+                throw ResourceException("could not write tiled height map: " + file);
+            }
+
+            // Tiles are stored a row of tiles after the other, so
+            // one strip of rows gives the next tilesX tiles in file
+            // order.
+            unsigned int w = header.width;
+            vector<float> strip((unsigned long long)tileSize * w);
+            vector<float> tile(tileSize * tileSize);
+            for (unsigned int tz = 0; tz < header.tilesZ; ++tz) {
+                unsigned int z0 = tz * tileSize;
+                unsigned int n = std::min(tileSize, header.height - z0);
+                rows.ReadRows(z0, n, &strip[0]);
+                for (unsigned int tx = 0; tx < header.tilesX; ++tx) {
+                    for (unsigned int z = 0; z < tileSize; ++z) {
+                        const float* row = &strip[(unsigned long long)std::min(z, n - 1) * w];
+                        for (unsigned int x = 0; x < tileSize; ++x)
+                            tile[z * tileSize + x] = row[Clamp(tx * tileSize + x, w)];
+                    }
+                    WriteTile(out, tile, file);
+                }
+            }
+            if (fclose(out) != 0) {
+                remove(file.c_str());
+                throw ResourceException("could not write tiled height map: " + file);
+            }
+        }
+
+        void TiledHeightMap::Build(FloatTexture2DPtr map, string file,
+                                   unsigned int tileSize) {
+            TextureHeightRows rows(map);
+            Build(rows, file, tileSize);
+        }
+
+        FloatTexture2DPtr TiledHeightMap::ToHeightMap(UCharTexture2DPtr image) {
+            unsigned int w = image->GetWidth();
+            unsigned int h = image->GetHeight();
+            unsigned int c = image->GetChannels();
+            FloatTexture2DPtr map(new Texture2D<float>(w, h, 1));
+            const unsigned char* src = image->GetData();
+            float* dst = map->GetData();
+            for (unsigned long long i = 0; i < (unsigned long long)w * h; ++i)
+                dst[i] = src[i * c];
+            return map;
+        }
+
+        TiledHeightMap::TiledHeightMap(string file, unsigned long long budget)
+            : loads(0) {
+            in = fopen(file.c_str(), "rb");
+            if (in == NULL)
+                throw ResourceException("could not open tiled height map: " + file);
+            if (!ReadAt(in, 0, &header, sizeof(header)) ||
+                memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+                fclose(in);
+                throw ResourceException("invalid tiled height map: " + file);
+            }
+            tileBytes = (unsigned long long)header.tileSize * header.tileSize * sizeof(float);
+            dataOffset = DATA_OFFSET;
+            maxTiles = std::max((unsigned long long)9, budget / tileBytes);
+            logger.info << "tiled height map " << header.width << "x" << header.height
+                        << " in " << header.tilesX * header.tilesZ << " tiles, keeping at most "
+                        << maxTiles << " resident" << logger.end;
+        }
+
+        TiledHeightMap::~TiledHeightMap() {
+            fclose(in);
+        }
+
+        TiledHeightMap::TilePtr TiledHeightMap::LoadTile(unsigned int tx, unsigned int tz) {
+            TilePtr tile(new vector<float>(header.tileSize * header.tileSize));
+            unsigned long long index = tz * header.tilesX + tx;
+            if (!ReadAt(in, dataOffset + index * tileBytes, &(*tile)[0], tileBytes))
+                logger.error << "short read of height map tile "
+                             << tx << ", " << tz << logger.end;
+            ++loads;
+
+            TileKey key(tx, tz);
+            lru.push_front(key);
+            Entry& e = tiles[key];
+            e.tile = tile;
+            e.use = lru.begin();
+
+            while (tiles.size() > maxTiles) {
+                tiles.erase(lru.back());
+                lru.pop_back();
+            }
+            return tile;
+        }
+
+        TiledHeightMap::TilePtr TiledHeightMap::GetTile(unsigned int tx, unsigned int tz) {
+            std::map<TileKey, Entry>::iterator itr = tiles.find(TileKey(tx, tz));
+            if (itr == tiles.end())
+                return LoadTile(tx, tz);
+            lru.splice(lru.begin(), lru, itr->second.use);
+            return itr->second.tile;
+        }
+
+        bool TiledHeightMap::IsResident(unsigned int tx, unsigned int tz) const {
+            return tiles.find(TileKey(tx, tz)) != tiles.end();
+        }
+
+        float TiledHeightMap::GetHeight(int x, int z) {
+            x = Clamp(x, header.width);
+            z = Clamp(z, header.height);
+            unsigned int ts = header.tileSize;
+            TilePtr tile = GetTile(x / ts, z / ts);
+            return (*tile)[(z % ts) * ts + x % ts];
+        }
+
+        void TiledHeightMap::ReadRegion(int x, int z, unsigned int w, unsigned int h,
+                                        float* out) {
+            unsigned int ts = header.tileSize;
+            for (unsigned int j = 0; j < h; ++j) {
+                int sz = Clamp(z + j, header.height);
+                for (unsigned int i = 0; i < w; ) {
+                    // Copy the run of the row that falls in one tile.
+                    unsigned int tx = Clamp(x + i, header.width) / ts;
+                    TilePtr tile = GetTile(tx, sz / ts);
+                    const float* row = &(*tile)[(sz % ts) * ts];
+                    for (; i < w; ++i) {
+                        unsigned int sx = Clamp(x + i, header.width);
+                        if (sx / ts != tx) break;
+                        out[j * w + i] = row[sx % ts];
+                    }
+                }
+            }
+        }
+
+        unsigned int TiledHeightMap::Prefetch(float x, float z, float radius,
+                                              unsigned int maxLoads) {
+            unsigned int ts = header.tileSize;
+            int tx0 = Clamp((int)floor((x - radius) / ts), header.tilesX);
+            int tx1 = Clamp((int)floor((x + radius) / ts), header.tilesX);
+            int tz0 = Clamp((int)floor((z - radius) / ts), header.tilesZ);
+            int tz1 = Clamp((int)floor((z + radius) / ts), header.tilesZ);
+
+            vector<std::pair<float, TileKey> > missing;
+            for (int tz = tz0; tz <= tz1; ++tz)
+                for (int tx = tx0; tx <= tx1; ++tx) {
+                    float dx = (tx + 0.5f) * ts - x;
+                    float dz = (tz + 0.5f) * ts - z;
+                    TileKey key(tx, tz);
+                    if (tiles.find(key) == tiles.end())
+                        missing.push_back(std::make_pair(dx * dx + dz * dz, key));
+                    else
+                        GetTile(tx, tz); // mark as recently used
+                }
+            std::sort(missing.begin(), missing.end());
+
+            unsigned int n = std::min((unsigned int)missing.size(), maxLoads);
+            for (unsigned int i = 0; i < n; ++i)
+                LoadTile(missing[i].second.first, missing[i].second.second);
+            return n;
+        }
+
+        HeightMapStreamer::HeightMapStreamer(TiledHeightMap& map,
+                                             Display::IViewingVolume& view,
+                                             Vector<3, float> offset,
+                                             float widthScale, float radius,
+                                             unsigned int loadsPerFrame)
+            : map(map), view(view), offset(offset), widthScale(widthScale),
+              radius(radius), loadsPerFrame(loadsPerFrame) {}
+
+        void HeightMapStreamer::Handle(Core::ProcessEventArg arg) {
+            Vector<3, float> pos = (view.GetPosition() - offset) / widthScale;
+            map.Prefetch(pos[0], pos[2], radius, loadsPerFrame);
+        }
+
+    }
+}
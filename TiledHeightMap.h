@@ -0,0 +1,203 @@
+// Tiled height map.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TILED_HEIGHT_MAP_H_
+#define _TILED_HEIGHT_MAP_H_
+
+#include <Core/IListener.h>
+#include <Core/EngineEvents.h>
+#include <Display/IViewingVolume.h>
+#include <Math/Vector.h>
+#include <Resources/Texture2D.h>
+
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        using Resources::FloatTexture2DPtr;
+        using Resources::UCharTexture2DPtr;
+        using Math::Vector;
+        using std::string;
+
+        /**
+         * Rows of a height map, read a strip at a time while a tiled
+         * height map is built, so the whole map never has to be in
+         * memory.
+         */
+        class IHeightRows {
+        public:
+            virtual ~IHeightRows() {}
+            virtual unsigned int GetWidth() = 0;
+            virtual unsigned int GetHeight() = 0;
+
+            /**
+             * Read the rows from z to z + rows into out, row by row.
+             */
+            virtual void ReadRows(unsigned int z, unsigned int rows, float* out) = 0;
+        };
+
+        /**
+         * The first channel of a height map already in memory.
+         */
+        class TextureHeightRows : public IHeightRows {
+            FloatTexture2DPtr map;
+        public:
+            TextureHeightRows(FloatTexture2DPtr map) : map(map) {}
+            unsigned int GetWidth() { return map->GetWidth(); }
+            unsigned int GetHeight() { return map->GetHeight(); }
+            void ReadRows(unsigned int z, unsigned int rows, float* out);
+        };
+
+        /**
+         * A raw file of width * height native floats, read from disk
+         * a strip at a time. Used for maps too large to load whole.
+         */
+        class RawHeightRows : public IHeightRows {
+            FILE* in;
+            string file;
+            unsigned int width, height;
+        public:
+            RawHeightRows(string file, unsigned int width, unsigned int height);
+            ~RawHeightRows();
+            unsigned int GetWidth() { return width; }
+            unsigned int GetHeight() { return height; }
+            void ReadRows(unsigned int z, unsigned int rows, float* out);
+        };
+
+        /**
+         * A height map stored on disk as square float tiles, paged in
+         * on demand through an LRU cache with a fixed memory budget.
+         *
+         * Lookups outside the map are clamped to the edge, like the
+         * CLAMP_TO_EDGE wrapping of the height map texture.
+         */
+        class TiledHeightMap {
+        public:
+            typedef boost::shared_ptr<std::vector<float> > TilePtr;
+
+        private:
+            struct Header {
+                char magic[8];
+                unsigned int width, height, tileSize;
+                unsigned int tilesX, tilesZ;
+            };
+            typedef std::pair<unsigned int, unsigned int> TileKey;
+            typedef std::list<TileKey> LRUList;
+            struct Entry {
+                TilePtr tile;
+                LRUList::iterator use;
+            };
+
+            FILE* in;
+            Header header;
+            unsigned long long tileBytes, dataOffset;
+            unsigned int maxTiles;
+            std::map<TileKey, Entry> tiles;
+            LRUList lru;
+            unsigned int loads;
+
+            TilePtr LoadTile(unsigned int tx, unsigned int tz);
+
+        public:
+            static const unsigned int DEFAULT_TILE_SIZE = 256;
+
+            /**
+             * Write a height map as a tiled height map file. One
+             * strip of tileSize rows is read and kept at a time.
+             */
+            static void Build(IHeightRows& rows, string file,
+                              unsigned int tileSize = DEFAULT_TILE_SIZE);
+
+            /**
+             * Write the first channel of a height map as a tiled
+             * height map file.
+             */
+            static void Build(FloatTexture2DPtr map, string file,
+                              unsigned int tileSize = DEFAULT_TILE_SIZE);
+
+            /**
+             * Convert the first channel of an image to a single
+             * channel float height map in one pass. Replaces
+             * ChangeChannels followed by ConvertTex, which keeps two
+             * extra copies around.
+             */
+            static FloatTexture2DPtr ToHeightMap(UCharTexture2DPtr image);
+
+            /**
+             * @param budget Bytes of tile data to keep resident. At
+             * least a 3x3 block of tiles is always kept.
+             */
+            TiledHeightMap(string file, unsigned long long budget);
+            ~TiledHeightMap();
+
+            unsigned int GetWidth() const { return header.width; }
+            unsigned int GetHeight() const { return header.height; }
+            unsigned int GetTileSize() const { return header.tileSize; }
+
+            /**
+             * Get a tile, loading it if it is not resident. The tile
+             * stays valid while the pointer is held, also if the
+             * cache evicts it.
+             */
+            TilePtr GetTile(unsigned int tx, unsigned int tz);
+            bool IsResident(unsigned int tx, unsigned int tz) const;
+
+            float GetHeight(int x, int z);
+
+            /**
+             * Copy a w * h region starting at (x, z) to out, row by
+             * row.
+             */
+            void ReadRegion(int x, int z, unsigned int w, unsigned int h,
+                            float* out);
+
+            /**
+             * Load up to maxLoads missing tiles within radius texels of
+             * (x, z), nearest first. Returns the number loaded.
+             */
+            unsigned int Prefetch(float x, float z, float radius,
+                                  unsigned int maxLoads);
+
+            unsigned int GetResidentTiles() const { return tiles.size(); }
+            unsigned long long GetResidentBytes() const {
+                return tiles.size() * tileBytes;
+            }
+            unsigned int GetTileLoads() const { return loads; }
+        };
+
+        /**
+         * Keeps the tiles around the camera resident. A few tiles are
+         * loaded per frame, so flying over the map never stalls on a
+         * burst of reads.
+         */
+        class HeightMapStreamer
+            : public Core::IListener<Core::ProcessEventArg> {
+            TiledHeightMap& map;
+            Display::IViewingVolume& view;
+            Vector<3, float> offset;
+            float widthScale;
+            float radius;
+            unsigned int loadsPerFrame;
+        public:
+            HeightMapStreamer(TiledHeightMap& map, Display::IViewingVolume& view,
+                              Vector<3, float> offset, float widthScale,
+                              float radius, unsigned int loadsPerFrame = 4);
+            void Handle(Core::ProcessEventArg arg);
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,50 @@
+// Timed terrain rendering view.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TIMED_RENDERING_VIEW_H_
+#define _TIMED_RENDERING_VIEW_H_
+
+#include <Renderers/OpenGL/TerrainRenderingView.h>
+#include <Scene/PostProcessNode.h>
+#include <Scene/ChainPostProcessNode.h>
+
+#include "PostProcessTimer.h"
+
+namespace OpenEngine {
+    namespace Renderers {
+        namespace OpenGL {
+
+            /**
+             * A terrain rendering view that times every post process
+             * node it visits.
+             */
+            class TimedRenderingView : public TerrainRenderingView {
+                Utils::PostProcessTimer& timer;
+            public:
+                TimedRenderingView(Utils::PostProcessTimer& timer)
+                    : TerrainRenderingView(), timer(timer) {}
+
+                void VisitPostProcessNode(Scene::PostProcessNode* node) {
+                    timer.Begin(node);
+                    TerrainRenderingView::VisitPostProcessNode(node);
+                    timer.End(node);
+                }
+
+                void VisitChainPostProcessNode(Scene::ChainPostProcessNode* node) {
+                    timer.Begin(node);
+                    TerrainRenderingView::VisitChainPostProcessNode(node);
+                    timer.End(node);
+                }
+            };
+
+        }
+    }
+}
+
+#endif
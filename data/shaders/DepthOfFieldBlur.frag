@@ -0,0 +1,21 @@
+uniform sampler2D color0;
+uniform sampler2DShadow depth;
+
+// One texel of the low resolution buffer along the blur.
+uniform vec2 direction;
+
+varying vec2 texCoord;
+
+void main () {
+    // A 9 tap Gaussian in 5 fetches. Each pair of neighbouring taps
+    // is one linear filtered fetch between them, placed by their
+    // weights and weighted by their sum.
+    vec2 o1 = direction * 1.3846153846;
+    vec2 o2 = direction * 3.2307692308;
+    vec4 color = texture2D(color0, texCoord) * 0.2270270270
+        + (texture2D(color0, texCoord + o1) + texture2D(color0, texCoord - o1)) * 0.3162162162
+        + (texture2D(color0, texCoord + o2) + texture2D(color0, texCoord - o2)) * 0.0702702703;
+
+    gl_FragColor = color;
+    gl_FragDepth = shadow2D(depth, vec3(texCoord, 0.0)).x;
+}
@@ -0,0 +1,10 @@
+# Vertical low resolution depth of field blur shader resource.
+
+# Vertext shader program.
+vert: shaders/default.vert
+
+# Fragment shader program.
+frag: shaders/DepthOfFieldBlur.frag
+
+# Uniform values
+unif: direction = 0.0 0.003333
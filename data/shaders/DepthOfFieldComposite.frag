@@ -0,0 +1,44 @@
+uniform sampler2D color0;       // The blurred low resolution image
+uniform sampler2DShadow depth;  // and its depth.
+uniform sampler2D scene;
+uniform sampler2DShadow sceneDepth;
+
+uniform float cocScale;
+uniform vec2 lowSize;
+uniform float depthEpsilon;
+
+varying vec2 texCoord;
+
+// Bilinear tap of the low resolution image, weighted down where its
+// depth differs from the depth of the pixel.
+vec4 Tap(vec2 uv, float weight, float d, inout float total) {
+    float dl = shadow2D(depth, vec3(uv, 0.0)).x;
+    weight /= depthEpsilon + abs(dl - d);
+    total += weight;
+    return weight * texture2D(color0, uv);
+}
+
+void main () {
+    float focus = shadow2D(sceneDepth, vec3(0.5, 0.5, 0.0)).x;
+    float d = shadow2D(sceneDepth, vec3(texCoord, 0.0)).x;
+
+    // The four low resolution texels around the pixel.
+    vec2 p = texCoord * lowSize - 0.5;
+    vec2 f = fract(p);
+    vec2 base = (floor(p) + 0.5) / lowSize;
+    vec2 texel = 1.0 / lowSize;
+    float total = 0.0;
+    vec4 blur = Tap(base, (1.0 - f.x) * (1.0 - f.y), d, total)
+        + Tap(base + vec2(texel.x, 0.0), f.x * (1.0 - f.y), d, total)
+        + Tap(base + vec2(0.0, texel.y), (1.0 - f.x) * f.y, d, total)
+        + Tap(base + texel, f.x * f.y, d, total);
+    blur /= total;
+
+    // The blurred color was premultiplied by the circle of confusion.
+    vec3 blurColor = blur.rgb / max(blur.a, 0.0001);
+    float coc = clamp(abs(d - focus) * cocScale, 0.0, 1.0);
+
+    vec4 sharp = texture2D(scene, texCoord);
+    gl_FragColor = vec4(mix(sharp.rgb, blurColor, coc), sharp.a);
+    gl_FragDepth = d;
+}
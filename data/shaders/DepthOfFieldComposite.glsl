@@ -0,0 +1,12 @@
+# Depth of field composite shader resource.
+
+# Vertext shader program.
+vert: shaders/default.vert
+
+# Fragment shader program.
+frag: shaders/DepthOfFieldComposite.frag
+
+# Uniform values
+unif: cocScale = 40.0
+unif: lowSize = 400.0 300.0
+unif: depthEpsilon = 0.0005
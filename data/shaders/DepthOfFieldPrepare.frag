@@ -0,0 +1,28 @@
+uniform sampler2D color0;
+uniform sampler2DShadow depth;
+
+uniform float cocScale;
+uniform vec2 sampleOffset;
+
+varying vec2 texCoord;
+
+// Reduces the scene to the low resolution buffer and computes the
+// circle of confusion once per low resolution pixel. The color is
+// premultiplied by it, so the blur passes weigh each tap by how out
+// of focus it is and sharp pixels do not bleed into their
+// surroundings.
+void main () {
+    float focus = shadow2D(depth, vec3(0.5, 0.5, 0.0)).x;
+    float d = shadow2D(depth, vec3(texCoord, 0.0)).x;
+    float coc = clamp(abs(d - focus) * cocScale, 0.0, 1.0);
+
+    // Four linear filtered taps average the block of scene pixels
+    // under this one.
+    vec4 color = texture2D(color0, texCoord + vec2(-sampleOffset.x, -sampleOffset.y))
+        + texture2D(color0, texCoord + vec2( sampleOffset.x, -sampleOffset.y))
+        + texture2D(color0, texCoord + vec2(-sampleOffset.x,  sampleOffset.y))
+        + texture2D(color0, texCoord + vec2( sampleOffset.x,  sampleOffset.y));
+
+    gl_FragColor = vec4(color.rgb * 0.25 * coc, coc);
+    gl_FragDepth = d;
+}
@@ -0,0 +1,12 @@
+# Depth of field prepare shader resource.
+
+# Vertext shader program.
+vert: shaders/default.vert
+
+# Fragment shader program.
+frag: shaders/DepthOfFieldPrepare.frag
+
+# Uniform values
+unif: cocScale = 40.0
+# A quarter of the reduction, in texels of the scene.
+unif: sampleOffset = 0.000625 0.000833
@@ -0,0 +1,20 @@
+uniform sampler2D color0;
+uniform sampler2DShadow depth;
+
+varying vec2 texCoord;
+
+void main () {
+    // Half a texel of the output.
+    vec2 halfPixel = 0.5 * vec2(dFdx(texCoord.x), dFdy(texCoord.y));
+
+    // Half a texel of the output is a full texel of the input, so
+    // the corner taps each average four input texels.
+    vec4 sum = texture2D(color0, texCoord) * 4.0;
+    sum += texture2D(color0, texCoord - halfPixel);
+    sum += texture2D(color0, texCoord + halfPixel);
+    sum += texture2D(color0, texCoord + vec2(halfPixel.x, -halfPixel.y));
+    sum += texture2D(color0, texCoord - vec2(halfPixel.x, -halfPixel.y));
+
+    gl_FragColor = sum / 8.0;
+    gl_FragDepth = shadow2D(depth, vec3(texCoord, 0.0)).x;
+}
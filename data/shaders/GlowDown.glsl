@@ -0,0 +1,7 @@
+# Glow pyramid downsample shader resource.
+
+# Vertext shader program.
+vert: shaders/default.vert
+
+# Fragment shader program.
+frag: shaders/GlowDown.frag
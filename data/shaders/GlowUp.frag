@@ -0,0 +1,27 @@
+uniform sampler2D color0;       // The glow of the level below
+uniform sampler2DShadow depth;
+uniform sampler2D level;        // This level of the pyramid
+
+uniform float glowSpread;
+
+varying vec2 texCoord;
+
+// Tent filtered upsample of the smaller level in eight taps.
+vec4 Upsample() {
+    // Half a texel of the output.
+    vec2 halfPixel = 0.5 * vec2(dFdx(texCoord.x), dFdy(texCoord.y));
+    vec4 sum = texture2D(color0, texCoord + vec2(-halfPixel.x * 2.0, 0.0));
+    sum += texture2D(color0, texCoord + vec2(-halfPixel.x, halfPixel.y)) * 2.0;
+    sum += texture2D(color0, texCoord + vec2(0.0, halfPixel.y * 2.0));
+    sum += texture2D(color0, texCoord + vec2(halfPixel.x, halfPixel.y)) * 2.0;
+    sum += texture2D(color0, texCoord + vec2(halfPixel.x * 2.0, 0.0));
+    sum += texture2D(color0, texCoord + vec2(halfPixel.x, -halfPixel.y)) * 2.0;
+    sum += texture2D(color0, texCoord + vec2(0.0, -halfPixel.y * 2.0));
+    sum += texture2D(color0, texCoord + vec2(-halfPixel.x, -halfPixel.y)) * 2.0;
+    return sum / 12.0;
+}
+
+void main () {
+    gl_FragColor = mix(texture2D(level, texCoord), Upsample(), glowSpread);
+    gl_FragDepth = shadow2D(depth, vec3(texCoord, 0.0)).x;
+}
@@ -0,0 +1,11 @@
+# Glow pyramid upsample shader resource.
+
+# Vertext shader program.
+vert: shaders/default.vert
+
+# Fragment shader program.
+frag: shaders/GlowUp.frag
+
+# Uniform values
+# How much of the wider levels is kept over this one.
+unif: glowSpread = 0.5
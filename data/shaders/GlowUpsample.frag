@@ -0,0 +1,22 @@
+uniform sampler2D color0;       // The glow at half resolution
+uniform sampler2DShadow sceneDepth;
+
+varying vec2 texCoord;
+
+void main () {
+    // Half a texel of the output.
+    vec2 halfPixel = 0.5 * vec2(dFdx(texCoord.x), dFdy(texCoord.y));
+
+    // Tent filtered upsample to the full resolution.
+    vec4 sum = texture2D(color0, texCoord + vec2(-halfPixel.x * 2.0, 0.0));
+    sum += texture2D(color0, texCoord + vec2(-halfPixel.x, halfPixel.y)) * 2.0;
+    sum += texture2D(color0, texCoord + vec2(0.0, halfPixel.y * 2.0));
+    sum += texture2D(color0, texCoord + vec2(halfPixel.x, halfPixel.y)) * 2.0;
+    sum += texture2D(color0, texCoord + vec2(halfPixel.x * 2.0, 0.0));
+    sum += texture2D(color0, texCoord + vec2(halfPixel.x, -halfPixel.y)) * 2.0;
+    sum += texture2D(color0, texCoord + vec2(0.0, -halfPixel.y * 2.0));
+    sum += texture2D(color0, texCoord + vec2(-halfPixel.x, -halfPixel.y)) * 2.0;
+
+    gl_FragColor = sum / 12.0;
+    gl_FragDepth = shadow2D(sceneDepth, vec3(texCoord, 0.0)).x;
+}
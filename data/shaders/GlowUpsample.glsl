@@ -0,0 +1,7 @@
+# Glow pyramid final upsample shader resource.
+
+# Vertext shader program.
+vert: shaders/default.vert
+
+# Fragment shader program.
+frag: shaders/GlowUpsample.frag
@@ -1,11 +0,0 @@
-# Horizontal depth of field shader resource.
-
-# Vertext shader program.
-vert: shaders/default.vert
-
-# Fragment shader program.
-frag: shaders/HorizontalCircleBlur.frag
-
-# Uniform values
-unif: halfSamples = 5
-unif: offset = 0.003
@@ -2,86 +2,101 @@ uniform sampler2D color0;
 uniform sampler2DShadow depth;
 
 uniform mat4 viewProjectionInverse;
+uniform vec3 viewPos;
 
+// Cloud density, a single channel.
 uniform sampler3D src;
+// Largest density of each brick of src and its border.
+uniform sampler3D occupancy;
+uniform vec3 gridSize;
 
 varying vec2 texCoord;
 
-const vec4 center = vec4(.0);
-const float radius = 100.0;
-
 const vec3 boxMin = vec3(0.0);
 const vec3 boxMax = vec3(500.0);
+const float volumeScale = 500.0;
 
-const float stepSize = 5.0;
+uniform float stepSize;
+uniform float stepGrowth;
 
 uniform float time;
 
-bool repeat = false;
-
 bool RayBoxIntersection(in vec3 origin, in vec3 dir,
                         in vec3 aabbMin, in vec3 aabbMax,
                         out float nearAlpha, out float farAlpha){
+    vec3 minInters = (aabbMin - origin) / dir;
+    vec3 maxInters = (aabbMax - origin) / dir;
 
-    if (repeat){
-        nearAlpha -0.0;
-        farAlpha = 100000000.0;
-        return true;
-    }else{
-        vec3 minInters = (aabbMin - origin) / dir;
-        vec3 maxInters = (aabbMax - origin) / dir;
-        
-        vec3 minAlphas = min(minInters, maxInters);
-        vec3 maxAlphas = max(minInters, maxInters);
-        
-        nearAlpha = max(0.0, max(minAlphas.x, max(minAlphas.y, minAlphas.z)));
-        farAlpha = min(maxAlphas.x, min(maxAlphas.y, maxAlphas.z));
-        
-        return nearAlpha < farAlpha && 0. < farAlpha;
-    }
+    vec3 minAlphas = min(minInters, maxInters);
+    vec3 maxAlphas = max(minInters, maxInters);
+
+    nearAlpha = max(0.0, max(minAlphas.x, max(minAlphas.y, minAlphas.z)));
+    farAlpha = min(maxAlphas.x, min(maxAlphas.y, maxAlphas.z));
+
+    return nearAlpha < farAlpha && 0. < farAlpha;
 }
 
-void main () {
-    vec4 hat = texture2D(color0, texCoord);
+// Distance along the ray to the border of the occupancy cell holding
+// the grid position g.
+float CellExit(vec3 g, vec3 gridDir) {
+    vec3 border = floor(g) + step(0.0, gridDir);
+    vec3 t = (border - g) / gridDir;
+    return min(t.x, min(t.y, t.z));
+}
 
-    // Get the depth buffer value at this pixel.  
+// Renders the clouds alone, premultiplied by their opacity; the
+// composite pass blends them over the scene.
+void main () {
+    // Get the depth buffer value at this pixel.
     float zOverW = shadow2D(depth, vec3(texCoord, 0.0)).x;
-    // screenPos is the viewport position at this pixel in the range -1 to 1.  
-    vec4 screenPos = vec4(texCoord.x * 2.0 - 1.0, 
-                          texCoord.y * 2.0 - 1.0,  
+    // screenPos is the viewport position at this pixel in the range -1 to 1.
+    vec4 screenPos = vec4(texCoord.x * 2.0 - 1.0,
+                          texCoord.y * 2.0 - 1.0,
                           zOverW * 2.0 - 1.0, 1.0);
 
-    // Transform by the view-projection inverse.  
-    //vec4 currentPos = gl_ModelViewProjectionMatrixInverse * screenPos;
+    // Transform by the view-projection inverse.
     vec4 currentPos = viewProjectionInverse * screenPos;
 
     // Ray in world space.
-    vec4 origin = gl_ModelViewMatrixInverse[3];
-    vec4 worldPos = currentPos / currentPos.w;
-    vec4 ray = normalize(worldPos - origin);
+    vec3 origin = viewPos;
+    vec3 worldPos = currentPos.xyz / currentPos.w;
+    vec3 ray = normalize(worldPos - origin);
 
     float near, far;
     vec4 color = vec4(.0);
-    if (RayBoxIntersection(vec3(origin), vec3(ray), boxMin, boxMax, near, far)){
-        
-        far = min((worldPos.x - origin.x) / ray.x, far);
-        
-        for (float t = near; t < far; t+= stepSize){
-            vec4 pos = origin + ray * t;
-            
-            pos.z -= time/20.0;
-
-            vec4 sample = texture3D(src, vec3(pos) / 500.0) / 3.0;
-            sample.rgb = vec3(0.1);
-
-            //color = (1.0 - sample.a) * color + sample.a * sample;
-            float scl = min(1.0 - color.a, sample.a);
-            color += scl * sample;
-            if (color.a >= 1.0)
+    if (RayBoxIntersection(origin, ray, boxMin, boxMax, near, far)){
+        far = min(length(worldPos - origin), far);
+
+        // The ray in occupancy cells per unit of distance.
+        vec3 gridDir = ray / volumeScale * gridSize;
+        // Starting a fraction of a step in, different for
+        // neighbouring pixels, turns banding into fine noise the
+        // upsampling smooths out.
+        float jitter = fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+        float t = near + jitter * stepSize;
+        while (t < far) {
+            vec3 pos = origin + ray * t;
+            pos.z -= time / 20.0;
+            vec3 uv = pos / volumeScale;
+
+            // Skip empty cells in one go.
+            vec3 g = fract(uv) * gridSize;
+            if (texture3D(occupancy, (floor(g) + 0.5) / gridSize).r <= 0.0) {
+                t += CellExit(g, gridDir) + 0.01;
+                continue;
+            }
+
+            // Steps grow with the distance to the eye, the opacity
+            // is corrected so the result does not depend on them.
+            float dt = stepSize * (1.0 + t * stepGrowth);
+            float density = texture3D(src, uv).r / 3.0;
+            float alpha = 1.0 - pow(max(1.0 - density, 0.0), dt / stepSize);
+            color += (1.0 - color.a) * alpha * vec4(vec3(0.1), 1.0);
+            if (color.a >= 0.99)
                 break;
+            t += dt;
         }
-        
     }
-    gl_FragColor = mix(hat, color, color.a);
+    gl_FragColor = color;
     gl_FragDepth = zOverW;
 }
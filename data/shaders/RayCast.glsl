@@ -5,3 +5,10 @@ vert: shaders/default.vert
 
 # Fragment shader program.
 frag: shaders/RayCast.frag
+
+# Uniform values
+unif: stepSize = 5.0
+# Step growth per unit of distance from the eye.
+unif: stepGrowth = 0.002
+# Occupancy cells along each axis of the cloud texture.
+unif: gridSize = 16.0 16.0 8.0
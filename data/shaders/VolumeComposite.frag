@@ -0,0 +1,39 @@
+uniform sampler2D color0;       // The clouds at low resolution
+uniform sampler2DShadow depth;  // and the depth they were cast to.
+uniform sampler2D scene;
+uniform sampler2DShadow sceneDepth;
+
+uniform vec2 lowSize;
+uniform float depthEpsilon;
+
+varying vec2 texCoord;
+
+// Bilinear tap of the low resolution image, weighted down where its
+// depth differs from the depth of the pixel.
+vec4 Tap(vec2 uv, float weight, float d, inout float total) {
+    float dl = shadow2D(depth, vec3(uv, 0.0)).x;
+    weight /= depthEpsilon + abs(dl - d);
+    total += weight;
+    return weight * texture2D(color0, uv);
+}
+
+void main () {
+    float d = shadow2D(sceneDepth, vec3(texCoord, 0.0)).x;
+
+    // The four low resolution texels around the pixel.
+    vec2 p = texCoord * lowSize - 0.5;
+    vec2 f = fract(p);
+    vec2 base = (floor(p) + 0.5) / lowSize;
+    vec2 texel = 1.0 / lowSize;
+    float total = 0.0;
+    vec4 clouds = Tap(base, (1.0 - f.x) * (1.0 - f.y), d, total)
+        + Tap(base + vec2(texel.x, 0.0), f.x * (1.0 - f.y), d, total)
+        + Tap(base + vec2(0.0, texel.y), (1.0 - f.x) * f.y, d, total)
+        + Tap(base + texel, f.x * f.y, d, total);
+    clouds /= total;
+
+    // The clouds are premultiplied by their opacity.
+    vec4 hat = texture2D(scene, texCoord);
+    gl_FragColor = vec4(hat.rgb * (1.0 - clouds.a) + clouds.rgb, hat.a);
+    gl_FragDepth = d;
+}
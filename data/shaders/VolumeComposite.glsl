@@ -0,0 +1,11 @@
+# Volume rendering composite shader resource.
+
+# Vertext shader program.
+vert: shaders/default.vert
+
+# Fragment shader program.
+frag: shaders/VolumeComposite.frag
+
+# Uniform values
+unif: lowSize = 400.0 300.0
+unif: depthEpsilon = 0.0005
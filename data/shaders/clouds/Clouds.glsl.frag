@@ -11,7 +11,8 @@ void main(void) {
     coords += wind;
     //coords -= floor(coords);
 
-    vec4 rgba = texture3D(clouds, coords);
+    // The volume only holds the density, the clouds are white.
+    vec4 rgba = vec4(1.0, 1.0, 1.0, texture3D(clouds, coords).r);
     rgba.rgb *= max(1.0-timeOfDayRatio, 0.2);
     gl_FragColor = rgba;
     float hlim = 0.55;
@@ -0,0 +1,14 @@
+// Film grain, per pixel noise that changes 24 times a second.
+
+//unif: grainAmount = 0.08
+//uses: time
+
+uniform float grainAmount;
+
+vec4 FilmGrain(vec4 color) {
+    // The frame number wraps so the hash input stays small.
+    float frame = mod(floor(time * 24.0), 64.0);
+    vec2 p = gl_FragCoord.xy + frame * vec2(17.0, 29.0);
+    float noise = fract(sin(dot(p, vec2(12.9898, 78.233))) * 43758.5453);
+    return vec4(color.rgb + (noise - 0.5) * grainAmount, color.a);
+}
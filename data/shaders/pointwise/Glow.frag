@@ -0,0 +1,12 @@
+// Glow composite, the scene plus the glow built by the passes of the
+// glow stage.
+
+//unif: glowCoefficients = 0.75 0.3
+
+uniform sampler2D glowScene;
+uniform vec2 glowCoefficients;
+
+vec4 Glow(vec4 color) {
+    vec4 orig = texture2D(glowScene, texCoord);
+    return glowCoefficients.x * orig + glowCoefficients.y * color;
+}
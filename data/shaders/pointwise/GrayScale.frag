@@ -0,0 +1,6 @@
+// Gray scale from the luminance of the color.
+
+vec4 GrayScale(vec4 color) {
+    float l = dot(color.rgb, vec3(0.299, 0.587, 0.114));
+    return vec4(l, l, l, color.a);
+}
@@ -0,0 +1,48 @@
+uniform vec3 viewPos;
+uniform vec3 offset;
+
+// Per level, set by the clipmap node.
+uniform vec2 levelOrigin;
+uniform float levelScale;
+uniform float sampleScale;
+uniform float morph;
+uniform sampler2D heights;
+uniform sampler2D coarseHeights;
+
+uniform float invSize;
+uniform float halfCells;
+uniform float morphWidth;
+uniform vec2 invMapSize;
+
+varying float height;
+
+varying vec3 eyeDir;
+
+varying vec2 texCoord;
+
+void main()
+{
+    // Grid position in samples of the level.
+    vec2 p = levelOrigin + gl_Vertex.xy;
+
+    float h = texture2DLod(heights, (p + 0.5) * invSize, 0.0).x;
+
+    // Blend to the next level near the outer edge, the coarse
+    // heights are interpolated halfway between its samples.
+    vec2 d = abs(p - (levelOrigin + halfCells));
+    float alpha = clamp((max(d.x, d.y) - (halfCells - morphWidth)) / morphWidth, 0.0, 1.0) * morph;
+    float coarse = texture2DLod(coarseHeights, (p * 0.5 + 0.5) * invSize, 0.0).x;
+    h = mix(h, coarse, alpha);
+
+    vec4 vertex = vec4(p.x * levelScale + offset.x, h + offset.y, p.y * levelScale + offset.z, 1.0);
+
+    texCoord = p * sampleScale * invMapSize;
+
+    // Calculate the eyeDir relative to the vertex.
+    eyeDir = viewPos - vertex.xyz;
+
+    height = vertex.y;
+
+    gl_ClipVertex = gl_ModelViewMatrix * vertex;
+    gl_Position = gl_ModelViewProjectionMatrix * vertex;
+}
@@ -0,0 +1,14 @@
+# Compact terrain patch shader resource.
+
+# Vertext shader program.
+vert: shaders/terrain3D/TerrainPatch.vert
+
+# Fragment shader program.
+frag: shaders/terrain3D/Terrain3D.frag
+
+# Uniform values
+
+unif: spec[0] = 0.2 128.0
+unif: spec[1] = 0.0 1.0
+unif: spec[2] = 0.7 32.0
+unif: spec[3] = 0.1 64.0
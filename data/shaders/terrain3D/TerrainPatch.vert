@@ -0,0 +1,51 @@
+uniform vec3 viewPos;
+uniform vec3 offset;
+uniform float widthScale;
+uniform vec2 invMapSize;
+uniform float heightBase;
+uniform float heightStep;
+uniform float morphStep;
+
+// Per patch, set by the patch node: the grid position of its corner.
+uniform vec2 patchOrigin;
+
+// The row of a vertex in the patch is kept above its column.
+const float ROW_STRIDE = 256.0;
+
+// Steps of the morph distance code in a doubling of the distance.
+const float OCTAVE = 1024.0;
+
+varying float height;
+
+varying vec3 eyeDir;
+
+varying vec2 texCoord;
+
+void main()
+{
+    float row = floor(gl_Vertex.x / ROW_STRIDE);
+    vec2 p = patchOrigin + vec2(gl_Vertex.x - row * ROW_STRIDE, row);
+
+    vec4 vertex = vec4(p.x * widthScale + offset.x,
+                       gl_Vertex.y * heightStep + heightBase,
+                       p.y * widthScale + offset.z, 1.0);
+    float morphValue = gl_Vertex.z * morphStep;
+    // Where the morph delta shows less than the pixel tolerance.
+    float morphDistance = exp2(gl_Vertex.w / OCTAVE) - 1.0;
+
+    // Every patch drawing the vertex morphs it the same, entirely at
+    // twice the distance.
+    float dist = distance(viewPos, vertex.xyz);
+    float morphScale = clamp(dist / max(morphDistance, 0.001) - 1.0, 0.0, 1.0);
+    vertex.y += morphScale * morphValue;
+
+    texCoord = p * invMapSize;
+
+    // Calculate the eyeDir relative to the vertex.
+    eyeDir = viewPos - vertex.xyz;
+
+    height = vertex.y;
+
+    gl_ClipVertex = gl_ModelViewMatrix * vertex;
+    gl_Position = gl_ModelViewProjectionMatrix * vertex;
+}
@@ -13,6 +13,7 @@
 #include <Logging/StreamLogger.h>
 #include <Core/Engine.h>
 #include <Core/EngineEvents.h>
+#include <Core/Mutex.h>
 #include <Display/Camera.h>
 #include <Display/Frustum.h>
 #include <Display/PerspectiveViewingVolume.h>
@@ -21,12 +22,13 @@
 #include <Resources/ResourceManager.h>
 #include <Resources/Directory.h>
 #include <Resources/Texture3D.h>
-#include <Resources/Texture3DFileListResource.h>
 #include <Scene/BlendingNode.h>
 #include <Scene/MeshNode.h>
 #include <Scene/SceneNode.h>
 #include <Devices/IMouse.h>
 #include <Devices/IKeyboard.h>
+#include <Math/RandomGenerator.h>
+#include <Math/Matrix.h>
 #include <Utils/Timer.h>
 
 // SDL extension
@@ -45,13 +47,14 @@
 #include <Display/RenderCanvas.h>
 #include <Display/OpenGL/TextureCopy.h>
 #include "Scene/Island.h"
-#include <Scene/GrassNode.h>
+#include "scene/InstancedGrassNode.h"
+#include "scene/ClipmapNode.h"
+#include "scene/TerrainPatchNode.h"
 #include <Scene/SunNode.h>
 #include <Scene/WaterNode.h>
 #include <Resources/FreeImage.h>
 #include <Utils/TerrainUtils.h>
 #include <Utils/TerrainTexUtils.h>
-#include <Utils/ValueNoise.h>
 
 // Fps stuff
 #include <Display/HUD.h>
@@ -67,6 +70,22 @@
 #include <Utils/CameraInspector.h>
 
 #include "TerrainHandler.h"
+#include "CloudVolume.h"
+#include "AssetCache.h"
+#include "MappedTexture3D.h"
+#include "HeightMapBlur.h"
+#include "TiledHeightMap.h"
+#include "HeightField.h"
+#include "IslandMaterials.h"
+#include "GrassMask.h"
+#include "TerrainPatchCuller.h"
+#include "StartupGraph.h"
+#include "ShaderCache.h"
+#include "TextureStreamer.h"
+#include "FrameBenchmark.h"
+#include "PostProcessTimer.h"
+#include "PostProcessPipeline.h"
+#include "TimedRenderingView.h"
 
 // Mesh stuff
 #include <Utils/MeshCreator.h>
@@ -101,6 +120,10 @@ Frustum* frustum;
 IRenderingView* renderingview;
 TextureLoader* textureloader;
 HUD* hud;
+FrameBenchmark* benchmark = NULL;
+PostProcessTimer* ppTimer;
+StartupGraph* startup;
+TextureStreamer* streamer;
 
 bool useShader = true;
 
@@ -208,15 +231,40 @@ public:
     }
 };
 
+// Points a shader lit by the sun at it.
+class LightDirAnimator
+    : public IListener<Core::ProcessEventArg> {
+    IShaderResourcePtr shader;
+    SunNode& sun;
 
-class Delayed3dTextureLoader 
-    : public IListener<Renderers::RenderingEventArg> {
-private:
-    ITexture3DPtr tex;
 public:
-    Delayed3dTextureLoader(ITexture3DPtr tex) : tex(tex) {}
-    void Handle(RenderingEventArg arg) {
-        arg.renderer.LoadTexture(tex);
+    LightDirAnimator(IShaderResourcePtr shader, SunNode& sun)
+        : shader(shader), sun(sun) {}
+
+    void Handle(Core::ProcessEventArg arg) {
+        shader->SetUniform("lightDir", sun.GetPos().GetNormalize());
+    }
+};
+
+// Gives the volume rendering the camera it casts rays from and the
+// time the clouds drift with.
+class RayCastAnimator
+    : public IListener<Core::ProcessEventArg> {
+    IShaderResourcePtr shader;
+    IViewingVolume& view;
+    float time;
+
+public:
+    RayCastAnimator(IShaderResourcePtr shader, IViewingVolume& view)
+        : shader(shader), view(view), time(0.0) {}
+
+    void Handle(Core::ProcessEventArg arg) {
+        time += arg.approx / 1000.0;
+        Matrix<4, 4, float> viewProjection =
+            view.GetViewMatrix() * view.GetProjectionMatrix();
+        shader->SetUniform("viewProjectionInverse", viewProjection.GetInverse());
+        shader->SetUniform("viewPos", view.GetPosition());
+        shader->SetUniform("time", time);
     }
 };
 
@@ -249,18 +297,65 @@ public:
 
 class GlowHandler{
 private:
-    IShaderResourcePtr glow;
+    PostProcessPipeline::Stage& glow;
+    Vector<3, float> coefficients;
 public:
-    GlowHandler(IShaderResourcePtr g) {
-        glow = g;
-    }
+    GlowHandler(PostProcessPipeline::Stage& g)
+        : glow(g), coefficients(0.75, 0.3, 0.0) {}
     void SetCoefficients(Vector<3, float> c){
-        glow->SetUniform("coefficients", c);
+        coefficients = c;
+        glow.SetUniform("glowCoefficients", Vector<2, float>(c[0], c[1]));
     }
     Vector<3, float> GetCoefficients(){
-        Vector<3, float> ret;
-        glow->GetUniform("coefficients",ret);
-        return ret;
+        return coefficients;
+    }
+};
+
+// The composite of the low resolution depth of field reads the
+// scene from the frame buffer of the innermost pass.
+class LowDepthOfFieldSetup : public PostProcessPipeline::IStageSetup {
+    IShaderResourcePtr composite;
+public:
+    LowDepthOfFieldSetup(IShaderResourcePtr composite) : composite(composite) {}
+    void Setup(PostProcessPipeline::Stage& stage, ISceneNode* node) {
+        PostProcessNode* prepare = (PostProcessNode*)stage.GetPass(3);
+        composite->SetTexture("scene", prepare->GetSceneFrameBuffer()->GetTexAttachment(0));
+        composite->SetTexture("sceneDepth", prepare->GetSceneFrameBuffer()->GetDepthTexture());
+    }
+};
+
+// The composite of the low resolution volume rendering reads the
+// scene from the frame buffer of the ray casting pass.
+class VolumeSetup : public PostProcessPipeline::IStageSetup {
+    IShaderResourcePtr composite;
+public:
+    VolumeSetup(IShaderResourcePtr composite) : composite(composite) {}
+    void Setup(PostProcessPipeline::Stage& stage, ISceneNode* node) {
+        PostProcessNode* rayCast = (PostProcessNode*)stage.GetPass(1);
+        composite->SetTexture("scene", rayCast->GetSceneFrameBuffer()->GetTexAttachment(0));
+        composite->SetTexture("sceneDepth", rayCast->GetSceneFrameBuffer()->GetDepthTexture());
+    }
+};
+
+// Connects the glow pyramid. The passes are, from the outside in,
+// the final upsample, an up pass per level from the second and a
+// down pass per level from the scene. Each up pass adds the level
+// made by the down pass reading that level.
+class GlowSetup : public PostProcessPipeline::IStageSetup {
+    IShaderResourcePtr upsample;
+    std::vector<IShaderResourcePtr> ups;
+public:
+    GlowSetup(IShaderResourcePtr upsample, std::vector<IShaderResourcePtr> ups)
+        : upsample(upsample), ups(ups) {}
+    void Setup(PostProcessPipeline::Stage& stage, ISceneNode* node) {
+        unsigned int passes = 2 * (ups.size() + 1);
+        PostProcessNode* scene = (PostProcessNode*)stage.GetPass(passes - 1);
+        stage.SetTexture("glowScene", scene->GetSceneFrameBuffer()->GetTexAttachment(0));
+        upsample->SetTexture("sceneDepth", scene->GetSceneFrameBuffer()->GetDepthTexture());
+        for (unsigned int i = 0; i < ups.size(); ++i) {
+            PostProcessNode* down = (PostProcessNode*)stage.GetPass(passes - 2 - i);
+            ups[i]->SetTexture("level", down->GetSceneFrameBuffer()->GetTexAttachment(0));
+        }
     }
 };
 
@@ -296,105 +391,37 @@ public:
 namespace OpenEngine {
 namespace Utils {
 namespace Inspection {
-    ValueList PPInspect(ChainPostProcessNode* glow,
-                        ChainPostProcessNode* depthOfField,
-                        PostProcessNode* volumeRendering,
-                        PostProcessNode* motionBlur,
-                        PostProcessNode* filmGrain,
-                        PostProcessNode* grayscale,
-                        PostProcessNode* underwater,
-                        PostProcessNode* edgeDetection) {
+    ValueList PPInspect(PostProcessPipeline* pipeline) {
+        const char* names[] = { "Glow", "Depth Of Field",
+                                "Low Res Depth Of Field", "Volume Rendering",
+                                "Motion Blur", "Film Grain", "Grayscale",
+                                "Underwater", "Edge Detection" };
         ValueList values;
-        {
-            RWValueCall<ChainPostProcessNode, bool> *v
-                = new RWValueCall<ChainPostProcessNode, bool>
-                (*glow,
-                 &ChainPostProcessNode::Enabled,
-                 &ChainPostProcessNode::SetEnabled);
-            v->name = "Glow";
-            values.push_back(v);
-        }
-        {
-            GlowHandler* gh = new GlowHandler(glow->GetPostProcessNode(0)->GetEffect());
-            RWValueCall<GlowHandler, Vector<3, float> > *v
-                = new RWValueCall<GlowHandler, Vector<3, float> >
-                (*gh,
-                 &GlowHandler::GetCoefficients,
-                 &GlowHandler::SetCoefficients);
-            v->name = "Glow coefficients";
-            /*
-            v->properties[MIN] = 0;
-            v->properties[MAX] = 1;
-            v->properties[STEP] = 0.01;
-            */
-            values.push_back(v);
-        }
-        {
-            RWValueCall<ChainPostProcessNode, bool> *v
-                = new RWValueCall<ChainPostProcessNode, bool>
-                (*depthOfField,
-                 &ChainPostProcessNode::Enabled,
-                 &ChainPostProcessNode::SetEnabled);
-            v->name = "Depth Of Field";
-            values.push_back(v);
+        for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+            {
+                PostProcessPipeline::Stage* stage = pipeline->GetStage(names[i]);
+                RWValueCall<PostProcessPipeline::Stage, bool> *v
+                    = new RWValueCall<PostProcessPipeline::Stage, bool>
+                    (*stage,
+                     &PostProcessPipeline::Stage::Enabled,
+                     &PostProcessPipeline::Stage::SetEnabled);
+                v->name = names[i];
+                values.push_back(v);
+            }
+            if (i == 0) {
+                GlowHandler* gh = new GlowHandler(*pipeline->GetStage(names[i]));
+                RWValueCall<GlowHandler, Vector<3, float> > *v
+                    = new RWValueCall<GlowHandler, Vector<3, float> >
+                    (*gh,
+                     &GlowHandler::GetCoefficients,
+                     &GlowHandler::SetCoefficients);
+                v->name = "Glow coefficients";
+                values.push_back(v);
+            }
         }
-        {
-            RWValueCall<PostProcessNode, bool> *v
-                = new RWValueCall<PostProcessNode, bool>
-                (*volumeRendering,
-                 &PostProcessNode::GetEnabled,
-                 &PostProcessNode::SetEnabled);
-            v->name = "Volume Rendering";
-            values.push_back(v);
-        }
-        {
-            RWValueCall<PostProcessNode, bool> *v
-                = new RWValueCall<PostProcessNode, bool>
-                (*motionBlur,
-                 &PostProcessNode::GetEnabled,
-                 &PostProcessNode::SetEnabled);
-            v->name = "Motion Blur";
-            values.push_back(v);
-        }
-        {
-            RWValueCall<PostProcessNode, bool> *v
-                = new RWValueCall<PostProcessNode, bool>
-                (*filmGrain,
-                 &PostProcessNode::GetEnabled,
-                 &PostProcessNode::SetEnabled);
-            v->name = "Film Grain";
-            values.push_back(v);
-        }
-        {
-            RWValueCall<PostProcessNode, bool> *v
-                = new RWValueCall<PostProcessNode, bool>
-                (*grayscale,
-                 &PostProcessNode::GetEnabled,
-                 &PostProcessNode::SetEnabled);
-            v->name = "Grayscale";
-            values.push_back(v);
-        }
-        {
-            RWValueCall<PostProcessNode, bool> *v
-                = new RWValueCall<PostProcessNode, bool>
-                (*underwater,
-                 &PostProcessNode::GetEnabled,
-                 &PostProcessNode::SetEnabled);
-            v->name = "Underwater";
-            values.push_back(v);
-        }
-        {
-            RWValueCall<PostProcessNode, bool> *v
-                = new RWValueCall<PostProcessNode, bool>
-                (*edgeDetection,
-                 &PostProcessNode::GetEnabled,
-                 &PostProcessNode::SetEnabled);
-            v->name = "Edge detection";
-            values.push_back(v);
-        }
-
         return values;
     }
+
 ValueList Inspect(SunNode *sun, CloudAnimator *ca) {
     ValueList values;
     {
@@ -435,8 +462,149 @@ ValueList Inspect(SunNode *sun, CloudAnimator *ca) {
     }
     return values;    
 }
+
+ValueList PPTimingInspect(PostProcessTimer* timer) {
+    ValueList values;
+    const std::vector<PostProcessStage*>& stages = timer->GetStages();
+    for (unsigned int i = 0; i < stages.size(); ++i) {
+        {
+            RValueCall<PostProcessStage, float> *v
+                = new RValueCall<PostProcessStage, float>
+                (*stages[i], &PostProcessStage::GetGPU);
+            v->name = stages[i]->GetName() + " GPU ms";
+            values.push_back(v);
+        }
+        {
+            RValueCall<PostProcessStage, float> *v
+                = new RValueCall<PostProcessStage, float>
+                (*stages[i], &PostProcessStage::GetCPU);
+            v->name = stages[i]->GetName() + " CPU ms";
+            values.push_back(v);
+        }
+    }
+    return values;
+}
+
+// The timing bar lists the stages the timer knows when it is built.
+// Enabling a stage can add new ones, such as a newly fused group of
+// pointwise stages, so the bar is built again when the count changes.
+class PPTimingBar : public IListener<RenderingEventArg> {
+    AntTweakBar& atb;
+    PostProcessTimer& timer;
+    InspectionBar* bar;
+    unsigned int stages;
+public:
+    PPTimingBar(AntTweakBar& atb, PostProcessTimer& timer)
+        : atb(atb), timer(timer), bar(NULL), stages(0) {
+        Rebuild();
+    }
+
+    void Rebuild() {
+        if (bar) TwDeleteBar(bar->GetBar());
+        stages = timer.GetStages().size();
+        bar = new InspectionBar("Post Process Timing", PPTimingInspect(&timer));
+        atb.AddBar(bar);
+    }
+
+    void Handle(RenderingEventArg arg) {
+        if (timer.GetStages().size() != stages)
+            Rebuild();
+    }
+};
+
+ValueList PatchCullInspect(TerrainPatchCuller* culler) {
+    ValueList values;
+    {
+        RWValueCall<TerrainPatchCuller, bool> *v
+            = new RWValueCall<TerrainPatchCuller, bool>
+            (*culler,
+             &TerrainPatchCuller::GetHorizonTest,
+             &TerrainPatchCuller::SetHorizonTest);
+        v->name = "horizon test";
+        values.push_back(v);
+    }
+    {
+        RValueCall<TerrainPatchCuller, unsigned int> *v
+            = new RValueCall<TerrainPatchCuller, unsigned int>
+            (*culler, &TerrainPatchCuller::GetDrawn);
+        v->name = "drawn";
+        values.push_back(v);
+    }
+    {
+        RValueCall<TerrainPatchCuller, unsigned int> *v
+            = new RValueCall<TerrainPatchCuller, unsigned int>
+            (*culler, &TerrainPatchCuller::GetFrustumCulled);
+        v->name = "frustum culled";
+        values.push_back(v);
+    }
+    {
+        RValueCall<TerrainPatchCuller, unsigned int> *v
+            = new RValueCall<TerrainPatchCuller, unsigned int>
+            (*culler, &TerrainPatchCuller::GetHorizonCulled);
+        v->name = "horizon culled";
+        values.push_back(v);
+    }
+    return values;
+}
+
+ValueList TerrainLODInspect(TerrainPatchNode* node) {
+    ValueList values;
+    {
+        RWValueCall<TerrainPatchNode, float> *v
+            = new RWValueCall<TerrainPatchNode, float>
+            (*node,
+             &TerrainPatchNode::GetPixelTolerance,
+             &TerrainPatchNode::SetPixelTolerance);
+        v->name = "pixel tolerance";
+        v->properties[MIN] = 0.25;
+        v->properties[MAX] = 16.0;
+        v->properties[STEP] = 0.25;
+        values.push_back(v);
+    }
+    {
+        RValueCall<TerrainPatchNode, unsigned int> *v
+            = new RValueCall<TerrainPatchNode, unsigned int>
+            (*node, &TerrainPatchNode::GetDrawnVertices);
+        v->name = "vertices drawn";
+        values.push_back(v);
+    }
+    return values;
+}
 }}}
 
+// Reports the patch counts of the frame just rendered to the frame
+// benchmark.
+class PatchCullCounter
+    : public IListener<Renderers::RenderingEventArg> {
+    TerrainPatchCuller& culler;
+    FrameBenchmark& benchmark;
+    unsigned int drawn, frustumCulled, horizonCulled;
+
+public:
+    PatchCullCounter(TerrainPatchCuller& culler, FrameBenchmark& benchmark)
+        : culler(culler), benchmark(benchmark),
+          drawn(benchmark.AddCounter("patches_drawn")),
+          frustumCulled(benchmark.AddCounter("patches_frustum_culled")),
+          horizonCulled(benchmark.AddCounter("patches_horizon_culled")) {}
+
+    void Handle(Renderers::RenderingEventArg arg) {
+        benchmark.SetCounter(drawn, culler.GetDrawn());
+        benchmark.SetCounter(frustumCulled, culler.GetFrustumCulled());
+        benchmark.SetCounter(horizonCulled, culler.GetHorizonCulled());
+    }
+};
+
+class TimingDumper : public Core::IListener<Devices::KeyboardEventArg> {
+    PostProcessTimer& timer;
+public:
+    TimingDumper(PostProcessTimer& timer) : timer(timer) {}
+
+    void Handle(Devices::KeyboardEventArg arg){
+        if (arg.type == EVENT_PRESS && arg.sym == KEY_F6)
+            timer.Dump();
+    }
+};
+
 class AntToggler : public Core::IListener<Devices::KeyboardEventArg> {
     Display::AntTweakBar* atb;
 public:
@@ -452,6 +620,227 @@ public:
 void SetupDisplay();
 void SetupRendering();
 
+// Attach a listener to the engine process event, timed when running
+// the frame benchmark.
+void AttachProcess(IListener<Core::ProcessEventArg>& listener, std::string name) {
+    if (benchmark)
+        engine->ProcessEvent().Attach(*(new TimedListener<Core::ProcessEventArg>
+                                        (listener, *benchmark, name)));
+    else
+        engine->ProcessEvent().Attach(listener);
+}
+
+// The shader resource of a level of the glow pyramid. The post
+// process node of a pass binds its own frame buffer to the shader, so
+// the passes cannot share the one resource the resource manager hands
+// out for a file. Each level gets a resource of its own, made from
+// the same file the way the shader plugin makes them.
+IShaderResourcePtr GlowShader(std::string name) {
+    std::string file = DirectoryManager::FindFileInPath("shaders/" + name + ".glsl");
+    return IShaderResourcePtr(new OpenGLShader(file));
+}
+
+// What the startup stages make, and the settings they make it from.
+struct StartupAssets {
+    GeneratedAssetCache& cache;
+    // The resource manager and the logger are not safe to call from
+    // several stages at once.
+    Core::Mutex resources;
+    unsigned int blurPasses;
+    float widthScale, heightScale;
+    Vector<3, float> landOffset;
+    unsigned int grassCell;
+    // The island node builds its vertex buffers only if it draws the
+    // terrain itself, the heights are read from it then.
+    bool drawIsland;
+
+    FloatTexture2DPtr map;
+    TiledHeightMap* heightTiles;
+    Island* land;
+    HeightField* heightField;
+    IHeightField* heights;
+    GrassMask* grassMask;
+    TerrainPatchCuller* patchCuller;
+    FloatMappedTexture3DPtr cloudTexture, cloudOccupancy;
+    UCharTexture2DPtr stars;
+
+    StartupAssets(GeneratedAssetCache& cache)
+        : cache(cache), blurPasses(3), widthScale(2.0), heightScale(1.5),
+          landOffset(0, -10.75, 0), grassCell(2), drawIsland(false),
+          heightTiles(NULL), land(NULL), heightField(NULL), heights(NULL),
+          grassMask(NULL), patchCuller(NULL) {}
+};
+
+void LoadHeightMap(StartupAssets& a) {
+    a.resources.Lock();
+    UCharTexture2DPtr tmap = ResourceManager<UCharTexture2D>
+        ::Create("textures/heightmap.png");
+    a.resources.Unlock();
+    tmap->Load();
+    FloatTexture2DPtr map = TiledHeightMap::ToHeightMap(tmap);
+    tmap->Unload();
+    tmap.reset();
+    map->SetWrapping(CLAMP_TO_EDGE);
+    map->SetColorFormat(LUMINANCE32F);
+    HeightMapBlur::BoxBlur(map, a.blurPasses);
+    a.map = map;
+}
+
+// Tiled copy of the height map for the parts of the terrain that
+// page heights in around the camera.
+void BuildHeightTiles(StartupAssets& a) {
+    std::string tilesAsset = "heightmap.tiles";
+    AssetKey tilesKey("TiledHeightMap 1");
+    tilesKey.AddFile("textures/heightmap.png").Add(a.blurPasses)
+        .Add(TiledHeightMap::DEFAULT_TILE_SIZE);
+    if (!a.cache.IsValid(tilesAsset, tilesKey)) {
+        a.resources.Lock();
+        logger.info << "tiling height map" << logger.end;
+        a.resources.Unlock();
+        TiledHeightMap::Build(a.map, a.cache.GetTempPath(tilesAsset));
+        a.cache.Commit(tilesAsset, tilesKey);
+    }
+    // Logs the tile layout.
+    a.resources.Lock();
+    a.heightTiles = new TiledHeightMap(a.cache.GetPath(tilesAsset), 64 << 20);
+    a.resources.Unlock();
+}
+
+void BuildIsland(StartupAssets& a) {
+    // The island takes the lock itself around the resource manager,
+    // its textures are decoded and packed alongside the other stages.
+    Island* land = new Island(a.map, a.cache, *streamer, a.resources);
+    land->SetHeightScale(a.heightScale);
+    land->SetWidthScale(a.widthScale);
+    land->SetOffset(a.landOffset);
+    a.land = land;
+    if (a.drawIsland)
+        a.heights = new NodeHeightField(land);
+}
+
+// Heights and normal map of the terrain when the island node does
+// not draw it.
+void BuildHeightField(StartupAssets& a) {
+    a.heightField = new HeightField(a.map, a.heightScale, a.widthScale, a.landOffset);
+    a.heights = a.heightField;
+}
+
+// Grass mask, baked once from the height map and kept up to date
+// with the terrain edits.
+void BakeGrassMask(StartupAssets& a) {
+    a.grassMask = new GrassMask(a.heights, a.map->GetWidth(), a.map->GetHeight(),
+                                a.widthScale, a.grassCell);
+    std::string grassAsset = "grass.mask";
+    AssetKey grassKey("GrassMask 1");
+    grassKey.AddFile("textures/heightmap.png").Add(a.blurPasses)
+        .Add(a.heightScale).Add(a.widthScale).Add(a.grassCell);
+    if (!a.cache.IsValid(grassAsset, grassKey) ||
+        !a.grassMask->Load(a.cache.GetPath(grassAsset))) {
+        a.resources.Lock();
+        logger.info << "baking grass mask" << logger.end;
+        a.resources.Unlock();
+        a.grassMask->Bake();
+        a.grassMask->Save(a.cache.GetTempPath(grassAsset));
+        a.cache.Commit(grassAsset, grassKey);
+    }
+}
+
+// Patches outside the frustum or behind the terrain are not drawn.
+void MeasurePatches(StartupAssets& a) {
+    a.patchCuller = new TerrainPatchCuller
+        (a.heights, a.map->GetWidth(), a.map->GetHeight());
+}
+
+void GenerateClouds(StartupAssets& a) {
+    const unsigned int cloudRes[3] = {128, 128, 64};
+    const unsigned int cloudBlur = 3, cloudLayers = 3, cloudSeed = 0;
+    const float cloudBandwidth = 128, cloudMRes = 0.5, cloudMBand = 1;
+    // The density is kept as a single channel, 16 bit floats on the
+    // GPU, next to a map of the largest density in each 8^3 brick
+    // that rays use to skip empty space.
+    const unsigned int cloudBrick = 8;
+    std::string cloudAsset = "clouds.3d.raw";
+    std::string brickAsset = "clouds.bricks.raw";
+    std::string foldername = a.cache.GetPath(cloudAsset);
+    AssetKey cloudKey("CloudVolume 2");
+    cloudKey.Add(cloudRes[0]).Add(cloudRes[1]).Add(cloudRes[2])
+        .Add(cloudBandwidth).Add(cloudMRes).Add(cloudMBand)
+        .Add(cloudBlur).Add(cloudLayers).Add(cloudSeed).Add(cloudBrick);
+    if (!a.cache.IsValid(cloudAsset, cloudKey) ||
+        !a.cache.IsValid(brickAsset, cloudKey)) {
+        a.resources.Lock();
+        logger.info << "generating 3d texture: " << foldername << logger.end;
+        a.resources.Unlock();
+        FloatTexture3DPtr cloudChannel = 
+            CloudVolume::Generate(cloudRes[0], cloudRes[1], cloudRes[2],
+                                  cloudBandwidth, cloudMRes, cloudMBand,
+                                  cloudBlur, cloudLayers, cloudSeed);
+        CloudVolume::Normalize(cloudChannel,0,1); 
+        CloudVolume::ExpCurve(cloudChannel);
+        cloudChannel->SetColorFormat(LUMINANCE32F);
+        FloatMappedTexture3D::Write(cloudChannel,
+                                    a.cache.GetTempPath(cloudAsset), false);
+        FloatTexture3DPtr bricks = CloudVolume::Occupancy(cloudChannel, cloudBrick);
+        bricks->SetColorFormat(LUMINANCE32F);
+        FloatMappedTexture3D::Write(bricks, a.cache.GetTempPath(brickAsset), false);
+        a.cache.Commit(cloudAsset, cloudKey);
+        a.cache.Commit(brickAsset, cloudKey);
+    }
+    a.resources.Lock();
+    logger.info << "loading 3d texture: " << foldername << logger.end;
+    a.resources.Unlock();
+    a.cloudTexture = FloatMappedTexture3D::Create(foldername);
+    a.cloudTexture->SetMipmapping(true);
+    a.cloudTexture->SetWrapping(REPEAT);
+    a.cloudTexture->SetCompression(false);
+    a.cloudTexture->SetHalfFloat(true);
+
+    a.cloudOccupancy = FloatMappedTexture3D::Create(a.cache.GetPath(brickAsset));
+    a.cloudOccupancy->SetMipmapping(false);
+    a.cloudOccupancy->SetWrapping(REPEAT);
+}
+
+void LoadStars(StartupAssets& a) {
+    std::string starAsset = "stars/stars.png";
+    std::string starFile = a.cache.GetPath(starAsset);
+    unsigned int ssize = 512; //sampled for the report at 128.
+    unsigned int starCount = 200;
+    AssetKey starKey("stars 1");
+    starKey.Add(ssize).Add(starCount);
+    UCharTexture2DPtr stars;
+    if (a.cache.IsValid(starAsset, starKey)) {
+        a.resources.Lock();
+        logger.info << "loading texture: " << starFile << logger.end;
+        stars = ResourceManager<UCharTexture2D>::Create(starFile);
+        a.resources.Unlock();
+    } else {
+        a.resources.Lock();
+        logger.info << "generating texture: " << starFile << logger.end;
+        a.resources.Unlock();
+        stars = UCharTexture2DPtr(new Texture2D<unsigned char>(ssize,ssize,1));
+        unsigned char* data = stars->GetData();
+        RandomGenerator r;
+        for (unsigned int n=0; n<starCount; n++) {
+            float dist = r.UniformFloat(0.05, 0.9);
+            float angle = r.UniformFloat(0, 2*PI);
+            unsigned int x = (unsigned int)
+                (ssize/2 + cos(angle) * dist * ssize/2);
+            unsigned int y = (unsigned int)
+                (ssize/2 + sin(angle) * dist * ssize/2);
+            data[x+y*ssize] = (unsigned char)
+                (255 * r.UniformFloat(0.5, 0.9));
+        }
+        stars = TexUtils::ToRGBAfromLuminance(stars);
+        a.resources.Lock();
+        TextureTool<unsigned char>::DumpTexture
+            (stars, a.cache.GetTempPath(starAsset));
+        a.resources.Unlock();
+        a.cache.Commit(starAsset, starKey);
+    }
+    streamer->Add(stars, "stars", Vector<4, unsigned char>(0, 0, 0, 0));
+    a.stars = stars;
+}
+
 int main(int argc, char** argv) {
     // create a logger to std out    
     Logger::AddLogger(new StreamLogger(&std::cout));
@@ -459,12 +848,59 @@ int main(int argc, char** argv) {
     logger.info << "current working directory: " 
                 << Directory::GetCWD()<< logger.end;
 
+    if (argc > 1 && std::string(argv[1]) == "--benchmark-clouds") {
+        CloudVolume::Benchmark(128);
+        CloudVolume::Benchmark(512);
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--benchmark-blur") {
+        HeightMapBlur::Benchmark(1024);
+        HeightMapBlur::Benchmark(4096);
+        HeightMapBlur::Benchmark(16384);
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--benchmark-materials") {
+        IslandMaterials::Benchmark(1024);
+        IslandMaterials::Benchmark(4096);
+        return EXIT_SUCCESS;
+    }
+
+    // Startup is timed from here to the first frame.
+    startup = new StartupGraph();
 
     // setup the engine
     engine = new Engine;
 
     SetupDisplay();
 
+    // --benchmark-frames [frames] [output] flies the camera along a
+    // fixed path and writes frame timings instead of running
+    // interactively. See BENCHMARK for running it on software GL.
+    if (argc > 1 && std::string(argv[1]) == "--benchmark-frames") {
+        unsigned int frames = argc > 2 ? atoi(argv[2]) : 600;
+        std::string output = argc > 3 ? argv[3] : "frames.json";
+        benchmark = new FrameBenchmark(*engine, *camera, frames, output);
+    }
+
+    // --dof-half or --dof-quarter starts with the low resolution
+    // depth of field instead of the full resolution chain.
+    // --volume-rendering starts with the volume rendering enabled.
+    // --clipmap draws the terrain as a geometry clipmap fed from the
+    // tiled height map instead of the height map patches.
+    // --height-map-patches draws the patches of the height map node
+    // instead of the compact terrain patches.
+    unsigned int dofReduction = 0;
+    bool volumeRendering = false;
+    bool clipmap = false;
+    bool heightMapPatches = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--dof-half") dofReduction = 2;
+        if (std::string(argv[i]) == "--dof-quarter") dofReduction = 4;
+        if (std::string(argv[i]) == "--volume-rendering") volumeRendering = true;
+        if (std::string(argv[i]) == "--clipmap") clipmap = true;
+        if (std::string(argv[i]) == "--height-map-patches") heightMapPatches = true;
+    }
+
     // add plug-ins
     ResourceManager<ITexture2D>::AddPlugin(new FreeImagePlugin());
     ResourceManager<UCharTexture2D>::AddPlugin(new UCharFreeImagePlugin());
@@ -472,10 +908,19 @@ int main(int argc, char** argv) {
     ResourceManager<IShaderResource>::AddPlugin(new GLShaderPlugin());
 
     DirectoryManager::AppendPath("projects/Terrain/data/");
+    GeneratedAssetCache assetCache(datadir + "generated/");
+    // The driver is asked to keep the linked shader programs between
+    // runs, until a shader source or the driver changes. Set up
+    // before the GL context is made.
+    std::vector<std::string> shaderDirs;
+    shaderDirs.push_back(datadir + "shaders");
+    shaderDirs.push_back("extensions/OpenGLPostProcessEffects/shaders");
+    ShaderCache* shaderCache = new ShaderCache(assetCache, shaderDirs);
 
     scene = new SceneNode();
 
     SetupRendering();
+    startup->AddUpload("shader cache", *shaderCache);
 
     // Setup fps counter
     // FPSSurfacePtr fps = FPSSurface::Create();
@@ -489,63 +934,95 @@ int main(int argc, char** argv) {
     // Setup scene
     Vector<2, int> dimension(800, 600);
     //Vector<2, int> dimension(1440, 900);
-    std::list<IShaderResourcePtr> effects;
-    IShaderResourcePtr glow = ResourceManager<IShaderResource>::Create("shaders/glow.glsl");
-    effects.push_back(glow);
-    effects.push_back(ResourceManager<IShaderResource>::Create("shaders/HorizontalCircleBlur.glsl"));
-    ChainPostProcessNode* glowNode = new ChainPostProcessNode(effects, dimension, 1, true);
-    glow->SetTexture("scene", glowNode->GetPostProcessNode(1)->GetSceneFrameBuffer()->GetTexAttachment(0));
-    renderer->InitializeEvent().Attach(*glowNode);
+    // Post process effects. The nodes are made by the pipeline
+    // below, and only for the enabled effects. Pointwise effects are
+    // snippets the pipeline fuses into one pass.
+
+    // Glow pyramid: the scene is halved glowLevels times and each
+    // level is upsampled onto the one above it, so the glow gets
+    // wider with the levels at a few taps per level. The passes find
+    // their texel size from the screen space derivatives, so the
+    // shader of every level is the same apart from its textures.
+    const unsigned int glowLevels = 4;
+    Vector<2, int> glowSize[glowLevels + 1];
+    glowSize[0] = dimension;
+    for (unsigned int i = 1; i <= glowLevels; ++i)
+        glowSize[i] = Vector<2, int>(glowSize[i - 1][0] / 2, glowSize[i - 1][1] / 2);
+    std::list<PostProcessPipeline::Pass> glowPasses;
+    IShaderResourcePtr glowUpsample = ResourceManager<IShaderResource>::Create("shaders/GlowUpsample.glsl");
+    glowPasses.push_back(PostProcessPipeline::Pass(glowUpsample, glowSize[1]));
+    std::vector<IShaderResourcePtr> glowUps;
+    for (unsigned int i = 2; i <= glowLevels; ++i) {
+        IShaderResourcePtr up = GlowShader("GlowUp");
+        glowPasses.push_back(PostProcessPipeline::Pass(up, glowSize[i]));
+        glowUps.push_back(up);
+    }
+    for (int i = glowLevels - 1; i >= 0; --i)
+        glowPasses.push_back(PostProcessPipeline::Pass
+                             (GlowShader("GlowDown"), glowSize[i]));
 
     IShaderResourcePtr motionBlur = ResourceManager<IShaderResource>::Create("extensions/OpenGLPostProcessEffects/shaders/MotionBlur.glsl");
-    PostProcessNode* motionBlurNode = new PostProcessNode(motionBlur, dimension);
-    motionBlurNode->SetEnabled(false);
-    renderer->InitializeEvent().Attach(*motionBlurNode);
 
     std::list<IShaderResourcePtr> dof;
     dof.push_back(ResourceManager<IShaderResource>::Create("shaders/VerticalDepthOfField.glsl"));
     dof.push_back(ResourceManager<IShaderResource>::Create("shaders/HorizontalDepthOfField.glsl"));
-    ChainPostProcessNode* depthOfFieldNode = new ChainPostProcessNode(dof, dimension, 1, true);
-    depthOfFieldNode->SetEnabled(true);
-    renderer->InitializeEvent().Attach(*depthOfFieldNode);
 
+    // Low resolution depth of field: the circle of confusion is
+    // computed once while reducing the scene, the blur runs at the
+    // low resolution and a depth aware filter upsamples it.
+    unsigned int dofScale = dofReduction ? dofReduction : 2;
+    Vector<2, int> low(dimension[0] / dofScale, dimension[1] / dofScale);
+    IShaderResourcePtr dofPrepare = ResourceManager<IShaderResource>::Create("shaders/DepthOfFieldPrepare.glsl");
+    dofPrepare->SetUniform("sampleOffset", Vector<2, float>(dofScale / 4.0 / dimension[0],
+                                                            dofScale / 4.0 / dimension[1]));
+    IShaderResourcePtr dofBlurX = ResourceManager<IShaderResource>::Create("shaders/DepthOfFieldBlurX.glsl");
+    dofBlurX->SetUniform("direction", Vector<2, float>(1.0 / low[0], 0.0));
+    IShaderResourcePtr dofBlurY = ResourceManager<IShaderResource>::Create("shaders/DepthOfFieldBlurY.glsl");
+    dofBlurY->SetUniform("direction", Vector<2, float>(0.0, 1.0 / low[1]));
+    IShaderResourcePtr dofComposite = ResourceManager<IShaderResource>::Create("shaders/DepthOfFieldComposite.glsl");
+    dofComposite->SetUniform("lowSize", Vector<2, float>(low[0], low[1]));
+    std::list<PostProcessPipeline::Pass> lowDof;
+    lowDof.push_back(PostProcessPipeline::Pass(dofComposite, low));
+    lowDof.push_back(PostProcessPipeline::Pass(dofBlurY, low));
+    lowDof.push_back(PostProcessPipeline::Pass(dofBlurX, low));
+    lowDof.push_back(PostProcessPipeline::Pass(dofPrepare, dimension));
+
+    // Volume rendering: rays are cast at half resolution and
+    // composited over the scene with a depth aware upsample.
+    Vector<2, int> volumeSize(dimension[0] / 2, dimension[1] / 2);
     IShaderResourcePtr rayCast = ResourceManager<IShaderResource>::Create("shaders/RayCast.glsl");
-    PostProcessNode* rayCastNode = new PostProcessNode(rayCast, dimension);
-    rayCastNode->SetEnabled(false);
-    renderer->InitializeEvent().Attach(*rayCastNode);
-
-    IShaderResourcePtr filmGrain = ResourceManager<IShaderResource>::Create("extensions/OpenGLPostProcessEffects/shaders/FilmGrain.glsl");
-    PostProcessNode* filmGrainNode = new PostProcessNode(filmGrain, dimension);
-    filmGrainNode->SetEnabled(false);
-    renderer->InitializeEvent().Attach(*filmGrainNode);
-    
-    IShaderResourcePtr grayscale = ResourceManager<IShaderResource>::Create("extensions/OpenGLPostProcessEffects/shaders/GrayScale.glsl");
-    PostProcessNode* grayScaleNode = new PostProcessNode(grayscale, dimension);
-    grayScaleNode->SetEnabled(false);
-    renderer->InitializeEvent().Attach(*grayScaleNode);
-
+    IShaderResourcePtr volumeComposite = ResourceManager<IShaderResource>::Create("shaders/VolumeComposite.glsl");
+    volumeComposite->SetUniform("lowSize", Vector<2, float>(volumeSize[0], volumeSize[1]));
+    std::list<PostProcessPipeline::Pass> volumePasses;
+    volumePasses.push_back(PostProcessPipeline::Pass(volumeComposite, volumeSize));
+    volumePasses.push_back(PostProcessPipeline::Pass(rayCast, dimension));
     IShaderResourcePtr underwater = ResourceManager<IShaderResource>::Create("extensions/OpenGLPostProcessEffects/shaders/UnderWater.glsl");
-    PostProcessNode* underwaterNode = new PostProcessNode(underwater, dimension);
-    underwaterNode->SetEnabled(false);
-    renderer->InitializeEvent().Attach(*underwaterNode);
-
     IShaderResourcePtr edgeDetection = ResourceManager<IShaderResource>::Create("extensions/OpenGLPostProcessEffects/shaders/EdgeDetection.glsl");
-    PostProcessNode* edgeDetectionNode = new PostProcessNode(edgeDetection, dimension);
-    edgeDetectionNode->SetEnabled(false);
-    renderer->InitializeEvent().Attach(*edgeDetectionNode);
 
-    
-    UCharTexture2DPtr tmap = ResourceManager<UCharTexture2D>
-        ::Create("textures/heightmap.png");
-    tmap = ChangeChannels(tmap, 1);
-    FloatTexture2DPtr map = ConvertTex(tmap);
-    map->SetWrapping(CLAMP_TO_EDGE);
-    map->SetColorFormat(LUMINANCE32F);
-    BoxBlur(map);
-    BoxBlur(map);
-    BoxBlur(map);
-    const float widthScale = 2.0;
-    const float heightScale = 1.5;
+    // The independent parts of startup run side by side, the stages
+    // after the height map wait for it.
+    StartupAssets assets(assetCache);
+    assets.drawIsland = heightMapPatches && !clipmap;
+    unsigned int heightStage = startup->Add("height map", LoadHeightMap, assets);
+    startup->After(startup->Add("height tiles", BuildHeightTiles, assets), heightStage);
+    unsigned int islandStage = startup->Add("island", BuildIsland, assets);
+    startup->After(islandStage, heightStage);
+    unsigned int fieldStage = islandStage;
+    if (!assets.drawIsland) {
+        fieldStage = startup->Add("height field", BuildHeightField, assets);
+        startup->After(fieldStage, heightStage);
+    }
+    startup->After(startup->Add("grass mask", BakeGrassMask, assets), fieldStage);
+    startup->After(startup->Add("terrain patches", MeasurePatches, assets), fieldStage);
+    startup->Add("clouds", GenerateClouds, assets);
+    startup->Add("stars", LoadStars, assets);
+    startup->Run();
+
+    FloatTexture2DPtr map = assets.map;
+    TiledHeightMap* heightTiles = assets.heightTiles;
+
+    const float widthScale = assets.widthScale;
+    const float heightScale = assets.heightScale;
     Vector<3, float> origo(map->GetHeight() * widthScale / 2,
                            0,
                            map->GetWidth() * widthScale / 2);
@@ -556,15 +1033,69 @@ int main(int argc, char** argv) {
     sun->SetRenderGeometry(false);
     sun->SetTimeOfDay(6.0f);
     //sun->SetDayLength(0.0f);
-    engine->ProcessEvent().Attach(*sun);
+    AttachProcess(*sun, "sun");
 
     // Setup terrain
-    HeightMapNode* land = new Island(map);
-    land->SetHeightScale(heightScale);
-    land->SetWidthScale(widthScale);
-    land->SetOffset(Vector<3, float>(0, -10.75, 0));
-    renderer->InitializeEvent().Attach(*land);
-    keyboard->KeyEvent().Attach(*(new TerrainHandler(land)));
+    Island* land = assets.land;
+    Vector<3, float> landOffset = assets.landOffset;
+    IHeightField* heights = assets.heights;
+    HeightField* heightField = assets.heightField;
+    // Uploading the island node builds its full vertex buffers, so it
+    // is only uploaded when it draws the terrain. Otherwise the maps
+    // of the height field are uploaded instead, and again in part
+    // after every edit.
+    if (heightField) {
+        startup->AddUpload("height field", *heightField);
+        renderer->PreProcessEvent().Attach(*heightField);
+    } else
+        startup->AddUpload("island", *land);
+    TerrainEditor* editor = 
+        new TerrainEditor(heights, map->GetWidth(), map->GetHeight());
+    AttachProcess(*editor, "editor");
+    TerrainEditJournal* journal = new TerrainEditJournal(*editor);
+    editor->EditEvent().Attach(*journal);
+    keyboard->KeyEvent().Attach(*(new TerrainHandler
+        (*editor, *journal, assetCache.GetPath("terrain.journal"))));
+    TerrainPatchCuller* patchCuller = assets.patchCuller;
+    editor->EditEvent().Attach(*patchCuller);
+
+    // The clipmap reads its heights from the tiles and keeps its own
+    // copy of edits, the tiles are not written back.
+    ClipmapNode* clipmapNode = NULL;
+    if (clipmap) {
+        IShaderResourcePtr clipmapShader = ResourceManager<IShaderResource>
+            ::Create(datadir + "shaders/terrain3D/Clipmap.glsl");
+        land->AddShader(clipmapShader);
+        clipmapNode = new ClipmapNode(*heightTiles, widthScale, heightScale,
+                                      landOffset, clipmapShader, *frustum);
+        startup->AddUpload("clipmap", *clipmapNode);
+        editor->EditEvent().Attach(*clipmapNode);
+        AttachProcess(*(new LightDirAnimator(clipmapShader, *sun)), "clipmap light");
+        // Only the clipmap reads the tiles, so only page them in
+        // around the camera for it.
+        AttachProcess(*(new HeightMapStreamer
+            (*heightTiles, *camera, landOffset, widthScale, 1024)), "height streamer");
+    }
+
+    // The patches of the island drawn from 8 byte vertices, made
+    // after the height field is uploaded. They replace the vertex
+    // buffers of the island node rather than adding to them.
+    TerrainPatchNode* patchNode = NULL;
+    if (!clipmap && !heightMapPatches) {
+        IShaderResourcePtr patchShader = ResourceManager<IShaderResource>
+            ::Create(datadir + "shaders/terrain3D/TerrainPatch.glsl");
+        land->AddShader(patchShader);
+        patchNode = new TerrainPatchNode(heights, map->GetWidth(), map->GetHeight(),
+                                         patchShader, *frustum);
+        patchNode->SetScreenHeight(dimension[1]);
+        patchNode->SetPatchCuller(patchCuller);
+        startup->AddUpload("compact patches", *patchNode);
+        editor->EditEvent().Attach(*patchNode);
+        AttachProcess(*(new LightDirAnimator(patchShader, *sun)), "patch light");
+    } else
+        land->SetPatchCuller(patchCuller);
+    if (heightField)
+        land->SetShaderTextures(heightField->GetNormalMap());
 
     // Setup water
     WaterNode* water = new WaterNode(Vector<3, float>(origo), 2560);
@@ -576,47 +1107,40 @@ int main(int argc, char** argv) {
             ::Create("textures/waterNormals.png");
         UCharTexture2DPtr dudvmap = ResourceManager<UCharTexture2D>
             ::Create("textures/waterDistortion.png");
+        // Flat and undistorted until they are streamed in.
+        streamer->Add(normalmap, "water normals",
+                      Vector<4, unsigned char>(128, 128, 255, 255));
+        streamer->Add(dudvmap, "water distortion",
+                      Vector<4, unsigned char>(128, 128, 128, 255));
         water->SetNormalDudvMap(normalmap, dudvmap);
     }else{
-        ITexture2DPtr waterSurface = ResourceManager<ITexture2D>
+        UCharTexture2DPtr waterSurface = ResourceManager<UCharTexture2D>
             ::Create("textures/water.png");
+        streamer->Add(waterSurface, "water surface",
+                      Vector<4, unsigned char>(40, 80, 110, 255));
         water->SetSurfaceTexture(waterSurface, 64.0);
     }
-    renderer->InitializeEvent().Attach(*water);
-    engine->ProcessEvent().Attach(*water);
+    startup->AddUpload("water", *water);
+    AttachProcess(*water, "water");
 
 
-    Utils::Timer timer;
-    timer.Start();
-
     // Add Clouds
     IShaderResourcePtr cloudShader = ResourceManager<IShaderResource>::
     Create("projects/Terrain/data/shaders/clouds/Clouds.glsl");
-
-    std::string foldername = "projects/Terrain/data/generated/clouds.3d.exr";
-    FloatTexture3DPtr cloudTexture;
-    if (Directory::Exists(foldername)) {
-        logger.info << "loading 3d texture: " << foldername << logger.end;
-        cloudTexture = Texture3DFileListResource<float>::Create(foldername);
-    } else {
-        logger.info << "generating 3d texture: " << foldername << logger.end;
-        FloatTexture3DPtr cloudChannel = 
-            ValueNoise::Generate3D(128, 128, 64,
-                                    128, 0.5, 1, 3, 3, 0);
-        //TexUtils::Blur3D(cloudChannel,20);
-        TexUtils::Normalize3D(cloudChannel,0,1); 
-        TexUtils::CloudExpCurve3D(cloudChannel);
-        cloudTexture = 
-            TexUtils::ToRGBAinAlphaChannel3D(cloudChannel);
-        TextureTool<float>::DumpTexture(cloudTexture, foldername);
-    }
-    cloudTexture->SetMipmapping(true);
-    cloudTexture->SetWrapping(REPEAT);
-    cloudTexture->SetCompression(false);
+    FloatMappedTexture3DPtr cloudTexture = assets.cloudTexture;
     cloudShader->SetTexture("clouds", (ITexture3DPtr)cloudTexture);
 
     rayCast->SetTexture("src", (ITexture3DPtr)cloudTexture);
 
+    FloatMappedTexture3DPtr cloudOccupancy = assets.cloudOccupancy;
+    rayCast->SetTexture("occupancy", (ITexture3DPtr)cloudOccupancy);
+    rayCast->SetUniform("gridSize", Vector<3, float>(cloudOccupancy->GetWidth(),
+                                                     cloudOccupancy->GetHeight(),
+                                                     cloudOccupancy->GetDepth()));
+    // No clouds until the volume is streamed in.
+    streamer->Add(cloudTexture, "cloud volume", Vector<4, unsigned char>(0, 0, 0, 0));
+    streamer->Add(cloudOccupancy, "cloud bricks", Vector<4, unsigned char>(0, 0, 0, 0));
+
     /*
     //from: http://geography.about.com/library/faq/blqzdiameter.htm
     float earth_diameter = 12756.32; //m
@@ -640,13 +1164,10 @@ int main(int argc, char** argv) {
     cloudScene->AddNode(cloudPos);
 
     CloudDomeMover* cdm = new CloudDomeMover(*camera, *cloudPos);
-    engine->ProcessEvent().Attach(*cdm);    
-
-    Delayed3dTextureLoader* d3dtl = new Delayed3dTextureLoader(cloudTexture);
-    renderer->InitializeEvent().Attach(*d3dtl);
+    AttachProcess(*cdm, "cloud dome");
 
     CloudAnimator* cAnim = new CloudAnimator(cloudShader, 20, *sun);
-    engine->ProcessEvent().Attach(*cAnim);
+    AttachProcess(*cAnim, "cloud animator");
 
     // gradient dome
     MeshPtr atmosphericDome = 
@@ -657,37 +1178,12 @@ int main(int argc, char** argv) {
     UCharTexture2DPtr gradient = ResourceManager<UCharTexture2D>
         ::Create("textures/EarthClearSky2.png");
     gradient->SetWrapping(CLAMP_TO_EDGE);
+    streamer->Add(gradient, "gradient", Vector<4, unsigned char>(100, 140, 200, 255));
     gradientShader->SetTexture("gradient", (ITexture2DPtr)gradient);
     atmosphericDome->GetMaterial()->shad = gradientShader;
 
     // stars
-    std::string starDir = "projects/Terrain/data/generated/stars";
-    std::string starFile = starDir + "/stars.png";
-    UCharTexture2DPtr stars;
-    if (File::Exists(starFile)) {
-        logger.info << "loading texture: " << starFile << logger.end;
-        stars  = ResourceManager<UCharTexture2D>::Create(starFile);
-    } else {
-        logger.info << "generating texture: " << starFile << logger.end;
-        unsigned int ssize = 512; //sampled for the report at 128.
-        stars = UCharTexture2DPtr(new Texture2D<unsigned char>(ssize,ssize,1));
-        unsigned char* data = stars->GetData();
-        RandomGenerator r;
-        for (unsigned int n=0; n<200; n++) {
-            float dist = r.UniformFloat(0.05, 0.9);
-            float angle = r.UniformFloat(0, 2*PI);
-            unsigned int x = (unsigned int)
-                (ssize/2 + cos(angle) * dist * ssize/2);
-            unsigned int y = (unsigned int)
-                (ssize/2 + sin(angle) * dist * ssize/2);
-            data[x+y*ssize] = (unsigned char)
-                (255 * r.UniformFloat(0.5, 0.9));
-        }
-        Directory::Make(starDir);
-        stars = TexUtils::ToRGBAfromLuminance(stars);
-        TextureTool<unsigned char>::DumpTexture(stars, starFile);
-    }
-	gradientShader->SetTexture("stars", (ITexture2DPtr)stars);
+	gradientShader->SetTexture("stars", (ITexture2DPtr)assets.stars);
 
     MeshNode* atmosphericNode = new MeshNode();
     atmosphericNode->SetMesh(atmosphericDome);
@@ -697,17 +1193,23 @@ int main(int argc, char** argv) {
     atmosphericDomePosition->AddNode(atmosphericNode);
     atmosphericScene->AddNode(atmosphericDomePosition);
     GradientAnimator* gAnim = new GradientAnimator(gradientShader, 50, *sun, *frustum);
-    engine->ProcessEvent().Attach(*gAnim);
+    AttachProcess(*gAnim, "gradient animator");
+    RayCastAnimator* rAnim = new RayCastAnimator(rayCast, *frustum);
+    AttachProcess(*rAnim, "ray cast animator");
 
-    logger.info << "time elapsed: "
-                << timer.GetElapsedTime() << logger.end;
+    GrassMask* grassMask = assets.grassMask;
+    renderer->PreProcessEvent().Attach(*grassMask);
 
     // Grass node
     IShaderResourcePtr grassShader = ResourceManager<IShaderResource>
         ::Create("projects/Terrain/data/shaders/grass/Grass.glsl");
-    GrassNode* grass = new GrassNode(land, grassShader, 8000, 64, 1);
-    engine->ProcessEvent().Attach(*grass);
-    renderer->InitializeEvent().Attach(*grass);
+    InstancedGrassNode* grass = new InstancedGrassNode
+        (heights, map->GetWidth(), map->GetHeight(), *grassMask, grassShader, *frustum);
+    AttachProcess(*grass, "grass");
+    startup->AddUpload("grass", *grass);
+    // The mask is rebaked before the patches are measured again.
+    editor->EditEvent().Attach(*grassMask);
+    editor->EditEvent().Attach(*grass);
 
     // Renderstate node
     RenderStateNode* state = new RenderStateNode();
@@ -715,28 +1217,71 @@ int main(int argc, char** argv) {
     keyboard->KeyEvent().Attach(*(new RenderStateHandler(state)));
     
     // Scene setup
-    scene->AddNode(filmGrainNode);
-    filmGrainNode->AddNode(grayScaleNode);
-    grayScaleNode->AddNode(underwaterNode);
-    underwaterNode->AddNode(depthOfFieldNode);
-    depthOfFieldNode->AddNode(rayCastNode);
-    rayCastNode->AddNode(glowNode);
-    glowNode->AddNode(motionBlurNode);
-    motionBlurNode->AddNode(edgeDetectionNode);
-    edgeDetectionNode->AddNode(water);
+    PostProcessPipeline* postProcess =
+        new PostProcessPipeline(scene, water, dimension, assetCache);
+    postProcess->SetTimer(ppTimer);
+    postProcess->AddPointwise("Film Grain", "shaders/pointwise/FilmGrain.frag", false);
+    postProcess->AddPointwise("Grayscale", "shaders/pointwise/GrayScale.frag", false);
+    postProcess->AddStage("Underwater", underwater, false);
+    postProcess->AddChain("Depth Of Field", dof, dofReduction == 0);
+    postProcess->AddPasses("Low Res Depth Of Field", lowDof, dofReduction != 0,
+                           new LowDepthOfFieldSetup(dofComposite));
+    postProcess->AddPasses("Volume Rendering", volumePasses, volumeRendering,
+                           new VolumeSetup(volumeComposite));
+    postProcess->AddPasses("Glow", glowPasses, true,
+                           new GlowSetup(glowUpsample, glowUps),
+                           "shaders/pointwise/Glow.frag");
+    postProcess->AddStage("Motion Blur", motionBlur, false);
+    postProcess->AddStage("Edge Detection", edgeDetection, false);
+    renderer->PreProcessEvent().Attach(*postProcess);
     water->AddNode(state);
     state->AddNode(atmosphericScene);
     atmosphericScene->AddNode(cloudScene);
     state->AddNode(grass);
-    grass->AddNode(land);
+    if (clipmapNode)
+        grass->AddNode(clipmapNode);
+    else if (patchNode)
+        grass->AddNode(patchNode);
+    else
+        grass->AddNode(land);
     scene->AddNode(sun);
 
+    keyboard->KeyEvent().Attach(*(new TimingDumper(*ppTimer)));
+    renderer->InitializeEvent().Attach(*startup);
+    renderer->PostProcessEvent().Attach(*startup);
+
+    if (benchmark) {
+        // No tweak bars or mouse look, the benchmark flies the
+        // camera: over the island, across the top and down to skim
+        // the water.
+        float r = origo[0];
+        Vector<3, float> up(0, 1, 0);
+        benchmark->AddKey(camera->GetPosition(), origo);
+        benchmark->AddKey(origo + Vector<3, float>(-0.6 * r, 400, 0.6 * r), origo);
+        benchmark->AddKey(origo + up * 250, origo + Vector<3, float>(r, 0, r));
+        benchmark->AddKey(origo + Vector<3, float>(0.6 * r, 400, -0.6 * r), origo);
+        benchmark->AddKey(origo + Vector<3, float>(1.2 * r, 5, 0), origo + up * 100);
+        benchmark->AddKey(origo + Vector<3, float>(0.8 * r, -5, 0.4 * r), origo);
+        benchmark->AddKey(camera->GetPosition(), origo);
+        benchmark->Attach(*renderer);
+        renderer->PostProcessEvent().Attach
+            (*(new PatchCullCounter(*patchCuller, *benchmark)));
+        engine->ProcessEvent().Attach(*benchmark);
+        keyboard->KeyEvent().Attach(*(new QuitHandler(*engine)));
+        engine->Start();
+        return EXIT_SUCCESS;
+    }
+
     // ant tweak bar
     AntTweakBar *atb = new AntTweakBar();
     atb->AttachTo(*renderer);
     atb->AddBar(new InspectionBar("debug variables",Inspect(sun,cAnim)));
-    atb->AddBar(new InspectionBar("Post Process Nodes",PPInspect(glowNode,depthOfFieldNode,rayCastNode,motionBlurNode,filmGrainNode,grayScaleNode,underwaterNode,edgeDetectionNode)));
+    atb->AddBar(new InspectionBar("Post Process Nodes",PPInspect(postProcess)));
     atb->AddBar(new InspectionBar("Camera", Inspection::Inspect(camera)));
+    renderer->PostProcessEvent().Attach(*(new PPTimingBar(*atb, *ppTimer)));
+    atb->AddBar(new InspectionBar("Terrain Patches", PatchCullInspect(patchCuller)));
+    if (patchNode)
+        atb->AddBar(new InspectionBar("Terrain LOD", TerrainLODInspect(patchNode)));
     keyboard->KeyEvent().Attach(*atb);
     mouse->MouseMovedEvent().Attach(*atb);
     mouse->MouseButtonEvent().Attach(*atb);
@@ -791,7 +1336,9 @@ void SetupDisplay(){
 void SetupRendering(){
     renderer = new Renderer();
     textureloader = new TextureLoader(*renderer);
-    renderingview = new TerrainRenderingView();
+    ppTimer = new PostProcessTimer();
+    renderingview = new TimedRenderingView(*ppTimer);
+    renderer->PostProcessEvent().Attach(*ppTimer);
 
     renderer->InitializeEvent().Attach(*renderingview);
     renderer->ProcessEvent().Attach(*renderingview);
@@ -801,8 +1348,12 @@ void SetupRendering(){
     canvas->SetScene(scene);
     frame->SetCanvas(canvas);
 
-    renderer->InitializeEvent()
-        .Attach(*(new TextureLoadOnInit(*textureloader)));
+    // Streamed textures are drawn with placeholders until they are
+    // uploaded, which the texture loader then leaves alone.
+    streamer = new TextureStreamer();
+    startup->AddUpload("texture placeholders", *streamer);
+    renderer->PreProcessEvent().Attach(*streamer);
+    startup->AddUpload("scene textures", *(new TextureLoadOnInit(*textureloader)));
  
     renderer->PreProcessEvent().Attach(*textureloader); // needed by fps
 
@@ -0,0 +1,311 @@
+// Geometry clipmap node.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "scene/ClipmapNode.h"
+
+#include <Logging/Logger.h>
+#include <Meta/OpenGL.h>
+
+#include "TiledHeightMap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        using Math::Vector;
+        using Utils::TerrainRegion;
+
+        // Texture units of the level heights, above those of the
+        // terrain shader.
+        static const unsigned int HEIGHTS_UNIT = 6;
+        static const unsigned int COARSE_HEIGHTS_UNIT = 7;
+
+        // Modulo that is positive for negative numbers too.
+        static inline int Wrap(int x, int n) {
+            int m = x % n;
+            return m < 0 ? m + n : m;
+        }
+
+        static inline int FloorDiv(int x, int n) {
+            return x < 0 ? -((-x + n - 1) / n) : x / n;
+        }
+
+        ClipmapNode::ClipmapNode(Utils::TiledHeightMap& heights,
+                                 float widthScale, float heightScale,
+                                 Vector<3, float> offset,
+                                 Resources::IShaderResourcePtr shader,
+                                 Display::IViewingVolume& view,
+                                 unsigned int levels, unsigned int cells)
+            : heights(heights), shader(shader), view(view),
+              widthScale(widthScale), heightScale(heightScale), offset(offset),
+              cells(std::max(8u, cells / 8 * 8)), size(2 * this->cells),
+              levels(std::max(1u, levels)), vertexBuffer(0), program(0),
+              levelOriginLoc(-1), levelScaleLoc(-1), sampleScaleLoc(-1), morphLoc(-1),
+              heightsLoc(-1), coarseHeightsLoc(-1), uploads(0) {
+            for (unsigned int i = 0; i < this->levels.size(); ++i) {
+                this->levels[i].x = this->levels[i].z = 0;
+                this->levels[i].windowX = this->levels[i].windowZ = 0;
+                this->levels[i].valid = false;
+                this->levels[i].texture = 0;
+            }
+            for (unsigned int i = 0; i < 5; ++i)
+                indexBuffers[i] = indexCounts[i] = 0;
+        }
+
+        ClipmapNode::~ClipmapNode() {
+            for (unsigned int i = 0; i < levels.size(); ++i)
+                if (levels[i].texture) glDeleteTextures(1, &levels[i].texture);
+            if (vertexBuffer) glDeleteBuffers(1, &vertexBuffer);
+            if (indexBuffers[0]) glDeleteBuffers(5, indexBuffers);
+        }
+
+        unsigned int ClipmapNode::GetVertexCount() const {
+            return levels.size() * (cells + 1) * (cells + 1);
+        }
+
+        float ClipmapNode::Height(int x, int z) {
+            x = std::min(std::max(x, 0), int(heights.GetWidth()) - 1);
+            z = std::min(std::max(z, 0), int(heights.GetHeight()) - 1);
+            if (!edits.empty()) {
+                std::map<BlockKey, std::vector<float> >::iterator itr =
+                    edits.find(BlockKey(x / BLOCK, z / BLOCK));
+                if (itr != edits.end())
+                    return itr->second[(z % BLOCK) * BLOCK + x % BLOCK];
+            }
+            return heights.GetHeight(x, z) * heightScale;
+        }
+
+        void ClipmapNode::BuildGrid() {
+            const unsigned int n = cells + 1;
+            std::vector<float> grid;
+            grid.reserve(n * n * 2);
+            for (unsigned int k = 0; k < n; ++k)
+                for (unsigned int i = 0; i < n; ++i) {
+                    grid.push_back(i);
+                    grid.push_back(k);
+                }
+            glGenBuffers(1, &vertexBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, grid.size() * sizeof(float), &grid[0], GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+            // Buffer 0 is the whole grid. The level inside covers
+            // half the cells of a level, starting cells / 4 or one
+            // more cell in on each axis, so buffers 1 to 4 leave out
+            // those four squares.
+            glGenBuffers(5, indexBuffers);
+            for (unsigned int b = 0; b < 5; ++b) {
+                unsigned int holeX = cells / 4 + (b ? (b - 1) % 2 : 0);
+                unsigned int holeZ = cells / 4 + (b ? (b - 1) / 2 : 0);
+                std::vector<unsigned short> indices;
+                for (unsigned int k = 0; k < cells; ++k)
+                    for (unsigned int i = 0; i < cells; ++i) {
+                        if (b && holeX <= i && i < holeX + cells / 2 &&
+                            holeZ <= k && k < holeZ + cells / 2)
+                            continue;
+                        unsigned int v = k * n + i;
+                        unsigned int quad[6] = { v, v + n, v + 1, v + 1, v + n, v + n + 1 };
+                        indices.insert(indices.end(), quad, quad + 6);
+                    }
+                indexCounts[b] = indices.size();
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffers[b]);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short),
+                             &indices[0], GL_STATIC_DRAW);
+            }
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
+
+        void ClipmapNode::Upload(unsigned int level, int x, int z, int w, int d) {
+            // The rectangle may wrap around the texture on both axes,
+            // so it is uploaded in up to four pieces.
+            int step = 1 << level;
+            glBindTexture(GL_TEXTURE_2D, levels[level].texture);
+            for (int j = 0; j < d; ) {
+                int tz = Wrap(z + j, size);
+                int rows = std::min(d - j, int(size) - tz);
+                for (int i = 0; i < w; ) {
+                    int tx = Wrap(x + i, size);
+                    int columns = std::min(w - i, int(size) - tx);
+                    scratch.resize(columns * rows);
+                    for (int b = 0; b < rows; ++b)
+                        for (int a = 0; a < columns; ++a)
+                            scratch[b * columns + a] =
+                                Height((x + i + a) * step, (z + j + b) * step);
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, tx, tz, columns, rows,
+                                    GL_LUMINANCE, GL_FLOAT, &scratch[0]);
+                    uploads += columns * rows;
+                    i += columns;
+                }
+                j += rows;
+            }
+        }
+
+        void ClipmapNode::Update(unsigned int l, Vector<3, float> eye) {
+            Level& level = levels[l];
+            // Grid origins are kept even, so the grid lines of a level
+            // fall on those of the level outside it.
+            float scale = widthScale * (1 << l);
+            float cx = (eye[0] - offset[0]) / scale;
+            float cz = (eye[2] - offset[2]) / scale;
+            level.x = 2 * int(floorf((cx - cells / 2) * 0.5f));
+            level.z = 2 * int(floorf((cz - cells / 2) * 0.5f));
+            // The texture holds the grid with half a grid of margin.
+            int wx = level.x - int(cells) / 2, wz = level.z - int(cells) / 2;
+            int dx = wx - level.windowX, dz = wz - level.windowZ;
+            int n = size;
+            if (!level.valid || n <= abs(dx) || n <= abs(dz)) {
+                Upload(l, wx, wz, n, n);
+                level.valid = true;
+            } else {
+                // Only the columns and rows that came into the
+                // window are read, the rest of the texture is kept.
+                if (dx > 0) Upload(l, level.windowX + n, wz, dx, n);
+                if (dx < 0) Upload(l, wx, wz, -dx, n);
+                if (dz > 0) Upload(l, wx, level.windowZ + n, n, dz);
+                if (dz < 0) Upload(l, wx, wz, n, -dz);
+                TerrainRegion& r = level.dirty;
+                if (!r.IsEmpty()) {
+                    TerrainRegion window(wx, wz, n, n);
+                    if (r.Overlaps(window)) {
+                        int x0 = std::max(r.x, wx), z0 = std::max(r.z, wz);
+                        int x1 = std::min(r.x + int(r.width), wx + n);
+                        int z1 = std::min(r.z + int(r.depth), wz + n);
+                        Upload(l, x0, z0, x1 - x0, z1 - z0);
+                    }
+                }
+            }
+            level.dirty = TerrainRegion();
+            level.windowX = wx;
+            level.windowZ = wz;
+        }
+
+        void ClipmapNode::Handle(Renderers::RenderingEventArg arg) {
+            for (unsigned int l = 0; l < levels.size(); ++l) {
+                glGenTextures(1, &levels[l].texture);
+                glBindTexture(GL_TEXTURE_2D, levels[l].texture);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE32F_ARB, size, size, 0,
+                             GL_LUMINANCE, GL_FLOAT, NULL);
+            }
+            glBindTexture(GL_TEXTURE_2D, 0);
+            BuildGrid();
+            CHECK_FOR_GL_ERROR();
+
+            shader->Load();
+            shader->SetUniform("invSize", 1.0f / size);
+            shader->SetUniform("halfCells", float(cells / 2));
+            shader->SetUniform("morphWidth", float(cells / 8));
+            shader->SetUniform("invMapSize", Vector<2, float>(1.0f / heights.GetWidth(),
+                                                              1.0f / heights.GetHeight()));
+            shader->SetUniform("offset", offset);
+            shader->ApplyShader();
+            glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+            levelOriginLoc = glGetUniformLocation(program, "levelOrigin");
+            levelScaleLoc = glGetUniformLocation(program, "levelScale");
+            sampleScaleLoc = glGetUniformLocation(program, "sampleScale");
+            morphLoc = glGetUniformLocation(program, "morph");
+            heightsLoc = glGetUniformLocation(program, "heights");
+            coarseHeightsLoc = glGetUniformLocation(program, "coarseHeights");
+            shader->ReleaseShader();
+
+            logger.info << "clipmap of " << levels.size() << " levels of "
+                        << cells << " cells, " << GetVertexCount()
+                        << " vertices" << logger.end;
+        }
+
+        void ClipmapNode::Handle(Utils::TerrainEditEventArg arg) {
+            const TerrainRegion& r = arg.region;
+            for (unsigned int j = 0; j < r.depth; ++j)
+                for (unsigned int i = 0; i < r.width; ++i) {
+                    int x = r.x + i, z = r.z + j;
+                    BlockKey key(x / BLOCK, z / BLOCK);
+                    std::map<BlockKey, std::vector<float> >::iterator itr = edits.find(key);
+                    if (itr == edits.end()) {
+                        // A new block starts out as the tiled heights.
+                        std::vector<float> block(BLOCK * BLOCK);
+                        for (int b = 0; b < BLOCK; ++b)
+                            for (int a = 0; a < BLOCK; ++a)
+                                block[b * BLOCK + a] = heights.GetHeight
+                                    (key.first * BLOCK + a, key.second * BLOCK + b) * heightScale;
+                        itr = edits.insert(std::make_pair(key, block)).first;
+                    }
+                    itr->second[(z % BLOCK) * BLOCK + x % BLOCK] = arg.after[j * r.width + i];
+                }
+
+            // The samples of every level under the edit are uploaded
+            // in the next frame.
+            for (unsigned int l = 0; l < levels.size(); ++l) {
+                int step = 1 << l;
+                int x0 = -FloorDiv(-r.x, step), z0 = -FloorDiv(-r.z, step);
+                int x1 = FloorDiv(r.x + int(r.width) - 1, step) + 1;
+                int z1 = FloorDiv(r.z + int(r.depth) - 1, step) + 1;
+                if (x1 <= x0 || z1 <= z0) continue;
+                TerrainRegion samples(x0, z0, x1 - x0, z1 - z0);
+                TerrainRegion& dirty = levels[l].dirty;
+                dirty = dirty.IsEmpty() ? samples : dirty.Union(samples);
+            }
+        }
+
+        void ClipmapNode::Apply(Renderers::RenderingEventArg arg, ISceneNodeVisitor& v) {
+            if (vertexBuffer == 0) return;
+            Vector<3, float> eye = view.GetPosition();
+            for (unsigned int l = 0; l < levels.size(); ++l)
+                Update(l, eye);
+
+            shader->SetUniform("viewPos", eye);
+            shader->ApplyShader();
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glVertexPointer(2, GL_FLOAT, 0, (GLvoid*)0);
+            glUniform1i(heightsLoc, HEIGHTS_UNIT);
+            glUniform1i(coarseHeightsLoc, COARSE_HEIGHTS_UNIT);
+            for (unsigned int l = 0; l < levels.size(); ++l) {
+                const Level& level = levels[l];
+                bool coarsest = l + 1 == levels.size();
+                glActiveTexture(GL_TEXTURE0 + HEIGHTS_UNIT);
+                glBindTexture(GL_TEXTURE_2D, level.texture);
+                glActiveTexture(GL_TEXTURE0 + COARSE_HEIGHTS_UNIT);
+                glBindTexture(GL_TEXTURE_2D, levels[coarsest ? l : l + 1].texture);
+                glUniform2f(levelOriginLoc, level.x, level.z);
+                glUniform1f(levelScaleLoc, widthScale * (1 << l));
+                glUniform1f(sampleScaleLoc, 1 << l);
+                glUniform1f(morphLoc, coarsest ? 0.0f : 1.0f);
+
+                unsigned int b = 0;
+                if (l > 0) {
+                    // Where the level inside sits in this one.
+                    const Level& inner = levels[l - 1];
+                    int holeX = inner.x / 2 - level.x - int(cells) / 4;
+                    int holeZ = inner.z / 2 - level.z - int(cells) / 4;
+                    b = 1 + std::min(std::max(holeX, 0), 1) + 2 * std::min(std::max(holeZ, 0), 1);
+                }
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffers[b]);
+                glDrawElements(GL_TRIANGLES, indexCounts[b], GL_UNSIGNED_SHORT, (GLvoid*)0);
+            }
+            glActiveTexture(GL_TEXTURE0 + COARSE_HEIGHTS_UNIT);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glActiveTexture(GL_TEXTURE0 + HEIGHTS_UNIT);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glActiveTexture(GL_TEXTURE0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glDisableClientState(GL_VERTEX_ARRAY);
+            shader->ReleaseShader();
+            CHECK_FOR_GL_ERROR();
+            VisitSubNodes(v);
+        }
+
+    }
+}
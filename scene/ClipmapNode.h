@@ -0,0 +1,128 @@
+// Geometry clipmap node.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _CLIPMAP_NODE_H_
+#define _CLIPMAP_NODE_H_
+
+#include <Core/IListener.h>
+#include <Display/IViewingVolume.h>
+#include <Math/Vector.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/IShaderResource.h>
+#include <Scene/RenderNode.h>
+
+#include "TerrainEditor.h"
+
+#include <map>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+        class TiledHeightMap;
+    }
+    namespace Scene {
+
+        /**
+         * Terrain drawn as a geometry clipmap: nested square grids
+         * of the same number of cells centered on the camera, each
+         * with cells twice the size of the one inside it.
+         *
+         * Every level keeps the heights around its grid in a float
+         * texture addressed toroidally, so when the camera moves
+         * only the rows and columns that came into view are read
+         * from the tiled height map and uploaded. The grid itself is
+         * one static vertex buffer; the innermost level draws all of
+         * it and the others draw it as a ring around the level
+         * inside. Near the outer edge of a level the vertices morph
+         * to the heights of the next level, so the levels meet
+         * without cracks.
+         *
+         * The vertex count is the same every frame and does not
+         * depend on the size of the height map.
+         */
+        class ClipmapNode
+            : public RenderNode
+            , public Core::IListener<Renderers::RenderingEventArg>
+            , public Core::IListener<Utils::TerrainEditEventArg> {
+            struct Level {
+                // Grid origin, and origin of the heights held by the
+                // texture, in samples of the level.
+                int x, z;
+                int windowX, windowZ;
+                bool valid;
+                unsigned int texture;
+                // Edited samples waiting to be uploaded.
+                Utils::TerrainRegion dirty;
+            };
+            // Edited heights, in blocks of BLOCK * BLOCK samples.
+            typedef std::pair<int, int> BlockKey;
+            static const int BLOCK = 64;
+
+            Utils::TiledHeightMap& heights;
+            Resources::IShaderResourcePtr shader;
+            Display::IViewingVolume& view;
+            float widthScale, heightScale;
+            Math::Vector<3, float> offset;
+            unsigned int cells, size;
+            std::vector<Level> levels;
+            std::map<BlockKey, std::vector<float> > edits;
+            std::vector<float> scratch;
+            unsigned int vertexBuffer;
+            // The full grid, and the ring for each of the four places
+            // the level inside may sit.
+            unsigned int indexBuffers[5];
+            unsigned int indexCounts[5];
+            int program;
+            int levelOriginLoc, levelScaleLoc, sampleScaleLoc, morphLoc;
+            int heightsLoc, coarseHeightsLoc;
+            unsigned int uploads;
+
+            float Height(int x, int z);
+            void Upload(unsigned int level, int x, int z, int w, int d);
+            void Update(unsigned int level, Math::Vector<3, float> eye);
+            void BuildGrid();
+
+        public:
+            /**
+             * @param cells Cells along the side of a level, a
+             *              multiple of 8.
+             */
+            ClipmapNode(Utils::TiledHeightMap& heights,
+                        float widthScale, float heightScale,
+                        Math::Vector<3, float> offset,
+                        Resources::IShaderResourcePtr shader,
+                        Display::IViewingVolume& view,
+                        unsigned int levels = 6, unsigned int cells = 64);
+            ~ClipmapNode();
+
+            /**
+             * Creates the textures and buffers, attach to the
+             * renderer initialize event.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+
+            /**
+             * Keeps edited heights and refreshes the samples under
+             * them, attach to the terrain editor edit event.
+             */
+            void Handle(Utils::TerrainEditEventArg arg);
+
+            void Apply(Renderers::RenderingEventArg arg, ISceneNodeVisitor& v);
+
+            unsigned int GetVertexCount() const;
+            /**
+             * Height samples uploaded since the node was made.
+             */
+            unsigned int GetUploads() const { return uploads; }
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,345 @@
+// Instanced grass node.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "scene/InstancedGrassNode.h"
+
+#include <Logging/Logger.h>
+#include <Math/Matrix.h>
+#include <Math/RandomGenerator.h>
+#include <Meta/OpenGL.h>
+
+#include "GrassMask.h"
+#include "ParallelRange.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        using Math::Matrix;
+        using Math::Vector;
+        using Resources::IShaderResource;
+        using Utils::IHeightField;
+
+        // Position, straw center with the mask density it needs in
+        // y, and texture coordinate.
+        static const unsigned int VERTEX_FLOATS = 8;
+        // Patch x and z and how far its straws have grown.
+        static const unsigned int INSTANCE_FLOATS = 3;
+        static const float STRAW_WIDTH = 2.0f;
+        static const float STRAW_HEIGHT = 1.5f;
+
+        InstancedGrassNode::InstancedGrassNode(IHeightField* terrain,
+                                               unsigned int width, unsigned int depth,
+                                               Utils::GrassMask& mask,
+                                               Resources::IShaderResourcePtr shader,
+                                               Display::IViewingVolume& view,
+                                               float density, float range,
+                                               float patchSize,
+                                               unsigned int quadsPerStar)
+            : terrain(terrain), mask(mask), shader(shader), view(view),
+              width(width), depth(depth), widthScale(terrain->GetWidthScale()),
+              range(range), quadsPerStar(std::max(1u, quadsPerStar)), visible(0),
+              templateBuffer(0), instanceBuffer(0), patchAttribute(-1),
+              instanced(false), time(0.0f) {
+            // Patches are whole height map cells.
+            this->patchSize = std::max(1.0f, floorf(patchSize / widthScale)) * widthScale;
+            straws = std::max(1u, (unsigned int)(density * this->patchSize * this->patchSize));
+            vertices = int(this->patchSize / widthScale + 0.5f);
+            columns = (width + vertices - 1) / vertices;
+            rows = (depth + vertices - 1) / vertices;
+            patches.resize(columns * rows);
+            BuildTemplate();
+            MeasurePatches(Utils::TerrainRegion(0, 0, columns, rows));
+            unsigned int grass = 0;
+            for (unsigned int p = 0; p < patches.size(); ++p)
+                if (patches[p].grass) ++grass;
+            logger.info << "grass on " << grass << " of " << patches.size()
+                        << " patches" << logger.end;
+        }
+
+        InstancedGrassNode::~InstancedGrassNode() {
+            if (templateBuffer) glDeleteBuffers(1, &templateBuffer);
+            if (instanceBuffer) glDeleteBuffers(1, &instanceBuffer);
+        }
+
+        void InstancedGrassNode::BuildTemplate() {
+            // The straws are placed independently, so any prefix of
+            // them covers the patch evenly and a level can draw fewer
+            // by drawing a shorter prefix.
+            Math::RandomGenerator r;
+            r.Seed(0);
+            strawVertices.reserve(straws * quadsPerStar * 4 * VERTEX_FLOATS);
+            for (unsigned int s = 0; s < straws; ++s) {
+                float cx = r.UniformFloat(0.0f, patchSize);
+                float cz = r.UniformFloat(0.0f, patchSize);
+                float size = r.UniformFloat(0.8f, 1.2f);
+                float angle = r.UniformFloat(0.0f, M_PI);
+                float threshold = r.UniformFloat(0.0f, 1.0f);
+                for (unsigned int q = 0; q < quadsPerStar; ++q) {
+                    float a = angle + q * M_PI / quadsPerStar;
+                    float dx = cos(a) * STRAW_WIDTH * size * 0.5f;
+                    float dz = sin(a) * STRAW_WIDTH * size * 0.5f;
+                    float h = STRAW_HEIGHT * size;
+                    const float corner[4][4] = {
+                        { -dx, 0.0f, -dz, 0.0f },
+                        {  dx, 0.0f,  dz, 0.0f },
+                        {  dx, h,     dz, 1.0f },
+                        { -dx, h,    -dz, 1.0f } };
+                    for (unsigned int c = 0; c < 4; ++c) {
+                        float v[VERTEX_FLOATS] = {
+                            cx + corner[c][0], corner[c][1], cz + corner[c][2],
+                            cx, threshold, cz,
+                            c == 1 || c == 2 ? 1.0f : 0.0f, corner[c][3] };
+                        strawVertices.insert(strawVertices.end(), v, v + VERTEX_FLOATS);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Measures the height bounds of rows of patches. Straws reach
+         * a little past their patch, so one vertex of the neighbours
+         * is included.
+         */
+        class PatchMeasureJob : public Utils::IRangeJob {
+            IHeightField* terrain;
+            int width, depth, vertices;
+            const Utils::TerrainRegion& region;
+        public:
+            std::vector<float> minY, maxY;
+
+            PatchMeasureJob(IHeightField* terrain, int width, int depth,
+                            int vertices, const Utils::TerrainRegion& region)
+                : terrain(terrain), width(width), depth(depth), vertices(vertices),
+                  region(region), minY(region.width * region.depth),
+                  maxY(region.width * region.depth) {}
+
+            void Run(unsigned int begin, unsigned int end) {
+                for (unsigned int row = begin; row < end; ++row)
+                    for (unsigned int col = 0; col < region.width; ++col) {
+                        unsigned int p = row * region.width + col;
+                        int px = region.x + col, pz = region.z + row;
+                        minY[p] = 1e30f;
+                        maxY[p] = -1e30f;
+                        int x0 = std::max(px * vertices - 1, 0);
+                        int z0 = std::max(pz * vertices - 1, 0);
+                        int x1 = std::min((px + 1) * vertices + 1, width);
+                        int z1 = std::min((pz + 1) * vertices + 1, depth);
+                        for (int z = z0; z < z1; ++z)
+                            for (int x = x0; x < x1; ++x) {
+                                float h = terrain->GetHeight(x, z);
+                                minY[p] = std::min(minY[p], h);
+                                maxY[p] = std::max(maxY[p], h);
+                            }
+                    }
+            }
+        };
+
+        void InstancedGrassNode::MeasurePatches(const Utils::TerrainRegion& region) {
+            PatchMeasureJob job(terrain, width, depth, vertices, region);
+            Utils::ParallelRange::Run(job, region.depth);
+            for (unsigned int row = 0; row < region.depth; ++row)
+                for (unsigned int col = 0; col < region.width; ++col) {
+                    int px = region.x + col, pz = region.z + row;
+                    Patch& patch = patches[pz * columns + px];
+                    patch.minY = job.minY[row * region.width + col];
+                    patch.maxY = job.maxY[row * region.width + col] + STRAW_HEIGHT * 1.2f;
+                    patch.grass = mask.Any(Utils::TerrainRegion
+                                           (px * vertices, pz * vertices, vertices, vertices));
+                }
+        }
+
+        void InstancedGrassNode::Cull() {
+            // The frustum planes, from the columns of the view
+            // projection matrix.
+            Matrix<4, 4, float> m = view.GetViewMatrix() * view.GetProjectionMatrix();
+            float planes[6][4];
+            for (unsigned int i = 0; i < 4; ++i) {
+                planes[0][i] = m(i, 3) + m(i, 0);
+                planes[1][i] = m(i, 3) - m(i, 0);
+                planes[2][i] = m(i, 3) + m(i, 1);
+                planes[3][i] = m(i, 3) - m(i, 1);
+                planes[4][i] = m(i, 3) + m(i, 2);
+                planes[5][i] = m(i, 3) - m(i, 2);
+            }
+
+            Vector<3, float> eye = view.GetPosition();
+            Vector<3, float> offset = terrain->GetOffset();
+            for (unsigned int l = 0; l < LEVELS; ++l)
+                instances[l].clear();
+            visible = 0;
+            // Density halves at every doubling of the distance past
+            // the first level.
+            float near = range / (1 << (LEVELS - 1));
+            float fadeStart = range * 0.75f;
+            // Only the patches around the camera can be in range.
+            float side = vertices * widthScale;
+            int c0 = std::max(int(floorf((eye[0] - offset[0] - range) / side)), 0);
+            int r0 = std::max(int(floorf((eye[2] - offset[2] - range) / side)), 0);
+            int c1 = std::min(int(floorf((eye[0] - offset[0] + range) / side)) + 1, int(columns));
+            int r1 = std::min(int(floorf((eye[2] - offset[2] + range) / side)) + 1, int(rows));
+            for (int row = r0; row < r1; ++row)
+                for (int col = c0; col < c1; ++col) {
+                    const Patch& patch = patches[row * columns + col];
+                    if (!patch.grass) continue;
+                    float min[3] = { col * side + offset[0], patch.minY, row * side + offset[2] };
+                    float max[3] = { min[0] + side, patch.maxY, min[2] + side };
+
+                    // Distance to the nearest point of the patch.
+                    float d2 = 0.0f;
+                    for (unsigned int i = 0; i < 3; ++i) {
+                        float d = std::max(std::max(min[i] - eye[i], eye[i] - max[i]), 0.0f);
+                        d2 += d * d;
+                    }
+                    if (range * range <= d2) continue;
+
+                    bool inside = true;
+                    for (unsigned int i = 0; i < 6 && inside; ++i) {
+                        // The corner furthest along the plane normal.
+                        float d = planes[i][3];
+                        for (unsigned int j = 0; j < 3; ++j)
+                            d += planes[i][j] * (planes[i][j] < 0.0f ? min[j] : max[j]);
+                        inside = 0.0f <= d;
+                    }
+                    if (!inside) continue;
+
+                    float dist = sqrt(d2);
+                    unsigned int level = 0;
+                    while (level + 1 < LEVELS && near * (1 << level) <= dist)
+                        ++level;
+                    float grown = 1.0f - std::max(dist - fadeStart, 0.0f) / (range - fadeStart);
+                    float instance[INSTANCE_FLOATS] = { col * side, row * side, grown };
+                    instances[level].insert(instances[level].end(),
+                                            instance, instance + INSTANCE_FLOATS);
+                    ++visible;
+                }
+        }
+
+        void InstancedGrassNode::Handle(Core::ProcessEventArg arg) {
+            time += arg.approx / 1000000.0f;
+            Cull();
+            shader->SetUniform("time", time);
+        }
+
+        void InstancedGrassNode::Handle(Renderers::RenderingEventArg arg) {
+            shader->Load();
+            IShaderResource::TextureList texs = shader->GetTextures();
+            for (IShaderResource::TextureList::iterator itr = texs.begin();
+                 itr != texs.end(); ++itr)
+                arg.renderer.LoadTexture(*itr);
+
+            arg.renderer.LoadTexture(mask.GetTexture());
+            shader->SetTexture("heightmap", terrain->GetHeightMap());
+            shader->SetTexture("grassMask", (Resources::ITexture2DPtr)mask.GetTexture());
+            float invScale = 1.0f / widthScale;
+            float cellSide = mask.GetCellSize() * widthScale;
+            shader->SetUniform("invMaskExtent",
+                               Vector<2, float>(1.0f / (cellSide * mask.GetColumns()),
+                                                1.0f / (cellSide * mask.GetRows())));
+            shader->SetUniform("invHmapDimsScale",
+                               Vector<2, float>(invScale / width, invScale / depth));
+            Vector<3, float> offset = terrain->GetOffset();
+            shader->SetUniform("hmapOffset", Vector<2, float>(offset[0], offset[2]));
+
+            shader->ApplyShader();
+            patchAttribute = shader->GetAttributeID("patch");
+            shader->ReleaseShader();
+
+            glGenBuffers(1, &templateBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, templateBuffer);
+            glBufferData(GL_ARRAY_BUFFER, strawVertices.size() * sizeof(float),
+                         &strawVertices[0], GL_STATIC_DRAW);
+            glGenBuffers(1, &instanceBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            CHECK_FOR_GL_ERROR();
+
+            instanced = GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced;
+            if (!instanced)
+                logger.info << "no instanced arrays, grass patches are drawn one by one"
+                            << logger.end;
+        }
+
+        void InstancedGrassNode::Handle(Utils::TerrainEditEventArg arg) {
+            // Heights within a vertex of a patch change its bounds.
+            const Utils::TerrainRegion& r = arg.region;
+            int c0 = std::max(r.x - 1, 0) / vertices;
+            int r0 = std::max(r.z - 1, 0) / vertices;
+            int c1 = std::min((r.x + (int)r.width) / vertices + 1, int(columns));
+            int r1 = std::min((r.z + (int)r.depth) / vertices + 1, int(rows));
+            if (c0 < c1 && r0 < r1)
+                MeasurePatches(Utils::TerrainRegion(c0, r0, c1 - c0, r1 - r0));
+        }
+
+        void InstancedGrassNode::Apply(Renderers::RenderingEventArg arg,
+                                       ISceneNodeVisitor& v) {
+            VisitSubNodes(v);
+            if (visible == 0 || patchAttribute < 0) return;
+
+            const unsigned int stride = VERTEX_FLOATS * sizeof(float);
+            const unsigned int strawVertexCount = quadsPerStar * 4;
+
+            shader->ApplyShader();
+            glBindBuffer(GL_ARRAY_BUFFER, templateBuffer);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glEnableClientState(GL_NORMAL_ARRAY);
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glVertexPointer(3, GL_FLOAT, stride, (GLvoid*)0);
+            glNormalPointer(GL_FLOAT, stride, (GLvoid*)(3 * sizeof(float)));
+            glTexCoordPointer(2, GL_FLOAT, stride, (GLvoid*)(6 * sizeof(float)));
+
+            if (instanced) {
+                // All levels share one buffer, streamed every frame.
+                glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+                glBufferData(GL_ARRAY_BUFFER,
+                             visible * INSTANCE_FLOATS * sizeof(float),
+                             NULL, GL_STREAM_DRAW);
+                unsigned int first = 0;
+                for (unsigned int l = 0; l < LEVELS; ++l) {
+                    if (instances[l].empty()) continue;
+                    glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(float),
+                                    instances[l].size() * sizeof(float),
+                                    &instances[l][0]);
+                    first += instances[l].size();
+                }
+                glEnableVertexAttribArray(patchAttribute);
+                glVertexAttribDivisorARB(patchAttribute, 1);
+                first = 0;
+                for (unsigned int l = 0; l < LEVELS; ++l) {
+                    if (instances[l].empty()) continue;
+                    glVertexAttribPointer(patchAttribute, INSTANCE_FLOATS, GL_FLOAT,
+                                          GL_FALSE, 0, (GLvoid*)(first * sizeof(float)));
+                    unsigned int count = std::max(1u, straws >> l) * strawVertexCount;
+                    glDrawArraysInstancedARB(GL_QUADS, 0, count,
+                                             instances[l].size() / INSTANCE_FLOATS);
+                    first += instances[l].size();
+                }
+                glVertexAttribDivisorARB(patchAttribute, 0);
+                glDisableVertexAttribArray(patchAttribute);
+            } else {
+                for (unsigned int l = 0; l < LEVELS; ++l) {
+                    unsigned int count = std::max(1u, straws >> l) * strawVertexCount;
+                    for (unsigned int i = 0; i < instances[l].size(); i += INSTANCE_FLOATS) {
+                        glVertexAttrib3fv(patchAttribute, &instances[l][i]);
+                        glDrawArrays(GL_QUADS, 0, count);
+                    }
+                }
+            }
+
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glDisableClientState(GL_NORMAL_ARRAY);
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            shader->ReleaseShader();
+            CHECK_FOR_GL_ERROR();
+        }
+
+    }
+}
@@ -0,0 +1,131 @@
+// Instanced grass node.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _INSTANCED_GRASS_NODE_H_
+#define _INSTANCED_GRASS_NODE_H_
+
+#include <Core/IListener.h>
+#include <Core/EngineEvents.h>
+#include <Display/IViewingVolume.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/IShaderResource.h>
+#include <Scene/RenderNode.h>
+
+#include "TerrainEditor.h"
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+        class GrassMask;
+    }
+    namespace Scene {
+
+        /**
+         * Grass straws drawn in square patches laid over a height
+         * map.
+         *
+         * Every patch is drawn from the same template of straws
+         * placed at random. The height bounds of each patch and
+         * whether the grass mask has any grass on it are kept, and
+         * measured again for the patches under a terrain edit.
+         *
+         * Each frame the patches within range of the camera are
+         * culled against the view frustum and sorted into density
+         * levels by distance, every level drawing half the straws of
+         * the one before. Each level is one instanced draw of a
+         * prefix of the template, the patch position read from a per
+         * instance attribute. The straws of a drawn patch look up
+         * their cell of the mask for its density and normal.
+         */
+        class InstancedGrassNode
+            : public RenderNode
+            , public Core::IListener<Core::ProcessEventArg>
+            , public Core::IListener<Renderers::RenderingEventArg>
+            , public Core::IListener<Utils::TerrainEditEventArg> {
+        public:
+            static const unsigned int LEVELS = 3;
+
+        private:
+            struct Patch {
+                float minY, maxY;
+                bool grass;
+            };
+
+            Utils::IHeightField* terrain;
+            Utils::GrassMask& mask;
+            Resources::IShaderResourcePtr shader;
+            Display::IViewingVolume& view;
+            unsigned int width, depth;
+            float widthScale, patchSize, range;
+            unsigned int straws, quadsPerStar;
+            // Patch side in height map vertices.
+            int vertices;
+            std::vector<Patch> patches;
+            unsigned int columns, rows;
+            std::vector<float> strawVertices;
+            // Instance attributes of the visible patches, one run per
+            // level.
+            std::vector<float> instances[LEVELS];
+            unsigned int visible;
+            unsigned int templateBuffer, instanceBuffer;
+            int patchAttribute;
+            bool instanced;
+            float time;
+
+            void BuildTemplate();
+            void MeasurePatches(const Utils::TerrainRegion& region);
+            void Cull();
+
+        public:
+            /**
+             * @param width, depth Size of the height map in vertices.
+             * @param mask Where grass grows, updated before the node
+             *             on terrain edits.
+             * @param density Straws per square unit nearest the camera.
+             * @param range Distance at which the grass has faded out.
+             * @param patchSize Side of a patch in world units.
+             */
+            InstancedGrassNode(Utils::IHeightField* terrain,
+                               unsigned int width, unsigned int depth,
+                               Utils::GrassMask& mask,
+                               Resources::IShaderResourcePtr shader,
+                               Display::IViewingVolume& view,
+                               float density = 2.0f, float range = 96.0f,
+                               float patchSize = 16.0f,
+                               unsigned int quadsPerStar = 1);
+            ~InstancedGrassNode();
+
+            /**
+             * Culls the patches, attach to the engine process event.
+             */
+            void Handle(Core::ProcessEventArg arg);
+
+            /**
+             * Loads the shader and buffers, attach to the renderer
+             * initialize event.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+
+            /**
+             * Measures the edited patches again, attach to the
+             * terrain editor edit event after the grass mask.
+             */
+            void Handle(Utils::TerrainEditEventArg arg);
+
+            void Apply(Renderers::RenderingEventArg arg, ISceneNodeVisitor& v);
+
+            unsigned int GetPatchCount() const { return patches.size(); }
+            unsigned int GetVisiblePatches() const { return visible; }
+        };
+
+    }
+}
+
+#endif
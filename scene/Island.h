@@ -11,13 +11,19 @@
 #define _ISLAND_NODE_H_
 
 #include <Scene/HeightMapNode.h>
+#include <Core/Mutex.h>
 #include <Resources/ResourceManager.h>
 #include <Resources/IShaderResource.h>
 #include <Resources/Texture2D.h>
 #include <Resources/Texture3D.h>
 #include <Utils/TextureTool.h>
 #include <Utils/TexUtils.h>
-#include <Math/RandomGenerator.h>
+
+#include "AssetCache.h"
+#include "IslandMaterials.h"
+#include "MappedTexture3D.h"
+#include "TerrainPatchCuller.h"
+#include "TextureStreamer.h"
 
 #include <vector>
 using std::vector;
@@ -27,33 +33,86 @@ string datadir = "projects/Terrain/data/";
 namespace OpenEngine {
     namespace Scene {
 
+        /**
+         * An island texture array with layer 1 of the two largest
+         * levels replaced by another texture, scaled to fit when it
+         * is decoded.
+         */
+        class IslandLayers
+            : public Utils::StreamedMappedTexture3D<unsigned char> {
+            UCharTexture2DPtr layer;
+            vector<UCharTexture2DPtr> scaled;
+        public:
+            IslandLayers(UCharMappedTexture3DPtr tex, string name,
+                         UCharTexture2DPtr layer)
+                : Utils::StreamedMappedTexture3D<unsigned char>(tex, name),
+                  layer(layer) {}
+
+            void Decode() {
+                Utils::StreamedMappedTexture3D<unsigned char>::Decode();
+                unsigned int width = tex->GetWidth();
+                unsigned int height = tex->GetHeight();
+                UCharTexture2DPtr level = layer;
+                for (unsigned int l = 0; l < 2; ++l) {
+                    level = Utils::TexUtils::Scale(level, width, height);
+                    GLenum format, internal;
+                    if (!Resources::GLTextureFormat(level->GetColorFormat(), false,
+                                                    format, internal))
+                        throw Resources::ResourceException("no upload for the color format of "
+                                                           + name);
+                    for (unsigned int i = 0; i < slices.size(); ++i)
+                        if (slices[i].level == (GLint)l && slices[i].layer == 1) {
+                            slices[i].format = format;
+                            slices[i].texelSize = level->GetChannels();
+                            slices[i].data = level->GetData();
+                        }
+                    scaled.push_back(level);
+                    width /= 2;
+                    height /= 2;
+                }
+                layer->Unload();
+            }
+        };
+
         class Island : public HeightMapNode {
         protected:
-            UCharTexture3DPtr groundTex;
-            UCharTexture3DPtr normalTex;
+            UCharMappedTexture3DPtr groundTex;
+            UCharMappedTexture3DPtr normalTex;
             UCharTexture2DPtr dirtTex;
             UCharTexture2DPtr dirtNormalTex;
+            // Other shaders drawing the island, given its textures.
+            vector<IShaderResourcePtr> shaders;
+            Utils::TerrainPatchCuller* culler;
             
         public:
-            Island(FloatTexture2DPtr tex)
-                : HeightMapNode(tex){
+            /**
+             * The ground and normal textures are handed to the
+             * streamer, which may be done from any thread. The
+             * resource manager and the logger are only used while
+             * holding resources, the textures are decoded, packed and
+             * written without it.
+             */
+            Island(FloatTexture2DPtr tex, Utils::GeneratedAssetCache& cache,
+                   Utils::TextureStreamer& streamer, Core::Mutex& resources)
+                : HeightMapNode(tex), culler(NULL) {
+                resources.Lock();
                 this->landscapeShader = ResourceManager<IShaderResource>
                     ::Create(datadir+"shaders/terrain3D/Terrain3D.glsl");
-
+                resources.Unlock();
 
                 vector<UCharTexture2DPtr> texList;
-                std::string foldername = datadir + 
-                    "generated/island/colormap.3d.png";
-                if (Directory::Exists(foldername)) {
-                    logger.info << "loading island coloring textures: "
-                                << foldername << logger.end;
-                    groundTex = Texture3DFileListResource<unsigned char>
-                        ::Create(foldername);
-                } else {
+                std::string asset = "island/colormap.3d.raw";
+                std::string foldername = cache.GetPath(asset);
+                Utils::AssetKey colorKey("island colormap 1");
+                colorKey.AddFile("textures/sand.png")
+                    .AddFile("textures/grass.png")
+                    .AddFile("textures/snow.png")
+                    .AddFile("textures/rockface.png");
+                if (!cache.IsValid(asset, colorKey)) {
+                    // Create the textures and place them in a 3d texture
+                    resources.Lock();
                     logger.info << "constructing island coloring texture: " 
                                 << foldername << logger.end;
-
-                    // Create the textures and place them in a 3d texture
                     UCharTexture2DPtr sand = ResourceManager<UCharTexture2D>
                         ::Create("textures/sand.png");
                     texList.push_back(sand);
@@ -66,158 +125,130 @@ namespace OpenEngine {
                     UCharTexture2DPtr cliff = ResourceManager<UCharTexture2D>
                         ::Create("textures/rockface.png");
                     texList.push_back(cliff);
-                    groundTex = UCharTexture3DPtr(new Texture3D<unsigned char>
-                                                  (texList));
-                    
-                    TextureTool<unsigned char>::DumpTexture(groundTex,
-                                                            foldername);
+                    resources.Unlock();
+                    UCharMappedTexture3D::Write
+                        (UCharTexture3DPtr(new Texture3D<unsigned char>(texList)),
+                         cache.GetTempPath(asset), true);
+                    cache.Commit(asset, colorKey);
                 }
+                resources.Lock();
+                logger.info << "loading island coloring textures: "
+                            << foldername << logger.end;
+                resources.Unlock();
+                groundTex = UCharMappedTexture3D::Create(foldername);
 
                 texList.clear();
-                foldername = datadir +
-                    "generated/island/normalmap.3d.png";
-                if (Directory::Exists(foldername)) {
-                    logger.info << "loading island normal maps: "
-                                << foldername << logger.end;
-                    normalTex = Texture3DFileListResource<unsigned char>
-                        ::Create(foldername);
-                } else {
+                asset = "island/normalmap.3d.raw";
+                foldername = cache.GetPath(asset);
+                Utils::AssetKey normalKey("island normalmap 2");
+                normalKey.AddFile("textures/sandNormals.png")
+                    .AddFile("textures/grassNormals.png")
+                    .AddFile("textures/rockfaceNormals.png")
+                    .Add(1024u).Add(0.1f).Add(0u);
+                if (!cache.IsValid(asset, normalKey)) {
+                resources.Lock();
                     logger.info << "constructing island normal maps: " 
                                 << foldername << logger.end;
-
-
                 UCharTexture2DPtr sandNormal = ResourceManager<UCharTexture2D>
                     //::Create("textures/newSandNormals.png");
                     ::Create("textures/sandNormals.png");
-                texList.push_back(sandNormal);
                 UCharTexture2DPtr grassNormal = ResourceManager<UCharTexture2D>
                     ::Create("textures/grassNormals.png");
+                UCharTexture2DPtr cliffNormal = ResourceManager<UCharTexture2D>
+                    ::Create("textures/rockfaceNormals.png");
+                resources.Unlock();
+                texList.push_back(sandNormal);
 
                 grassNormal->Load();
-                for (unsigned int u = 0; u < grassNormal->GetWidth(); ++u)
-                    for (unsigned int v = 0; v < grassNormal->GetHeight(); ++v){
-                        Vector<3, float> pixel;
-                        pixel[0] = grassNormal->GetPixel(u, v)[0];
-                        pixel[1] = grassNormal->GetPixel(u, v)[1];
-                        pixel[2] = grassNormal->GetPixel(u, v)[2];
-                        
-                        pixel = (pixel / 256.0f) * 2.0 - 1.0;
-
-                        pixel[0] = 1.0;
-                        pixel.Normalize();
-
-                        pixel = ((pixel + 1.0f) * 0.5f) * 256.0f;
-
-                        grassNormal->GetPixel(u, v)[0] = pixel[0];
-                        grassNormal->GetPixel(u, v)[1] = pixel[1];
-                        grassNormal->GetPixel(u, v)[2] = pixel[2];
-                    }
+                Utils::IslandMaterials::FlattenNormals(grassNormal);
                 texList.push_back(grassNormal);
 
-                unsigned int w = 1024;
-                unsigned int h = 1024;
                 UCharTexture2DPtr snowNormal =
-                    UCharTexture2DPtr(new Texture2D<unsigned char>(w,h,3));
-                snowNormal->SetColorFormat(BGR);
-                unsigned char* data = snowNormal->GetData();
-                RandomGenerator r;
-                for (unsigned int x=0; x<w; x++) {
-                    for (unsigned int y=0; y<h; y++) {
-                        Vector<3,float> v(1, r.Normal(0, 0.1),
-                                          r.Normal(0, 0.1));
-                        v.Normalize();
-                        
-                        data[(x+y*w)*3 + 0] = (v[0] * 0.5 + 0.5) * 256;
-                        data[(x+y*w)*3 + 1] = (v[1] * 0.5 + 0.5) * 256;
-                        data[(x+y*w)*3 + 2] = (v[2] * 0.5 + 0.5) * 256;
-                    }
-                }
+                    Utils::IslandMaterials::SnowNormals(1024, 1024, 0.1f, 0);
                 texList.push_back(snowNormal);
 
-                UCharTexture2DPtr cliffNormal = ResourceManager<UCharTexture2D>
-                    ::Create("textures/rockfaceNormals.png");
                 texList.push_back(cliffNormal);
 
-                normalTex = UCharTexture3DPtr(new Texture3D<unsigned char>
-                                              (texList));
-
-                TextureTool<unsigned char>::DumpTexture(normalTex,
-                                                        foldername);
+                UCharMappedTexture3D::Write
+                    (UCharTexture3DPtr(new Texture3D<unsigned char>(texList)),
+                     cache.GetTempPath(asset), true);
+                cache.Commit(asset, normalKey);
                 }
+                resources.Lock();
+                logger.info << "loading island normal maps: "
+                            << foldername << logger.end;
+                resources.Unlock();
+                normalTex = UCharMappedTexture3D::Create(foldername);
                 
+                resources.Lock();
                 dirtTex = ResourceManager<UCharTexture2D>
                     ::Create("textures/dirt.png");
 
                 dirtNormalTex = ResourceManager<UCharTexture2D>
                     ::Create("textures/dirtNormals.png");
-            }
+                resources.Unlock();
 
-            void Initialize(RenderingEventArg arg) {
                 groundTex->SetMipmapping(true);
                 groundTex->SetUseCase(ITexture3D::TEXTURE2D_ARRAY);
-                arg.renderer.LoadTexture(groundTex.get());
-                this->landscapeShader->SetTexture("groundTex", (ITexture3DPtr)groundTex);
-
                 normalTex->SetMipmapping(true);
                 normalTex->SetUseCase(ITexture3D::TEXTURE2D_ARRAY);
-                arg.renderer.LoadTexture(normalTex.get());
+                // Sand colored and flat until they are streamed in.
+                streamer.Add(new IslandLayers(groundTex, "island colors", dirtTex),
+                             Math::Vector<4, unsigned char>(150, 135, 100, 255));
+                streamer.Add(new IslandLayers(normalTex, "island normals", dirtNormalTex),
+                             Math::Vector<4, unsigned char>(128, 128, 255, 255));
+            }
+
+            void Initialize(RenderingEventArg arg) {
+                this->landscapeShader->SetTexture("groundTex", (ITexture3DPtr)groundTex);
                 this->landscapeShader->SetTexture("normalTex", (ITexture3DPtr)normalTex);
+                SetShaderTextures(GetNormalMap());
+            }
 
-                glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, groundTex->GetID());
-                glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_GENERATE_MIPMAP, GL_FALSE);
-                CHECK_FOR_GL_ERROR();
-
-                unsigned int width = groundTex->GetWidth();
-                unsigned int height = groundTex->GetHeight();
-                for (unsigned int l = 0; l < 2; ++l){                    
-                    dirtTex = Utils::TexUtils::Scale(dirtTex, width, height);
-                    
-                    glTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT,
-                                    l,
-                                    0,
-                                    0,
-                                    1,
-                                    width,
-                                    height,
-                                    1,
-                                    GL_BGRA,
-                                    GL_UNSIGNED_BYTE,
-                                    dirtTex->GetData());
+            /**
+             * Give another shader the ground and normal textures of
+             * the island when it is initialized.
+             */
+            void AddShader(IShaderResourcePtr shader) {
+                shaders.push_back(shader);
+            }
 
-                    width /= 2;
-                    height /= 2;
+            /**
+             * Give the added shaders the island textures and a normal
+             * map, for when they draw the island without it being
+             * initialized.
+             */
+            void SetShaderTextures(ITexture2DPtr normalMap) {
+                for (unsigned int i = 0; i < shaders.size(); ++i) {
+                    shaders[i]->SetTexture("groundTex", (ITexture3DPtr)groundTex);
+                    shaders[i]->SetTexture("normalTex", (ITexture3DPtr)normalTex);
+                    shaders[i]->SetTexture("normalMap", normalMap);
                 }
-                glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_GENERATE_MIPMAP, GL_TRUE);
-                dirtTex->Unload();
-                CHECK_FOR_GL_ERROR();
-
-                glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, normalTex->GetID());
-                glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_GENERATE_MIPMAP, GL_FALSE);
-                CHECK_FOR_GL_ERROR();
-
-                width = groundTex->GetWidth();
-                height = groundTex->GetHeight();
-                for (unsigned int l = 0; l < 2; ++l){                    
-                    dirtNormalTex = Utils::TexUtils::Scale(dirtNormalTex, width, height);
-                    
-                    glTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT,
-                                    l,
-                                    0,
-                                    0,
-                                    1,
-                                    width,
-                                    height,
-                                    1,
-                                    GL_BGR,
-                                    GL_UNSIGNED_BYTE,
-                                    dirtNormalTex->GetData());
+            }
 
-                    width /= 2;
-                    height /= 2;
+            /**
+             * Cull the patches with a culler of the same patch grid
+             * before they are drawn. The patches have had their level
+             * of detail and frustum visibility set by then, the
+             * culler only hides more of them.
+             */
+            void SetPatchCuller(Utils::TerrainPatchCuller* culler) {
+                if (culler && (culler->GetColumns() != (unsigned int)patchGridWidth ||
+                               culler->GetRows() != (unsigned int)patchGridDepth)) {
+                    logger.warning << "patch culler does not match the island patches"
+                                   << logger.end;
+                    culler = NULL;
                 }
-                glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_GENERATE_MIPMAP, GL_TRUE);
-                dirtNormalTex->Unload();
-                CHECK_FOR_GL_ERROR();
+                this->culler = culler;
+            }
+
+            void PreRender(Display::Viewport view) {
+                if (culler == NULL) return;
+                culler->Cull(*view.GetViewingVolume());
+                for (int z = 0; z < patchGridDepth; ++z)
+                    for (int x = 0; x < patchGridWidth; ++x)
+                        if (!culler->IsVisible(x, z))
+                            patchNodes[z * patchGridWidth + x]->SetVisible(false);
             }
 
             void PostRender(Display::Viewport view) {
@@ -0,0 +1,524 @@
+// Terrain patch node.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include "scene/TerrainPatchNode.h"
+
+#include <Logging/Logger.h>
+#include <Math/Matrix.h>
+#include <Meta/OpenGL.h>
+
+#include "ParallelRange.h"
+#include "TerrainPatchCuller.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace OpenEngine {
+    namespace Scene {
+
+        using Math::Vector;
+        using Utils::IHeightField;
+        using Utils::TerrainRegion;
+
+        // Edges of a patch, as bits of the set of edges next to a
+        // coarser neighbour.
+        enum { NORTH = 1, SOUTH = 2, WEST = 4, EAST = 8, EDGE_SETS = 16 };
+
+        // Steps of the morph distance code in a doubling of the
+        // distance, as in TerrainPatch.vert.
+        static const float OCTAVE = 1024.0f;
+
+        // Rounded up, so the distance decoded is never nearer.
+        static short EncodeDistance(float d) {
+            float code = ceilf(logf(1.0f + d) / logf(2.0f) * OCTAVE);
+            return short(std::min(code, 32767.0f));
+        }
+
+        static float DecodeDistance(short code) {
+            return powf(2.0f, code / OCTAVE) - 1.0f;
+        }
+
+        // The patches along one axis a vertex belongs to.
+        static void PatchSpan(int x, int squares, int count, int& first, int& last) {
+            last = std::min(x / squares, count - 1);
+            first = x % squares == 0 && x > 0 ? std::min(x / squares - 1, count - 1) : last;
+        }
+
+        /**
+         * Computes the morph distances of a level for rows of
+         * vertices.
+         */
+        class TerrainPatchNode::MorphJob : public Utils::IRangeJob {
+            TerrainPatchNode& node;
+            unsigned int level;
+            const TerrainRegion& region;
+            int z0;
+        public:
+            MorphJob(TerrainPatchNode& node, unsigned int level,
+                     const TerrainRegion& region, int z0)
+                : node(node), level(level), region(region), z0(z0) {}
+
+            void Run(unsigned int begin, unsigned int end) {
+                for (unsigned int z = begin; z < end; ++z)
+                    node.MorphDistances(z0 + z, level, region);
+            }
+        };
+
+        /**
+         * Fills the vertices of rows of patches.
+         */
+        class TerrainPatchNode::FillJob : public Utils::IRangeJob {
+            TerrainPatchNode& node;
+            const TerrainRegion& region;
+            std::vector<short>& vertices;
+        public:
+            bool inRange;
+
+            FillJob(TerrainPatchNode& node, const TerrainRegion& region,
+                    std::vector<short>& vertices)
+                : node(node), region(region), vertices(vertices), inRange(true) {}
+
+            void Run(unsigned int begin, unsigned int end) {
+                unsigned int size = node.patchVertices * 4;
+                for (unsigned int row = begin; row < end; ++row)
+                    for (unsigned int col = 0; col < region.width; ++col) {
+                        unsigned int p = (region.z + row) * node.columns + region.x + col;
+                        if (!node.Fill(p, &vertices[(row * region.width + col) * size]))
+                            inRange = false;
+                    }
+            }
+        };
+
+        TerrainPatchNode::TerrainPatchNode(IHeightField* terrain,
+                                           unsigned int width, unsigned int depth,
+                                           Resources::IShaderResourcePtr shader,
+                                           Display::IViewingVolume& view,
+                                           unsigned int squares)
+            : terrain(terrain), shader(shader), view(view), culler(NULL),
+              width(width), depth(depth), squares(1), levels(1),
+              tolerance(2.0f), screenHeight(600.0f), pixelScale(0.0f),
+              heightMin(0.0f), heightMax(0.0f), heightStep(1.0f),
+              vertexBuffer(0), indexBuffer(0),
+              program(0), patchOriginLoc(-1), drawn(0), drawnVertices(0) {
+            // The largest power of two that fits.
+            while (this->squares * 2 <= std::min(squares, MAX_SQUARES)) {
+                this->squares *= 2;
+                ++levels;
+            }
+            columns = (width - 1 + this->squares - 1) / this->squares;
+            rows = (depth - 1 + this->squares - 1) / this->squares;
+            patchVertices = (this->squares + 1) * (this->squares + 1);
+            Patch patch;
+            patch.minY = patch.maxY = 0.0f;
+            patch.level = 0;
+            patches.resize(columns * rows, patch);
+            morphDistances.resize(width * depth, 0.0f);
+            levelDistances.resize(columns * rows * levels, 0.0f);
+        }
+
+        TerrainPatchNode::~TerrainPatchNode() {
+            if (vertexBuffer) glDeleteBuffers(1, &vertexBuffer);
+            if (indexBuffer) glDeleteBuffers(1, &indexBuffer);
+        }
+
+        void TerrainPatchNode::SetPixelTolerance(float pixels) {
+            tolerance = std::max(pixels, 0.01f);
+        }
+
+        void TerrainPatchNode::SetScreenHeight(unsigned int pixels) {
+            screenHeight = std::max(pixels, 1u);
+        }
+
+        void TerrainPatchNode::SetPatchCuller(Utils::TerrainPatchCuller* culler) {
+            if (culler && (culler->GetColumns() != columns || culler->GetRows() != rows)) {
+                logger.warning << "patch culler does not match the terrain patches"
+                               << logger.end;
+                culler = NULL;
+            }
+            this->culler = culler;
+        }
+
+        unsigned int TerrainPatchNode::GetVertexBytes() const {
+            return columns * rows * patchVertices * 4 * sizeof(short);
+        }
+
+        float TerrainPatchNode::Height(int x, int z) {
+            x = std::min(std::max(x, 0), int(width) - 1);
+            z = std::min(std::max(z, 0), int(depth) - 1);
+            return terrain->GetHeight(x, z);
+        }
+
+        unsigned int TerrainPatchNode::Level(int x, int z) const {
+            // The coarsest level the vertex is part of.
+            unsigned int level = 0;
+            while (level + 1 < levels && x % (2 << level) == 0 && z % (2 << level) == 0)
+                ++level;
+            return level;
+        }
+
+        float TerrainPatchNode::Delta(int x, int z, unsigned int level) {
+            // The last row and column of the map stay put, so the
+            // vertices collapsed onto them stay collapsed.
+            if (level + 1 >= levels || int(width) - 1 <= x || int(depth) - 1 <= z)
+                return 0.0f;
+            // The vertex morphs to the middle of the edge it lies on
+            // in the next level.
+            int s = 1 << level;
+            float a, b;
+            if (z % (2 * s) == 0) {
+                a = Height(x - s, z);
+                b = Height(x + s, z);
+            } else if (x % (2 * s) == 0) {
+                a = Height(x, z - s);
+                b = Height(x, z + s);
+            } else {
+                // Along the diagonal the quads are split on.
+                a = Height(x - s, z + s);
+                b = Height(x + s, z - s);
+            }
+            return (a + b) * 0.5f - Height(x, z);
+        }
+
+        float TerrainPatchNode::Diameter(unsigned int p) const {
+            float side = squares * terrain->GetWidthScale();
+            float height = patches[p].maxY - patches[p].minY;
+            return sqrt(2.0f * side * side + height * height);
+        }
+
+        float TerrainPatchNode::PixelScale() {
+            // Pixels a unit of height covers at unit distance, over
+            // the tolerance.
+            Math::Matrix<4, 4, float> projection = view.GetProjectionMatrix();
+            return 0.5f * screenHeight * projection(1, 1) / tolerance;
+        }
+
+        void TerrainPatchNode::Quantize() {
+            float lo = 1e30f, hi = -1e30f;
+            for (unsigned int z = 0; z < depth; ++z)
+                for (unsigned int x = 0; x < width; ++x) {
+                    float h = terrain->GetHeight(x, z);
+                    lo = std::min(lo, h);
+                    hi = std::max(hi, h);
+                }
+            // Room for edits before everything is quantized again.
+            float margin = std::max(1.0f, (hi - lo) * 0.25f);
+            heightMin = lo - margin;
+            heightMax = hi + margin;
+            heightStep = (heightMax - heightMin) / 65535.0f;
+            shader->SetUniform("heightBase", heightMin + 32768.0f * heightStep);
+            shader->SetUniform("heightStep", heightStep);
+            // Deltas span twice the range in the same number of steps.
+            shader->SetUniform("morphStep", 2.0f * heightStep);
+        }
+
+        void TerrainPatchNode::Measure(const TerrainRegion& region) {
+            for (unsigned int row = region.z; row < region.z + region.depth; ++row)
+                for (unsigned int col = region.x; col < region.x + region.width; ++col) {
+                    Patch& patch = patches[row * columns + col];
+                    unsigned int x1 = std::min((col + 1) * squares, width - 1);
+                    unsigned int z1 = std::min((row + 1) * squares, depth - 1);
+                    patch.minY = 1e30f;
+                    patch.maxY = -1e30f;
+                    for (unsigned int z = row * squares; z <= z1; ++z)
+                        for (unsigned int x = col * squares; x <= x1; ++x) {
+                            float h = terrain->GetHeight(x, z);
+                            patch.minY = std::min(patch.minY, h);
+                            patch.maxY = std::max(patch.maxY, h);
+                        }
+                }
+        }
+
+        void TerrainPatchNode::MorphDistances(int z, unsigned int level,
+                                              const TerrainRegion& region) {
+            int step = 1 << level;
+            if (z % step != 0) return;
+            int x0 = region.x * squares;
+            int x1 = std::min(int(region.x + region.width) * int(squares), int(width) - 1);
+            int firstRow, lastRow;
+            PatchSpan(z, squares, rows, firstRow, lastRow);
+            for (int x = x0; x <= x1; x += step) {
+                if (Level(x, z) != level) continue;
+                // Where the delta shows less than the tolerance.
+                float d = fabsf(Delta(x, z, level)) * pixelScale;
+                if (level > 0) {
+                    // Not before the level below has morphed away in
+                    // every patch the vertex is in, from anywhere in
+                    // those patches.
+                    int firstCol, lastCol;
+                    PatchSpan(x, squares, columns, firstCol, lastCol);
+                    for (int row = firstRow; row <= lastRow; ++row)
+                        for (int col = firstCol; col <= lastCol; ++col) {
+                            unsigned int p = row * columns + col;
+                            d = std::max(d, 2.0f * levelDistances[p * levels + level - 1]
+                                         + Diameter(p));
+                        }
+                }
+                morphDistances[z * width + x] = DecodeDistance(EncodeDistance(d));
+            }
+        }
+
+        void TerrainPatchNode::ComputeMorphDistances(const TerrainRegion& region) {
+            int z0 = region.z * squares;
+            int z1 = std::min(int(region.z + region.depth) * int(squares), int(depth) - 1);
+            for (unsigned int level = 0; level < levels; ++level) {
+                MorphJob job(*this, level, region, z0);
+                Utils::ParallelRange::Run(job, z1 - z0 + 1);
+
+                // A level has morphed away once its furthest morphing
+                // vertex has, at twice its distance.
+                unsigned int step = 1 << level;
+                for (unsigned int row = region.z; row < region.z + region.depth; ++row)
+                    for (unsigned int col = region.x; col < region.x + region.width; ++col) {
+                        unsigned int x1 = std::min((col + 1) * squares, width - 1);
+                        unsigned int z1 = std::min((row + 1) * squares, depth - 1);
+                        float d = 0.0f;
+                        for (unsigned int z = row * squares; z <= z1; z += step)
+                            for (unsigned int x = col * squares; x <= x1; x += step)
+                                if (Level(x, z) == level)
+                                    d = std::max(d, morphDistances[z * width + x]);
+                        levelDistances[(row * columns + col) * levels + level] = d;
+                    }
+            }
+        }
+
+        bool TerrainPatchNode::Fill(unsigned int p, short* out) {
+            int x0 = (p % columns) * squares, z0 = (p / columns) * squares;
+            bool inRange = true;
+            for (int k = 0; k <= int(squares); ++k)
+                for (int i = 0; i <= int(squares); ++i) {
+                    // The last patches may overhang the map, their
+                    // vertices past it collapse onto its edge.
+                    int x = std::min(x0 + i, int(width) - 1);
+                    int z = std::min(z0 + k, int(depth) - 1);
+                    float h = Height(x, z);
+                    inRange = inRange && heightMin <= h && h <= heightMax;
+                    float delta = Delta(x0 + i, z0 + k, Level(x0 + i, z0 + k));
+
+                    float q = floorf((h - heightMin) / heightStep + 0.5f) - 32768.0f;
+                    float m = floorf(delta / (2.0f * heightStep) + 0.5f);
+                    out[0] = (x - x0) + (z - z0) * 256;
+                    out[1] = short(std::min(std::max(q, -32768.0f), 32767.0f));
+                    out[2] = short(std::min(std::max(m, -32767.0f), 32767.0f));
+                    out[3] = EncodeDistance(morphDistances[z * width + x]);
+                    out += 4;
+                }
+            return inRange;
+        }
+
+        void TerrainPatchNode::Update(const TerrainRegion& region) {
+            // A level of a patch waits for the level below it in the
+            // patches around it, so the distances may change a patch
+            // per level away from the edit.
+            int n = levels;
+            TerrainRegion r = TerrainRegion(region.x - n, region.z - n,
+                                            region.width + 2 * n, region.depth + 2 * n)
+                .Clip(columns, rows);
+            Measure(r);
+            ComputeMorphDistances(r);
+
+            unsigned int size = patchVertices * 4;
+            std::vector<short> vertices(r.width * r.depth * size);
+            FillJob job(*this, r, vertices);
+            Utils::ParallelRange::Run(job, r.depth);
+            if (!job.inRange) {
+                // An edit left the quantized range.
+                Quantize();
+                Update(TerrainRegion(0, 0, columns, rows));
+                return;
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            for (unsigned int row = 0; row < r.depth; ++row)
+                glBufferSubData(GL_ARRAY_BUFFER,
+                                ((r.z + row) * columns + r.x) * size * sizeof(short),
+                                r.width * size * sizeof(short),
+                                &vertices[row * r.width * size]);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        void TerrainPatchNode::BuildIndices() {
+            const int n = squares + 1;
+            std::vector<unsigned short> indices;
+            indexOffsets.resize(levels * EDGE_SETS);
+            indexCounts.resize(levels * EDGE_SETS);
+            for (unsigned int l = 0; l < levels; ++l)
+                for (unsigned int edges = 0; edges < EDGE_SETS; ++edges) {
+                    unsigned int set = l * EDGE_SETS + edges;
+                    indexOffsets[set] = indices.size();
+                    int s = 1 << l, last = squares;
+                    // The coarsest level has no coarser neighbours.
+                    unsigned int coarser = l + 1 < levels ? edges : 0;
+                    for (int k = 0; k < last; k += s)
+                        for (int i = 0; i < last; i += s) {
+                            int quad[6][2] = { {i, k}, {i, k + s}, {i + s, k},
+                                               {i + s, k}, {i, k + s}, {i + s, k + s} };
+                            unsigned int v[6];
+                            for (unsigned int c = 0; c < 6; ++c) {
+                                int x = quad[c][0], z = quad[c][1];
+                                // Vertices left out of a coarser
+                                // neighbour's edge move to the one
+                                // before them, which folds the
+                                // triangles beside them away.
+                                if (x % (2 * s) != 0 && (((coarser & NORTH) && z == 0) ||
+                                                        ((coarser & SOUTH) && z == last)))
+                                    x -= s;
+                                if (z % (2 * s) != 0 && (((coarser & WEST) && x == 0) ||
+                                                        ((coarser & EAST) && x == last)))
+                                    z -= s;
+                                v[c] = z * n + x;
+                            }
+                            for (unsigned int t = 0; t < 6; t += 3)
+                                if (v[t] != v[t + 1] && v[t] != v[t + 2] && v[t + 1] != v[t + 2])
+                                    indices.insert(indices.end(), v + t, v + t + 3);
+                        }
+                    indexCounts[set] = indices.size() - indexOffsets[set];
+                }
+            glGenBuffers(1, &indexBuffer);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short),
+                         &indices[0], GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
+
+        void TerrainPatchNode::SelectLevels(Vector<3, float> eye) {
+            Vector<3, float> offset = terrain->GetOffset();
+            float ws = terrain->GetWidthScale();
+            for (unsigned int row = 0; row < rows; ++row)
+                for (unsigned int col = 0; col < columns; ++col) {
+                    unsigned int p = row * columns + col;
+                    Patch& patch = patches[p];
+                    // Distance to the nearest point of the patch box,
+                    // no vertex of it is closer.
+                    float x0 = col * squares * ws + offset[0];
+                    float z0 = row * squares * ws + offset[2];
+                    float x1 = std::min((col + 1) * squares, width - 1) * ws + offset[0];
+                    float z1 = std::min((row + 1) * squares, depth - 1) * ws + offset[2];
+                    float dx = std::max(std::max(x0 - eye[0], eye[0] - x1), 0.0f);
+                    float dy = std::max(std::max(patch.minY - eye[1], eye[1] - patch.maxY), 0.0f);
+                    float dz = std::max(std::max(z0 - eye[2], eye[2] - z1), 0.0f);
+                    float d = sqrt(dx * dx + dy * dy + dz * dz);
+                    // Leave out the levels that have morphed away.
+                    patch.level = 0;
+                    while (patch.level + 1 < levels &&
+                           2.0f * levelDistances[p * levels + patch.level] <= d)
+                        ++patch.level;
+                }
+
+            // Neighbours may be at most one level apart, patches get
+            // finer until they are. The morph distances already keep
+            // them so, this only guards the edges.
+            for (unsigned int row = 0; row < rows; ++row)
+                for (unsigned int col = 0; col < columns; ++col) {
+                    unsigned int& level = patches[row * columns + col].level;
+                    if (col > 0) level = std::min(level, patches[row * columns + col - 1].level + 1);
+                    if (row > 0) level = std::min(level, patches[(row - 1) * columns + col].level + 1);
+                }
+            for (unsigned int row = rows; row-- > 0; )
+                for (unsigned int col = columns; col-- > 0; ) {
+                    unsigned int& level = patches[row * columns + col].level;
+                    if (col + 1 < columns)
+                        level = std::min(level, patches[row * columns + col + 1].level + 1);
+                    if (row + 1 < rows)
+                        level = std::min(level, patches[(row + 1) * columns + col].level + 1);
+                }
+        }
+
+        void TerrainPatchNode::Handle(Renderers::RenderingEventArg arg) {
+            shader->Load();
+            Quantize();
+            pixelScale = PixelScale();
+            glGenBuffers(1, &vertexBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, GetVertexBytes(), NULL, GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            Update(TerrainRegion(0, 0, columns, rows));
+            BuildIndices();
+            CHECK_FOR_GL_ERROR();
+
+            shader->SetUniform("offset", terrain->GetOffset());
+            shader->SetUniform("widthScale", terrain->GetWidthScale());
+            shader->SetUniform("invMapSize", Vector<2, float>(1.0f / width, 1.0f / depth));
+            shader->ApplyShader();
+            glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+            patchOriginLoc = glGetUniformLocation(program, "patchOrigin");
+            shader->ReleaseShader();
+
+            logger.info << columns * rows << " terrain patches of " << squares
+                        << " squares, " << GetVertexBytes() / 1024 << " KB of vertices, "
+                        << tolerance << " pixel tolerance" << logger.end;
+        }
+
+        void TerrainPatchNode::Handle(Utils::TerrainEditEventArg arg) {
+            const TerrainRegion& r = arg.region;
+            // Patches share their border vertices, and morph to the
+            // heights one level step away.
+            int reach = 1 << (levels - 1);
+            int c0 = std::max(r.x - reach, 0) / int(squares);
+            int r0 = std::max(r.z - reach, 0) / int(squares);
+            int c1 = std::min((r.x + (int)r.width + reach) / int(squares) + 1, int(columns));
+            int r1 = std::min((r.z + (int)r.depth + reach) / int(squares) + 1, int(rows));
+            if (c1 <= c0 || r1 <= r0) return;
+            TerrainRegion edited(c0, r0, c1 - c0, r1 - r0);
+            dirty = dirty.IsEmpty() ? edited : dirty.Union(edited);
+        }
+
+        void TerrainPatchNode::Apply(Renderers::RenderingEventArg arg, ISceneNodeVisitor& v) {
+            if (vertexBuffer == 0) return;
+            // A new tolerance or field of view moves every morph
+            // distance.
+            float scale = PixelScale();
+            if (fabsf(scale - pixelScale) > 0.01f * pixelScale) {
+                pixelScale = scale;
+                dirty = TerrainRegion(0, 0, columns, rows);
+            }
+            if (!dirty.IsEmpty()) {
+                Update(dirty);
+                dirty = TerrainRegion();
+            }
+
+            Vector<3, float> eye = view.GetPosition();
+            if (culler) culler->Cull(view);
+            SelectLevels(eye);
+
+            shader->SetUniform("viewPos", eye);
+            shader->ApplyShader();
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            drawn = drawnVertices = 0;
+            for (unsigned int row = 0; row < rows; ++row)
+                for (unsigned int col = 0; col < columns; ++col) {
+                    if (culler && !culler->IsVisible(col, row)) continue;
+                    unsigned int p = row * columns + col;
+                    unsigned int level = patches[p].level;
+                    unsigned int edges = 0;
+                    if (row > 0 && level < patches[p - columns].level) edges |= NORTH;
+                    if (row + 1 < rows && level < patches[p + columns].level) edges |= SOUTH;
+                    if (col > 0 && level < patches[p - 1].level) edges |= WEST;
+                    if (col + 1 < columns && level < patches[p + 1].level) edges |= EAST;
+                    unsigned int set = level * EDGE_SETS + edges;
+
+                    glUniform2f(patchOriginLoc, col * squares, row * squares);
+                    glVertexPointer(4, GL_SHORT, 0,
+                                    (GLvoid*)(size_t)(p * patchVertices * 4 * sizeof(short)));
+                    glDrawElements(GL_TRIANGLES, indexCounts[set], GL_UNSIGNED_SHORT,
+                                   (GLvoid*)(size_t)(indexOffsets[set] * sizeof(unsigned short)));
+                    unsigned int side = (squares >> level) + 1;
+                    drawnVertices += side * side;
+                    ++drawn;
+                }
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glDisableClientState(GL_VERTEX_ARRAY);
+            shader->ReleaseShader();
+            CHECK_FOR_GL_ERROR();
+            VisitSubNodes(v);
+        }
+
+    }
+}
@@ -0,0 +1,181 @@
+// Terrain patch node.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TERRAIN_PATCH_NODE_H_
+#define _TERRAIN_PATCH_NODE_H_
+
+#include <Core/IListener.h>
+#include <Display/IViewingVolume.h>
+#include <Math/Vector.h>
+#include <Renderers/IRenderer.h>
+#include <Resources/IShaderResource.h>
+#include <Scene/RenderNode.h>
+
+#include "TerrainEditor.h"
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+        class TerrainPatchCuller;
+    }
+    namespace Scene {
+
+        /**
+         * The patches of a height field drawn from a compact
+         * vertex buffer, with the level of detail of each patch
+         * chosen by the error it shows on screen.
+         *
+         * A vertex is four shorts: its column and row in the patch,
+         * its height and its morph delta, both quantized to steps of
+         * the same size over the height range of the whole map, and
+         * the distance it starts to morph at, log encoded. The patch
+         * origin is a uniform set per patch, and the world position
+         * and texture coordinates are derived from it in the vertex
+         * shader, so a vertex takes 8 bytes.
+         *
+         * The heights are read from the height field, and the
+         * normals from its normal map, so no height map node has to
+         * build its vertex buffers for the terrain to be drawn.
+         *
+         * A vertex starts to morph to the coarser level once its
+         * morph delta projects to less than the pixel tolerance, and
+         * has morphed entirely at twice that distance. Each patch
+         * keeps a pyramid of the distance every level of it has
+         * morphed away beyond, and is drawn without the levels the
+         * nearest point of it is beyond. A vertex starts to morph no
+         * nearer than twice the distance of the level below it, plus
+         * the size of the patches around it, so a level only morphs
+         * once the patches have left out the level below. Flat
+         * ground thereby loses its detail close to the camera, and
+         * cliffs keep theirs far away.
+         *
+         * Neighbours end up at most one level apart, and a patch
+         * drops the vertices along the edges it shares with a
+         * coarser neighbour. Vertices morph by their own distance,
+         * so a vertex is at the same height in every patch that
+         * draws it and the patches meet without cracks.
+         */
+        class TerrainPatchNode
+            : public RenderNode
+            , public Core::IListener<Renderers::RenderingEventArg>
+            , public Core::IListener<Utils::TerrainEditEventArg> {
+        public:
+            static const unsigned int MAX_SQUARES = 64;
+
+        private:
+            class MorphJob;
+            class FillJob;
+            struct Patch {
+                float minY, maxY;
+                unsigned int level;
+            };
+
+            Utils::IHeightField* terrain;
+            Resources::IShaderResourcePtr shader;
+            Display::IViewingVolume& view;
+            Utils::TerrainPatchCuller* culler;
+            unsigned int width, depth, squares, levels;
+            unsigned int columns, rows, patchVertices;
+            float tolerance, screenHeight, pixelScale;
+            // Quantized height range, kept with a margin for edits.
+            float heightMin, heightMax, heightStep;
+            std::vector<Patch> patches;
+            // The distance every vertex of the map starts to morph
+            // at, and for each patch and level the distance all
+            // vertices of the level have morphed away beyond.
+            std::vector<float> morphDistances;
+            std::vector<float> levelDistances;
+            unsigned int vertexBuffer, indexBuffer;
+            // Indices of each level with the edges next to coarser
+            // neighbours dropped, one set for each combination of
+            // edges.
+            std::vector<unsigned int> indexOffsets, indexCounts;
+            // Patches to measure and fill again.
+            Utils::TerrainRegion dirty;
+            int program, patchOriginLoc;
+            unsigned int drawn, drawnVertices;
+
+            float Height(int x, int z);
+            unsigned int Level(int x, int z) const;
+            float Delta(int x, int z, unsigned int level);
+            float Diameter(unsigned int patch) const;
+            float PixelScale();
+            void Quantize();
+            void Measure(const Utils::TerrainRegion& region);
+            void MorphDistances(int z, unsigned int level,
+                                const Utils::TerrainRegion& region);
+            void ComputeMorphDistances(const Utils::TerrainRegion& region);
+            bool Fill(unsigned int patch, short* out);
+            void Update(const Utils::TerrainRegion& region);
+            void BuildIndices();
+            void SelectLevels(Math::Vector<3, float> eye);
+
+        public:
+            /**
+             * @param width, depth Size of the height map in vertices.
+             * @param squares Side of a patch in height map squares, a
+             *                power of two up to MAX_SQUARES.
+             */
+            TerrainPatchNode(Utils::IHeightField* terrain,
+                             unsigned int width, unsigned int depth,
+                             Resources::IShaderResourcePtr shader,
+                             Display::IViewingVolume& view,
+                             unsigned int squares = 32);
+            ~TerrainPatchNode();
+
+            /**
+             * Largest error on screen, in pixels, a level is left out
+             * at. The morph distances are computed again on the next
+             * frame.
+             */
+            void SetPixelTolerance(float pixels);
+            float GetPixelTolerance() const { return tolerance; }
+
+            /**
+             * Height in pixels of the image the terrain is drawn to.
+             */
+            void SetScreenHeight(unsigned int pixels);
+
+            /**
+             * Only draw the patches a culler of the same patch grid
+             * finds visible.
+             */
+            void SetPatchCuller(Utils::TerrainPatchCuller* culler);
+
+            /**
+             * Creates the buffers, attach to the renderer initialize
+             * event after the height field is uploaded.
+             */
+            void Handle(Renderers::RenderingEventArg arg);
+
+            /**
+             * Rebuilds the vertices of the edited patches before the
+             * next frame, attach to the terrain editor edit event.
+             */
+            void Handle(Utils::TerrainEditEventArg arg);
+
+            void Apply(Renderers::RenderingEventArg arg, ISceneNodeVisitor& v);
+
+            /**
+             * Bytes of vertex data held for all patches.
+             */
+            unsigned int GetVertexBytes() const;
+
+            /**
+             * Patches and vertices drawn in the last frame.
+             */
+            unsigned int GetDrawn() const { return drawn; }
+            unsigned int GetDrawnVertices() const { return drawnVertices; }
+        };
+
+    }
+}
+
+#endif